@@ -23,6 +23,15 @@ private:
 	virtual std::string GetFilesetNameImpl (const Uuid& filesetId) override;
 	virtual int64_t GetFilesetFileCountImpl (const Uuid& filesetId) override;
 	virtual int64_t GetFilesetSizeImpl (const Uuid& filesetId) override;
+	virtual int64_t GetFilesetDownloadSizeImpl (const Uuid& filesetId) override;
+	virtual int64 GetFileSizeImpl (const char* path) override;
+	virtual int64 ReadFileImpl (const char* path, const int64 offset,
+		const MutableArrayRef<>& buffer, const ResourceLimits& limits) override;
+
+	void GetContentObjectDeltasImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+		const ArrayRef<SHA256Digest>& baseObjects,
+		const GetContentObjectDeltaCallback& getCallback,
+		const ResourceLimits& limits) override;
 
 	void RepairImpl (Repository& source, ExecutionContext& context) override;
 	void ValidateImpl (const ValidationCallback& validationCallback,
@@ -30,6 +39,38 @@ private:
 	void ConfigureImpl (Repository& other,
 		const ArrayRef<Uuid>& filesets,
 		ExecutionContext& context) override;
+
+protected:
+	struct FileContents
+	{
+		SHA256Digest hash;
+		int64 size;
+	};
+
+	FileContents GetFileContents (const char* path);
+
+	static void CopyOverlappingRange (const ArrayRef<>& chunk,
+		const int64 chunkOffset, const int64 offset,
+		const MutableArrayRef<>& buffer);
+
+	struct FileToValidate
+	{
+		SHA256Digest hash;
+		Path path;
+		int64 size;
+	};
+
+	using NextFileCallback = std::function<bool (FileToValidate& file)>;
+
+	static void ValidateFiles (const NextFileCallback& nextFile,
+		const ValidationCallback& validationCallback,
+		ExecutionContext& context, ProgressHelper& progress);
+
+private:
+	bool HasFilesetStatistics ();
+
+	bool filesetStatisticsChecked_ = false;
+	bool hasFilesetStatistics_ = false;
 };
 }
 
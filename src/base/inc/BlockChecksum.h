@@ -0,0 +1,62 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_BLOCK_CHECKSUM_H
+#define KYLA_CORE_INTERNAL_BLOCK_CHECKSUM_H
+
+#include <vector>
+
+#include "ArrayRef.h"
+#include "Hash.h"
+#include "Types.h"
+
+namespace kyla {
+/**
+Weak checksum of a block, as used by rsync. When the block is moved by one
+byte, the checksum can be updated in constant time, so it can be computed at
+every offset of a file to search for blocks with a known checksum.
+*/
+class RollingChecksum final
+{
+public:
+	explicit RollingChecksum (const ArrayRef<>& block);
+
+	/**
+	Move the block by one byte. out is the first byte of the current block,
+	in the byte following it.
+	*/
+	void Roll (const byte out, const byte in);
+
+	uint32 Get () const;
+
+private:
+	uint32 a_ = 0;
+	uint32 b_ = 0;
+	uint32 size_ = 0;
+};
+
+uint32 ComputeWeakChecksum (const ArrayRef<>& block);
+
+struct BlockToFind
+{
+	int64 size;
+	uint32 weakChecksum;
+	SHA256Digest strongChecksum;
+};
+
+/**
+Search data for blocks, at any offset. A block matches if both the weak and
+the strong checksum are equal. Returns the offset of a match for every block,
+or -1 if the block was not found.
+*/
+std::vector<int64> FindBlocks (const ArrayRef<>& data,
+	const ArrayRef<BlockToFind>& blocks);
+}
+
+#endif
@@ -0,0 +1,49 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_DELTA_H
+#define KYLA_CORE_INTERNAL_DELTA_H
+
+#include <functional>
+#include <vector>
+
+#include "ArrayRef.h"
+#include "FileIO.h"
+#include "Types.h"
+
+namespace kyla {
+/**
+Encode target as a binary delta against base. The delta is a sequence of
+instructions which either copy a range of base, or insert literal bytes.
+Matches are found using a rolling hash over blocks of base, so ranges which
+moved inside the file are found as well.
+
+The delta is not compressed, literal bytes are stored as-is.
+*/
+std::vector<byte> ComputeDelta (const ArrayRef<>& base, const ArrayRef<>& target);
+
+/**
+Called with consecutive pieces of the target. offset is the position of
+contents in the target, totalSize the size of the whole target.
+*/
+using ApplyDeltaCallback = std::function<void (const ArrayRef<>& contents,
+	const int64 offset, const int64 totalSize)>;
+
+/**
+Reconstruct the target from which delta was computed. base is read as
+needed, and the target is passed to callback in pieces of at most bufferSize
+bytes, so neither has to be held in memory. Throws if the delta is malformed
+or doesn't match base, which may happen after some pieces were passed on.
+An empty target is passed on as one empty piece.
+*/
+void ApplyDelta (File& base, const ArrayRef<>& delta, const int64 bufferSize,
+	const ApplyDeltaCallback& callback);
+}
+
+#endif
@@ -11,8 +11,12 @@ details.
 #define KYLA_CORE_INTERNAL_DEPLOYED_REPOSITORY_H
 
 #include "BaseRepository.h"
+#include "Hash.h"
 #include "sql/Database.h"
 
+#include <unordered_map>
+#include <vector>
+
 namespace kyla {
 class DeployedRepository final : public BaseRepository
 {
@@ -25,12 +29,33 @@ public:
 		const Path& targetDirectory,
 		ExecutionContext& context);
 
+	/**
+	Deploy source into several new directories in one pass, see
+	ConfigureMany.
+	*/
+	static std::vector<std::unique_ptr<DeployedRepository>> CreateFrom (
+		Repository& source,
+		const ArrayRef<Uuid>& filesets,
+		const ArrayRef<Path>& targetDirectories,
+		ExecutionContext& context);
+
+	static void ConfigureMany (Repository& source,
+		const ArrayRef<DeployedRepository*>& targets,
+		const ArrayRef<Uuid>& filesets,
+		ExecutionContext& context);
+
+	static ConfigurationPlan Plan (Repository& source,
+		Repository* target,
+		const ArrayRef<Uuid>& filesets,
+		ExecutionContext& context);
+
 private:
 	void ValidateImpl (const ValidationCallback& validationCallback,
 		ExecutionContext& context) override;
 
 	void GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
-		const GetContentObjectCallback& getCallback) override;
+		const GetContentObjectCallback& getCallback,
+		const ResourceLimits& limits) override;
 	void RepairImpl (Repository& source,
 		ExecutionContext& context) override;
 	void ConfigureImpl (Repository& other,
@@ -39,18 +64,40 @@ private:
 
 	Sql::Database& GetDatabaseImpl () override;
 
+	void UpgradeReferenceCounts (Log& log);
 	void PreparePendingFilesets (Log& log, const ArrayRef<Uuid>& filesets,
 		ProgressHelper& progress);
 	void UpdateFilesets ();
 	void UpdateFilesetIdsForUnchangedFiles ();
+	void PreserveOutdatedFiles (Log& log);
 	void RemoveChangedFiles (Log& log);
-	void GetNewContentObjects (Repository& source, Log& log,
-		ProgressHelper& progress);
+	static void GetNewContentObjects (Repository& source,
+		const ArrayRef<DeployedRepository*>& targets,
+		ExecutionContext& context, ProgressHelper& progress);
+	static bool AssembleFromOutdatedFiles (Repository& source,
+		const SHA256Digest& hash,
+		const ArrayRef<DeployedRepository*>& targets,
+		ExecutionContext& context, ProgressHelper& progress);
+	void StoreContentObject (const SHA256Digest& hash,
+		const ArrayRef<>& contents,
+		const int64 offset,
+		const int64 totalSize,
+		Log& log, ProgressHelper& progress);
 	void CopyExistingFiles (Log& log);
 	void Cleanup (Log& log);
+	void RemoveStagingFiles (Log& log);
 
 	Sql::Database db_;
 	Path path_;
+
+	// Copies of content objects which are removed by a configure, but can
+	// be used to reconstruct new ones, see PreserveOutdatedFiles. Both are
+	// only valid during a configure
+	std::unordered_map<SHA256Digest, Path, HashDigestHash, HashDigestEqual> preservedObjects_;
+	// The preserved objects previously used by the files of a new content
+	// object with block checksums
+	std::unordered_map<SHA256Digest, std::vector<SHA256Digest>,
+		HashDigestHash, HashDigestEqual> outdatedObjects_;
 };
 } // namespace kyla
 
@@ -32,6 +32,16 @@ private:
 	const char* file_;
 	int line_;
 };
+
+/**
+Thrown by long running operations once cancellation has been requested
+through Repository::ExecutionContext.
+*/
+class OperationCancelledException : public RuntimeException
+{
+public:
+	OperationCancelledException (const char* file, const int line);
+};
 }
 
 #endif
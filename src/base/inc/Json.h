@@ -0,0 +1,24 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_JSON_H
+#define KYLA_CORE_INTERNAL_JSON_H
+
+#include <iosfwd>
+
+#include "StringRef.h"
+
+namespace kyla {
+/**
+Write s as a quoted JSON string, escaping it as needed.
+*/
+void WriteJsonString (std::ostream& output, const StringRef& s);
+}
+
+#endif
@@ -25,7 +25,8 @@ private:
 		ExecutionContext& context) override;
 
 	void GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
-		const GetContentObjectCallback& getCallback) override;
+		const GetContentObjectCallback& getCallback,
+		const ResourceLimits& limits) override;
 	void RepairImpl (Repository& source,
 		ExecutionContext& context) override;
 
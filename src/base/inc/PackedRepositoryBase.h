@@ -17,6 +17,7 @@ namespace kyla {
 class PackedRepositoryBase : public BaseRepository
 {
 public:
+	PackedRepositoryBase ();
 	~PackedRepositoryBase ();
 
 	struct PackageFile
@@ -33,9 +34,21 @@ private:
 		ExecutionContext& context) override;
 
 	void GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
-		const GetContentObjectCallback& getCallback) override;
+		const GetContentObjectCallback& getCallback,
+		const ResourceLimits& limits) override;
+
+	void GetContentObjectDeltasImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+		const ArrayRef<SHA256Digest>& baseObjects,
+		const GetContentObjectDeltaCallback& getCallback,
+		const ResourceLimits& limits) override;
+
+	int64 ReadFileImpl (const char* path, const int64 offset,
+		const MutableArrayRef<>& buffer, const ResourceLimits& limits) override;
 
 	virtual std::unique_ptr<PackageFile> OpenPackage (const std::string& packageName) const = 0;
+
+	struct ChunkCache;
+	std::unique_ptr<ChunkCache> chunkCache_;
 };
 } // namespace kyla
 
@@ -0,0 +1,85 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_PATH_TABLE_H
+#define KYLA_CORE_INTERNAL_PATH_TABLE_H
+
+#include <string>
+#include <vector>
+
+#include "StringRef.h"
+#include "Types.h"
+
+namespace kyla {
+/**
+Stores a large number of paths compactly. Paths are split at separators, and
+every component is stored once per parent directory, so directories shared
+by many files are only stored once. A path is identified by a small integer,
+and looking it up costs one hash table probe per component.
+
+Paths are returned with / as the separator, but are otherwise unchanged, so
+absolute paths and . or .. components round-trip. The empty path has id 0.
+*/
+class PathTable final
+{
+public:
+	typedef uint32 PathId;
+
+	PathTable ();
+
+	/**
+	Add a path if it is not stored yet, and return its id. Ids are assigned
+	in increasing order, and every directory of a path gets an id as well.
+	*/
+	PathId Add (const StringRef& path);
+
+	/**
+	Return the id of a path, or InvalidPathId if it was never added.
+	*/
+	PathId Find (const StringRef& path) const;
+
+	std::string GetString (const PathId id) const;
+
+	/**
+	Return the directory containing a path, or InvalidPathId for the empty
+	path.
+	*/
+	PathId GetParent (const PathId id) const;
+
+	/**
+	The last component of a path, valid until the next call to Add.
+	*/
+	StringRef GetName (const PathId id) const;
+
+	// Number of ids, including directories
+	std::size_t GetSize () const;
+
+private:
+	struct Entry
+	{
+		PathId parent;
+		uint32 nameOffset;
+		uint32 nameLength;
+	};
+
+	PathId FindComponent (const PathId parent, const StringRef& name,
+		std::size_t& bucket) const;
+	void Grow ();
+
+	std::vector<Entry> entries_;
+	// Component names, without terminators
+	std::string names_;
+	// Open addressing with linear probing, empty buckets are InvalidPathId
+	std::vector<PathId> buckets_;
+};
+
+const PathTable::PathId InvalidPathId = 0xFFFFFFFF;
+}
+
+#endif
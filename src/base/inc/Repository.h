@@ -10,8 +10,14 @@ details.
 #ifndef KYLA_CORE_INTERNAL_REPOSITORY_H
 #define KYLA_CORE_INTERNAL_REPOSITORY_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "ArrayRef.h"
 #include "FileIO.h"
@@ -21,57 +27,88 @@ details.
 namespace kyla {
 namespace Sql {
 	class Database;
+	class Profiler;
 }
 
 class Log;
+class Tracer;
+
+/**
+A progress update, as passed to the Progress callback.
+*/
+struct ProgressInfo
+{
+	float totalProgress;
+
+	const char* stageName;
+	const char* action;
+
+	// Bytes processed in the current stage. Both are zero if the stage is
+	// not byte based
+	int64 bytesDone;
+	int64 bytesTotal;
+
+	// Smoothed throughput of the current stage, in bytes per second
+	double bytesPerSecond;
+	// Estimated time until the current stage is finished, or negative if
+	// unknown
+	double secondsRemaining;
+};
 
 class Progress
 {
 public:
-	using ProgressCallback = std::function<void (const float p, const char* s, const char* a)>;
+	using ProgressCallback = std::function<void (const ProgressInfo& info)>;
 
-	Progress (ProgressCallback callback)
+	Progress (ProgressCallback callback,
+		std::chrono::milliseconds interval = std::chrono::milliseconds (100))
 		: callback_ (callback)
+		, interval_ (interval)
 	{
 	}
 
-	void operator () (const float p, const char* s, const char* a)
+	void operator () (const ProgressInfo& info)
 	{
-		callback_ (p, s, a);
+		callback_ (info);
+	}
+
+	/**
+	The minimum time between two updates. Stage changes are always
+	reported.
+	*/
+	std::chrono::milliseconds GetInterval () const
+	{
+		return interval_;
+	}
+
+	void SetInterval (std::chrono::milliseconds interval)
+	{
+		interval_ = interval;
 	}
 
 private:
 	ProgressCallback callback_;
+	std::chrono::milliseconds interval_;
 };
 
+/**
+Tracks the progress of an operation split into stages, and forwards it to a
+Progress callback at most once per interval.
+
+Within a stage, progress is measured in items, or in bytes if a byte target
+has been set, in which case throughput and remaining time are reported as
+well.
+*/
 class ProgressHelper
 {
 public:
-	ProgressHelper (Progress progressCallback)
-		: progressCallback_ (progressCallback)
-	{
-	}
+	ProgressHelper (Progress progressCallback);
 
-	void Start (const int stageCount)
-	{
-		stageCount_ = stageCount;
-		currentStage_ = -1;
-	}
+	void Start (const int stageCount);
+	void AdvanceStage (const char* stageName);
 
-	void AdvanceStage (const char* stageName)
-	{
-		++currentStage_;
-		stageName_ = stageName;
-		currentStageTarget_ = 0;
-		current_ = 0;
-		progressCallback_ (GetTotalProgress (),
-			stageName_.c_str (), nullptr);
-	}
-
-	void SetStageTarget (const int64 target)
-	{
-		currentStageTarget_ = target;
-	}
+	void SetStageTarget (const int64 target);
+	void SetStageByteTarget (const int64 bytes);
 
 	void SetAction (const char* action)
 	{
@@ -81,46 +118,45 @@ public:
 	void operator++()
 	{
 		++current_;
-
-		progressCallback_ (GetTotalProgress (),
-			stageName_.c_str (), action_.c_str ());
+		Update (false);
 	}
 
 	void operator++(int)
 	{
 		++current_;
-
-		progressCallback_ (GetTotalProgress (), 
-			stageName_.c_str (), action_.c_str ());
+		Update (false);
 	}
 
-	void SetStageFinished ()
+	void AdvanceBytes (const int64 bytes)
 	{
-		current_ = currentStageTarget_ = 1;
-		progressCallback_ (GetTotalProgress (),
-			stageName_.c_str (), action_.c_str ());
+		bytesDone_ += bytes;
+		Update (false);
 	}
 
+	void SetStageFinished ();
+
 private:
-	float GetInStageProgress () const
-	{
-		assert (current_ <= currentStageTarget_);
-		return static_cast<float> (current_) / static_cast<float> (currentStageTarget_);
-	}
+	using Clock = std::chrono::steady_clock;
 
-	float GetTotalProgress () const
-	{
-		const float stageWeight = static_cast<float> (currentStage_) / static_cast<float> (stageCount_);
-		return stageWeight * currentStage_ + stageWeight * GetInStageProgress ();
-	}
+	void Update (const bool force);
+
+	float GetInStageProgress () const;
+	float GetTotalProgress () const;
 
 	Progress progressCallback_;
 	int64 current_ = 0;
 	int64 currentStageTarget_ = 0;
+	int64 bytesDone_ = 0;
+	int64 bytesTotal_ = 0;
 	int stageCount_ = 1;
 	int currentStage_ = 0;
 	std::string action_;
 	std::string stageName_;
+
+	Clock::time_point lastUpdate_;
+	Clock::time_point lastSample_;
+	int64 lastSampleBytes_ = 0;
+	double bytesPerSecond_ = 0;
 };
 
 enum class ValidationResult
@@ -130,6 +166,70 @@ enum class ValidationResult
 	Missing
 };
 
+/**
+The changes a configure would perform, as computed by PlanConfiguration.
+*/
+struct ConfigurationPlan
+{
+	struct SourcePackage
+	{
+		std::string name;
+		// Bytes read from this package, as stored (that is, compressed)
+		int64 downloadSize = 0;
+		int64 chunkCount = 0;
+	};
+
+	// Only packages which are read from are listed. Content objects which are
+	// not stored in a package (for instance, in a loose repository) are only
+	// included in the totals
+	std::vector<SourcePackage> sourcePackages;
+
+	// Assumes local files are intact, so deltas against them can be used
+	int64 downloadSize = 0;
+	int64 chunkCount = 0;
+	int64 contentObjectCount = 0;
+	// Part of the download size which is first searched for in the previous
+	// version of a file. Only chunks which are not found are downloaded
+	int64 reusableSize = 0;
+
+	// Files which are written and removed on the target, including files
+	// which are replaced with a new version
+	int64 writeFileCount = 0;
+	int64 writeSize = 0;
+	int64 deleteFileCount = 0;
+	int64 deleteSize = 0;
+};
+
+/**
+Bounds for the resources used by a single action. The defaults are suitable
+for a machine running one installation at a time.
+*/
+struct ResourceLimits
+{
+	ResourceLimits ()
+		: threadCount (std::max<int> (1, std::thread::hardware_concurrency ()))
+	{
+	}
+
+	// Upper bound for the buffers held at once, in bytes. At least one chunk
+	// is always buffered, even if it is larger than the budget
+	int64 memoryBudget = 64 << 20;
+	// Number of worker threads used for hashing and decompression
+	int threadCount;
+	// Number of reads which may be in flight at once
+	int ioConcurrency = 4;
+
+	/**
+	Size of one of count buffers sharing the memory budget, clamped to
+	[64 KiB, maximumSize].
+	*/
+	int64 GetBufferSize (const int count, const int64 maximumSize) const
+	{
+		return std::max<int64> (64 << 10,
+			std::min<int64> (maximumSize, memoryBudget / std::max (count, 1)));
+	}
+};
+
 struct Repository
 {
 	Repository () = default;
@@ -142,6 +242,26 @@ struct Repository
 	{
 		Log& log;
 		Progress& progress;
+		// Optional, if set, all database access performed by an action is
+		// profiled
+		Sql::Profiler* profiler;
+		// Optional, if set, a timeline of the action is recorded
+		Tracer* tracer;
+		// Optional, if set to true, the running action stops at the next
+		// point where the repository is consistent
+		const std::atomic<bool>* cancellationFlag;
+		ResourceLimits limits;
+
+		bool IsCancellationRequested () const
+		{
+			return cancellationFlag && cancellationFlag->load ();
+		}
+
+		/**
+		Throw an OperationCancelledException if cancellation has been
+		requested.
+		*/
+		void CheckCancellation () const;
 	};
 
 	using ValidationCallback = std::function<void (const SHA256Digest& contentObject,
@@ -156,8 +276,30 @@ struct Repository
 		const int64 offset,
 		const int64 totalSize)>;
 
+	/**
+	Call getCallback for every requested content object. Large objects may be
+	returned in several parts, the parts of one object are returned in order.
+	The callback is always invoked on the calling thread.
+	*/
 	void GetContentObjects (const ArrayRef<SHA256Digest>& requestedObjects,
-		const GetContentObjectCallback& getCallback);
+		const GetContentObjectCallback& getCallback,
+		const ResourceLimits& limits);
+
+	using GetContentObjectDeltaCallback = std::function<void (const SHA256Digest& objectDigest,
+		const SHA256Digest& baseDigest,
+		const ArrayRef<>& delta)>;
+
+	/**
+	Call getCallback for every requested content object which has a binary
+	delta against one of baseObjects, see ApplyDelta. At most one delta is
+	returned per object, objects without a delta are skipped and have to be
+	fetched using GetContentObjects. The callback is always invoked on the
+	calling thread.
+	*/
+	void GetContentObjectDeltas (const ArrayRef<SHA256Digest>& requestedObjects,
+		const ArrayRef<SHA256Digest>& baseObjects,
+		const GetContentObjectDeltaCallback& getCallback,
+		const ResourceLimits& limits);
 
 	void Repair (Repository& source,
 		ExecutionContext& context);
@@ -170,6 +312,23 @@ struct Repository
 	std::string GetFilesetName (const Uuid& filesetId);
 	int64_t GetFilesetFileCount (const Uuid& filesetId);
 	int64_t GetFilesetSize (const Uuid& filesetId);
+	int64_t GetFilesetDownloadSize (const Uuid& filesetId);
+
+	/**
+	Get the size of a file, as deployed. The path is relative to the
+	repository root, using forward slashes.
+	*/
+	int64 GetFileSize (const char* path);
+
+	/**
+	Read a file directly from the repository, without deploying it. Up to
+	buffer.GetSize () bytes are read starting at offset, the number of bytes
+	read is returned. This is less than the buffer size only if the end of
+	the file has been reached. Decoded data kept between calls is bounded by
+	the memory budget of limits.
+	*/
+	int64 ReadFile (const char* path, const int64 offset,
+		const MutableArrayRef<>& buffer, const ResourceLimits& limits);
 
 	Sql::Database& GetDatabase ();
 
@@ -177,13 +336,22 @@ private:
 	virtual void ValidateImpl (const ValidationCallback& validationCallback,
 		ExecutionContext& context) = 0;
 	virtual void GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
-		const GetContentObjectCallback& getCallback) = 0;
+		const GetContentObjectCallback& getCallback,
+		const ResourceLimits& limits) = 0;
+	virtual void GetContentObjectDeltasImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+		const ArrayRef<SHA256Digest>& baseObjects,
+		const GetContentObjectDeltaCallback& getCallback,
+		const ResourceLimits& limits) = 0;
 	virtual void RepairImpl (Repository& source,
 		ExecutionContext& context) = 0;
 	virtual std::vector<Uuid> GetFilesetsImpl () = 0;
 	virtual std::string GetFilesetNameImpl (const Uuid& filesetId) = 0;
 	virtual int64_t GetFilesetFileCountImpl (const Uuid& filesetId) = 0;
 	virtual int64_t GetFilesetSizeImpl (const Uuid& filesetId) = 0;
+	virtual int64_t GetFilesetDownloadSizeImpl (const Uuid& filesetId) = 0;
+	virtual int64 GetFileSizeImpl (const char* path) = 0;
+	virtual int64 ReadFileImpl (const char* path, const int64 offset,
+		const MutableArrayRef<>& buffer, const ResourceLimits& limits) = 0;
 	virtual void ConfigureImpl (Repository& other,
 		const ArrayRef<Uuid>& filesets,
 		ExecutionContext& context) = 0;
@@ -197,6 +365,34 @@ std::unique_ptr<Repository> DeployRepository (Repository& source,
 	const char* targetPath,
 	const ArrayRef<Uuid>& selectedFilesets,
 	Repository::ExecutionContext& context);
+
+/**
+Deploy source into several directories in one pass. Every content object is
+read and decoded once, and written to all targets.
+*/
+std::vector<std::unique_ptr<Repository>> DeployRepositories (Repository& source,
+	const ArrayRef<const char*>& targetPaths,
+	const ArrayRef<Uuid>& selectedFilesets,
+	Repository::ExecutionContext& context);
+
+/**
+Configure several deployed repositories to the same file sets in one pass.
+Content objects are fetched once, even if several targets need them.
+*/
+void ConfigureRepositories (Repository& source,
+	const ArrayRef<Repository*>& targets,
+	const ArrayRef<Uuid>& selectedFilesets,
+	Repository::ExecutionContext& context);
+
+/**
+Compute what configuring target to the selected file sets would do, without
+modifying the target. If target is null, an installation into an empty
+directory is planned.
+*/
+ConfigurationPlan PlanConfiguration (Repository& source,
+	Repository* target,
+	const ArrayRef<Uuid>& selectedFilesets,
+	Repository::ExecutionContext& context);
 }
 
 #endif
@@ -10,9 +10,66 @@ details.
 #ifndef KYLA_REPOSITORY_BUILDER_H
 #define KYLA_REPOSITORY_BUILDER_H
 
+#include "Compression.h"
+#include "Repository.h"
+
 namespace kyla {
+/**
+Build a repository as described by descriptorFile. If baseRepository is set,
+content objects which are stored in it are not written again. Instead, the
+new repository references the packages of the base repository, and only
+new content objects are written into new packages. The base repository
+must be a packed repository, and targetDirectory may be the same
+directory, in which case new packages are added next to the existing ones.
+Otherwise, the packages which are still used are linked or copied into
+targetDirectory.
+
+If computeDeltas is set, new content objects additionally get a binary delta
+from the content object the same file used in the base repository. Targets
+which have that version deployed only download the delta.
+
+Files are hashed and compressed on the calling thread, so only the memory
+budget of limits is used, to size the read buffer used for hashing.
+*/
 void BuildRepository (const char* descriptorFile,
-	const char* sourceDirectory, const char* targetDirectory);
+	const char* sourceDirectory, const char* targetDirectory,
+	const char* baseRepository, const bool computeDeltas,
+	const ResourceLimits& limits);
+
+struct RepackOptions
+{
+	enum class Order
+	{
+		// Keep the order of the source packages
+		Package,
+		// Group content objects by the first file set using them, so
+		// installing a file set reads a contiguous range
+		Fileset,
+		// Sort content objects by the first path using them
+		Path
+	};
+
+	// If not set, every package keeps the compression most of its chunks use
+	bool overrideCompression = false;
+	CompressionAlgorithm compression = CompressionAlgorithm::Brotli;
+
+	int64 chunkSize = 4 << 20;
+	Order order = Order::Package;
+
+	ResourceLimits limits;
+};
+
+/**
+Write a new packed repository to targetDirectory, using the contents of an
+existing repository. The file sets, files and source packages stay the same,
+but the contents are compressed and split into chunks again, and can be
+reordered. This doesn't need the original source files.
+
+If the source repository has no source packages, for instance, because it is
+a loose repository, all contents are stored in a package called main.
+*/
+void RepackRepository (const char* sourceRepository,
+	const char* targetDirectory, const RepackOptions& options);
 }
 
 #endif
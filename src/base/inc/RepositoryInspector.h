@@ -0,0 +1,108 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_REPOSITORY_INSPECTOR_H
+#define KYLA_CORE_INTERNAL_REPOSITORY_INSPECTOR_H
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "Types.h"
+#include "Uuid.h"
+
+namespace kyla {
+struct Repository;
+
+/**
+Statistics about how the contents of a repository are stored, as computed by
+InspectRepository. All sizes are in bytes.
+*/
+struct RepositoryInspection
+{
+	struct ChunkSizeBucket
+	{
+		// Chunks with a source size in (upperBound/2, upperBound]. The first
+		// bucket contains all smaller chunks
+		int64 upperBound = 0;
+		int64 chunkCount = 0;
+		int64 sourceSize = 0;
+	};
+
+	/**
+	Compression statistics for a group of chunks, for instance, all chunks
+	using the same codec.
+	*/
+	struct ChunkGroup
+	{
+		std::string name;
+		int64 chunkCount = 0;
+		int64 sourceSize = 0;
+		int64 storedSize = 0;
+	};
+
+	/**
+	How a file set is laid out inside a package. Chunks are read in package
+	order, so every chunk which doesn't start where the previous one ended
+	requires a seek over the chunks in between.
+	*/
+	struct FilesetLayout
+	{
+		Uuid id;
+		std::string name;
+		int64 chunkCount = 0;
+		int64 readSize = 0;
+		int64 seekCount = 0;
+		int64 seekDistance = 0;
+	};
+
+	struct SourcePackage
+	{
+		std::string name;
+		std::string filename;
+
+		int64 chunkCount = 0;
+		int64 sourceSize = 0;
+		int64 storedSize = 0;
+		// Chunks which have an entry in storage_hashes
+		int64 hashedChunkCount = 0;
+
+		int64 contentObjectCount = 0;
+		// Size of the content objects stored in this package, and of all
+		// files using them. The difference was saved by deduplication
+		int64 uniqueSize = 0;
+		int64 referencedSize = 0;
+
+		// Binary deltas stored in addition to the chunks, and their size in
+		// the package. Chunks don't include deltas
+		int64 deltaCount = 0;
+		int64 deltaStoredSize = 0;
+
+		std::vector<ChunkSizeBucket> chunkSizes;
+		std::vector<ChunkGroup> compression;
+		// Chunks are attributed to the extension of the first file (by path)
+		// using the content object
+		std::vector<ChunkGroup> extensions;
+		std::vector<FilesetLayout> filesets;
+	};
+
+	std::vector<SourcePackage> sourcePackages;
+
+	void WriteJson (std::ostream& output) const;
+};
+
+/**
+Collect storage statistics for every source package in a repository. Only
+the repository database is read. Repositories which don't store their
+contents in packages have no source packages.
+*/
+RepositoryInspection InspectRepository (Repository& repository);
+}
+
+#endif
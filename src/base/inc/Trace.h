@@ -0,0 +1,149 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_TRACE_H
+#define KYLA_CORE_INTERNAL_TRACE_H
+
+#include <chrono>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "StringRef.h"
+#include "Types.h"
+
+namespace kyla {
+/**
+Records a timeline of spans, for instance, reading, decompressing or hashing
+a chunk, together with the thread they ran on and a count, usually the number
+of bytes they processed. The timeline can be written in the Chrome trace event format, and
+viewed using chrome://tracing or Perfetto.
+
+Spans are usually recorded using TraceSpan, for the tracer made current by a
+TracerScope. A tracer can be shared between threads.
+*/
+class Tracer final
+{
+public:
+	Tracer ();
+
+	/**
+	Record a span. start and duration are in nanoseconds, see GetTime. The
+	category, name and countName must outlive the tracer, usually, they are
+	literals. The count is shown as countName, for instance, bytes or rows.
+	*/
+	void AddSpan (const char* category, const char* name,
+		const int64 start, const int64 duration,
+		const char* countName, const int64 count,
+		const StringRef& detail);
+
+	/**
+	Nanoseconds since the tracer was created or reset.
+	*/
+	int64 GetTime () const;
+
+	void Reset ();
+
+	/**
+	Write all spans as a JSON object in the Chrome trace event format.
+	*/
+	void WriteJson (std::ostream& output) const;
+
+	/**
+	Get the tracer which is current on the calling thread, or null.
+	*/
+	static Tracer* GetCurrent ();
+
+private:
+	struct Span
+	{
+		const char* category;
+		const char* name;
+		const char* countName;
+		// Points into details_, or null
+		const std::string* detail;
+		int64 start;
+		int64 duration;
+		int64 count;
+		int thread;
+	};
+
+	using Clock = std::chrono::steady_clock;
+
+	mutable std::mutex mutex_;
+	Clock::time_point origin_;
+	std::vector<Span> spans_;
+	// Details repeat a lot, for instance, the SQL of a statement which is
+	// executed many times, so every one is stored once
+	std::unordered_set<std::string> details_;
+	// Threads are numbered in the order they record their first span
+	std::unordered_map<std::thread::id, int> threads_;
+};
+
+/**
+Make a tracer current on the calling thread for the lifetime of the scope,
+and restore the previous one afterwards. If tracer is null, nothing happens.
+
+Threads don't inherit the current tracer, so work running on other threads
+has to open a scope of its own.
+*/
+class TracerScope final
+{
+public:
+	explicit TracerScope (Tracer* tracer);
+	~TracerScope ();
+
+	TracerScope (const TracerScope&) = delete;
+	TracerScope& operator= (const TracerScope&) = delete;
+
+private:
+	Tracer* tracer_;
+	Tracer* previous_ = nullptr;
+};
+
+/**
+Record a span from construction to destruction with the current tracer of
+the calling thread. If there is none, nothing is recorded, which only costs
+looking up the current tracer. category and name must outlive the tracer.
+*/
+class TraceSpan final
+{
+public:
+	TraceSpan (const char* category, const char* name, const int64 bytes = 0);
+	~TraceSpan ();
+
+	TraceSpan (const TraceSpan&) = delete;
+	TraceSpan& operator= (const TraceSpan&) = delete;
+
+	void AddBytes (const int64 bytes)
+	{
+		bytes_ += bytes;
+	}
+
+	/**
+	Attach a description, for instance, the file being processed. Nothing is
+	copied if no tracer is current.
+	*/
+	void SetDetail (const StringRef& detail);
+
+private:
+	Tracer* tracer_;
+	const char* category_;
+	const char* name_;
+	int64 start_ = 0;
+	int64 bytes_;
+	std::string detail_;
+};
+}
+
+#endif
@@ -13,6 +13,8 @@ details.
 #include <memory>
 #include <cstdint>
 #include <string>
+#include <utility>
+#include <vector>
 #include "../ArrayRef.h"
 #include "../FileIO.h"
 
@@ -24,6 +26,7 @@ enum class OpenMode
 	ReadWrite
 };
 
+class Profiler;
 class Statement;
 class TemporaryTable;
 class Transaction;
@@ -60,6 +63,12 @@ public:
 
 	Transaction BeginTransaction (TransactionType type = TransactionType::Immediate);
 
+	/**
+	Prepare a statement. Compiled statements are kept in a least-recently-used
+	cache keyed by the SQL text, so preparing the same SQL repeatedly only
+	parses it once. The returned statement is always reset and has no
+	bindings.
+	*/
 	Statement Prepare (const char* statement);
 	Statement Prepare (const std::string& statement);
 
@@ -70,11 +79,25 @@ public:
 	std::int64_t GetLastRowId ();
 
 	void AttachTemporaryCopy (const char* name, Database& source);
+
+	/**
+	Attach the database file other is connected to as name, without copying
+	it. It is opened with the same mode as this database. Databases which
+	only exist in memory are copied, see AttachTemporaryCopy.
+	*/
+	void Attach (const char* name, Database& other);
 	void Detach (const char* name);
 
 	TemporaryTable CreateTemporaryTable (const char* name,
 		const char* columnDefinition);
 
+	/**
+	Attach a profiler, which records statistics for every statement executed
+	on this database until it is detached again by passing null.
+	*/
+	void SetProfiler (Profiler* profiler);
+	Profiler* GetProfiler () const;
+
 public:
 	struct Impl;
 
@@ -120,6 +143,23 @@ enum class Type
 	Blob
 };
 
+/**
+An array bound to a statement using Statement::BindArray.
+*/
+struct ArrayBinding
+{
+	enum class Type
+	{
+		Int64,
+		Blob
+	};
+
+	const void* data = nullptr;
+	std::int64_t count = 0;
+	std::int64_t elementSize = 0;
+	Type type = Type::Blob;
+};
+
 class Statement final
 {
 public:
@@ -140,6 +180,27 @@ public:
 	void Bind (const int index, const ArrayRef<>& data,
 		const ValueBinding binding = ValueBinding::Copy);
 
+	/**
+	Bind an array as a table-valued parameter. The array can be accessed in
+	the statement using the kyla_array table-valued function, for instance:
+
+	SELECT * FROM content_objects WHERE Hash IN (SELECT Value FROM kyla_array(?))
+
+	Integer arrays produce integer values, all other element types are
+	returned as fixed-size blobs. The data is not copied and must stay valid
+	until the statement is destroyed or the index is bound again.
+	*/
+	void BindArray (const int index, const ArrayRef<std::int64_t>& values);
+
+	template <typename T>
+	void BindArray (const int index, const ArrayRef<T>& values)
+	{
+		BindArray (index, values.GetData (), values.GetCount (), sizeof (T));
+	}
+
+	void BindArray (const int index, const void* data,
+		const std::int64_t count, const std::int64_t elementSize);
+
 	template <typename ... Args>
 	void BindArguments (Args&& ... args)
 	{
@@ -169,8 +230,15 @@ private:
 		BindArgumentsInternal<Index+1> (args...);
 	}
 
+	void BindArray (const int index, const ArrayBinding& binding);
+	void Release ();
+
 	Database::Impl* impl_ = nullptr;
 	void*			p_ = nullptr;
+	bool			cached_ = false;
+
+	// Parameter index, array handle
+	std::vector<std::pair<int, std::int64_t>> arrayHandles_;
 };
 
 class TemporaryTable final
@@ -0,0 +1,112 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CORE_INTERNAL_SQL_PROFILER_H
+#define KYLA_CORE_INTERNAL_SQL_PROFILER_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace kyla {
+class Log;
+
+namespace Sql {
+class Database;
+
+/**
+Aggregated statistics for all executions of one SQL statement.
+*/
+struct StatementProfile
+{
+	std::string sql;
+
+	// Number of times the statement was compiled. Cached statements are
+	// only prepared once
+	std::int64_t prepareCount = 0;
+	// Number of completed executions, that is, runs until reset or done
+	std::int64_t executionCount = 0;
+	// Number of calls to Statement::Step
+	std::int64_t stepCount = 0;
+	// Wall clock time spent executing, in nanoseconds
+	std::int64_t totalTime = 0;
+	// Number of rows visited in full table scans
+	std::int64_t fullScanSteps = 0;
+	// Number of rows inserted into automatic indices. If this is non-zero,
+	// SQLite had to build a transient index, which usually means an index
+	// is missing
+	std::int64_t autoIndexSteps = 0;
+	// Number of virtual machine instructions, a rough measure of work
+	std::int64_t virtualMachineSteps = 0;
+};
+
+/**
+Collects per-statement statistics from one or more databases. Attach it using
+Database::SetProfiler, or through a ProfilerScope. Profiling is opt-in as the
+bookkeeping costs a hash lookup per step.
+
+A profiler can be shared between databases, and databases used on different
+threads.
+*/
+class Profiler final
+{
+public:
+	void OnPrepare (const char* sql);
+	void OnStep (const char* sql);
+	void OnExecuted (const char* sql, const std::int64_t time,
+		const std::int64_t fullScanSteps, const std::int64_t autoIndexSteps,
+		const std::int64_t virtualMachineSteps);
+
+	/**
+	Get all recorded statements, sorted by total time, slowest first.
+	*/
+	std::vector<StatementProfile> GetProfile () const;
+
+	void Reset ();
+
+	/**
+	Write a summary of the slowest statements to the log.
+	*/
+	void Report (Log& log, const std::size_t maxStatements = 10) const;
+
+	/**
+	Write all recorded statements as a JSON array.
+	*/
+	void WriteJson (std::ostream& output) const;
+
+private:
+	mutable std::mutex mutex_;
+	std::unordered_map<std::string, StatementProfile> statements_;
+};
+
+/**
+Attaches a profiler to a database for the lifetime of the scope, and restores
+the previously attached one afterwards. If profiler is null, nothing happens.
+*/
+class ProfilerScope final
+{
+public:
+	ProfilerScope (Profiler* profiler, Database& database);
+	~ProfilerScope ();
+
+	ProfilerScope (const ProfilerScope&) = delete;
+	ProfilerScope& operator= (const ProfilerScope&) = delete;
+
+private:
+	Profiler* profiler_;
+	Profiler* previous_ = nullptr;
+	Database& database_;
+};
+}
+}
+
+#endif
@@ -11,6 +11,17 @@ details.
 
 #include "sql/Database.h"
 #include "Exception.h"
+#include "Hash.h"
+#include "Trace.h"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
 
 namespace kyla {
 ///////////////////////////////////////////////////////////////////////////////
@@ -33,9 +44,42 @@ std::vector<Uuid> BaseRepository::GetFilesetsImpl ()
 	return result;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/**
+Repositories created by older builders don't have the precomputed statistics
+table, in which case we have to compute everything on the fly.
+*/
+bool BaseRepository::HasFilesetStatistics ()
+{
+	if (!filesetStatisticsChecked_) {
+		auto query = GetDatabase ().Prepare (
+			"SELECT COUNT(*) FROM sqlite_master "
+			"WHERE type = 'table' AND name = 'file_set_statistics'");
+		query.Step ();
+
+		hasFilesetStatistics_ = query.GetInt64 (0) > 0;
+		filesetStatisticsChecked_ = true;
+	}
+
+	return hasFilesetStatistics_;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 int64_t BaseRepository::GetFilesetSizeImpl (const Uuid& id)
 {
+	if (HasFilesetStatistics ()) {
+		auto query = GetDatabase ().Prepare (
+			"SELECT file_set_statistics.Size "
+			"FROM file_set_statistics "
+			"INNER JOIN file_sets ON file_sets.Id = file_set_statistics.FileSetId "
+			"WHERE file_sets.Uuid = ?");
+		query.BindArguments (id);
+
+		if (query.Step ()) {
+			return query.GetInt64 (0);
+		}
+	}
+
 	static const char* querySql =
 		"SELECT SUM(content_objects.size) "
 		"FROM file_sets "
@@ -53,6 +97,19 @@ int64_t BaseRepository::GetFilesetSizeImpl (const Uuid& id)
 ///////////////////////////////////////////////////////////////////////////////
 int64_t BaseRepository::GetFilesetFileCountImpl (const Uuid& id)
 {
+	if (HasFilesetStatistics ()) {
+		auto query = GetDatabase ().Prepare (
+			"SELECT file_set_statistics.FileCount "
+			"FROM file_set_statistics "
+			"INNER JOIN file_sets ON file_sets.Id = file_set_statistics.FileSetId "
+			"WHERE file_sets.Uuid = ?");
+		query.BindArguments (id);
+
+		if (query.Step ()) {
+			return query.GetInt64 (0);
+		}
+	}
+
 	static const char* querySql =
 		"SELECT COUNT(content_objects.Id) "
 		"FROM file_sets "
@@ -67,6 +124,56 @@ int64_t BaseRepository::GetFilesetFileCountImpl (const Uuid& id)
 	return query.GetInt64 (0);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+int64_t BaseRepository::GetFilesetDownloadSizeImpl (const Uuid& id)
+{
+	if (HasFilesetStatistics ()) {
+		auto query = GetDatabase ().Prepare (
+			"SELECT file_set_statistics.DownloadSize "
+			"FROM file_set_statistics "
+			"INNER JOIN file_sets ON file_sets.Id = file_set_statistics.FileSetId "
+			"WHERE file_sets.Uuid = ?");
+		query.BindArguments (id);
+
+		if (query.Step ()) {
+			return query.GetInt64 (0);
+		}
+	}
+
+	// If there is no storage mapping, the content objects are stored as-is
+	static const char* querySql =
+		"SELECT COALESCE("
+		"    (SELECT SUM(PackageSize) FROM storage_mapping "
+		"        WHERE ContentObjectId IN (SELECT ContentObjectId FROM files "
+		"            WHERE FileSetId = file_sets.Id)), "
+		"    (SELECT SUM(Size) FROM content_objects "
+		"        WHERE Id IN (SELECT ContentObjectId FROM files "
+		"            WHERE FileSetId = file_sets.Id)), "
+		"    0) "
+		"FROM file_sets "
+		"WHERE file_sets.Uuid = ?";
+
+	auto query = GetDatabase ().Prepare (querySql);
+	query.BindArguments (id);
+
+	if (query.Step ()) {
+		return query.GetInt64 (0);
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Only packed repositories store deltas.
+*/
+void BaseRepository::GetContentObjectDeltasImpl (const ArrayRef<SHA256Digest>&,
+	const ArrayRef<SHA256Digest>&,
+	const GetContentObjectDeltaCallback&,
+	const ResourceLimits&)
+{
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 std::string BaseRepository::GetFilesetNameImpl (const Uuid& id)
 {
@@ -80,6 +187,297 @@ std::string BaseRepository::GetFilesetNameImpl (const Uuid& id)
 	return query.GetText (0);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+BaseRepository::FileContents BaseRepository::GetFileContents (const char* path)
+{
+	static const char* querySql =
+		"SELECT content_objects.Hash, content_objects.Size "
+		"FROM files "
+		"INNER JOIN content_objects ON content_objects.Id = files.ContentObjectId "
+		"WHERE files.Path = ?";
+
+	auto query = GetDatabase ().Prepare (querySql);
+	query.BindArguments (path);
+
+	if (!query.Step ()) {
+		throw RuntimeException ("Repository",
+			str (boost::format ("File '%1%' does not exist") % path),
+			KYLA_FILE_LINE);
+	}
+
+	FileContents result;
+	query.GetBlob (0, result.hash);
+	result.size = query.GetInt64 (1);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Copy the part of a chunk starting at chunkOffset within a file which
+overlaps the range [offset, offset + buffer size) into buffer.
+*/
+void BaseRepository::CopyOverlappingRange (const ArrayRef<>& chunk,
+	const int64 chunkOffset, const int64 offset,
+	const MutableArrayRef<>& buffer)
+{
+	const auto begin = std::max (chunkOffset, offset);
+	const auto end = std::min (chunkOffset + chunk.GetSize (),
+		offset + buffer.GetSize ());
+
+	if (begin >= end) {
+		return;
+	}
+
+	::memcpy (static_cast<byte*> (buffer.GetData ()) + (begin - offset),
+		static_cast<const byte*> (chunk.GetData ()) + (begin - chunkOffset),
+		end - begin);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int64 BaseRepository::GetFileSizeImpl (const char* path)
+{
+	return GetFileContents (path).size;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Fetches the whole content object and copies out the requested range. Packed
+repositories override this to decode only the chunks which are needed.
+*/
+int64 BaseRepository::ReadFileImpl (const char* path, const int64 offset,
+	const MutableArrayRef<>& buffer, const ResourceLimits&)
+{
+	if (offset < 0) {
+		throw RuntimeException ("Repository", "Offset must not be negative",
+			KYLA_FILE_LINE);
+	}
+
+	const auto contents = GetFileContents (path);
+
+	if (offset >= contents.size) {
+		return 0;
+	}
+
+	const auto bytesToRead = std::min<int64> (contents.size - offset,
+		buffer.GetSize ());
+	const MutableArrayRef<> output (buffer.GetData (), bytesToRead);
+
+	GetContentObjects (ArrayRef<SHA256Digest> (&contents.hash, 1),
+		[&](const SHA256Digest&, const ArrayRef<>& chunk,
+		const int64 chunkOffset, const int64) -> void {
+		CopyOverlappingRange (chunk, chunkOffset, offset, output);
+	}, ResourceLimits ());
+
+	return bytesToRead;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Check files on disk against their expected size and hash. nextFile is called
+on the calling thread, and the files are handed to limits.threadCount workers,
+each using its own buffer carved out of the memory budget. A worker picks up
+the next file as soon as it is done, so a large file doesn't hold up the
+others. Results are reported on the calling thread, in the order nextFile
+returned the files.
+*/
+void BaseRepository::ValidateFiles (const NextFileCallback& nextFile,
+	const ValidationCallback& validationCallback,
+	ExecutionContext& context, ProgressHelper& progress)
+{
+	const auto threadCount = std::max (context.limits.threadCount, 1);
+	// Larger buffers don't make hashing any faster
+	const auto bufferSize = context.limits.GetBufferSize (threadCount, 1 << 20);
+
+	const auto validateFile = [bufferSize](const FileToValidate& file,
+		std::vector<byte>& buffer) -> ValidationResult {
+		TraceSpan span ("hash", "Validate", file.size);
+		if (Tracer::GetCurrent ()) {
+			span.SetDetail (file.path.string ());
+		}
+
+		if (!boost::filesystem::exists (file.path)) {
+			return ValidationResult::Missing;
+		}
+
+		///@TODO(minor) Try/catch here and report corrupted if something goes wrong?
+		/// This would indicate the file got deleted or is read-protected
+		/// while the validation is running
+
+		if (static_cast<int64> (Stat (file.path).size) != file.size) {
+			return ValidationResult::Corrupted;
+		}
+
+		// For size 0 files, don't bother checking the hash
+		///@TODO(minor) Assert hash is the null hash
+		if (file.size == 0) {
+			return ValidationResult::Ok;
+		}
+
+		buffer.resize (static_cast<std::size_t> (
+			std::min (bufferSize, file.size)));
+
+		if (ComputeSHA256 (file.path, buffer) != file.hash) {
+			return ValidationResult::Corrupted;
+		}
+
+		return ValidationResult::Ok;
+	};
+
+	if (threadCount == 1) {
+		std::vector<byte> buffer;
+
+		for (;;) {
+			context.CheckCancellation ();
+
+			FileToValidate file;
+			if (!nextFile (file)) {
+				break;
+			}
+
+			const auto result = validateFile (file, buffer);
+
+			validationCallback (file.hash, file.path.string ().c_str (), result);
+			progress.AdvanceBytes (file.size);
+		}
+
+		return;
+	}
+
+	struct PendingFile
+	{
+		FileToValidate file;
+		ValidationResult result;
+		std::exception_ptr error;
+		bool done;
+	};
+
+	// Enough files are queued so workers don't wait for the calling thread
+	// while it reports a result
+	const auto maxPendingFiles = 2 * static_cast<std::size_t> (threadCount);
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	// Files in the order nextFile returned them, until they are reported
+	std::deque<PendingFile> pending;
+	// Index of the first file in pending no worker picked up yet
+	std::size_t nextPending = 0;
+	bool hasMoreFiles = true;
+	bool stopped = false;
+
+	const auto tracer = Tracer::GetCurrent ();
+
+	const auto worker = [&]() -> void {
+		TracerScope tracerScope (tracer);
+		std::vector<byte> buffer;
+
+		for (;;) {
+			PendingFile* file;
+
+			{
+				std::unique_lock<std::mutex> lock (mutex);
+				changed.wait (lock, [&]() -> bool {
+					return stopped || nextPending < pending.size () || !hasMoreFiles;
+				});
+
+				if (stopped || nextPending == pending.size ()) {
+					break;
+				}
+
+				// Elements of a deque don't move when others are added or
+				// removed at the ends
+				file = &pending [nextPending++];
+			}
+
+			auto result = ValidationResult::Ok;
+			std::exception_ptr error;
+
+			try {
+				result = validateFile (file->file, buffer);
+			} catch (...) {
+				error = std::current_exception ();
+			}
+
+			std::lock_guard<std::mutex> lock (mutex);
+			file->result = result;
+			file->error = error;
+			file->done = true;
+			changed.notify_all ();
+		}
+	};
+
+	std::vector<std::future<void>> workers;
+	for (int i = 0; i < threadCount; ++i) {
+		workers.push_back (std::async (std::launch::async, worker));
+	}
+
+	const auto stop = [&]() -> void {
+		{
+			std::lock_guard<std::mutex> lock (mutex);
+			stopped = true;
+			changed.notify_all ();
+		}
+
+		for (auto& w : workers) {
+			w.wait ();
+		}
+	};
+
+	try {
+		for (;;) {
+			context.CheckCancellation ();
+
+			// Only the calling thread adds or removes files, so the size can
+			// be read without holding the lock
+			while (hasMoreFiles && pending.size () < maxPendingFiles) {
+				FileToValidate file;
+				const auto hasFile = nextFile (file);
+
+				std::lock_guard<std::mutex> lock (mutex);
+
+				if (hasFile) {
+					pending.push_back (PendingFile{ std::move (file),
+						ValidationResult::Ok, nullptr, false });
+				} else {
+					hasMoreFiles = false;
+				}
+
+				changed.notify_all ();
+			}
+
+			if (pending.empty ()) {
+				break;
+			}
+
+			PendingFile file;
+
+			{
+				std::unique_lock<std::mutex> lock (mutex);
+				changed.wait (lock, [&]() -> bool {
+					return pending.front ().done;
+				});
+
+				file = std::move (pending.front ());
+				pending.pop_front ();
+				--nextPending;
+			}
+
+			if (file.error) {
+				std::rethrow_exception (file.error);
+			}
+
+			validationCallback (file.file.hash,
+				file.file.path.string ().c_str (), file.result);
+			progress.AdvanceBytes (file.file.size);
+		}
+	} catch (...) {
+		stop ();
+		throw;
+	}
+
+	stop ();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void BaseRepository::RepairImpl (Repository& /*source*/,
 	ExecutionContext& /*context*/)
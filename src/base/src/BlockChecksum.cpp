@@ -0,0 +1,112 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "BlockChecksum.h"
+
+#include <map>
+#include <unordered_map>
+
+namespace kyla {
+///////////////////////////////////////////////////////////////////////////////
+RollingChecksum::RollingChecksum (const ArrayRef<>& block)
+	: size_ (static_cast<uint32> (block.GetSize ()))
+{
+	const auto data = static_cast<const byte*> (block.GetData ());
+
+	// Both sums are taken modulo 2^16 in Get, so they can wrap around here
+	for (uint32 i = 0; i < size_; ++i) {
+		a_ += data [i];
+		b_ += (size_ - i) * data [i];
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void RollingChecksum::Roll (const byte out, const byte in)
+{
+	a_ += in - out;
+	b_ += a_ - size_ * out;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32 RollingChecksum::Get () const
+{
+	return (a_ & 0xFFFF) | (b_ << 16);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32 ComputeWeakChecksum (const ArrayRef<>& block)
+{
+	return RollingChecksum (block).Get ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<int64> FindBlocks (const ArrayRef<>& data,
+	const ArrayRef<BlockToFind>& blocks)
+{
+	std::vector<int64> result (blocks.GetSize (), -1);
+
+	const ArrayRef<byte> bytes (static_cast<const byte*> (data.GetData ()),
+		data.GetSize ());
+	const auto dataSize = static_cast<int64> (data.GetSize ());
+
+	// The checksum depends on the block size, so every size needs its own
+	// pass over the data. Blocks are usually split at a fixed size, so
+	// there are only few different ones
+	std::map<int64, std::unordered_multimap<uint32, std::size_t>> blocksBySize;
+	for (ArrayRef<BlockToFind>::size_type i = 0; i < blocks.GetSize (); ++i) {
+		if (blocks [i].size > 0 && blocks [i].size <= dataSize) {
+			blocksBySize [blocks [i].size].emplace (blocks [i].weakChecksum, i);
+		}
+	}
+
+	for (const auto& blocksWithSize : blocksBySize) {
+		const auto blockSize = blocksWithSize.first;
+		const auto& candidates = blocksWithSize.second;
+		auto remaining = candidates.size ();
+
+		RollingChecksum checksum (bytes.Slice (0,
+			static_cast<std::size_t> (blockSize)));
+
+		for (int64 offset = 0; ; ++offset) {
+			const auto range = candidates.equal_range (checksum.Get ());
+
+			// The strong checksum is only computed if a block which hasn't
+			// been found yet has the same weak checksum
+			bool hasStrongChecksum = false;
+			SHA256Digest strongChecksum;
+
+			for (auto it = range.first; it != range.second; ++it) {
+				if (result [it->second] != -1) {
+					continue;
+				}
+
+				if (!hasStrongChecksum) {
+					strongChecksum = ComputeSHA256 (bytes.Slice (
+						static_cast<std::size_t> (offset),
+						static_cast<std::size_t> (blockSize)));
+					hasStrongChecksum = true;
+				}
+
+				if (blocks [it->second].strongChecksum == strongChecksum) {
+					result [it->second] = offset;
+					--remaining;
+				}
+			}
+
+			if (remaining == 0 || offset + blockSize >= dataSize) {
+				break;
+			}
+
+			checksum.Roll (bytes [offset], bytes [offset + blockSize]);
+		}
+	}
+
+	return result;
+}
+}
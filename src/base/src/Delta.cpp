@@ -0,0 +1,281 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "Delta.h"
+
+#include "Exception.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+namespace kyla {
+namespace {
+// The delta starts with the magic, followed by the target size. Every
+// instruction is an opcode, followed by its arguments as variable length
+// integers:
+//   Add length <length bytes>
+//   Copy baseOffset length
+const char DeltaMagic [8] = { 'K', 'Y', 'D', 'E', 'L', 'T', 'A', '1' };
+
+enum DeltaOpcode : byte
+{
+	DeltaOpcode_Add = 0,
+	DeltaOpcode_Copy = 1
+};
+
+// Matches shorter than a block are not worth a copy instruction
+const std::size_t BlockSize = 32;
+const std::uint32_t HashMultiplier = 0x01000193;
+
+///////////////////////////////////////////////////////////////////////////////
+void WriteVarint (std::vector<byte>& output, std::uint64_t value)
+{
+	while (value >= 0x80) {
+		output.push_back (static_cast<byte> (value | 0x80));
+		value >>= 7;
+	}
+
+	output.push_back (static_cast<byte> (value));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::uint64_t ReadVarint (const byte* data, const std::size_t size,
+	std::size_t& offset)
+{
+	std::uint64_t result = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (offset >= size) {
+			break;
+		}
+
+		const auto b = data [offset++];
+		result |= static_cast<std::uint64_t> (b & 0x7F) << shift;
+
+		if ((b & 0x80) == 0) {
+			return result;
+		}
+	}
+
+	throw RuntimeException ("Delta", "Delta is truncated", KYLA_FILE_LINE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::uint32_t HashBlock (const byte* data)
+{
+	std::uint32_t hash = 0;
+
+	for (std::size_t i = 0; i < BlockSize; ++i) {
+		hash = hash * HashMultiplier + data [i];
+	}
+
+	return hash;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void WriteAdd (std::vector<byte>& output, const byte* data,
+	const std::size_t size)
+{
+	if (size == 0) {
+		return;
+	}
+
+	output.push_back (DeltaOpcode_Add);
+	WriteVarint (output, size);
+	output.insert (output.end (), data, data + size);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void WriteCopy (std::vector<byte>& output, const std::size_t offset,
+	const std::size_t size)
+{
+	output.push_back (DeltaOpcode_Copy);
+	WriteVarint (output, offset);
+	WriteVarint (output, size);
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<byte> ComputeDelta (const ArrayRef<>& base, const ArrayRef<>& target)
+{
+	const auto baseData = static_cast<const byte*> (base.GetData ());
+	const auto baseSize = static_cast<std::size_t> (base.GetSize ());
+	const auto targetData = static_cast<const byte*> (target.GetData ());
+	const auto targetSize = static_cast<std::size_t> (target.GetSize ());
+
+	std::vector<byte> result (DeltaMagic, DeltaMagic + sizeof (DeltaMagic));
+	WriteVarint (result, targetSize);
+
+	// Index every block of the base. Only the first occurrence of a block is
+	// kept, as any copy of it reconstructs the same bytes
+	std::unordered_map<std::uint32_t, std::size_t> blocks;
+	blocks.reserve (baseSize / BlockSize);
+
+	for (std::size_t i = 0; i + BlockSize <= baseSize; i += BlockSize) {
+		blocks.emplace (HashBlock (baseData + i), i);
+	}
+
+	// Weight of the byte leaving the window when rolling the hash
+	std::uint32_t outgoingWeight = 1;
+	for (std::size_t i = 1; i < BlockSize; ++i) {
+		outgoingWeight *= HashMultiplier;
+	}
+
+	std::size_t literalStart = 0;
+	std::size_t position = 0;
+	std::uint32_t hash = 0;
+	bool hashValid = false;
+
+	while (position + BlockSize <= targetSize && !blocks.empty ()) {
+		if (!hashValid) {
+			hash = HashBlock (targetData + position);
+			hashValid = true;
+		}
+
+		const auto block = blocks.find (hash);
+
+		if (block != blocks.end () && ::memcmp (baseData + block->second,
+			targetData + position, BlockSize) == 0) {
+			auto matchBase = block->second;
+			auto matchTarget = position;
+			auto matchSize = BlockSize;
+
+			// Extend into the pending literal bytes
+			while (matchBase > 0 && matchTarget > literalStart
+				&& baseData [matchBase - 1] == targetData [matchTarget - 1]) {
+				--matchBase;
+				--matchTarget;
+				++matchSize;
+			}
+
+			while (matchBase + matchSize < baseSize
+				&& matchTarget + matchSize < targetSize
+				&& baseData [matchBase + matchSize] == targetData [matchTarget + matchSize]) {
+				++matchSize;
+			}
+
+			WriteAdd (result, targetData + literalStart, matchTarget - literalStart);
+			WriteCopy (result, matchBase, matchSize);
+
+			position = matchTarget + matchSize;
+			literalStart = position;
+			hashValid = false;
+			continue;
+		}
+
+		if (position + BlockSize < targetSize) {
+			hash = (hash - targetData [position] * outgoingWeight) * HashMultiplier
+				+ targetData [position + BlockSize];
+		}
+
+		++position;
+	}
+
+	WriteAdd (result, targetData + literalStart, targetSize - literalStart);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ApplyDelta (File& base, const ArrayRef<>& delta, const int64 bufferSize,
+	const ApplyDeltaCallback& callback)
+{
+	const auto baseSize = static_cast<std::uint64_t> (base.GetSize ());
+	const auto deltaData = static_cast<const byte*> (delta.GetData ());
+	const auto deltaSize = static_cast<std::size_t> (delta.GetSize ());
+
+	if (deltaSize < sizeof (DeltaMagic)
+		|| ::memcmp (deltaData, DeltaMagic, sizeof (DeltaMagic)) != 0) {
+		throw RuntimeException ("Delta", "Invalid delta header", KYLA_FILE_LINE);
+	}
+
+	std::size_t offset = sizeof (DeltaMagic);
+	const auto targetSize = ReadVarint (deltaData, deltaSize, offset);
+
+	// The size is only a hint, a corrupted delta must not make us allocate
+	// huge amounts of memory up front
+	std::vector<byte> buffer (static_cast<std::size_t> (std::max<std::uint64_t> (1,
+		std::min<std::uint64_t> (targetSize, static_cast<std::uint64_t> (bufferSize)))));
+	std::size_t bufferUsed = 0;
+	std::uint64_t bufferOffset = 0;
+
+	// A full buffer is only passed on once more data follows, so the last
+	// piece is passed on after the whole delta has been checked
+	const auto reserve = [&](const std::uint64_t size) -> std::size_t {
+		if (size > targetSize - bufferOffset - bufferUsed) {
+			throw RuntimeException ("Delta", "Delta exceeds the target size",
+				KYLA_FILE_LINE);
+		}
+
+		if (bufferUsed == buffer.size ()) {
+			callback (ArrayRef<> (buffer.data (), bufferUsed),
+				static_cast<int64> (bufferOffset), static_cast<int64> (targetSize));
+			bufferOffset += bufferUsed;
+			bufferUsed = 0;
+		}
+
+		return static_cast<std::size_t> (std::min<std::uint64_t> (size,
+			buffer.size () - bufferUsed));
+	};
+
+	while (offset < deltaSize) {
+		const auto opcode = deltaData [offset++];
+
+		if (opcode == DeltaOpcode_Add) {
+			const auto size = ReadVarint (deltaData, deltaSize, offset);
+
+			if (size > deltaSize - offset) {
+				throw RuntimeException ("Delta", "Delta is truncated", KYLA_FILE_LINE);
+			}
+
+			for (auto remaining = size; remaining > 0;) {
+				const auto count = reserve (remaining);
+				::memcpy (buffer.data () + bufferUsed, deltaData + offset, count);
+				bufferUsed += count;
+				offset += count;
+				remaining -= count;
+			}
+		} else if (opcode == DeltaOpcode_Copy) {
+			const auto copyOffset = ReadVarint (deltaData, deltaSize, offset);
+			const auto size = ReadVarint (deltaData, deltaSize, offset);
+
+			if (copyOffset > baseSize || size > baseSize - copyOffset) {
+				throw RuntimeException ("Delta", "Delta copies outside of the base",
+					KYLA_FILE_LINE);
+			}
+
+			base.Seek (static_cast<int64> (copyOffset));
+
+			for (auto remaining = size; remaining > 0;) {
+				const auto count = reserve (remaining);
+
+				if (base.Read (MutableArrayRef<> (buffer.data () + bufferUsed,
+					count)) != static_cast<int64> (count)) {
+					throw RuntimeException ("Delta", "Could not read the base",
+						KYLA_FILE_LINE);
+				}
+
+				bufferUsed += count;
+				remaining -= count;
+			}
+		} else {
+			throw RuntimeException ("Delta", "Invalid delta instruction",
+				KYLA_FILE_LINE);
+		}
+	}
+
+	if (bufferOffset + bufferUsed != targetSize) {
+		throw RuntimeException ("Delta", "Delta is truncated", KYLA_FILE_LINE);
+	}
+
+	callback (ArrayRef<> (buffer.data (), bufferUsed),
+		static_cast<int64> (bufferOffset), static_cast<int64> (targetSize));
+}
+}
@@ -15,16 +15,54 @@ details.
 #include "Hash.h"
 #include "Log.h"
 
+#include "BlockChecksum.h"
 #include "Compression.h"
+#include "Delta.h"
+#include "PathTable.h"
+#include "Trace.h"
 
 #include <boost/format.hpp>
 
 #include "install-db-structure.h"
 
+#include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
 #include <set>
 
 namespace kyla {
+namespace {
+/**
+A file which is mapped into memory while this object exists.
+*/
+struct MappedFile
+{
+	explicit MappedFile (const Path& path)
+		: file (OpenFile (path, FileOpenMode::Read))
+		, size (file->GetSize ())
+	{
+		// Empty files cannot be mapped
+		if (size > 0) {
+			data = file->Map ();
+		}
+	}
+
+	~MappedFile ()
+	{
+		if (data) {
+			file->Unmap (data);
+		}
+	}
+
+	MappedFile (const MappedFile&) = delete;
+	MappedFile& operator= (const MappedFile&) = delete;
+
+	std::unique_ptr<File> file;
+	int64 size;
+	void* data = nullptr;
+};
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 DeployedRepository::DeployedRepository (const char* path, Sql::OpenMode openMode)
 	: db_ (Sql::Database::Open (Path (path) / "k.db", openMode))
@@ -59,62 +97,30 @@ void DeployedRepository::ValidateImpl (const Repository::ValidationCallback& val
 	
 	auto query = db_.Prepare (queryFilesContentSql);
 
-	const int64 objectCount = [=]() -> int64
-	{
-		static const char* queryObjectCountSql =
-			"SELECT COUNT(*) FROM content_objects";
-		auto countQuery = db_.Prepare (queryObjectCountSql);
-		countQuery.Step ();
-		return countQuery.GetInt64 (0);
-	} ();
-
 	ProgressHelper progress (context.progress);
-	progress.SetStageTarget (objectCount);
 
-	while (query.Step ()) {
-		const Path path = query.GetText (0);
-		SHA256Digest hash;
-		query.GetBlob (1, hash);
-		const auto size = query.GetInt64 (2);
-
-		const auto filePath = path_ / path;
-		if (!boost::filesystem::exists (filePath)) {
-			validationCallback (hash, filePath.string ().c_str (),
-				ValidationResult::Missing);
-
-			++progress;
-			continue;
-		}
-
-		const auto statResult = Stat (filePath);
-
-		///@TODO(minor) Try/catch here and report corrupted if something goes wrong?
-		/// This would indicate the file got deleted or is read-protected
-		/// while the validation is running
-
-		if (statResult.size != size) {
-			validationCallback (hash, filePath.string ().c_str (),
-				ValidationResult::Corrupted);
-
-			++progress;
-			continue;
-		}
-
-		// For size 0 files, don't bother checking the hash
-		///@TODO(minor) Assert hash is the null hash
-		if (size != 0 && ComputeSHA256 (filePath) != hash) {
-			validationCallback (hash, filePath.string ().c_str (),
-				ValidationResult::Corrupted);
+	{
+		static const char* queryTotalSizeSql =
+			"SELECT COUNT(*), TOTAL(content_objects.Size) FROM files "
+			"LEFT JOIN content_objects ON content_objects.Id = files.ContentObjectId";
+		auto totalQuery = db_.Prepare (queryTotalSizeSql);
+		totalQuery.Step ();
+
+		progress.SetStageTarget (totalQuery.GetInt64 (0));
+		progress.SetStageByteTarget (totalQuery.GetInt64 (1));
+	}
 
-			++progress;
-			continue;
+	ValidateFiles ([&](FileToValidate& file) -> bool {
+		if (!query.Step ()) {
+			return false;
 		}
 
-		validationCallback (hash, filePath.string ().c_str (),
-			ValidationResult::Ok);
+		file.path = path_ / Path{ query.GetText (0) };
+		query.GetBlob (1, file.hash);
+		file.size = query.GetInt64 (2);
 
-		++progress;
-	}
+		return true;
+	}, validationCallback, context, progress);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -127,7 +133,9 @@ void DeployedRepository::RepairImpl (Repository& source,
 	/// In this case, we should probably prompt and ask what file sets need
 	/// to be recovered.
 
-	std::unordered_multimap<SHA256Digest, Path,
+	// All paths share the repository directory, which is stored only once
+	PathTable paths;
+	std::unordered_multimap<SHA256Digest, PathTable::PathId,
 		HashDigestHash, HashDigestEqual> requiredEntries;
 
 	// Extract keys
@@ -143,7 +151,7 @@ void DeployedRepository::RepairImpl (Repository& source,
 				requiredContentObjects.push_back (hash);
 			}
 
-			requiredEntries.emplace (std::make_pair (hash, Path{ path }));
+			requiredEntries.emplace (std::make_pair (hash, paths.Add (path)));
 		}
 	}, context);
 
@@ -151,31 +159,40 @@ void DeployedRepository::RepairImpl (Repository& source,
 		const ArrayRef<>& contents,
 		const int64 offset,
 		const int64 totalSize) -> void {
+		context.CheckCancellation ();
+
+		TraceSpan span ("write", "Store", contents.GetSize ());
+
 		// We lookup all paths from the map here - could do a query as well
 		// but as we built it anyway during validation, we reuse that
 
 		auto range = requiredEntries.equal_range (hash);
 		for (auto it = range.first; it != range.second; ++it) {
+			const Path path{ paths.GetString (it->second) };
 			std::unique_ptr<File> file;
 
 			if (offset == 0) {
-				file = CreateFile (it->second);
-				file->SetSize (contents.GetSize ());
+				file = CreateFile (path);
+				file->SetSize (totalSize);
 			} else {
-				file = OpenFile (it->second, FileOpenMode::Write);
+				file = OpenFile (path, FileOpenMode::Write);
 			}
 
-			byte* pointer = static_cast<byte*> (file->Map ());
-			::memcpy (pointer + offset, contents.GetData (), contents.GetSize ());
-			file->Unmap (pointer);
+			// Write through instead of mapping, so repairing a large file
+			// doesn't map all of it for every chunk
+			file->Seek (offset);
+			file->Write (contents);
 		}
-	});
+	}, context.limits);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 void DeployedRepository::GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
-	const Repository::GetContentObjectCallback& getCallback)
+	const Repository::GetContentObjectCallback& getCallback,
+	const ResourceLimits& /*limits*/)
 {
+	// Files are mapped, so the contents are backed by the page cache and
+	// don't count against the memory budget
 	auto query = db_.Prepare (
 		"SELECT Path FROM files "
 		"WHERE ContentObjectId=(SELECT Id FROM content_objects WHERE Hash=?) "
@@ -188,12 +205,19 @@ void DeployedRepository::GetContentObjectsImpl (const ArrayRef<SHA256Digest>& re
 		const auto filePath = path_ / Path{ query.GetText (0) };
 
 		auto file = OpenFile (filePath, FileOpenMode::Read);
-		auto pointer = file->Map ();
+		const auto fileSize = file->GetSize ();
+
+		// Empty files cannot be mapped
+		if (fileSize > 0) {
+			auto pointer = file->Map ();
 
-		const ArrayRef<> fileContents{ pointer, file->GetSize () };
-		getCallback (hash, fileContents, 0, file->GetSize ());
+			const ArrayRef<> fileContents{ pointer, fileSize };
+			getCallback (hash, fileContents, 0, fileSize);
 
-		file->Unmap (pointer);
+			file->Unmap (pointer);
+		} else {
+			getCallback (hash, ArrayRef<> {}, 0, 0);
+		}
 
 		query.Reset ();
 	}
@@ -204,54 +228,171 @@ void DeployedRepository::ConfigureImpl (Repository& source,
 	const ArrayRef<Uuid>& filesets,
 	ExecutionContext& context)
 {
-	// We do this in WAL mode for performance
-	db_.Execute ("PRAGMA journal_mode = WAL");
-	db_.Execute ("PRAGMA synchronous = NORMAL");
-
-	// We start by cleaning up all content objects which are not referenced
-	// A deployed repository needs at least one file referencing a
-	// content object, otherwise, the content object is missing. This
-	// allows us to process partially uninstalled repositories (or a
-	// repository that has been recovered.)
-	db_.Execute (
-		"DELETE FROM content_objects WHERE "
-		"Id IN ("
-		"SELECT Id from content_objects_with_reference_count "
-		"WHERE ReferenceCount=0"
-		");");
+	DeployedRepository* targets [] = { this };
+	ConfigureMany (source, targets, filesets, context);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Configure several repositories to the same file sets in one pass. Every
+target is prepared on its own, but content objects missing in any target are
+fetched from the source only once, and written to each target which needs
+them. Files are copied locally per target afterwards.
+*/
+void DeployedRepository::ConfigureMany (Repository& source,
+	const ArrayRef<DeployedRepository*>& targets,
+	const ArrayRef<Uuid>& filesets,
+	ExecutionContext& context)
+{
+	for (auto target : targets) {
+		TraceSpan span ("configure", "Prepare");
+
+		auto& db = target->db_;
+
+		// We do this in WAL mode for performance
+		db.Execute ("PRAGMA journal_mode = WAL");
+		db.Execute ("PRAGMA synchronous = NORMAL");
 
-	// This copies everything over, so we can do joins on source and target
-	// now. Assumes the source contains all file sets, content objects and
-	// files we're about to configure
-	db_.AttachTemporaryCopy ("source", source.GetDatabase ());
+		// We start by cleaning up all content objects which are not referenced
+		// A deployed repository needs at least one file referencing a
+		// content object, otherwise, the content object is missing. This
+		// allows us to process partially uninstalled repositories (or a
+		// repository that has been recovered.)
+		target->UpgradeReferenceCounts (context.log);
+
+		db.Execute (
+			"DELETE FROM content_objects WHERE ReferenceCount=0");
+
+		// This copies everything over, so we can do joins on source and target
+		// now. Assumes the source contains all file sets, content objects and
+		// files we're about to configure
+		db.AttachTemporaryCopy ("source", source.GetDatabase ());
+	}
 
 	ProgressHelper progressHelper (context.progress);
 	progressHelper.Start (2);
 
-	progressHelper.AdvanceStage ("Setup");
+	try {
+		context.CheckCancellation ();
+
+		progressHelper.AdvanceStage ("Setup");
+
+		// Store the file sets we're going to install in a temporary table for
+		// joins, etc.
+		std::vector<Sql::TemporaryTable> pendingFileSetTables;
+
+		for (auto target : targets) {
+			TraceSpan span ("configure", "Setup");
+
+			pendingFileSetTables.push_back (target->db_.CreateTemporaryTable (
+				"pending_file_sets", "Uuid BLOB NOT NULL UNIQUE"));
+
+			target->PreparePendingFilesets (context.log, filesets, progressHelper);
+			target->UpdateFilesets ();
+			target->UpdateFilesetIdsForUnchangedFiles ();
+			target->PreserveOutdatedFiles (context.log);
+			target->RemoveChangedFiles (context.log);
+		}
+
+		progressHelper.SetStageFinished ();
+		context.CheckCancellation ();
+
+		progressHelper.AdvanceStage ("Install");
+		GetNewContentObjects (source, targets, context, progressHelper);
+		context.CheckCancellation ();
+
+		for (auto target : targets) {
+			target->RemoveStagingFiles (context.log);
+		}
+
+		for (auto target : targets) {
+			TraceSpan span ("configure", "Copy existing files");
+
+			target->CopyExistingFiles (context.log);
+			target->Cleanup (context.log);
+		}
+
+		progressHelper.SetStageFinished ();
+	} catch (const OperationCancelledException&) {
+		// Every content object is committed together with the files using
+		// it, so the database matches what is on disk. Only partially
+		// received content objects have to be removed. Running configure
+		// again completes the operation
+		context.log.Info ("Configure", "Configuration has been cancelled");
+
+		for (auto target : targets) {
+			target->RemoveStagingFiles (context.log);
+			target->db_.Detach ("source");
+			target->db_.Execute ("PRAGMA journal_mode = DELETE");
+		}
+
+		throw;
+	}
+
+	for (auto target : targets) {
+		TraceSpan span ("configure", "Finish");
+
+		auto& db = target->db_;
+
+		db.Detach ("source");
+
+		db.Execute ("PRAGMA journal_mode = DELETE");
+		db.Execute ("ANALYZE");
+		db.Execute ("VACUUM");
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Repositories deployed before the reference count was stored in
+content_objects use a view which counts the references on every access. Add
+the column and the triggers maintaining it if needed.
+*/
+void DeployedRepository::UpgradeReferenceCounts (Log& log)
+{
+	{
+		auto columnsQuery = db_.Prepare ("PRAGMA table_info(content_objects)");
 
-	// Store the file sets we're going to install in a temporary table for
-	// joins, etc.
-	auto pendingFileSetTable = db_.CreateTemporaryTable ("pending_file_sets",
-		"Uuid BLOB NOT NULL UNIQUE");
+		while (columnsQuery.Step ()) {
+			if (strcmp (columnsQuery.GetText (1), "ReferenceCount") == 0) {
+				return;
+			}
+		}
+	}
 
-	PreparePendingFilesets (context.log, filesets, progressHelper);
-	UpdateFilesets ();
-	UpdateFilesetIdsForUnchangedFiles ();
-	RemoveChangedFiles (context.log);
+	log.Info ("Configure", "Upgrading database to stored reference counts");
 
-	progressHelper.SetStageFinished ();
-	progressHelper.AdvanceStage ("Install");
-	GetNewContentObjects (source, context.log, progressHelper);
-	CopyExistingFiles (context.log);
-	Cleanup (context.log);
-	progressHelper.SetStageFinished ();
+	auto transaction = db_.BeginTransaction ();
 
-	db_.Detach ("source");
+	db_.Execute (
+		"DROP VIEW content_objects_with_reference_count;"
+		"ALTER TABLE content_objects "
+		"    ADD COLUMN ReferenceCount INTEGER NOT NULL DEFAULT 0;"
+		"UPDATE content_objects SET ReferenceCount = "
+		"    (SELECT COUNT(*) FROM files WHERE ContentObjectId = content_objects.Id);"
+		"CREATE INDEX content_objects_unreferenced_idx ON content_objects (Id) "
+		"    WHERE ReferenceCount = 0;"
+		"CREATE TRIGGER files_insert_reference_count AFTER INSERT ON files "
+		"BEGIN "
+		"    UPDATE content_objects SET ReferenceCount = ReferenceCount + 1 "
+		"        WHERE Id = NEW.ContentObjectId; "
+		"END;"
+		"CREATE TRIGGER files_delete_reference_count AFTER DELETE ON files "
+		"BEGIN "
+		"    UPDATE content_objects SET ReferenceCount = ReferenceCount - 1 "
+		"        WHERE Id = OLD.ContentObjectId; "
+		"END;"
+		"CREATE TRIGGER files_update_reference_count AFTER UPDATE OF ContentObjectId ON files "
+		"BEGIN "
+		"    UPDATE content_objects SET ReferenceCount = ReferenceCount - 1 "
+		"        WHERE Id = OLD.ContentObjectId; "
+		"    UPDATE content_objects SET ReferenceCount = ReferenceCount + 1 "
+		"        WHERE Id = NEW.ContentObjectId; "
+		"END;"
+		"CREATE VIEW content_objects_with_reference_count "
+		"    AS SELECT Id, Hash, Size, ReferenceCount FROM content_objects;");
 
-	db_.Execute ("PRAGMA journal_mode = DELETE");
-	db_.Execute ("ANALYZE");
-	db_.Execute ("VACUUM");
+	transaction.Commit ();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -265,17 +406,18 @@ void DeployedRepository::PreparePendingFilesets (Log& log, const ArrayRef<Uuid>&
 	{
 		auto transaction = db_.BeginTransaction ();
 		auto insertFilesetQuery = db_.Prepare (
-			"INSERT INTO pending_file_sets (Uuid) VALUES (?);");
+			"INSERT INTO pending_file_sets (Uuid) "
+			"SELECT Value FROM kyla_array(?);");
 
 		log.Debug ("Configure", "Selecting filesets for configure");
 
 		progress.SetStageTarget (filesets.GetCount ());
 		progress.SetAction ("Configuring filesets");
-		for (const auto& fileset : filesets) {
-			insertFilesetQuery.BindArguments (fileset);
-			insertFilesetQuery.Step ();
-			insertFilesetQuery.Reset ();
 
+		insertFilesetQuery.BindArray (1, filesets);
+		insertFilesetQuery.Step ();
+
+		for (const auto& fileset : filesets) {
 			log.Debug ("Configure", boost::format ("Selected fileset: '%1%'") % ToString (fileset));
 			++progress;
 		}
@@ -367,25 +509,139 @@ void DeployedRepository::RemoveChangedFiles (Log& log)
 	}
 
 	// content objects
-	db_.Execute ("DELETE FROM content_objects "
-		"WHERE Id IN "
-		"(SELECT Id FROM content_objects_with_reference_count WHERE ReferenceCount = 0)");
+	db_.Execute ("DELETE FROM content_objects WHERE ReferenceCount = 0");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Keep a copy of the content objects which RemoveChangedFiles is about to
+delete, if they help to get the new contents:
+
+- Content objects the source stores a delta against
+- The previous content of files whose new content object has block
+  checksums, so unchanged chunks can be taken from it
+
+Only content objects needed for the pending file sets are considered. The
+copies are stored next to the staging files, and removed with them.
+*/
+void DeployedRepository::PreserveOutdatedFiles (Log& log)
+{
+	preservedObjects_.clear ();
+	outdatedObjects_.clear ();
+
+	auto hasSourceTable = [this](const char* name) -> bool {
+		auto hasTableQuery = db_.Prepare (
+			"SELECT COUNT(*) FROM source.sqlite_master "
+			"WHERE type = 'table' AND name = ?");
+		hasTableQuery.BindArguments (name);
+		hasTableQuery.Step ();
+
+		return hasTableQuery.GetInt64 (0) > 0;
+	};
+
+	auto preserve = [this, &log](const SHA256Digest& hash, const char* path) -> bool {
+		if (preservedObjects_.find (hash) != preservedObjects_.end ()) {
+			return true;
+		}
+
+		const auto sourcePath = path_ / Path{ path };
+		const auto preservedPath = path_ / (ToString (hash) + ".kybase");
+
+		// Deployed files are never modified in place, so a link is enough
+		boost::system::error_code error;
+		boost::filesystem::create_hard_link (sourcePath, preservedPath, error);
+
+		if (error) {
+			boost::filesystem::copy_file (sourcePath, preservedPath, error);
+		}
+
+		if (error) {
+			log.Debug ("Configure", boost::format ("Could not keep outdated file '%1%'")
+				% sourcePath);
+			return false;
+		}
+
+		preservedObjects_ [hash] = preservedPath;
+
+		log.Debug ("Configure", boost::format ("Keeping outdated file %1%")
+			% sourcePath);
+
+		return true;
+	};
+
+	if (hasSourceTable ("storage_deltas")) {
+		auto deltaBasesQuery = db_.Prepare (
+			"SELECT main.content_objects.Hash, MIN(main.files.Path) FROM main.content_objects "
+			"INNER JOIN main.files ON main.files.ContentObjectId = main.content_objects.Id "
+			"WHERE main.content_objects.Hash IN ( "
+			"    SELECT source.storage_deltas.BaseHash FROM source.storage_deltas "
+			"    INNER JOIN source.content_objects ON source.content_objects.Id = source.storage_deltas.ContentObjectId "
+			"    WHERE NOT source.content_objects.Hash IN (SELECT Hash FROM main.content_objects) "
+			"    AND source.content_objects.Id IN (SELECT ContentObjectId FROM source.files "
+			"        WHERE FileSetId IN (SELECT Id FROM source.file_sets "
+			"        WHERE Uuid IN (SELECT Uuid FROM pending_file_sets)))) "
+			"GROUP BY main.content_objects.Hash");
+
+		while (deltaBasesQuery.Step ()) {
+			SHA256Digest hash;
+			deltaBasesQuery.GetBlob (0, hash);
+
+			preserve (hash, deltaBasesQuery.GetText (1));
+		}
+	}
+
+	if (hasSourceTable ("storage_block_checksums")) {
+		auto outdatedFilesQuery = db_.Prepare (
+			"SELECT main.content_objects.Hash, MIN(main.files.Path), source.content_objects.Hash FROM main.files "
+			"INNER JOIN main.content_objects ON main.files.ContentObjectId = main.content_objects.Id "
+			"INNER JOIN source.files ON source.files.Path = main.files.Path "
+			"INNER JOIN source.content_objects ON source.files.ContentObjectId = source.content_objects.Id "
+			"WHERE main.content_objects.Hash IS NOT source.content_objects.Hash "
+			"AND main.content_objects.Size > 0 "
+			"AND NOT source.content_objects.Hash IN (SELECT Hash FROM main.content_objects) "
+			"AND source.files.FileSetId IN (SELECT Id FROM source.file_sets "
+			"    WHERE Uuid IN (SELECT Uuid FROM pending_file_sets)) "
+			"AND source.content_objects.Id IN (SELECT source.storage_mapping.ContentObjectId "
+			"    FROM source.storage_mapping "
+			"    INNER JOIN source.storage_block_checksums "
+			"    ON source.storage_block_checksums.StorageMappingId = source.storage_mapping.Id) "
+			"GROUP BY main.content_objects.Hash, source.content_objects.Hash");
+
+		while (outdatedFilesQuery.Step ()) {
+			SHA256Digest hash, newHash;
+			outdatedFilesQuery.GetBlob (0, hash);
+			outdatedFilesQuery.GetBlob (2, newHash);
+
+			if (preserve (hash, outdatedFilesQuery.GetText (1))) {
+				outdatedObjects_ [newHash].push_back (hash);
+			}
+		}
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 /**
 Get new content objects, but only for those files, for which we don't
-have a content object already.
+have a content object already. Each object is fetched once, and stored in
+every target which is missing it.
 */
-void DeployedRepository::GetNewContentObjects (Repository& source, Log& log,
-	ProgressHelper& progress)
+void DeployedRepository::GetNewContentObjects (Repository& source,
+	const ArrayRef<DeployedRepository*>& targets,
+	ExecutionContext& context, ProgressHelper& progress)
 {
-	// Find all missing content objects in this database
+	auto& log = context.log;
+
+	// Find all missing content objects in the target databases
 	std::vector<SHA256Digest> requiredContentObjects;
+	std::unordered_map<SHA256Digest, std::vector<DeployedRepository*>,
+		HashDigestHash, HashDigestEqual> requiringTargets;
+	int64 requiredBytes = 0;
 
-	{
-		auto diffQuery = db_.Prepare (
-			"SELECT DISTINCT Hash FROM source.content_objects "
+	for (auto target : targets) {
+		TraceSpan span ("configure", "Find new content objects");
+
+		auto diffQuery = target->db_.Prepare (
+			"SELECT DISTINCT Hash, Size FROM source.content_objects "
 			"INNER JOIN source.files ON "
 			"source.content_objects.Id = source.files.ContentObjectId "
 			"WHERE source.files.FileSetId IN "
@@ -395,132 +651,481 @@ void DeployedRepository::GetNewContentObjects (Repository& source, Log& log,
 
 		while (diffQuery.Step ()) {
 			SHA256Digest contentObjectHash;
-
 			diffQuery.GetBlob (0, contentObjectHash);
-			requiredContentObjects.push_back (contentObjectHash);
+
+			auto& requiringTargetsForObject = requiringTargets [contentObjectHash];
+			if (requiringTargetsForObject.empty ()) {
+				requiredContentObjects.push_back (contentObjectHash);
+				requiredBytes += diffQuery.GetInt64 (1);
+			}
+
+			requiringTargetsForObject.push_back (target);
 
 			log.Debug ("Configure", boost::format ("Discovered content object '%1%'") % ToString (contentObjectHash));
 		}
 	}
 
 	progress.SetStageTarget (requiredContentObjects.size ());
+	progress.SetStageByteTarget (requiredBytes);
+
+	// Objects for which the source has a delta against a content object
+	// one of the targets kept are reconstructed first. The result is only
+	// used if its hash matches, so a modified local file never ends up in a
+	// target, and the object is fetched in full instead
+	std::unordered_map<SHA256Digest, Path, HashDigestHash, HashDigestEqual> deltaBases;
+	for (auto target : targets) {
+		deltaBases.insert (target->preservedObjects_.begin (),
+			target->preservedObjects_.end ());
+	}
+
+	if (!deltaBases.empty ()) {
+		std::vector<SHA256Digest> baseObjects;
+		for (const auto& deltaBase : deltaBases) {
+			baseObjects.push_back (deltaBase.first);
+		}
+
+		std::unordered_set<SHA256Digest, HashDigestHash, HashDigestEqual> reconstructedObjects;
+
+		source.GetContentObjectDeltas (requiredContentObjects, baseObjects,
+			[&](const SHA256Digest& hash,
+			const SHA256Digest& baseHash,
+			const ArrayRef<>& delta) -> void {
+			context.CheckCancellation ();
+
+			TraceSpan span ("decode", "Apply delta", delta.GetSize ());
+
+			// The target is written piece by piece through the staging file,
+			// so neither the base nor the target are held in memory
+			SHA256StreamHasher hasher;
+			hasher.Initialize ();
+
+			int64 totalSize = -1;
+			bool storing = false;
+
+			try {
+				auto baseFile = OpenFile (deltaBases [baseHash], FileOpenMode::Read);
+
+				ApplyDelta (*baseFile, delta, context.limits.GetBufferSize (1, 4 << 20),
+					[&](const ArrayRef<>& contents, const int64 offset, const int64 size) -> void {
+					hasher.Update (contents);
+
+					// The last piece completes the object in the targets, so it
+					// must only be stored if everything matches
+					if (offset + contents.GetSize () == size) {
+						if (hasher.Finalize () != hash) {
+							return;
+						}
+
+						totalSize = size;
+					}
+
+					storing = true;
+					for (auto target : requiringTargets [hash]) {
+						target->StoreContentObject (hash, contents, offset, size,
+							log, progress);
+					}
+					storing = false;
+				});
+			} catch (const std::exception& e) {
+				// Errors while writing the targets are not a problem of the delta
+				if (storing) {
+					throw;
+				}
+
+				log.Debug ("Configure", boost::format ("Could not apply delta to '%1%': %2%")
+					% ToString (hash) % e.what ());
+			}
+
+			if (totalSize == -1) {
+				log.Warning ("Configure", boost::format ("Delta for content object '%1%' "
+					"could not be applied, fetching it in full") % ToString (hash));
+				return;
+			}
+
+			progress.AdvanceBytes (totalSize);
+			++progress;
+
+			reconstructedObjects.insert (hash);
+
+			log.Debug ("Configure", boost::format ("Reconstructed content object '%1%' "
+				"from a %2% byte delta") % ToString (hash) % delta.GetSize ());
+		}, context.limits);
+
+		requiredContentObjects.erase (std::remove_if (
+			requiredContentObjects.begin (), requiredContentObjects.end (),
+			[&reconstructedObjects](const SHA256Digest& hash) -> bool {
+			return reconstructedObjects.find (hash) != reconstructedObjects.end ();
+		}), requiredContentObjects.end ());
+	}
+
+	// Objects with block checksums are assembled from the chunks which are
+	// still present in the outdated files at their paths, and only the
+	// remaining chunks are read from the source
+	{
+		std::unordered_set<SHA256Digest, HashDigestHash, HashDigestEqual> assembledObjects;
+
+		for (const auto& hash : requiredContentObjects) {
+			if (AssembleFromOutdatedFiles (source, hash, requiringTargets [hash],
+				context, progress)) {
+				assembledObjects.insert (hash);
+			}
+		}
+
+		requiredContentObjects.erase (std::remove_if (
+			requiredContentObjects.begin (), requiredContentObjects.end (),
+			[&assembledObjects](const SHA256Digest& hash) -> bool {
+			return assembledObjects.find (hash) != assembledObjects.end ();
+		}), requiredContentObjects.end ());
+	}
 
 	// Fetch the missing ones now and store in the right places
 	source.GetContentObjects (requiredContentObjects, [&](const SHA256Digest& hash,
 		const ArrayRef<>& contents,
 		const int64 offset,
 		const int64 totalSize) -> void {
-		const auto hashString = ToString (hash);
+		context.CheckCancellation ();
 
-		bool hasStagingFile = false;
-		const auto stagingFilePath = path_ / (hashString + ".kytmp");
-		if ((offset != 0) || (contents.GetSize () != totalSize)) {
-			std::unique_ptr<File> file;
-			
-			if (offset == 0) {
-				log.Debug ("Configure",
-					boost::format ("Created staging file %1%")
-					% stagingFilePath);
+		for (auto target : requiringTargets [hash]) {
+			target->StoreContentObject (hash, contents, offset, totalSize,
+				log, progress);
+		}
 
-				file = CreateFile (stagingFilePath);
-				file->SetSize (totalSize);
-			} else {
-				log.Debug ("Configure",
-					boost::format ("Appending to staging file %1%")
-					% stagingFilePath);
+		progress.AdvanceBytes (contents.GetSize ());
+
+		if ((offset + contents.GetSize ()) == totalSize) {
+			++progress;
+		}
+	}, context.limits);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Search the outdated files kept for a content object for its chunks, using the
+block checksums stored in the source. If any chunk is found, the object is
+assembled chunk by chunk, reading only the missing chunks from the source,
+and stored in targets.
+
+Returns false if nothing was stored, either because no chunk was found, or
+because the assembled object doesn't match its hash. It has to be fetched in
+full then.
+*/
+bool DeployedRepository::AssembleFromOutdatedFiles (Repository& source,
+	const SHA256Digest& hash,
+	const ArrayRef<DeployedRepository*>& targets,
+	ExecutionContext& context, ProgressHelper& progress)
+{
+	auto& log = context.log;
+
+	std::vector<std::unique_ptr<MappedFile>> outdatedFiles;
+	{
+		std::unordered_set<SHA256Digest, HashDigestHash, HashDigestEqual> outdatedObjects;
 
-				file = OpenFile (stagingFilePath, FileOpenMode::Write);
+		for (auto target : targets) {
+			const auto it = target->outdatedObjects_.find (hash);
+
+			if (it == target->outdatedObjects_.end ()) {
+				continue;
 			}
 
-			file->Seek (offset);
-			file->Write (contents);
+			for (const auto& outdatedObject : it->second) {
+				if (outdatedObjects.insert (outdatedObject).second) {
+					outdatedFiles.emplace_back (new MappedFile (
+						target->preservedObjects_ [outdatedObject]));
+				}
+			}
+		}
+	}
 
-			if ((offset + contents.GetSize ()) != totalSize) {
-				return;
-			} else {
-				hasStagingFile = true;
+	if (outdatedFiles.empty ()) {
+		return false;
+	}
+
+	TraceSpan span ("configure", "Assemble from outdated files");
+
+	// All targets have the same source attached
+	auto& db = targets [0]->db_;
+
+	std::string path;
+	int64 totalSize = 0;
+	{
+		auto objectQuery = db.Prepare (
+			"SELECT source.files.Path, source.content_objects.Size FROM source.files "
+			"INNER JOIN source.content_objects ON source.content_objects.Id = source.files.ContentObjectId "
+			"WHERE source.content_objects.Hash = ? "
+			"LIMIT 1");
+		objectQuery.BindArguments (hash);
+
+		if (!objectQuery.Step ()) {
+			return false;
+		}
+
+		path = objectQuery.GetText (0);
+		totalSize = objectQuery.GetInt64 (1);
+	}
+
+	std::vector<BlockToFind> blocks;
+	std::vector<int64> blockOffsets;
+	{
+		auto blocksQuery = db.Prepare (
+			"SELECT source.storage_mapping.SourceOffset, source.storage_mapping.SourceSize, "
+			"    source.storage_block_checksums.WeakChecksum, "
+			"    source.storage_block_checksums.StrongChecksum "
+			"FROM source.storage_mapping "
+			"INNER JOIN source.storage_block_checksums "
+			"    ON source.storage_block_checksums.StorageMappingId = source.storage_mapping.Id "
+			"INNER JOIN source.content_objects "
+			"    ON source.content_objects.Id = source.storage_mapping.ContentObjectId "
+			"WHERE source.content_objects.Hash = ? "
+			"ORDER BY source.storage_mapping.SourceOffset");
+		blocksQuery.BindArguments (hash);
+
+		int64 offset = 0;
+		while (blocksQuery.Step ()) {
+			// Chunks may be stored more than once, in different packages
+			if (blocksQuery.GetInt64 (0) != offset) {
+				continue;
 			}
+
+			BlockToFind block;
+			block.size = blocksQuery.GetInt64 (1);
+			block.weakChecksum = static_cast<uint32> (blocksQuery.GetInt64 (2));
+			blocksQuery.GetBlob (3, block.strongChecksum);
+
+			blocks.push_back (block);
+			blockOffsets.push_back (offset);
+
+			offset += block.size;
 		}
 
-		auto transaction = db_.BeginTransaction ();
-		log.Debug ("Configure", boost::format ("Received content object '%1%'") % hashString);
+		// Every chunk needs a checksum, otherwise the object can't be
+		// assembled
+		if (offset != totalSize) {
+			return false;
+		}
+	}
 
-		int64 contentObjectId = -1;
-		{
-			auto insertContentObjectQuery = db_.Prepare (
-				"INSERT INTO content_objects (Hash, Size) "
-				"VALUES (?, ?);");
+	// The file and offset of every chunk found locally, or -1
+	std::vector<std::size_t> foundInFile (blocks.size ());
+	std::vector<int64> foundAtOffset (blocks.size (), -1);
+	int64 reusedBytes = 0;
+
+	for (std::size_t i = 0; i < outdatedFiles.size (); ++i) {
+		context.CheckCancellation ();
 
-			insertContentObjectQuery.BindArguments (hash, contents.GetSize ());
-			insertContentObjectQuery.Step ();
-			insertContentObjectQuery.Reset ();
+		const auto& outdatedFile = *outdatedFiles [i];
 
-			contentObjectId = db_.GetLastRowId ();
+		std::vector<BlockToFind> remainingBlocks;
+		std::vector<std::size_t> remainingBlockIndices;
 
-			log.Debug ("Configure", boost::format ("Stored content object '%1%' with id %2%") % hashString % contentObjectId);
+		for (std::size_t j = 0; j < blocks.size (); ++j) {
+			if (foundAtOffset [j] == -1) {
+				remainingBlocks.push_back (blocks [j]);
+				remainingBlockIndices.push_back (j);
+			}
 		}
 
-		auto insertFileQuery = db_.Prepare (
-			"INSERT INTO main.files (Path, ContentObjectId, FileSetId) "
-			"SELECT ?, ?, main.file_sets.Id FROM source.files "
-			"INNER JOIN source.file_sets ON source.file_sets.Id = source.files.FileSetId "
-			"INNER JOIN file_sets ON source.file_sets.Uuid = main.file_sets.Uuid "
-			"WHERE source.files.path = ?"
-		);
+		if (remainingBlocks.empty ()) {
+			break;
+		}
 
-		auto getTargetFilesQuery = db_.Prepare (
-			"SELECT Path FROM source.files "
-			"WHERE source.files.ContentObjectId = (SELECT Id FROM source.content_objects WHERE source.content_objects.Hash = ?)");
+		const auto offsets = FindBlocks (
+			ArrayRef<> (outdatedFile.data, outdatedFile.size),
+			remainingBlocks);
 
-		getTargetFilesQuery.BindArguments (hash);
+		for (std::size_t j = 0; j < offsets.size (); ++j) {
+			if (offsets [j] != -1) {
+				foundInFile [remainingBlockIndices [j]] = i;
+				foundAtOffset [remainingBlockIndices [j]] = offsets [j];
+				reusedBytes += remainingBlocks [j].size;
+			}
+		}
+	}
 
-		bool isFirstFile = true;
-		Path lastFilePath;
-		while (getTargetFilesQuery.Step ()) {
-			const Path targetPath{ getTargetFilesQuery.GetText (0) };
+	if (reusedBytes == 0) {
+		return false;
+	}
 
-			progress.SetAction (getTargetFilesQuery.GetText (0));
+	SHA256StreamHasher hasher;
+	hasher.Initialize ();
 
-			boost::filesystem::create_directories (path_ / targetPath.parent_path ());
+	std::vector<byte> buffer;
 
-			if (hasStagingFile) {
-				if (isFirstFile) {
-					log.Debug ("Configure", 
-						boost::format ("Renaming staging file %1% to %2%") 
-							% stagingFilePath % targetPath);
+	for (std::size_t i = 0; i < blocks.size (); ++i) {
+		context.CheckCancellation ();
 
-					boost::filesystem::rename (stagingFilePath,
-						path_ / targetPath);
-					isFirstFile = false;
-				} else {
-					log.Debug ("Configure",
-						boost::format ("Copying file %1% to %2%")
-						% stagingFilePath % targetPath);
+		const auto size = blocks [i].size;
+		ArrayRef<> contents;
 
-					assert (!lastFilePath.empty ());
-					boost::filesystem::copy_file (lastFilePath,
-						path_ / targetPath);
-				}
+		if (foundAtOffset [i] != -1) {
+			contents = ArrayRef<> (static_cast<const byte*> (
+				outdatedFiles [foundInFile [i]]->data) + foundAtOffset [i], size);
+		} else {
+			buffer.resize (static_cast<std::size_t> (size));
 
-				lastFilePath = path_ / targetPath;
-			} else {
+			if (source.ReadFile (path.c_str (), blockOffsets [i], buffer,
+				context.limits) != size) {
+				log.Warning ("Configure", boost::format ("Could not read chunk of "
+					"content object '%1%', fetching it in full") % ToString (hash));
+				return false;
+			}
+
+			contents = buffer;
+		}
+
+		hasher.Update (contents);
+
+		// The last chunk completes the object in the targets, so it must
+		// only be stored if everything matches
+		if (i + 1 == blocks.size () && hasher.Finalize () != hash) {
+			log.Warning ("Configure", boost::format ("Content object '%1%' could not "
+				"be assembled from outdated files, fetching it in full") % ToString (hash));
+			return false;
+		}
+
+		for (auto target : targets) {
+			target->StoreContentObject (hash, contents, blockOffsets [i],
+				totalSize, log, progress);
+		}
+	}
+
+	progress.AdvanceBytes (totalSize);
+	++progress;
+
+	log.Debug ("Configure", boost::format ("Assembled content object '%1%', "
+		"reused %2% of %3% bytes from outdated files")
+		% ToString (hash) % reusedBytes % totalSize);
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Store a content object, or a part of it, and create all files using it.
+Objects received in several parts are assembled in a staging file first.
+*/
+void DeployedRepository::StoreContentObject (const SHA256Digest& hash,
+	const ArrayRef<>& contents,
+	const int64 offset,
+	const int64 totalSize,
+	Log& log, ProgressHelper& progress)
+{
+	const auto hashString = ToString (hash);
+
+	TraceSpan span ("write", "Store", contents.GetSize ());
+	span.SetDetail (hashString);
+
+	bool hasStagingFile = false;
+	const auto stagingFilePath = path_ / (hashString + ".kytmp");
+	if ((offset != 0) || (contents.GetSize () != totalSize)) {
+		std::unique_ptr<File> file;
+		
+		if (offset == 0) {
+			log.Debug ("Configure",
+				boost::format ("Created staging file %1%")
+				% stagingFilePath);
+
+			file = CreateFile (stagingFilePath);
+			file->SetSize (totalSize);
+		} else {
+			log.Debug ("Configure",
+				boost::format ("Appending to staging file %1%")
+				% stagingFilePath);
+
+			file = OpenFile (stagingFilePath, FileOpenMode::Write);
+		}
+
+		file->Seek (offset);
+		file->Write (contents);
+
+		if ((offset + contents.GetSize ()) != totalSize) {
+			return;
+		} else {
+			hasStagingFile = true;
+		}
+	}
+
+	auto transaction = db_.BeginTransaction ();
+	log.Debug ("Configure", boost::format ("Received content object '%1%'") % hashString);
+
+	int64 contentObjectId = -1;
+	{
+		auto insertContentObjectQuery = db_.Prepare (
+			"INSERT INTO content_objects (Hash, Size) "
+			"VALUES (?, ?);");
+
+		insertContentObjectQuery.BindArguments (hash, totalSize);
+		insertContentObjectQuery.Step ();
+		insertContentObjectQuery.Reset ();
+
+		contentObjectId = db_.GetLastRowId ();
+
+		log.Debug ("Configure", boost::format ("Stored content object '%1%' with id %2%") % hashString % contentObjectId);
+	}
+
+	auto insertFileQuery = db_.Prepare (
+		"INSERT INTO main.files (Path, ContentObjectId, FileSetId) "
+		"SELECT ?, ?, main.file_sets.Id FROM source.files "
+		"INNER JOIN source.file_sets ON source.file_sets.Id = source.files.FileSetId "
+		"INNER JOIN file_sets ON source.file_sets.Uuid = main.file_sets.Uuid "
+		"WHERE source.files.path = ?"
+	);
+
+	// Only files in the selected file sets are written. The same contents
+	// may be used by a file in another file set, which is not installed
+	auto getTargetFilesQuery = db_.Prepare (
+		"SELECT Path FROM source.files "
+		"WHERE source.files.ContentObjectId = (SELECT Id FROM source.content_objects WHERE source.content_objects.Hash = ?) "
+		"AND source.files.FileSetId IN "
+		"(SELECT Id FROM source.file_sets "
+		"WHERE Uuid IN (SELECT Uuid FROM pending_file_sets))");
+
+	getTargetFilesQuery.BindArguments (hash);
+
+	bool isFirstFile = true;
+	Path lastFilePath;
+	while (getTargetFilesQuery.Step ()) {
+		const Path targetPath{ getTargetFilesQuery.GetText (0) };
+
+		progress.SetAction (getTargetFilesQuery.GetText (0));
+
+		boost::filesystem::create_directories (path_ / targetPath.parent_path ());
+
+		if (hasStagingFile) {
+			if (isFirstFile) {
 				log.Debug ("Configure", 
-					boost::format ("Creating file %1%") % targetPath);
+					boost::format ("Renaming staging file %1% to %2%") 
+						% stagingFilePath % targetPath);
 
-				auto file = CreateFile (path_ / targetPath);
-				file->Write (contents);
+				boost::filesystem::rename (stagingFilePath,
+					path_ / targetPath);
+				isFirstFile = false;
+			} else {
+				log.Debug ("Configure",
+					boost::format ("Copying file %1% to %2%")
+					% stagingFilePath % targetPath);
+
+				assert (!lastFilePath.empty ());
+				boost::filesystem::copy_file (lastFilePath,
+					path_ / targetPath);
 			}
 
-			insertFileQuery.BindArguments (targetPath.string (), contentObjectId, targetPath.string ());
-			insertFileQuery.Step ();
-			insertFileQuery.Reset ();
+			lastFilePath = path_ / targetPath;
+		} else {
+			log.Debug ("Configure", 
+				boost::format ("Creating file %1%") % targetPath);
 
-			log.Debug ("Configure", boost::format ("Wrote file %1%") % targetPath);
+			auto file = CreateFile (path_ / targetPath);
+			file->Write (contents);
 		}
 
-		transaction.Commit ();
-		++progress;
-	});
+		insertFileQuery.BindArguments (targetPath.string (), contentObjectId, targetPath.string ());
+		insertFileQuery.Step ();
+		insertFileQuery.Reset ();
+
+		log.Debug ("Configure", boost::format ("Wrote file %1%") % targetPath);
+	}
+
+	transaction.Commit ();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -575,6 +1180,8 @@ void DeployedRepository::CopyExistingFiles (Log& log)
 
 		insertFileQuery.BindArguments (path.string (),
 			exemplarQuery.GetInt64 (1), path.string ());
+		insertFileQuery.Step ();
+		insertFileQuery.Reset ();
 
 		exemplarQuery.Reset ();
 
@@ -627,13 +1234,32 @@ void DeployedRepository::Cleanup (Log& log)
 	}
 
 	// content objects
-	db_.Execute ("DELETE FROM content_objects "
-		"WHERE Id IN "
-		"(SELECT Id FROM content_objects_with_reference_count WHERE ReferenceCount = 0)");
+	db_.Execute ("DELETE FROM content_objects WHERE ReferenceCount = 0");
 
 	log.Debug ("Configure", "Deleted unused content objects from repository");
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/**
+Remove the staging files of content objects which have not been received
+completely, and the copies of delta bases.
+*/
+void DeployedRepository::RemoveStagingFiles (Log& log)
+{
+	preservedObjects_.clear ();
+	outdatedObjects_.clear ();
+
+	for (boost::filesystem::directory_iterator it (path_), end; it != end; ++it) {
+		if (it->path ().extension () == ".kytmp"
+			|| it->path ().extension () == ".kybase") {
+			boost::filesystem::remove (it->path ());
+
+			log.Debug ("Configure", boost::format ("Removed staging file %1%")
+				% it->path ());
+		}
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 std::unique_ptr<DeployedRepository> DeployedRepository::CreateFrom (Repository& source,
 	const ArrayRef<Uuid>& filesets,
@@ -655,4 +1281,240 @@ std::unique_ptr<DeployedRepository> DeployedRepository::CreateFrom (Repository&
 
 	return std::move (result);
 }
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<std::unique_ptr<DeployedRepository>> DeployedRepository::CreateFrom (
+	Repository& source,
+	const ArrayRef<Uuid>& filesets,
+	const ArrayRef<Path>& targetDirectories,
+	Repository::ExecutionContext& context)
+{
+	std::vector<std::unique_ptr<DeployedRepository>> result;
+	std::vector<DeployedRepository*> targets;
+
+	for (const auto& targetDirectory : targetDirectories) {
+		boost::filesystem::create_directories (targetDirectory);
+
+		auto db = Sql::Database::Create ((targetDirectory / "k.db").string ().c_str ());
+		db.Execute (install_db_structure);
+		db.Close ();
+
+		result.emplace_back (new DeployedRepository{
+			targetDirectory.string ().c_str (), Sql::OpenMode::ReadWrite });
+		targets.push_back (result.back ().get ());
+	}
+
+	ConfigureMany (source, targets, filesets, context);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Computes the same difference as ConfigureImpl, but on the source database,
+so the target is never modified. The target database is attached as it is,
+and only temporary tables of the selected files are filled, so this is cheap
+enough to be called whenever the selection changes.
+
+The download size assumes local files are intact. Content objects which can
+be reconstructed from a delta against a local content object count with the
+smallest such delta. Content objects which configure tries to assemble from
+the previous version of a file are counted in full, but their size is also
+reported as reusable, as the chunks found locally are only known after
+reading the files.
+*/
+ConfigurationPlan DeployedRepository::Plan (Repository& source,
+	Repository* target,
+	const ArrayRef<Uuid>& filesets,
+	ExecutionContext& context)
+{
+	auto& db = source.GetDatabase ();
+
+	auto hasTable = [&db](const char* name) -> bool {
+		auto hasTableQuery = db.Prepare (
+			"SELECT COUNT(*) FROM sqlite_master "
+			"WHERE type = 'table' AND name = ?");
+		hasTableQuery.BindArguments (name);
+		hasTableQuery.Step ();
+
+		return hasTableQuery.GetInt64 (0) > 0;
+	};
+
+	auto desiredFilesTable = db.CreateTemporaryTable ("plan_desired_files",
+		"Path TEXT PRIMARY KEY NOT NULL, Hash BLOB NOT NULL, Size INTEGER NOT NULL, "
+		"ContentObjectId INTEGER NOT NULL");
+	auto fetchedObjectsTable = db.CreateTemporaryTable ("plan_fetched_objects",
+		"ContentObjectId INTEGER PRIMARY KEY NOT NULL");
+	auto deltasTable = db.CreateTemporaryTable ("plan_deltas",
+		"ContentObjectId INTEGER PRIMARY KEY NOT NULL, "
+		"SourcePackageId INTEGER NOT NULL, PackageSize INTEGER NOT NULL");
+
+	// The files currently in the target are read directly from its
+	// database, a new installation has none
+	if (target) {
+		db.Attach ("plan_target", target->GetDatabase ());
+		db.Execute (
+			"CREATE TEMPORARY VIEW plan_current_files AS "
+			"SELECT plan_target.files.Path AS Path, "
+			"    plan_target.content_objects.Hash AS Hash, "
+			"    plan_target.content_objects.Size AS Size "
+			"FROM plan_target.files "
+			"INNER JOIN plan_target.content_objects "
+			"    ON plan_target.content_objects.Id = plan_target.files.ContentObjectId");
+	} else {
+		db.Execute (
+			"CREATE TEMPORARY VIEW plan_current_files AS "
+			"SELECT NULL AS Path, NULL AS Hash, 0 AS Size WHERE 0");
+	}
+
+	const auto detachTarget = [&db, target]() -> void {
+		db.Execute ("DROP VIEW temp.plan_current_files");
+
+		if (target) {
+			db.Detach ("plan_target");
+		}
+	};
+
+	ConfigurationPlan result;
+
+	try {
+		{
+			auto insertDesiredFilesQuery = db.Prepare (
+				"INSERT INTO plan_desired_files (Path, Hash, Size, ContentObjectId) "
+				"SELECT files.Path, content_objects.Hash, content_objects.Size, "
+				"    content_objects.Id FROM files "
+				"INNER JOIN content_objects ON content_objects.Id = files.ContentObjectId "
+				"WHERE files.FileSetId IN "
+				"(SELECT Id FROM file_sets WHERE Uuid IN (SELECT Value FROM kyla_array(?)))");
+			insertDesiredFilesQuery.BindArray (1, filesets);
+			insertDesiredFilesQuery.Step ();
+		}
+
+		{
+			auto writeQuery = db.Prepare (
+				"SELECT COUNT(*), TOTAL(Size) FROM plan_desired_files AS Desired "
+				"WHERE NOT EXISTS (SELECT 1 FROM plan_current_files AS Current "
+				"    WHERE Current.Path = Desired.Path AND Current.Hash = Desired.Hash)");
+			writeQuery.Step ();
+
+			result.writeFileCount = writeQuery.GetInt64 (0);
+			result.writeSize = writeQuery.GetInt64 (1);
+		}
+
+		{
+			auto deleteQuery = db.Prepare (
+				"SELECT COUNT(*), TOTAL(Size) FROM plan_current_files AS Current "
+				"WHERE NOT EXISTS (SELECT 1 FROM plan_desired_files AS Desired "
+				"    WHERE Desired.Path = Current.Path AND Desired.Hash = Current.Hash)");
+			deleteQuery.Step ();
+
+			result.deleteFileCount = deleteQuery.GetInt64 (0);
+			result.deleteSize = deleteQuery.GetInt64 (1);
+		}
+
+		// Configure removes changed files before fetching, so content objects
+		// only referenced by those are fetched again, even if another file
+		// still needs them. Files outside of the selection are removed after
+		// fetching, so their contents are reused
+		db.Execute (
+			"INSERT INTO plan_fetched_objects (ContentObjectId) "
+			"SELECT DISTINCT ContentObjectId FROM plan_desired_files "
+			"WHERE Hash NOT IN ("
+			"    SELECT Current.Hash FROM plan_current_files AS Current "
+			"    LEFT JOIN plan_desired_files AS Desired ON Desired.Path = Current.Path "
+			"    WHERE Desired.Hash IS NULL OR Desired.Hash = Current.Hash)");
+
+		// Configure keeps every local content object a delta is stored
+		// against, and fetches the smallest delta instead of the object
+		if (hasTable ("storage_deltas")) {
+			db.Execute (
+				"INSERT INTO plan_deltas (ContentObjectId, SourcePackageId, PackageSize) "
+				"SELECT ContentObjectId, SourcePackageId, MIN(PackageSize) "
+				"FROM storage_deltas "
+				"WHERE ContentObjectId IN (SELECT ContentObjectId FROM plan_fetched_objects) "
+				"AND BaseHash IN (SELECT Hash FROM plan_current_files) "
+				"GROUP BY ContentObjectId");
+		}
+
+		{
+			auto packageQuery = db.Prepare (
+				"SELECT source_packages.Name, SUM(Fetched.PackageSize), COUNT(*) "
+				"FROM ("
+				"    SELECT SourcePackageId, PackageSize FROM storage_mapping "
+				"    WHERE ContentObjectId IN (SELECT ContentObjectId FROM plan_fetched_objects) "
+				"    AND NOT ContentObjectId IN (SELECT ContentObjectId FROM plan_deltas) "
+				"    UNION ALL "
+				"    SELECT SourcePackageId, PackageSize FROM plan_deltas) AS Fetched "
+				"INNER JOIN source_packages ON source_packages.Id = Fetched.SourcePackageId "
+				"GROUP BY source_packages.Id "
+				"ORDER BY source_packages.Id");
+
+			while (packageQuery.Step ()) {
+				ConfigurationPlan::SourcePackage package;
+				package.name = packageQuery.GetText (0);
+				package.downloadSize = packageQuery.GetInt64 (1);
+				package.chunkCount = packageQuery.GetInt64 (2);
+
+				result.downloadSize += package.downloadSize;
+				result.chunkCount += package.chunkCount;
+
+				result.sourcePackages.push_back (package);
+			}
+		}
+
+		{
+			// Loose and deployed repositories return content objects as-is
+			auto unpackagedQuery = db.Prepare (
+				"SELECT COUNT(*), TOTAL(Size) FROM content_objects "
+				"WHERE Id IN (SELECT ContentObjectId FROM plan_fetched_objects) "
+				"AND NOT EXISTS (SELECT 1 FROM storage_mapping "
+				"    WHERE storage_mapping.ContentObjectId = content_objects.Id)");
+			unpackagedQuery.Step ();
+
+			result.chunkCount += unpackagedQuery.GetInt64 (0);
+			result.downloadSize += unpackagedQuery.GetInt64 (1);
+		}
+
+		// Objects without a delta, which replace a non-empty file at the
+		// same path, are assembled from the chunks found in the old file.
+		// Which ones are found is only known once the file has been read
+		if (hasTable ("storage_block_checksums")) {
+			auto reusableQuery = db.Prepare (
+				"SELECT TOTAL(PackageSize) FROM storage_mapping "
+				"WHERE ContentObjectId IN (SELECT ContentObjectId FROM plan_fetched_objects) "
+				"AND NOT ContentObjectId IN (SELECT ContentObjectId FROM plan_deltas) "
+				"AND ContentObjectId IN (SELECT Desired.ContentObjectId "
+				"    FROM plan_desired_files AS Desired "
+				"    INNER JOIN plan_current_files AS Current ON Current.Path = Desired.Path "
+				"    WHERE Current.Hash IS NOT Desired.Hash AND Current.Size > 0) "
+				"AND ContentObjectId IN (SELECT storage_mapping.ContentObjectId "
+				"    FROM storage_mapping "
+				"    INNER JOIN storage_block_checksums "
+				"    ON storage_block_checksums.StorageMappingId = storage_mapping.Id)");
+			reusableQuery.Step ();
+
+			result.reusableSize = reusableQuery.GetInt64 (0);
+		}
+
+		{
+			auto countQuery = db.Prepare ("SELECT COUNT(*) FROM plan_fetched_objects");
+			countQuery.Step ();
+
+			result.contentObjectCount = countQuery.GetInt64 (0);
+		}
+	} catch (...) {
+		detachTarget ();
+		throw;
+	}
+
+	detachTarget ();
+
+	context.log.Debug ("Plan", boost::format ("Planned configuration: "
+		"%1% bytes to download, %2% of which may be reused from local files, "
+		"%3% bytes to write, %4% bytes to delete")
+		% result.downloadSize % result.reusableSize
+		% result.writeSize % result.deleteSize);
+
+	return result;
+}
 } // namespace kyla
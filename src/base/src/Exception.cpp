@@ -26,4 +26,11 @@ RuntimeException::RuntimeException (const std::string& source, const std::string
 , line_ (line)
 {
 }
+
+///////////////////////////////////////////////////////////////////////////////
+OperationCancelledException::OperationCancelledException (const char* file,
+	const int line)
+: RuntimeException ("Operation has been cancelled", file, line)
+{
+}
 }
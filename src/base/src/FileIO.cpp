@@ -93,8 +93,12 @@ struct LinuxFile final : public File
 
 	void* MapImpl (const std::int64_t offset, const std::int64_t size) override
 	{
+		// Files opened for reading only can't be mapped writable
+		const int protection = ((fcntl (fd_, F_GETFL) & O_ACCMODE) == O_RDONLY)
+			? PROT_READ : (PROT_WRITE | PROT_READ);
+
 		auto r = mmap (nullptr, size,
-			PROT_WRITE | PROT_READ, MAP_SHARED, fd_, offset);
+			protection, MAP_SHARED, fd_, offset);
 
 		mappings_ [r] = size;
 
@@ -105,6 +109,8 @@ struct LinuxFile final : public File
 	{
 		munmap (p, mappings_.find (p)->second);
 		mappings_.erase (p);
+
+		return p;
 	}
 
 	void SetSizeImpl (const std::int64_t size) override
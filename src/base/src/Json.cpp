@@ -0,0 +1,38 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "Json.h"
+
+#include <ostream>
+
+namespace kyla {
+///////////////////////////////////////////////////////////////////////////////
+void WriteJsonString (std::ostream& output, const StringRef& s)
+{
+	static const char* hexDigits = "0123456789abcdef";
+
+	output << '"';
+	for (const auto c : s) {
+		switch (c) {
+		case '"': output << "\\\""; break;
+		case '\\': output << "\\\\"; break;
+		case '\n': output << "\\n"; break;
+		case '\r': output << "\\r"; break;
+		case '\t': output << "\\t"; break;
+		default:
+			if (static_cast<unsigned char> (c) < 0x20) {
+				output << "\\u00" << hexDigits [(c >> 4) & 0xF] << hexDigits [c & 0xF];
+			} else {
+				output << c;
+			}
+		}
+	}
+	output << '"';
+}
+}
@@ -45,7 +45,8 @@ Sql::Database& LooseRepository::GetDatabaseImpl ()
 
 ///////////////////////////////////////////////////////////////////////////////
 void LooseRepository::GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
-	const Repository::GetContentObjectCallback& getCallback)
+	const Repository::GetContentObjectCallback& getCallback,
+	const ResourceLimits& /*limits*/)
 {
 	// This assumes the repository is in a valid state - i.e. content
 	// objects contain the right data and we're only requested content
@@ -87,66 +88,30 @@ void LooseRepository::ValidateImpl (const Repository::ValidationCallback& valida
 	
 	auto query = db_.Prepare (querySql);
 
-	const int64 objectCount = [=]() -> int64 {
-		static const char* queryObjectCountSql =
-			"SELECT COUNT(*) FROM content_objects";
-		auto countQuery = db_.Prepare (queryObjectCountSql);
-		countQuery.Step ();
-		return countQuery.GetInt64 (0);
-	} ();
-
 	ProgressHelper progress (context.progress);
-	progress.SetStageTarget (objectCount);
-
-	while (query.Step ()) {
-		SHA256Digest hash;
-		query.GetBlob (0, hash);
-		const auto size = query.GetInt64 (1);
-
-		const auto filePath = Path{ path_ } / Path{ ".ky" }
-		/ Path{ "objects" } / ToString (hash);
-
-		if (!boost::filesystem::exists (filePath)) {
-			validationCallback (hash,
-				filePath.string ().c_str (),
-				ValidationResult::Missing);
-
-			++progress;
-			continue;
-		}
 
-		const auto statResult = Stat (filePath);
+	{
+		static const char* queryTotalSizeSql =
+			"SELECT COUNT(*), TOTAL(Size) FROM content_objects";
+		auto totalQuery = db_.Prepare (queryTotalSizeSql);
+		totalQuery.Step ();
 
-		///@TODO(minor) Try/catch here and report corrupted if something goes wrong?
-		/// This would indicate the file got deleted or is read-protected
-		/// while the validation is running
-
-		if (statResult.size != size) {
-			validationCallback (hash,
-				filePath.string ().c_str (),
-				ValidationResult::Corrupted);
-
-			++progress;
-			continue;
-		}
-
-		// For size 0 files, don't bother checking the hash
-		///@TODO(minor) Assert hash is the null hash
-		if (size != 0 && ComputeSHA256 (filePath) != hash) {
-			validationCallback (hash,
-				filePath.string ().c_str (),
-				ValidationResult::Corrupted);
+		progress.SetStageTarget (totalQuery.GetInt64 (0));
+		progress.SetStageByteTarget (totalQuery.GetInt64 (1));
+	}
 
-			++progress;
-			continue;
+	ValidateFiles ([&](FileToValidate& file) -> bool {
+		if (!query.Step ()) {
+			return false;
 		}
 
-		validationCallback (hash,
-			filePath.string ().c_str (),
-			ValidationResult::Ok);
+		query.GetBlob (0, file.hash);
+		file.size = query.GetInt64 (1);
+		file.path = Path{ path_ } / Path{ ".ky" }
+			/ Path{ "objects" } / ToString (file.hash);
 
-		++progress;
-	}
+		return true;
+	}, validationCallback, context, progress);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -172,20 +137,21 @@ void LooseRepository::RepairImpl (Repository& source,
 	source.GetContentObjects (requiredContentObjects, [&](const SHA256Digest& hash,
 		const ArrayRef<>& contents,
 		const int64 offset, const int64 totalSize) -> void {
+		context.CheckCancellation ();
+
 		const auto filePath = Path{ path_ } / Path{ ".ky" }
 		/ Path{ "objects" } / ToString (hash);
 
 		std::unique_ptr<File> file;
 		if (offset == 0) {
 			file = CreateFile (filePath);
-			file->SetSize (contents.GetSize ());
+			file->SetSize (totalSize);
 		} else {
 			file = OpenFile (filePath, FileOpenMode::Write);
 		}
 
-		byte* pointer = static_cast<byte*> (file->Map ());
-		::memcpy (pointer + offset, contents.GetData (), contents.GetSize ());
-		file->Unmap (pointer);
-	});
+		file->Seek (offset);
+		file->Write (contents);
+	}, context.limits);
 }
 }
\ No newline at end of file
@@ -14,6 +14,7 @@ details.
 #include "FileIO.h"
 #include "Hash.h"
 #include "Log.h"
+#include "Trace.h"
 
 #include "Compression.h"
 
@@ -21,7 +22,17 @@ details.
 
 #include "install-db-structure.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <unordered_map>
+#include <unordered_set>
 #include <set>
 
 namespace kyla {
@@ -38,31 +49,474 @@ is used instead of the generic File class as a package file only supports
 reading and may not be mapped.
 */
 
+///////////////////////////////////////////////////////////////////////////////
+/**
+Decoded chunks used by ReadFile, so reading a file sequentially in small
+blocks only decodes every chunk once. Chunks are evicted least recently used
+first once the capacity, which is the memory budget of the read, is exceeded.
+*/
+struct PackedRepositoryBase::ChunkCache
+{
+	const std::vector<byte>* Find (const int64 storageMappingId)
+	{
+		auto it = index_.find (storageMappingId);
+
+		if (it == index_.end ()) {
+			return nullptr;
+		}
+
+		entries_.splice (entries_.begin (), entries_, it->second);
+		return &it->second->data;
+	}
+
+	const std::vector<byte>& Insert (const int64 storageMappingId,
+		std::vector<byte>&& data, const int64 capacity)
+	{
+		size_ += data.size ();
+		entries_.push_front (Entry{ storageMappingId, std::move (data) });
+		index_ [storageMappingId] = entries_.begin ();
+
+		// Never evict the chunk we just inserted, even if it's larger
+		// than the capacity
+		while (size_ > capacity && entries_.size () > 1) {
+			size_ -= entries_.back ().data.size ();
+			index_.erase (entries_.back ().storageMappingId);
+			entries_.pop_back ();
+		}
+
+		return entries_.front ().data;
+	}
+
+	PackageFile& GetPackage (const PackedRepositoryBase& repository,
+		const std::string& filename)
+	{
+		auto it = packages_.find (filename);
+
+		if (it == packages_.end ()) {
+			it = packages_.emplace (filename,
+				repository.OpenPackage (filename)).first;
+		}
+
+		return *it->second;
+	}
+
+private:
+	struct Entry
+	{
+		int64 storageMappingId;
+		std::vector<byte> data;
+	};
+
+	std::list<Entry> entries_;
+	std::unordered_map<int64, std::list<Entry>::iterator> index_;
+	int64 size_ = 0;
+
+	std::unordered_map<std::string, std::unique_ptr<PackageFile>> packages_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+PackedRepositoryBase::PackedRepositoryBase ()
+	: chunkCache_ (new ChunkCache)
+{
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 PackedRepositoryBase::~PackedRepositoryBase ()
 {
 }
 
+namespace {
+struct ChunkToFetch
+{
+	SHA256Digest hash;
+	int64 packageOffset;
+	int64 packageSize;
+	int64 sourceOffset;
+	int64 sourceSize;
+	int64 totalSize;
+	// Empty if the chunk is stored uncompressed
+	std::string compression;
+	bool hasStorageHash;
+	SHA256Digest storageHash;
+
+	// Memory held while the chunk is in flight
+	int64 GetBufferSize () const
+	{
+		return packageSize + (compression.empty () ? 0 : sourceSize);
+	}
+};
+
+struct FetchedChunk
+{
+	std::vector<byte> packageData;
+	std::vector<byte> sourceData;
+
+	const std::vector<byte>& GetContents (const ChunkToFetch& chunk) const
+	{
+		return chunk.compression.empty () ? packageData : sourceData;
+	}
+};
+
 ///////////////////////////////////////////////////////////////////////////////
-void PackedRepositoryBase::GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
-	const Repository::GetContentObjectCallback& getCallback)
+/**
+Read, verify and decode chunks from one package, and pass them to callback in
+order, on the calling thread.
+
+This is a two-stage pipeline. Up to limits.ioConcurrency reads are in flight,
+each using its own package file so reads never share a file position. Read
+chunks are verified and decoded on up to limits.threadCount workers. No new
+read is started while the buffers of the chunks in flight exceed the memory
+budget. Buffers are recycled once a chunk has been passed on.
+*/
+void FetchChunks (const std::vector<ChunkToFetch>& chunks,
+	const std::function<std::unique_ptr<PackedRepositoryBase::PackageFile> ()>& openPackage,
+	const ResourceLimits& limits,
+	const std::function<void (const ChunkToFetch& chunk, const ArrayRef<>& contents)>& callback)
 {
-	auto& db = GetDatabase ();
+	const auto ioSlots = static_cast<std::size_t> (std::max (limits.ioConcurrency, 1));
+	const auto decodeSlots = static_cast<std::size_t> (std::max (limits.threadCount, 1));
+
+	// With a single slot, work is deferred and runs on the calling thread
+	const auto readPolicy = (ioSlots > 1)
+		? std::launch::async : std::launch::deferred;
+	const auto decodePolicy = (decodeSlots > 1)
+		? std::launch::async : std::launch::deferred;
+
+	std::vector<std::unique_ptr<PackedRepositoryBase::PackageFile>> packageFiles (ioSlots);
+	std::vector<std::vector<byte>> freeBuffers;
+
+	const auto takeBuffer = [&freeBuffers]() -> std::vector<byte> {
+		if (freeBuffers.empty ()) {
+			return std::vector<byte> ();
+		}
+
+		auto buffer = std::move (freeBuffers.back ());
+		freeBuffers.pop_back ();
+		return buffer;
+	};
+
+	// Reads and decodes may run on other threads
+	const auto tracer = Tracer::GetCurrent ();
+
+	const auto read = [tracer](PackedRepositoryBase::PackageFile* packageFile,
+		const ChunkToFetch* chunk, std::vector<byte> buffer) -> std::vector<byte> {
+		TracerScope tracerScope (tracer);
+		TraceSpan span ("io", "Read", chunk->packageSize);
+
+		buffer.resize (static_cast<std::size_t> (chunk->packageSize));
+		packageFile->Read (chunk->packageOffset, buffer);
+		return buffer;
+	};
+
+	const auto decode = [tracer](const ChunkToFetch* chunk,
+		std::vector<byte> packageData, std::vector<byte> sourceData) -> FetchedChunk {
+		TracerScope tracerScope (tracer);
+
+		// If we find an entry in the storage_hashes table, validate the
+		// compressed source data
+		if (chunk->hasStorageHash) {
+			TraceSpan span ("hash", "Verify", chunk->packageSize);
+
+			if (ComputeSHA256 (packageData) != chunk->storageHash) {
+				throw RuntimeException ("PackedRepository",
+					str (boost::format ("Source data for chunk '%1%' is corrupted") %
+						ToString (chunk->hash)),
+					KYLA_FILE_LINE);
+			}
+		}
+
+		if (!chunk->compression.empty ()) {
+			TraceSpan span ("decode", "Decompress", chunk->sourceSize);
+
+			auto compressor = CreateBlockCompressor (
+				CompressionAlgorithmFromId (chunk->compression.c_str ()));
+
+			sourceData.resize (static_cast<std::size_t> (chunk->sourceSize));
+			compressor->Decompress (packageData, sourceData);
+		}
+
+		return FetchedChunk{ std::move (packageData), std::move (sourceData) };
+	};
+
+	// Declared last, so pending work is finished before anything it refers
+	// to is destroyed
+	std::deque<std::future<std::vector<byte>>> reads;
+	std::deque<std::future<FetchedChunk>> decodes;
+
+	std::size_t nextRead = 0, nextDecode = 0, nextDelivery = 0;
+	int64 bufferedBytes = 0;
+
+	while (nextDelivery < chunks.size ()) {
+		while (nextRead < chunks.size () && reads.size () < ioSlots
+			&& (bufferedBytes == 0 || bufferedBytes
+				+ chunks [nextRead].GetBufferSize () <= limits.memoryBudget)) {
+			// At most ioSlots reads are pending, so the slot is not in use
+			auto& packageFile = packageFiles [nextRead % ioSlots];
+			if (!packageFile) {
+				packageFile = openPackage ();
+			}
 
-	// We need to join the requested objects on our existing data, so
-	// store them in a temporary table
-	auto requestedContentObjects = db.CreateTemporaryTable (
-		"requested_content_objects", "Hash BLOB NOT NULL UNIQUE");
+			reads.push_back (std::async (readPolicy, read, packageFile.get (),
+				&chunks [nextRead], takeBuffer ()));
+			bufferedBytes += chunks [nextRead].GetBufferSize ();
+			++nextRead;
+		}
+
+		while (!reads.empty () && decodes.size () < decodeSlots) {
+			auto packageData = reads.front ().get ();
+			reads.pop_front ();
+
+			decodes.push_back (std::async (decodePolicy, decode,
+				&chunks [nextDecode], std::move (packageData), takeBuffer ()));
+			++nextDecode;
+		}
 
-	auto tempObjectInsert = db.Prepare ("INSERT INTO requested_content_objects "
-		"(Hash) VALUES (?)");
+		auto fetchedChunk = decodes.front ().get ();
+		decodes.pop_front ();
+
+		const auto& chunk = chunks [nextDelivery];
+
+		{
+			TraceSpan span ("callback", "Deliver", chunk.sourceSize);
+			callback (chunk, fetchedChunk.GetContents (chunk));
+		}
 
-	for (const auto& obj : requestedObjects) {
-		tempObjectInsert.BindArguments (obj);
-		tempObjectInsert.Step ();
-		tempObjectInsert.Reset ();
+		bufferedBytes -= chunk.GetBufferSize ();
+		++nextDelivery;
+
+		freeBuffers.push_back (std::move (fetchedChunk.packageData));
+		freeBuffers.push_back (std::move (fetchedChunk.sourceData));
+	}
+}
+
+struct PackageChunks
+{
+	std::string filename;
+	std::vector<ChunkToFetch> chunks;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Fetch the chunks of several packages, and pass them to callback on the
+calling thread.
+
+Packages which share no content object, for instance, the volumes of a split
+package, are fetched concurrently by up to limits.ioConcurrency workers, each
+using FetchChunks with a share of the limits. Packages which share a content
+object are fetched one after the other by the same worker, so the chunks of
+every content object are still passed on in order. Chunks of different
+content objects may be interleaved.
+*/
+void FetchPackages (const std::vector<PackageChunks>& packages,
+	const std::function<std::unique_ptr<PackedRepositoryBase::PackageFile> (const std::string&)>& openPackage,
+	const ResourceLimits& limits,
+	const std::function<void (const ChunkToFetch& chunk, const ArrayRef<>& contents)>& callback)
+{
+	// Union packages which contain chunks of the same content object, the
+	// lowest package index represents the group
+	std::vector<std::size_t> groupOf (packages.size ());
+	std::iota (groupOf.begin (), groupOf.end (), 0);
+
+	const auto findGroup = [&groupOf](std::size_t index) -> std::size_t {
+		while (groupOf [index] != index) {
+			index = groupOf [index] = groupOf [groupOf [index]];
+		}
+
+		return index;
+	};
+
+	std::unordered_map<SHA256Digest, std::size_t, HashDigestHash, HashDigestEqual> firstPackage;
+	for (std::size_t i = 0; i < packages.size (); ++i) {
+		for (const auto& chunk : packages [i].chunks) {
+			const auto it = firstPackage.emplace (chunk.hash, i).first;
+
+			const auto a = findGroup (it->second);
+			const auto b = findGroup (i);
+			groupOf [std::max (a, b)] = std::min (a, b);
+		}
+	}
+
+	// Packages stay in their original order inside each group
+	std::map<std::size_t, std::vector<std::size_t>> groupMap;
+	for (std::size_t i = 0; i < packages.size (); ++i) {
+		groupMap [findGroup (i)].push_back (i);
+	}
+
+	std::vector<std::vector<std::size_t>> groups;
+	for (auto& group : groupMap) {
+		groups.push_back (std::move (group.second));
+	}
+
+	const auto workerCount = std::min (groups.size (),
+		static_cast<std::size_t> (std::max (limits.ioConcurrency, 1)));
+
+	if (workerCount <= 1) {
+		for (const auto& package : packages) {
+			TraceSpan span ("package", "Fetch package");
+			span.SetDetail (package.filename);
+
+			FetchChunks (package.chunks, [&openPackage, &package]() {
+				return openPackage (package.filename);
+			}, limits, callback);
+		}
+
+		return;
 	}
 
+	// Chunks waiting to be passed on use half of the memory budget, the
+	// workers share the rest
+	ResourceLimits workerLimits = limits;
+	workerLimits.ioConcurrency = std::max (1,
+		limits.ioConcurrency / static_cast<int> (workerCount));
+	workerLimits.threadCount = std::max (1,
+		limits.threadCount / static_cast<int> (workerCount));
+	workerLimits.memoryBudget = limits.memoryBudget
+		/ (2 * static_cast<int64> (workerCount));
+	const auto queueBudget = limits.memoryBudget / 2;
+
+	struct QueuedChunk
+	{
+		const ChunkToFetch* chunk;
+		std::vector<byte> contents;
+	};
+
+	// Thrown inside a worker to abort FetchChunks once fetching stopped
+	struct FetchStopped {};
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<QueuedChunk> queue;
+	int64 queuedBytes = 0;
+	std::size_t nextGroup = 0;
+	std::size_t activeWorkers = workerCount;
+	bool stopped = false;
+	std::exception_ptr error;
+
+	const auto tracer = Tracer::GetCurrent ();
+
+	const auto worker = [&]() -> void {
+		TracerScope tracerScope (tracer);
+
+		try {
+			for (;;) {
+				std::size_t group;
+
+				{
+					std::lock_guard<std::mutex> lock (mutex);
+
+					if (stopped || nextGroup == groups.size ()) {
+						break;
+					}
+
+					group = nextGroup++;
+				}
+
+				for (const auto index : groups [group]) {
+					const auto& package = packages [index];
+
+					TraceSpan span ("package", "Fetch package");
+					span.SetDetail (package.filename);
+
+					FetchChunks (package.chunks, [&openPackage, &package]() {
+						return openPackage (package.filename);
+					}, workerLimits, [&](const ChunkToFetch& chunk, const ArrayRef<>& contents) -> void {
+						// The buffer is reused once we return, so it's copied
+						const auto data = static_cast<const byte*> (contents.GetData ());
+						std::vector<byte> copy (data, data + contents.GetSize ());
+						const auto size = static_cast<int64> (copy.size ());
+
+						std::unique_lock<std::mutex> lock (mutex);
+						changed.wait (lock, [&]() -> bool {
+							return stopped || queuedBytes == 0
+								|| queuedBytes + size <= queueBudget;
+						});
+
+						if (stopped) {
+							throw FetchStopped ();
+						}
+
+						queuedBytes += size;
+						queue.push_back (QueuedChunk{ &chunk, std::move (copy) });
+						changed.notify_all ();
+					});
+				}
+			}
+		} catch (const FetchStopped&) {
+		} catch (...) {
+			std::lock_guard<std::mutex> lock (mutex);
+
+			if (!error) {
+				error = std::current_exception ();
+			}
+
+			stopped = true;
+		}
+
+		std::lock_guard<std::mutex> lock (mutex);
+		--activeWorkers;
+		changed.notify_all ();
+	};
+
+	std::vector<std::future<void>> workers;
+	for (std::size_t i = 0; i < workerCount; ++i) {
+		workers.push_back (std::async (std::launch::async, worker));
+	}
+
+	const auto stop = [&]() -> void {
+		{
+			std::lock_guard<std::mutex> lock (mutex);
+			stopped = true;
+			changed.notify_all ();
+		}
+
+		for (auto& w : workers) {
+			w.wait ();
+		}
+	};
+
+	try {
+		for (;;) {
+			QueuedChunk queuedChunk;
+
+			{
+				std::unique_lock<std::mutex> lock (mutex);
+				changed.wait (lock, [&]() -> bool {
+					return stopped || !queue.empty () || activeWorkers == 0;
+				});
+
+				if (stopped || queue.empty ()) {
+					break;
+				}
+
+				queuedChunk = std::move (queue.front ());
+				queue.pop_front ();
+				queuedBytes -= static_cast<int64> (queuedChunk.contents.size ());
+				changed.notify_all ();
+			}
+
+			TraceSpan span ("callback", "Deliver", queuedChunk.chunk->sourceSize);
+			callback (*queuedChunk.chunk, queuedChunk.contents);
+		}
+	} catch (...) {
+		stop ();
+		throw;
+	}
+
+	stop ();
+
+	if (error) {
+		std::rethrow_exception (error);
+	}
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void PackedRepositoryBase::GetContentObjectsImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+	const Repository::GetContentObjectCallback& getCallback,
+	const ResourceLimits& limits)
+{
+	auto& db = GetDatabase ();
+
 	// Find all source packages we need to handle
 	auto findSourcePackagesQuery = db.Prepare (
 		"SELECT DISTINCT "
@@ -71,11 +525,16 @@ void PackedRepositoryBase::GetContentObjectsImpl (const ArrayRef<SHA256Digest>&
 		"FROM storage_mapping "
 		"    INNER JOIN content_objects ON storage_mapping.ContentObjectId = content_objects.Id "
 		"    INNER JOIN source_packages ON storage_mapping.SourcePackageId = source_packages.Id "
-		"WHERE content_objects.Hash IN (SELECT Hash FROM requested_content_objects) "
+		"WHERE content_objects.Hash IN (SELECT Value FROM kyla_array(?)) "
+		"ORDER BY Id"
 	);
 
+	// The requested objects are joined directly from the caller's array
+	findSourcePackagesQuery.BindArray (1, requestedObjects);
+
 	// Finds the content objects we need in a particular source package, and
-	// sorts them by the in-package offset
+	// sorts them by the in-package offset. Data stored in a package may be
+	// optionally protected by a hash - those hashes live in storage_hashes
 	auto contentObjectsInPackageQuery = db.Prepare ("SELECT  "
 		"    storage_mapping.PackageOffset AS PackageOffset,  "	// = 0
 		"    storage_mapping.PackageSize AS PackageSize, "		// = 1
@@ -84,86 +543,166 @@ void PackedRepositoryBase::GetContentObjectsImpl (const ArrayRef<SHA256Digest>&
 		"    content_objects.Size as TotalSize, "				// = 4
 		"    storage_mapping.Compression AS Compression, "		// = 5
 		"	 storage_mapping.SourceSize AS SourceSize, "		// = 6
-		"    storage_mapping.Id AS StorageMappingId "			// = 7
+		"    storage_hashes.Hash AS StorageHash "				// = 7
 		"FROM storage_mapping "
 		"INNER JOIN content_objects ON storage_mapping.ContentObjectId = content_objects.Id "
 		"INNER JOIN source_packages ON storage_mapping.SourcePackageId = source_packages.Id "
-		"WHERE content_objects.Hash IN (SELECT Hash FROM requested_content_objects) "
-		"    AND source_packages.Id = ? "
+		"LEFT JOIN storage_hashes ON storage_hashes.StorageMappingId = storage_mapping.Id "
+		"WHERE source_packages.Id = ? "
+		"    AND content_objects.Hash IN (SELECT Value FROM kyla_array(?)) "
 		"ORDER BY PackageOffset ");
 
-	// Data stored in a package may be optionally protected by a hash - those
-	// hases live in storage_hashes
-	auto getStorageHashQuery = db.Prepare (
-		"SELECT Hash "
-		"FROM storage_hashes "
-		"WHERE StorageMappingId = ?");
+	contentObjectsInPackageQuery.BindArray (2, requestedObjects);
 
-	std::vector<byte> compressionOutputBuffer;
-	std::vector<byte> readBuffer;
+	std::vector<PackageChunks> packages;
 
 	while (findSourcePackagesQuery.Step ()) {
-		const auto filename = findSourcePackagesQuery.GetText (0);
+		PackageChunks package;
+		package.filename = findSourcePackagesQuery.GetText (0);
 		const auto id = findSourcePackagesQuery.GetInt64 (1);
 
-		auto packageFile = OpenPackage (filename);
-
 		contentObjectsInPackageQuery.BindArguments (id);
 
-		std::string currentCompressorId;
-		std::unique_ptr<BlockCompressor> compressor;
-
+		auto& chunks = package.chunks;
 		while (contentObjectsInPackageQuery.Step ()) {
-			const auto packageOffset = contentObjectsInPackageQuery.GetInt64 (0);
-			const auto packageSize = contentObjectsInPackageQuery.GetInt64 (1);
-			const auto sourceOffset = contentObjectsInPackageQuery.GetInt64 (2);
-			SHA256Digest hash;
-			contentObjectsInPackageQuery.GetBlob (3, hash);
-			const auto totalSize = contentObjectsInPackageQuery.GetInt64 (4);
-			const char* compression = contentObjectsInPackageQuery.GetText (5);
-			const auto sourceSize = contentObjectsInPackageQuery.GetInt64 (6);
-			const auto storageMappingId = contentObjectsInPackageQuery.GetInt64 (7);
-			
-			readBuffer.resize (packageSize);
-			packageFile->Read (packageOffset, readBuffer);
-
-			// If we find an entry in the storage_hashes table, validate the
-			// compressed source data
-			getStorageHashQuery.BindArguments (storageMappingId);
+			ChunkToFetch chunk;
+			chunk.packageOffset = contentObjectsInPackageQuery.GetInt64 (0);
+			chunk.packageSize = contentObjectsInPackageQuery.GetInt64 (1);
+			chunk.sourceOffset = contentObjectsInPackageQuery.GetInt64 (2);
+			contentObjectsInPackageQuery.GetBlob (3, chunk.hash);
+			chunk.totalSize = contentObjectsInPackageQuery.GetInt64 (4);
+
+			if (const char* compression = contentObjectsInPackageQuery.GetText (5)) {
+				chunk.compression = compression;
+			}
 
-			if (getStorageHashQuery.Step ()) {
-				SHA256Digest digest;
-				getStorageHashQuery.GetBlob (0, digest);
+			chunk.sourceSize = contentObjectsInPackageQuery.GetInt64 (6);
 
-				if (ComputeSHA256 (readBuffer) != digest) {
-					throw RuntimeException ("PackedRepository",
-						str (boost::format ("Source data for chunk '%1%' is corrupted") %
-							ToString (hash)),
-						KYLA_FILE_LINE);
-				}
+			chunk.hasStorageHash = contentObjectsInPackageQuery.GetColumnType (7)
+				!= Sql::Type::Null;
+			if (chunk.hasStorageHash) {
+				contentObjectsInPackageQuery.GetBlob (7, chunk.storageHash);
 			}
-			getStorageHashQuery.Reset ();
 
-			if (compression == nullptr) {
-				getCallback (hash, readBuffer, sourceOffset, totalSize);
-				continue;
-			}
+			chunks.push_back (chunk);
+		}
 
-			if (compression != currentCompressorId) {
-				// we assume the compressors change infrequently
-				compressor = CreateBlockCompressor (
-					CompressionAlgorithmFromId (compression)
-				);
-			}
+		contentObjectsInPackageQuery.Reset ();
 
-			compressionOutputBuffer.resize (sourceSize);
-			compressor->Decompress (readBuffer,	compressionOutputBuffer);
+		packages.push_back (std::move (package));
+	}
 
-			getCallback (hash, compressionOutputBuffer, sourceOffset, 
-				totalSize);
+	FetchPackages (packages, [this](const std::string& filename) {
+		return OpenPackage (filename);
+	}, limits, [&](const ChunkToFetch& chunk, const ArrayRef<>& contents) -> void {
+		getCallback (chunk.hash, contents, chunk.sourceOffset,
+			chunk.totalSize);
+	});
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+If several deltas are stored for an object, the smallest one is used.
+Repositories built before deltas were added don't have the storage_deltas
+table, and never return anything.
+*/
+void PackedRepositoryBase::GetContentObjectDeltasImpl (const ArrayRef<SHA256Digest>& requestedObjects,
+	const ArrayRef<SHA256Digest>& baseObjects,
+	const Repository::GetContentObjectDeltaCallback& getCallback,
+	const ResourceLimits& limits)
+{
+	auto& db = GetDatabase ();
+
+	{
+		auto hasDeltasQuery = db.Prepare (
+			"SELECT COUNT(*) FROM sqlite_master "
+			"WHERE type = 'table' AND name = 'storage_deltas'");
+		hasDeltasQuery.Step ();
+
+		if (hasDeltasQuery.GetInt64 (0) == 0) {
+			return;
 		}
+	}
 
-		contentObjectsInPackageQuery.Reset ();
+	auto deltasQuery = db.Prepare ("SELECT "
+		"    storage_deltas.PackageOffset, "		// = 0
+		"    storage_deltas.PackageSize, "			// = 1
+		"    storage_deltas.DeltaSize, "			// = 2
+		"    storage_deltas.Compression, "			// = 3
+		"    storage_deltas.StorageHash, "			// = 4
+		"    content_objects.Hash, "				// = 5
+		"    storage_deltas.BaseHash, "				// = 6
+		"    source_packages.Filename "				// = 7
+		"FROM storage_deltas "
+		"INNER JOIN content_objects ON storage_deltas.ContentObjectId = content_objects.Id "
+		"INNER JOIN source_packages ON storage_deltas.SourcePackageId = source_packages.Id "
+		"WHERE content_objects.Hash IN (SELECT Value FROM kyla_array(?)) "
+		"    AND storage_deltas.BaseHash IN (SELECT Value FROM kyla_array(?)) "
+		"ORDER BY storage_deltas.PackageSize");
+	deltasQuery.BindArray (1, requestedObjects);
+	deltasQuery.BindArray (2, baseObjects);
+
+	// The delta is fetched like a chunk, with the object hash to identify it
+	struct Delta
+	{
+		ChunkToFetch chunk;
+		SHA256Digest baseHash;
+	};
+
+	std::unordered_set<SHA256Digest, HashDigestHash, HashDigestEqual> selectedObjects;
+	std::map<std::string, std::vector<Delta>> deltasPerPackage;
+
+	while (deltasQuery.Step ()) {
+		Delta delta;
+		deltasQuery.GetBlob (5, delta.chunk.hash);
+
+		// Ordered by size, so the first delta is the smallest
+		if (!selectedObjects.insert (delta.chunk.hash).second) {
+			continue;
+		}
+
+		delta.chunk.packageOffset = deltasQuery.GetInt64 (0);
+		delta.chunk.packageSize = deltasQuery.GetInt64 (1);
+		delta.chunk.sourceOffset = 0;
+		delta.chunk.sourceSize = deltasQuery.GetInt64 (2);
+		delta.chunk.totalSize = delta.chunk.sourceSize;
+
+		if (const char* compression = deltasQuery.GetText (3)) {
+			delta.chunk.compression = compression;
+		}
+
+		delta.chunk.hasStorageHash = true;
+		deltasQuery.GetBlob (4, delta.chunk.storageHash);
+		deltasQuery.GetBlob (6, delta.baseHash);
+
+		deltasPerPackage [deltasQuery.GetText (7)].push_back (delta);
+	}
+
+	std::vector<ChunkToFetch> chunks;
+	std::unordered_map<SHA256Digest, SHA256Digest, HashDigestHash, HashDigestEqual> baseHashes;
+
+	for (auto& package : deltasPerPackage) {
+		std::sort (package.second.begin (), package.second.end (),
+			[](const Delta& a, const Delta& b) -> bool {
+			return a.chunk.packageOffset < b.chunk.packageOffset;
+		});
+
+		chunks.clear ();
+		for (const auto& delta : package.second) {
+			chunks.push_back (delta.chunk);
+			baseHashes [delta.chunk.hash] = delta.baseHash;
+		}
+
+		const auto& filename = package.first;
+
+		TraceSpan span ("package", "Fetch deltas");
+		span.SetDetail (filename);
+
+		FetchChunks (chunks, [this, &filename]() {
+			return OpenPackage (filename);
+		}, limits, [&](const ChunkToFetch& chunk, const ArrayRef<>& contents) -> void {
+			getCallback (chunk.hash, baseHashes [chunk.hash], contents);
+		});
 	}
 }
 
@@ -201,6 +740,9 @@ void PackedRepositoryBase::ValidateImpl (const Repository::ValidationCallback& v
 	std::vector<byte> readBuffer;
 
 	while (findSourcePackagesQuery.Step ()) {
+		TraceSpan packageSpan ("package", "Validate package");
+		packageSpan.SetDetail (findSourcePackagesQuery.GetText (0));
+
 		auto packageFile = OpenPackage (findSourcePackagesQuery.GetText (0));
 		
 		contentObjectsInPackageQuery.BindArguments (
@@ -217,6 +759,8 @@ void PackedRepositoryBase::ValidateImpl (const Repository::ValidationCallback& v
 			const char* compression = contentObjectsInPackageQuery.GetText (4);
 			const auto sourceSize = contentObjectsInPackageQuery.GetInt64 (5);
 
+			TraceSpan span ("hash", "Validate", sourceSize);
+
 			readBuffer.resize (packageSize);
 			packageFile->Read (packageOffset, readBuffer);
 
@@ -254,4 +798,108 @@ void PackedRepositoryBase::ValidateImpl (const Repository::ValidationCallback& v
 		contentObjectsInPackageQuery.Reset ();
 	}
 }
-} // namespace kyla
\ No newline at end of file
+///////////////////////////////////////////////////////////////////////////////
+/**
+Only the chunks overlapping the requested range are read and decoded.
+*/
+int64 PackedRepositoryBase::ReadFileImpl (const char* path, const int64 offset,
+	const MutableArrayRef<>& buffer, const ResourceLimits& limits)
+{
+	if (offset < 0) {
+		throw RuntimeException ("PackedRepository", "Offset must not be negative",
+			KYLA_FILE_LINE);
+	}
+
+	const auto contents = GetFileContents (path);
+
+	if (offset >= contents.size) {
+		return 0;
+	}
+
+	const auto bytesToRead = std::min<int64> (contents.size - offset,
+		buffer.GetSize ());
+	const MutableArrayRef<> output (buffer.GetData (), bytesToRead);
+
+	auto& db = GetDatabase ();
+
+	auto chunksQuery = db.Prepare ("SELECT "
+		"    storage_mapping.Id AS StorageMappingId, "			// = 0
+		"    storage_mapping.PackageOffset AS PackageOffset, "	// = 1
+		"    storage_mapping.PackageSize AS PackageSize, "		// = 2
+		"    storage_mapping.SourceOffset AS SourceOffset, "	// = 3
+		"    storage_mapping.SourceSize AS SourceSize, "		// = 4
+		"    storage_mapping.Compression AS Compression, "		// = 5
+		"    source_packages.Filename AS Filename "				// = 6
+		"FROM storage_mapping "
+		"INNER JOIN content_objects ON storage_mapping.ContentObjectId = content_objects.Id "
+		"INNER JOIN source_packages ON storage_mapping.SourcePackageId = source_packages.Id "
+		"WHERE content_objects.Hash = ? "
+		"    AND storage_mapping.SourceOffset < ? "
+		"    AND storage_mapping.SourceOffset + storage_mapping.SourceSize > ? "
+		"ORDER BY SourceOffset");
+	chunksQuery.BindArguments (contents.hash, offset + bytesToRead, offset);
+
+	auto getStorageHashQuery = db.Prepare (
+		"SELECT Hash "
+		"FROM storage_hashes "
+		"WHERE StorageMappingId = ?");
+
+	std::vector<byte> readBuffer;
+
+	while (chunksQuery.Step ()) {
+		const auto storageMappingId = chunksQuery.GetInt64 (0);
+		const auto sourceOffset = chunksQuery.GetInt64 (3);
+
+		if (auto chunk = chunkCache_->Find (storageMappingId)) {
+			CopyOverlappingRange (*chunk, sourceOffset, offset, output);
+			continue;
+		}
+
+		const auto packageOffset = chunksQuery.GetInt64 (1);
+		const auto packageSize = chunksQuery.GetInt64 (2);
+		const auto sourceSize = chunksQuery.GetInt64 (4);
+		const char* compression = chunksQuery.GetText (5);
+
+		{
+			TraceSpan span ("io", "Read", packageSize);
+
+			readBuffer.resize (packageSize);
+			chunkCache_->GetPackage (*this, chunksQuery.GetText (6))
+				.Read (packageOffset, readBuffer);
+		}
+
+		getStorageHashQuery.BindArguments (storageMappingId);
+
+		if (getStorageHashQuery.Step ()) {
+			SHA256Digest digest;
+			getStorageHashQuery.GetBlob (0, digest);
+
+			if (ComputeSHA256 (readBuffer) != digest) {
+				throw RuntimeException ("PackedRepository",
+					str (boost::format ("Source data for chunk '%1%' is corrupted") %
+						ToString (contents.hash)),
+					KYLA_FILE_LINE);
+			}
+		}
+		getStorageHashQuery.Reset ();
+
+		std::vector<byte> chunk;
+
+		if (compression == nullptr) {
+			chunk = std::move (readBuffer);
+			readBuffer = std::vector<byte> ();
+		} else {
+			auto compressor = CreateBlockCompressor (
+				CompressionAlgorithmFromId (compression));
+
+			chunk.resize (sourceSize);
+			compressor->Decompress (readBuffer, chunk);
+		}
+
+		CopyOverlappingRange (chunkCache_->Insert (storageMappingId,
+			std::move (chunk), limits.memoryBudget), sourceOffset, offset, output);
+	}
+
+	return bytesToRead;
+}
+} // namespace kyla
@@ -0,0 +1,224 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "PathTable.h"
+
+#include "Exception.h"
+
+#include <limits>
+
+namespace kyla {
+namespace {
+///////////////////////////////////////////////////////////////////////////////
+bool IsSeparator (const char c)
+{
+#if KYLA_PLATFORM_WINDOWS
+	return c == '/' || c == '\\';
+#else
+	return c == '/';
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::size_t HashComponent (const PathTable::PathId parent, const StringRef& name)
+{
+	// FNV-1a, seeded with the parent so equal names in different
+	// directories end up in different buckets
+	uint64 hash = 14695981039346656037ULL ^ parent;
+	hash *= 1099511628211ULL;
+
+	for (const auto c : name) {
+		hash ^= static_cast<byte> (c);
+		hash *= 1099511628211ULL;
+	}
+
+	return static_cast<std::size_t> (hash);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Call callback for every component of path, in order. Consecutive separators
+yield empty components, so the path can be reconstructed exactly.
+*/
+template <typename Callback>
+bool ForEachComponent (const StringRef& path, Callback callback)
+{
+	if (path.IsEmpty ()) {
+		return true;
+	}
+
+	auto start = path.begin ();
+	for (auto it = path.begin (); ; ++it) {
+		if (it == path.end () || IsSeparator (*it)) {
+			if (!callback (StringRef{ start, it })) {
+				return false;
+			}
+
+			if (it == path.end ()) {
+				return true;
+			}
+
+			start = it + 1;
+		}
+	}
+}
+}
+
+/**
+@class PathTable
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+PathTable::PathTable ()
+	: buckets_ (64, InvalidPathId)
+{
+	// The empty path, which is the parent of all top-level components. It is
+	// never stored in the hash table
+	entries_.push_back (Entry{ InvalidPathId, 0, 0 });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+PathTable::PathId PathTable::Add (const StringRef& path)
+{
+	PathId current = 0;
+
+	ForEachComponent (path, [&](const StringRef& name) -> bool {
+		std::size_t bucket;
+		auto id = FindComponent (current, name, bucket);
+
+		if (id == InvalidPathId) {
+			if (entries_.size () >= InvalidPathId
+				|| names_.size () + name.GetLength () > std::numeric_limits<uint32>::max ()) {
+				throw RuntimeException ("Too many paths", KYLA_FILE_LINE);
+			}
+
+			if ((entries_.size () + 1) * 2 > buckets_.size ()) {
+				Grow ();
+				FindComponent (current, name, bucket);
+			}
+
+			id = static_cast<PathId> (entries_.size ());
+			entries_.push_back (Entry{ current,
+				static_cast<uint32> (names_.size ()),
+				static_cast<uint32> (name.GetLength ()) });
+			names_.append (name.begin (), name.end ());
+			buckets_ [bucket] = id;
+		}
+
+		current = id;
+		return true;
+	});
+
+	return current;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+PathTable::PathId PathTable::Find (const StringRef& path) const
+{
+	PathId current = 0;
+
+	if (!ForEachComponent (path, [&](const StringRef& name) -> bool {
+		std::size_t bucket;
+		current = FindComponent (current, name, bucket);
+		return current != InvalidPathId;
+	})) {
+		return InvalidPathId;
+	}
+
+	return current;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string PathTable::GetString (const PathId id) const
+{
+	std::vector<PathId> components;
+	std::size_t length = 0;
+
+	for (auto current = id; current != 0; current = entries_ [current].parent) {
+		components.push_back (current);
+		length += entries_ [current].nameLength + 1;
+	}
+
+	std::string result;
+	result.reserve (length);
+
+	for (auto it = components.rbegin (); it != components.rend (); ++it) {
+		if (it != components.rbegin ()) {
+			result.push_back ('/');
+		}
+
+		const auto& entry = entries_ [*it];
+		result.append (names_, entry.nameOffset, entry.nameLength);
+	}
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+PathTable::PathId PathTable::GetParent (const PathId id) const
+{
+	return entries_ [id].parent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+StringRef PathTable::GetName (const PathId id) const
+{
+	const auto& entry = entries_ [id];
+	return StringRef{ names_.data () + entry.nameOffset,
+		static_cast<int64> (entry.nameLength) };
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::size_t PathTable::GetSize () const
+{
+	return entries_.size ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Return the id of name within parent, or InvalidPathId. In this case, bucket
+is set to the empty bucket it can be inserted into.
+*/
+PathTable::PathId PathTable::FindComponent (const PathId parent,
+	const StringRef& name, std::size_t& bucket) const
+{
+	const auto mask = buckets_.size () - 1;
+
+	for (bucket = HashComponent (parent, name) & mask; ; bucket = (bucket + 1) & mask) {
+		const auto id = buckets_ [bucket];
+
+		if (id == InvalidPathId) {
+			return InvalidPathId;
+		}
+
+		if (entries_ [id].parent == parent && GetName (id) == name) {
+			return id;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void PathTable::Grow ()
+{
+	std::vector<PathId> buckets (buckets_.size () * 2, InvalidPathId);
+	const auto mask = buckets.size () - 1;
+
+	for (PathId id = 1; id < entries_.size (); ++id) {
+		auto bucket = HashComponent (entries_ [id].parent, GetName (id)) & mask;
+
+		while (buckets [bucket] != InvalidPathId) {
+			bucket = (bucket + 1) & mask;
+		}
+
+		buckets [bucket] = id;
+	}
+
+	buckets_.swap (buckets);
+}
+}
@@ -14,17 +14,169 @@ details.
 #include "PackedRepository.h"
 #include "WebRepository.h"
 
+#include "sql/Database.h"
+#include "sql/Profiler.h"
+#include "Exception.h"
+#include "Trace.h"
+
+#include <algorithm>
+
 namespace kyla {
+///////////////////////////////////////////////////////////////////////////////
+void Repository::ExecutionContext::CheckCancellation () const
+{
+	if (IsCancellationRequested ()) {
+		throw OperationCancelledException (KYLA_FILE_LINE);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+ProgressHelper::ProgressHelper (Progress progressCallback)
+	: progressCallback_ (progressCallback)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ProgressHelper::Start (const int stageCount)
+{
+	stageCount_ = stageCount;
+	currentStage_ = -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ProgressHelper::AdvanceStage (const char* stageName)
+{
+	++currentStage_;
+	stageName_ = stageName;
+	action_.clear ();
+	currentStageTarget_ = 0;
+	current_ = 0;
+	bytesDone_ = bytesTotal_ = 0;
+	bytesPerSecond_ = 0;
+	lastSample_ = Clock::now ();
+	lastSampleBytes_ = 0;
+
+	Update (true);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ProgressHelper::SetStageTarget (const int64 target)
+{
+	currentStageTarget_ = target;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ProgressHelper::SetStageByteTarget (const int64 bytes)
+{
+	bytesTotal_ = bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ProgressHelper::SetStageFinished ()
+{
+	current_ = currentStageTarget_ = 1;
+	bytesDone_ = bytesTotal_;
+
+	Update (true);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ProgressHelper::Update (const bool force)
+{
+	const auto now = Clock::now ();
+
+	if (!force && (now - lastUpdate_) < progressCallback_.GetInterval ()) {
+		return;
+	}
+
+	lastUpdate_ = now;
+
+	// Sample the throughput at most every 250 ms, and smooth it so the
+	// remaining time doesn't jump around with every chunk
+	const auto sampleDuration = std::chrono::duration<double> (now - lastSample_).count ();
+	if (sampleDuration >= 0.25) {
+		const double currentRate = (bytesDone_ - lastSampleBytes_) / sampleDuration;
+
+		if (bytesPerSecond_ > 0) {
+			bytesPerSecond_ = 0.3 * currentRate + 0.7 * bytesPerSecond_;
+		} else {
+			bytesPerSecond_ = currentRate;
+		}
+
+		lastSample_ = now;
+		lastSampleBytes_ = bytesDone_;
+	}
+
+	ProgressInfo info;
+	info.totalProgress = GetTotalProgress ();
+	info.stageName = stageName_.c_str ();
+	info.action = action_.empty () ? nullptr : action_.c_str ();
+	info.bytesDone = bytesDone_;
+	info.bytesTotal = bytesTotal_;
+	info.bytesPerSecond = bytesPerSecond_;
+
+	if (bytesTotal_ > 0 && bytesPerSecond_ > 0) {
+		info.secondsRemaining = (bytesTotal_ - bytesDone_) / bytesPerSecond_;
+	} else {
+		info.secondsRemaining = -1;
+	}
+
+	progressCallback_ (info);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+float ProgressHelper::GetInStageProgress () const
+{
+	float result = 0;
+
+	if (bytesTotal_ > 0) {
+		result = static_cast<float> (bytesDone_) / static_cast<float> (bytesTotal_);
+	} else if (currentStageTarget_ > 0) {
+		result = static_cast<float> (current_) / static_cast<float> (currentStageTarget_);
+	}
+
+	return std::min (result, 1.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+float ProgressHelper::GetTotalProgress () const
+{
+	if (stageCount_ <= 0 || currentStage_ < 0) {
+		return 0;
+	}
+
+	return (currentStage_ + GetInStageProgress ()) / static_cast<float> (stageCount_);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void Repository::Validate (const ValidationCallback& validationCallback,
 	ExecutionContext& context)
 {
-	ValidateImpl (validationCallback, context);
+	TracerScope tracerScope (context.tracer);
+	TraceSpan span ("action", "Validate");
+	Sql::ProfilerScope profilerScope (context.profiler, GetDatabase ());
+
+	if (context.cancellationFlag == nullptr) {
+		ValidateImpl (validationCallback, context);
+		return;
+	}
+
+	// Validation doesn't modify anything, so it can stop after any object
+	ValidateImpl ([&](const SHA256Digest& contentObject, const char* path,
+		const ValidationResult validationResult) -> void {
+		validationCallback (contentObject, path, validationResult);
+		context.CheckCancellation ();
+	}, context);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 void Repository::Repair (Repository& source, ExecutionContext& context)
 {
+	TracerScope tracerScope (context.tracer);
+	TraceSpan span ("action", "Repair");
+	Sql::ProfilerScope profilerScope (context.profiler, GetDatabase ());
+	Sql::ProfilerScope sourceProfilerScope (context.profiler, source.GetDatabase ());
+
 	RepairImpl (source, context);
 }
 
@@ -32,14 +184,30 @@ void Repository::Repair (Repository& source, ExecutionContext& context)
 void Repository::Configure (Repository& source, const ArrayRef<Uuid>& filesets,
 	ExecutionContext& context)
 {
+	TracerScope tracerScope (context.tracer);
+	TraceSpan span ("action", "Configure");
+	Sql::ProfilerScope profilerScope (context.profiler, GetDatabase ());
+	Sql::ProfilerScope sourceProfilerScope (context.profiler, source.GetDatabase ());
+
 	ConfigureImpl (source, filesets, context);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 void Repository::GetContentObjects (const ArrayRef<SHA256Digest>& requestedObjects,
-	const GetContentObjectCallback& getCallback)
+	const GetContentObjectCallback& getCallback,
+	const ResourceLimits& limits)
 {
-	GetContentObjectsImpl (requestedObjects, getCallback);
+	GetContentObjectsImpl (requestedObjects, getCallback, limits);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void Repository::GetContentObjectDeltas (const ArrayRef<SHA256Digest>& requestedObjects,
+	const ArrayRef<SHA256Digest>& baseObjects,
+	const GetContentObjectDeltaCallback& getCallback,
+	const ResourceLimits& limits)
+{
+	GetContentObjectDeltasImpl (requestedObjects, baseObjects, getCallback,
+		limits);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -66,6 +234,25 @@ int64_t Repository::GetFilesetFileCount (const Uuid& id)
 	return GetFilesetFileCountImpl (id);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+int64_t Repository::GetFilesetDownloadSize (const Uuid& id)
+{
+	return GetFilesetDownloadSizeImpl (id);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int64 Repository::GetFileSize (const char* path)
+{
+	return GetFileSizeImpl (path);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int64 Repository::ReadFile (const char* path, const int64 offset,
+	const MutableArrayRef<>& buffer, const ResourceLimits& limits)
+{
+	return ReadFileImpl (path, offset, buffer, limits);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 Sql::Database& Repository::GetDatabase ()
 {
@@ -98,10 +285,81 @@ std::unique_ptr<Repository> DeployRepository (Repository& source,
 	const ArrayRef<Uuid>& filesets,
 	Repository::ExecutionContext& context)
 {
+	TracerScope tracerScope (context.tracer);
+	TraceSpan span ("action", "Install");
+
 	Path targetPath{ destinationPath };
 	boost::filesystem::create_directories (destinationPath);
 
 	return std::unique_ptr<Repository> (DeployedRepository::CreateFrom (source, filesets, targetPath, 
 		context).release ());
 }
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<std::unique_ptr<Repository>> DeployRepositories (Repository& source,
+	const ArrayRef<const char*>& targetPaths,
+	const ArrayRef<Uuid>& filesets,
+	Repository::ExecutionContext& context)
+{
+	TracerScope tracerScope (context.tracer);
+	TraceSpan span ("action", "Install");
+
+	std::vector<Path> targetDirectories (targetPaths.begin (), targetPaths.end ());
+
+	Sql::ProfilerScope sourceProfilerScope (context.profiler, source.GetDatabase ());
+
+	auto deployedRepositories = DeployedRepository::CreateFrom (source,
+		filesets, targetDirectories, context);
+
+	std::vector<std::unique_ptr<Repository>> result;
+	for (auto& repository : deployedRepositories) {
+		result.emplace_back (repository.release ());
+	}
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void ConfigureRepositories (Repository& source,
+	const ArrayRef<Repository*>& targets,
+	const ArrayRef<Uuid>& filesets,
+	Repository::ExecutionContext& context)
+{
+	TracerScope tracerScope (context.tracer);
+	TraceSpan span ("action", "Configure");
+
+	std::vector<DeployedRepository*> deployedTargets;
+	std::vector<std::unique_ptr<Sql::ProfilerScope>> profilerScopes;
+
+	for (auto target : targets) {
+		auto deployedTarget = dynamic_cast<DeployedRepository*> (target);
+
+		if (deployedTarget == nullptr) {
+			throw RuntimeException ("Repository",
+				"Only deployed repositories can be configured together",
+				KYLA_FILE_LINE);
+		}
+
+		deployedTargets.push_back (deployedTarget);
+		profilerScopes.emplace_back (new Sql::ProfilerScope (context.profiler,
+			target->GetDatabase ()));
+	}
+
+	Sql::ProfilerScope sourceProfilerScope (context.profiler, source.GetDatabase ());
+
+	DeployedRepository::ConfigureMany (source, deployedTargets, filesets, context);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+ConfigurationPlan PlanConfiguration (Repository& source,
+	Repository* target,
+	const ArrayRef<Uuid>& filesets,
+	Repository::ExecutionContext& context)
+{
+	TracerScope tracerScope (context.tracer);
+	TraceSpan span ("action", "Plan");
+	Sql::ProfilerScope profilerScope (context.profiler, source.GetDatabase ());
+
+	return DeployedRepository::Plan (source, target, filesets, context);
+}
 }
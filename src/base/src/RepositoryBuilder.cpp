@@ -15,6 +15,8 @@ details.
 #include <string>
 
 #include "FileIO.h"
+#include "PathTable.h"
+#include "Trace.h"
 
 #include <pugixml.hpp>
 
@@ -35,10 +37,18 @@ details.
 #include "sql/Database.h"
 #include "Exception.h"
 
+#include "BlockChecksum.h"
 #include "Compression.h"
+#include "Delta.h"
+#include "RepositoryBuilder.h"
 
 #include <boost/format.hpp>
 
+#include <algorithm>
+#include <future>
+#include <limits>
+#include <tuple>
+
 namespace {
 using namespace kyla;
 
@@ -46,32 +56,60 @@ struct BuildContext
 {
 	Path sourceDirectory;
 	Path targetDirectory;
+	// If set, content objects stored in this repository are not written
+	// again, but referenced from its packages
+	Path baseRepository;
+	// Store deltas from the previous version of a file in the base
+	// repository to the new one
+	bool computeDeltas = false;
+	ResourceLimits limits;
 };
 
 struct File
 {
 	Path source;
 	Path target;
+};
 
-	SHA256Digest hash;
+/**
+All files in a directory which match a pattern. The directory is only scanned
+when the files are hashed, so the files are never stored in a list.
+*/
+struct DirectoryScan
+{
+	Path source;
+	Path target;
+
+	// Matched against the file name, supports * and ?
+	std::string pattern;
+	bool recursive;
 };
 
 struct FileSet
 {
 	std::vector<File> files;
+	std::vector<DirectoryScan> directories;
 
 	std::string name;
 	Uuid id;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
+struct FileReference
+{
+	// Into SourcePackage::targets
+	PathTable::PathId target;
+	// Index into the file sets of the source package
+	uint32 fileSet;
+};
+
 struct ContentObject
 {
 	Path sourceFile;
 	SHA256Digest hash;
 	std::size_t size;
 
-	std::vector<Path> duplicates;
+	std::vector<FileReference> duplicates;
 };
 
 struct SourcePackage
@@ -82,6 +120,9 @@ struct SourcePackage
 
 	std::vector<FileSet> fileSets;
 	std::vector<ContentObject> contentObjects;
+
+	// Target paths of all files, so paths in the same directory share it
+	PathTable targets;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -118,7 +159,9 @@ std::unordered_map<std::string, SourcePackage> GetSourcePackages (const pugi::xm
 	if (sourcePackageIds.find ("main") == sourcePackageIds.end ()) {
 		// Add the default (== main) package, which is compressed using Brotli
 		// by default
-		result ["main"] = SourcePackage{"main", CompressionAlgorithm::Brotli};
+		auto& mainPackage = result ["main"];
+		mainPackage.name = "main";
+		mainPackage.compressionAlgorithm = CompressionAlgorithm::Brotli;
 	}
 
 	return result;
@@ -145,19 +188,35 @@ void AssignFileSetsToPackages (const pugi::xml_document& doc,
 
 		auto& package = sourcePackages.find (sourcePackageId)->second;
 
-		for (const auto& fileNode : fileSetNode.node ().children ("File")) {
-			File file;
-			file.source = fileNode.attribute ("Source").as_string ();
+		for (const auto& node : fileSetNode.node ().children ()) {
+			if (strcmp (node.name (), "File") == 0) {
+				File file;
+				file.source = node.attribute ("Source").as_string ();
 
-			if (fileNode.attribute ("Target")) {
-				file.target = fileNode.attribute ("Target").as_string ();
-			} else {
-				file.target = file.source;
-			}
+				if (node.attribute ("Target")) {
+					file.target = node.attribute ("Target").as_string ();
+				} else {
+					file.target = file.source;
+				}
 
-			fileSet.files.push_back (file);
+				fileSet.files.push_back (file);
 
-			++filesFound;
+				++filesFound;
+			} else if (strcmp (node.name (), "Directory") == 0) {
+				DirectoryScan directory;
+				directory.source = node.attribute ("Source").as_string ();
+
+				if (node.attribute ("Target")) {
+					directory.target = node.attribute ("Target").as_string ();
+				} else {
+					directory.target = directory.source;
+				}
+
+				directory.pattern = node.attribute ("Pattern").as_string ("*");
+				directory.recursive = node.attribute ("Recursive").as_bool (true);
+
+				fileSet.directories.push_back (directory);
+			}
 		}
 
 		package.fileSets.emplace_back (std::move (fileSet));
@@ -165,50 +224,467 @@ void AssignFileSetsToPackages (const pugi::xml_document& doc,
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-void HashFiles (std::vector<FileSet>& fileSets,
-	const BuildContext& ctx)
+/**
+Match name against a pattern, where * matches any number of characters and ?
+matches exactly one.
+*/
+bool MatchesPattern (const char* pattern, const char* name)
 {
-	for (auto& fileSet : fileSets) {
-		for (auto& file : fileSet.files) {
-			file.hash = ComputeSHA256 (ctx.sourceDirectory / file.source);
+	// Position after the last *, to backtrack to if the rest doesn't match
+	const char* starPattern = nullptr;
+	const char* starName = nullptr;
+
+	while (*name) {
+		if (*pattern == '*') {
+			starPattern = ++pattern;
+			starName = name;
+		} else if (*pattern == '?' || *pattern == *name) {
+			++pattern;
+			++name;
+		} else if (starPattern) {
+			pattern = starPattern;
+			name = ++starName;
+		} else {
+			return false;
 		}
 	}
+
+	while (*pattern == '*') {
+		++pattern;
+	}
+
+	return *pattern == '\0';
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 /**
-Given a couple of file sets, we find unique files by hashing everything
-and merging the results on the hash.
+Call callback with the source and target path of every file in a directory
+scan, while the directory is being scanned.
 */
-std::vector<ContentObject> FindContentObjects (std::vector<FileSet>& fileSets,
-	const BuildContext& ctx)
+void ScanDirectory (const DirectoryScan& directory, const BuildContext& ctx,
+	const std::function<void (const Path& source, const Path& target)>& callback)
 {
-	std::unordered_map<SHA256Digest, std::vector<std::pair<Path, Path>>,
-		HashDigestHash, HashDigestEqual> uniqueContents;
+	const auto root = ctx.sourceDirectory / directory.source;
+
+	if (!boost::filesystem::is_directory (root)) {
+		throw RuntimeException (
+			str (boost::format ("Directory '%1%' does not exist") % root.string ()),
+			KYLA_FILE_LINE);
+	}
+
+	for (boost::filesystem::recursive_directory_iterator it (root), end; it != end; ++it) {
+		if (boost::filesystem::is_directory (it->status ())) {
+			if (!directory.recursive) {
+				it.no_push ();
+			}
+
+			continue;
+		}
+
+		if (!boost::filesystem::is_regular_file (it->status ())) {
+			continue;
+		}
 
-	for (const auto& fileSet : fileSets) {
-		for (const auto& file : fileSet.files) {
-			// This assumes the hashes are up-to-date, i.e. initialized
-			uniqueContents [file.hash].push_back (std::make_pair (file.source, file.target));
+		const auto& path = it->path ();
+
+		if (!MatchesPattern (directory.pattern.c_str (),
+			path.filename ().string ().c_str ())) {
+			continue;
+		}
+
+		// The iterator appends one component per level to root, so the
+		// relative path doesn't depend on how root is spelled, for instance,
+		// with a trailing separator
+		std::vector<Path> components;
+		auto parent = path;
+		for (int i = 0; i <= it.level (); ++i) {
+			components.push_back (parent.filename ());
+			parent = parent.parent_path ();
+		}
+
+		auto target = directory.target;
+		for (auto component = components.rbegin (); component != components.rend (); ++component) {
+			target /= *component;
 		}
+
+		callback (path, target);
 	}
+}
 
+///////////////////////////////////////////////////////////////////////////////
+/**
+Hash all files of a couple of file sets, and merge them into unique content
+objects by hash. Every file is hashed and merged on its own, and directory
+scans are never stored as a list, so only the content objects are kept in
+memory. The file lists are released afterwards.
+*/
+std::vector<ContentObject> FindContentObjects (std::vector<FileSet>& fileSets,
+	PathTable& targets, const BuildContext& ctx)
+{
+	std::unordered_map<SHA256Digest, std::size_t, HashDigestHash, HashDigestEqual> objectIndices;
 	std::vector<ContentObject> result;
-	result.reserve (uniqueContents.size ());
 
-	for (const auto& kv : uniqueContents) {
-		ContentObject uf;
+	// Larger buffers don't make hashing any faster
+	std::vector<byte> hashBuffer (static_cast<std::size_t> (
+		ctx.limits.GetBufferSize (1, 1 << 20)));
 
-		uf.hash = kv.first;
-		uf.sourceFile = ctx.sourceDirectory / kv.second.front ().first;
+	for (std::size_t i = 0; i < fileSets.size (); ++i) {
+		auto addFile = [&](const Path& source, const Path& target) -> void {
+			const auto size = Stat (source.string ().c_str ()).size;
 
-		uf.size = Stat (uf.sourceFile.string ().c_str ()).size;
+			TraceSpan span ("hash", "Hash", size);
+			if (Tracer::GetCurrent ()) {
+				span.SetDetail (source.string ());
+			}
+
+			const auto hash = ComputeSHA256 (source, hashBuffer);
+			const auto it = objectIndices.emplace (hash, result.size ());
 
-		for (const auto& sourceTargetPair : kv.second){
-			uf.duplicates.push_back (sourceTargetPair.second);
+			if (it.second) {
+				ContentObject contentObject;
+				contentObject.hash = hash;
+				contentObject.sourceFile = source;
+				contentObject.size = size;
+
+				result.push_back (std::move (contentObject));
+			}
+
+			result [it.first->second].duplicates.push_back (
+				FileReference{ targets.Add (target.string ()),
+					static_cast<uint32> (i) });
+		};
+
+		for (auto& file : fileSets [i].files) {
+			addFile (ctx.sourceDirectory / file.source, file.target);
+		}
+
+		for (const auto& directory : fileSets [i].directories) {
+			ScanDirectory (directory, ctx, addFile);
 		}
 
-		result.push_back (uf);
+		std::vector<File> ().swap (fileSets [i].files);
+	}
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Read an access trace, which lists target paths in the order an application
+reads them, one per line. Returns the position of the first access of every
+path.
+*/
+std::unordered_map<std::string, std::size_t> LoadAccessTrace (const Path& path)
+{
+	std::ifstream input (path.string ());
+
+	if (!input) {
+		throw RuntimeException (
+			str (boost::format ("Could not open access trace '%1%'") % path.string ()),
+			KYLA_FILE_LINE);
+	}
+
+	std::unordered_map<std::string, std::size_t> result;
+	std::string line;
+
+	while (std::getline (input, line)) {
+		if (!line.empty () && line.back () == '\r') {
+			line.pop_back ();
+		}
+
+		if (line.empty ()) {
+			continue;
+		}
+
+		// Only the first access is relevant for the layout
+		result.emplace (Path{ line }.generic_string (), result.size ());
+	}
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Order the content objects of a package, which is the order in which they
+are written. Objects are grouped by the first file set using them, so
+installing one file set reads a contiguous range of the package. Within a
+file set, objects follow the access trace, if there is one, and are then
+sorted by directory and extension, so similar files end up next to each
+other, which also helps compression.
+*/
+void OrderContentObjects (SourcePackage& package,
+	const std::unordered_map<std::string, std::size_t>& accessTrace)
+{
+	// File set, access position, directory, extension, path
+	using LayoutKey = std::tuple<std::size_t, std::size_t,
+		std::string, std::string, std::string>;
+
+	std::unordered_map<SHA256Digest, LayoutKey, HashDigestHash, HashDigestEqual> keys;
+
+	for (const auto& contentObject : package.contentObjects) {
+		// Objects used by several files are placed with the first one
+		LayoutKey objectKey;
+		bool hasKey = false;
+
+		for (const auto& reference : contentObject.duplicates) {
+			const Path target{ package.targets.GetString (reference.target) };
+			const auto path = target.generic_string ();
+			const auto access = accessTrace.find (path);
+
+			LayoutKey key{ reference.fileSet,
+				access == accessTrace.end ()
+					? std::numeric_limits<std::size_t>::max ()
+					: access->second,
+				target.parent_path ().generic_string (),
+				target.extension ().string (),
+				path };
+
+			if (!hasKey || key < objectKey) {
+				objectKey = std::move (key);
+				hasKey = true;
+			}
+		}
+
+		keys.emplace (contentObject.hash, std::move (objectKey));
+	}
+
+	std::sort (package.contentObjects.begin (), package.contentObjects.end (),
+		[&keys](const ContentObject& a, const ContentObject& b) -> bool {
+		return keys.find (a.hash)->second < keys.find (b.hash)->second;
+	});
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Compute the file set statistics once all files and storage mappings have been
+written, so querying a file set is a single row lookup later on.
+
+Every chunk of a content object is counted, so objects split across volumes
+count in each volume. If a chunk is stored in more than one source package,
+it is attributed to the package with the lowest id only.
+*/
+void PopulateFileSetStatistics (Sql::Database& db)
+{
+	auto statisticsInsert = db.BeginTransaction ();
+
+	db.Execute (
+		"INSERT INTO file_set_statistics "
+		"(FileSetId, FileCount, Size, UniqueSize, DownloadSize) "
+		"SELECT file_sets.Id, "
+		"    COUNT(files.ContentObjectId), "
+		"    COALESCE(SUM(content_objects.Size), 0), "
+		"    (SELECT COALESCE(SUM(Size), 0) FROM content_objects "
+		"        WHERE Id IN (SELECT ContentObjectId FROM files "
+		"            WHERE FileSetId = file_sets.Id)), "
+		"    0 "
+		"FROM file_sets "
+		"LEFT JOIN files ON file_sets.Id = files.FileSetId "
+		"LEFT JOIN content_objects ON content_objects.Id = files.ContentObjectId "
+		"GROUP BY file_sets.Id");
+
+	// With MIN, SQLite takes the other columns from the row with the lowest
+	// package id, which is the copy a chunk is attributed to
+	db.Execute (
+		"INSERT INTO file_set_source_package_statistics "
+		"(FileSetId, SourcePackageId, DownloadSize) "
+		"SELECT file_contents.FileSetId, chunks.SourcePackageId, "
+		"    SUM(chunks.PackageSize) "
+		"FROM (SELECT DISTINCT FileSetId, ContentObjectId FROM files) AS file_contents "
+		"INNER JOIN ("
+		"    SELECT ContentObjectId, MIN(SourcePackageId) AS SourcePackageId, PackageSize "
+		"    FROM storage_mapping "
+		"    GROUP BY ContentObjectId, SourceOffset"
+		") AS chunks ON chunks.ContentObjectId = file_contents.ContentObjectId "
+		"GROUP BY file_contents.FileSetId, chunks.SourcePackageId");
+
+	// Loose repositories have no storage mapping, objects are fetched as-is
+	db.Execute (
+		"UPDATE file_set_statistics SET DownloadSize = COALESCE("
+		"    (SELECT SUM(DownloadSize) FROM file_set_source_package_statistics "
+		"        WHERE FileSetId = file_set_statistics.FileSetId), "
+		"    UniqueSize)");
+
+	statisticsInsert.Commit ();
+}
+
+// The file starts with a header followed by all content objects.
+// The database is stored separately
+struct PackageHeader
+{
+	char id [8];
+	std::uint64_t version;
+	char reserved [48];
+
+	static void Initialize (PackageHeader& header)
+	{
+		memset (&header, 0, sizeof (header));
+
+		memcpy (header.id, "KYLAPKG", 8);
+		header.version = 0x0001000000000000ULL;
+		// Major           ^^^^
+		// Minor               ^^^^
+		// Patch                   ^^^^^^^^
+	}
+};
+
+/**
+The packages and chunks of a previous packed repository, which are reused by
+an incremental build. Everything is loaded into memory, as the base
+repository can be the directory which is being built.
+*/
+struct BaseRepositoryContents
+{
+	struct Package
+	{
+		std::string name;
+		std::string filename;
+		Uuid id;
+	};
+
+	struct Chunk
+	{
+		// Index into packages
+		std::size_t package;
+		int64 packageOffset;
+		int64 packageSize;
+		int64 sourceOffset;
+		int64 sourceSize;
+		// Empty if uncompressed
+		std::string compression;
+		bool hasStorageHash;
+		SHA256Digest storageHash;
+		bool hasBlockChecksums;
+		uint32 weakChecksum;
+		SHA256Digest strongChecksum;
+	};
+
+	Path directory;
+	std::vector<Package> packages;
+	std::unordered_map<SHA256Digest, std::vector<Chunk>,
+		HashDigestHash, HashDigestEqual> chunks;
+	// Content object of every file, by path
+	std::unordered_map<std::string, SHA256Digest> files;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+BaseRepositoryContents LoadBaseRepository (const Path& path)
+{
+	BaseRepositoryContents result;
+	result.directory = path;
+
+	auto repository = OpenRepository (path.string ().c_str (), false);
+	auto& db = repository->GetDatabase ();
+
+	std::unordered_map<int64, std::size_t> packageIndices;
+
+	auto packagesQuery = db.Prepare (
+		"SELECT Id, Name, Filename, Uuid FROM source_packages ORDER BY Id");
+	while (packagesQuery.Step ()) {
+		BaseRepositoryContents::Package package;
+		package.name = packagesQuery.GetText (1);
+		package.filename = packagesQuery.GetText (2);
+		packagesQuery.GetBlob (3, package.id);
+
+		packageIndices [packagesQuery.GetInt64 (0)] = result.packages.size ();
+		result.packages.push_back (package);
+	}
+
+	bool hasBlockChecksums = false;
+	{
+		auto hasBlockChecksumsQuery = db.Prepare (
+			"SELECT COUNT(*) FROM sqlite_master "
+			"WHERE type = 'table' AND name = 'storage_block_checksums'");
+		hasBlockChecksumsQuery.Step ();
+		hasBlockChecksums = hasBlockChecksumsQuery.GetInt64 (0) > 0;
+	}
+
+	// Repositories built before block checksums were added don't have the
+	// table, so the columns are NULL for them
+	auto chunksQuery = db.Prepare (std::string (
+		"SELECT content_objects.Hash, storage_mapping.SourcePackageId, "
+		"    storage_mapping.PackageOffset, storage_mapping.PackageSize, "
+		"    storage_mapping.SourceOffset, storage_mapping.SourceSize, "
+		"    storage_mapping.Compression, storage_hashes.Hash, ")
+		+ (hasBlockChecksums
+			? "    storage_block_checksums.WeakChecksum, storage_block_checksums.StrongChecksum "
+			: "    NULL, NULL ") +
+		"FROM storage_mapping "
+		"    INNER JOIN content_objects ON content_objects.Id = storage_mapping.ContentObjectId "
+		"    LEFT JOIN storage_hashes ON storage_hashes.StorageMappingId = storage_mapping.Id "
+		+ (hasBlockChecksums
+			? "    LEFT JOIN storage_block_checksums ON storage_block_checksums.StorageMappingId = storage_mapping.Id "
+			: "") +
+		"ORDER BY storage_mapping.ContentObjectId, storage_mapping.SourceOffset");
+	while (chunksQuery.Step ()) {
+		SHA256Digest hash;
+		chunksQuery.GetBlob (0, hash);
+
+		BaseRepositoryContents::Chunk chunk;
+		chunk.package = packageIndices.find (chunksQuery.GetInt64 (1))->second;
+		chunk.packageOffset = chunksQuery.GetInt64 (2);
+		chunk.packageSize = chunksQuery.GetInt64 (3);
+		chunk.sourceOffset = chunksQuery.GetInt64 (4);
+		chunk.sourceSize = chunksQuery.GetInt64 (5);
+
+		if (chunksQuery.GetColumnType (6) != Sql::Type::Null) {
+			chunk.compression = chunksQuery.GetText (6);
+		}
+
+		chunk.hasStorageHash = chunksQuery.GetColumnType (7) != Sql::Type::Null;
+		if (chunk.hasStorageHash) {
+			chunksQuery.GetBlob (7, chunk.storageHash);
+		}
+
+		chunk.hasBlockChecksums = chunksQuery.GetColumnType (8) != Sql::Type::Null;
+		if (chunk.hasBlockChecksums) {
+			chunk.weakChecksum = static_cast<uint32> (chunksQuery.GetInt64 (8));
+			chunksQuery.GetBlob (9, chunk.strongChecksum);
+		}
+
+		result.chunks [hash].push_back (chunk);
+	}
+
+	auto filesQuery = db.Prepare (
+		"SELECT files.Path, content_objects.Hash FROM files "
+		"INNER JOIN content_objects ON content_objects.Id = files.ContentObjectId");
+	while (filesQuery.Step ()) {
+		SHA256Digest hash;
+		filesQuery.GetBlob (1, hash);
+
+		result.files [filesQuery.GetText (0)] = hash;
+	}
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Read a content object from the packages of the base repository.
+*/
+std::vector<byte> ReadBaseContentObject (const BaseRepositoryContents& base,
+	const std::vector<BaseRepositoryContents::Chunk>& chunks)
+{
+	std::vector<byte> result;
+	std::vector<byte> packageData;
+
+	for (const auto& chunk : chunks) {
+		auto package = OpenFile (base.directory / base.packages [chunk.package].filename,
+			FileOpenMode::Read);
+
+		packageData.resize (static_cast<std::size_t> (chunk.packageSize));
+		package->Seek (chunk.packageOffset);
+		package->Read (packageData);
+
+		result.resize (static_cast<std::size_t> (chunk.sourceOffset + chunk.sourceSize));
+		const MutableArrayRef<> output (result.data () + chunk.sourceOffset,
+			chunk.sourceSize);
+
+		if (chunk.compression.empty ()) {
+			::memcpy (output.GetData (), packageData.data (), packageData.size ());
+		} else {
+			CreateBlockCompressor (CompressionAlgorithmFromId (
+				chunk.compression.c_str ()))->Decompress (packageData, output);
+		}
 	}
 
 	return result;
@@ -252,10 +728,14 @@ struct LooseRepositoryBuilder final : public RepositoryBuilder
 		db.Execute ("PRAGMA synchronous=NORMAL;");
 
 		for (const auto& sourcePackage : packages) {
-			const auto fileToFileSetId = PopulateFileSets (db, sourcePackage.second.fileSets);
-			PopulateContentObjectsAndFiles (db, sourcePackage.second.contentObjects, fileToFileSetId,
+			const auto fileSetIds = PopulateFileSets (db, sourcePackage.second.fileSets);
+			PopulateContentObjectsAndFiles (db, sourcePackage.second.contentObjects,
+				sourcePackage.second.targets, fileSetIds,
 				ctx.targetDirectory / ".ky" / "objects");
 		}
+
+		PopulateFileSetStatistics (db);
+
 		db.Execute ("PRAGMA journal_mode=DELETE;");
 		// Necessary to get good index statistics
 		db.Execute ("ANALYZE");
@@ -265,16 +745,16 @@ struct LooseRepositoryBuilder final : public RepositoryBuilder
 
 private:
 	/**
-	Store all file sets, and return a mapping of every file to its file set id.
+	Store all file sets, and return their ids, indexed like fileSets.
 	*/
-	std::map<Path, std::int64_t> PopulateFileSets (Sql::Database& db,
+	std::vector<int64> PopulateFileSets (Sql::Database& db,
 		const std::vector<FileSet>& fileSets)
 	{
 		auto fileSetsInsert = db.BeginTransaction ();
 		auto fileSetsInsertQuery = db.Prepare (
 			"INSERT INTO file_sets (Uuid, Name) VALUES (?, ?);");
 
-		std::map<Path, std::int64_t> result;
+		std::vector<int64> result;
 
 		for (const auto& fileSet : fileSets) {
 			fileSetsInsertQuery.BindArguments (
@@ -283,11 +763,7 @@ private:
 			fileSetsInsertQuery.Step ();
 			fileSetsInsertQuery.Reset ();
 
-			const auto fileSetId = db.GetLastRowId ();
-
-			for (const auto& file : fileSet.files) {
-				result [file.target] = fileSetId;
-			}
+			result.push_back (db.GetLastRowId ());
 		}
 
 		fileSetsInsert.Commit ();
@@ -300,7 +776,8 @@ private:
 	*/
 	void PopulateContentObjectsAndFiles (Sql::Database& db,
 		const std::vector<ContentObject>& uniqueFiles,
-		const std::map<Path, std::int64_t>& fileToFileSetId,
+		const PathTable& targets,
+		const std::vector<int64>& fileSetIds,
 		const Path& contentObjectPath)
 	{
 		auto contentObjectInsert = db.BeginTransaction ();
@@ -320,18 +797,17 @@ private:
 			const auto contentObjectId = db.GetLastRowId ();
 
 			for (const auto& reference : kv.duplicates) {
-				const auto fileSetId = fileToFileSetId.find (reference)->second;
-
 				filesInsertQuery.BindArguments (
-					reference.string ().c_str (),
+					targets.GetString (reference.target).c_str (),
 					contentObjectId,
-					fileSetId);
+					fileSetIds [reference.fileSet]);
 				filesInsertQuery.Step ();
 				filesInsertQuery.Reset ();
 			}
 
 			///@TODO(minor) Enable compression here
 			// store the file itself
+			TraceSpan span ("write", "Copy", kv.size);
 			boost::filesystem::copy_file (kv.sourceFile,
 				contentObjectPath / ToString (kv.hash));
 		}
@@ -350,6 +826,14 @@ struct PackedRepositoryBuilder final : public RepositoryBuilder
 
 	void Configure (const pugi::xml_document& repositoryDefinition) override
 	{
+		auto volumeSizeNode = repositoryDefinition.select_node ("//Package/VolumeSize");
+
+		if (volumeSizeNode) {
+			volumeSize_ = volumeSizeNode.node ().text ().as_llong ();
+
+			assert (volumeSize_ >= 0);
+		}
+
 		auto chunkSizeNode = repositoryDefinition.select_node ("//Package/ChunkSize");
 
 		if (chunkSizeNode) {
@@ -367,6 +851,15 @@ struct PackedRepositoryBuilder final : public RepositoryBuilder
 	void Build (const BuildContext& ctx,
 		const std::unordered_map<std::string, SourcePackage>& packages) override
 	{
+		// Must be loaded before the database is replaced, as the base
+		// repository can be the target directory
+		BaseRepositoryContents base;
+		if (!ctx.baseRepository.empty ()) {
+			base = LoadBaseRepository (ctx.baseRepository);
+		}
+
+		computeDeltas_ = ctx.computeDeltas;
+
 		auto dbFile = ctx.targetDirectory / "repository.db";
 		boost::filesystem::remove (dbFile);
 
@@ -378,20 +871,28 @@ struct PackedRepositoryBuilder final : public RepositoryBuilder
 		db.Execute ("PRAGMA synchronous=NORMAL;");
 
 		auto uniqueObjects = PopulateUniqueContentObjects (db, packages);
+		const auto basePackageIds = PopulateBasePackages (db, base, packages,
+			ctx.targetDirectory);
 
 		for (const auto& sourcePackage : packages) {
 			if (sourcePackage.second.contentObjects.empty ()) {
 				continue;
 			}
 
-			const auto fileToFileSetId = PopulateFileSets (db,
+			const auto fileSetIds = PopulateFileSets (db,
 				sourcePackage.second.fileSets);
 
+			TraceSpan span ("package", "Write package");
+			span.SetDetail (sourcePackage.second.name);
+
 			WritePackage (db, sourcePackage.second,
-				fileToFileSetId, uniqueObjects,
+				fileSetIds, uniqueObjects,
+				base, basePackageIds,
 				ctx.targetDirectory);
 		}
 
+		PopulateFileSetStatistics (db);
+
 		db.Execute ("PRAGMA journal_mode=DELETE;");
 		// Necessary to get good index statistics
 		db.Execute ("ANALYZE");
@@ -436,16 +937,115 @@ private:
 	}
 
 	/**
-	Store all file sets, and return a mapping of every file to its file set id.
+	Store the packages of the base repository which contain content objects
+	of this build, and return their ids, indexed like base.packages. Unused
+	packages are skipped and get the id -1. If the target directory is not
+	the base repository, the used packages are linked or copied into it.
+	*/
+	std::vector<int64> PopulateBasePackages (Sql::Database& db,
+		const BaseRepositoryContents& base,
+		const std::unordered_map<std::string, SourcePackage>& packages,
+		const Path& targetDirectory)
+	{
+		std::vector<int64> result (base.packages.size (), -1);
+
+		if (base.packages.empty ()) {
+			return result;
+		}
+
+		// New packages must not replace any file of the base repository,
+		// including packages which are not used any more
+		for (const auto& package : base.packages) {
+			usedPackageNames_.insert (package.name);
+			usedPackageNames_.insert (Path (package.filename).stem ().string ());
+		}
+
+		std::vector<bool> isUsed (base.packages.size (), false);
+		for (const auto& package : packages) {
+			for (const auto& contentObject : package.second.contentObjects) {
+				const auto baseChunks = base.chunks.find (contentObject.hash);
+
+				if (baseChunks == base.chunks.end ()) {
+					continue;
+				}
+
+				for (const auto& chunk : baseChunks->second) {
+					isUsed [chunk.package] = true;
+				}
+			}
+		}
+
+		const auto isSameDirectory = boost::filesystem::equivalent (
+			base.directory, targetDirectory);
+
+		auto packageInsert = db.BeginTransaction ();
+		auto packageInsertQuery = db.Prepare (
+			"INSERT INTO source_packages (Name, Filename, Uuid) VALUES (?, ?, ?)");
+
+		for (std::size_t i = 0; i < base.packages.size (); ++i) {
+			if (!isUsed [i]) {
+				continue;
+			}
+
+			const auto& package = base.packages [i];
+
+			// The id is kept, so clients which have downloaded the package
+			// already can reuse it
+			packageInsertQuery.BindArguments (package.name, package.filename,
+				package.id);
+			packageInsertQuery.Step ();
+			packageInsertQuery.Reset ();
+
+			result [i] = db.GetLastRowId ();
+
+			if (!isSameDirectory) {
+				const auto source = base.directory / package.filename;
+				const auto target = targetDirectory / package.filename;
+
+				boost::filesystem::remove (target);
+
+				boost::system::error_code error;
+				boost::filesystem::create_hard_link (source, target, error);
+
+				if (error) {
+					boost::filesystem::copy_file (source, target);
+				}
+			}
+		}
+
+		packageInsert.Commit ();
+
+		return result;
+	}
+
+	/**
+	Get a package name based on name which is not used by the base
+	repository or any package written so far.
 	*/
-	std::map<Path, std::int64_t> PopulateFileSets (Sql::Database& db,
+	std::string ReservePackageName (const std::string& name)
+	{
+		auto result = name;
+
+		for (int i = 1; usedPackageNames_.find (result) != usedPackageNames_.end (); ++i) {
+			result = name + "-" + std::to_string (i);
+		}
+
+		usedPackageNames_.insert (result);
+
+		return result;
+	}
+
+	/**
+	Store all file sets, and return their ids, indexed like fileSets.
+	*/
+	std::vector<int64> PopulateFileSets (Sql::Database& db,
 		const std::vector<FileSet>& fileSets)
 	{
 		auto fileSetsInsert = db.BeginTransaction ();
 		auto fileSetsInsertQuery = db.Prepare (
 			"INSERT INTO file_sets (Uuid, Name) VALUES (?, ?);");
 
-		std::map<Path, std::int64_t> result;
+		std::vector<int64> result;
 
 		for (const auto& fileSet : fileSets) {
 			fileSetsInsertQuery.BindArguments (
@@ -454,11 +1054,7 @@ private:
 			fileSetsInsertQuery.Step ();
 			fileSetsInsertQuery.Reset ();
 
-			const auto fileSetId = db.GetLastRowId ();
-
-			for (const auto& file : fileSet.files) {
-				result [file.target] = fileSetId;
-			}
+			result.push_back (db.GetLastRowId ());
 		}
 
 		fileSetsInsert.Commit ();
@@ -466,30 +1062,17 @@ private:
 		return result;
 	}
 
-	// The file starts with a header followed by all content objects.
-	// The database is stored separately
-	struct PackageHeader
-	{
-		char id [8];
-		std::uint64_t version;
-		char reserved [48];
-
-		static void Initialize (PackageHeader& header)
-		{
-			memset (&header, 0, sizeof (header));
-
-			memcpy (header.id, "KYLAPKG", 8);
-			header.version = 0x0001000000000000ULL;
-			// Major           ^^^^
-			// Minor               ^^^^
-			// Patch                   ^^^^^^^^
-		}
-	};
-
+	/**
+	Write the files of a source package, and store all content objects which
+	are not in the base repository into a new package. If all of them are,
+	no package is created.
+	*/
 	void WritePackage (Sql::Database& db,
 		const SourcePackage& sourcePackage,
-		const std::map<Path, int64>& fileToFileSetId,
+		const std::vector<int64>& fileSetIds,
 		const HashIntMap& uniqueContentObjects,
+		const BaseRepositoryContents& base,
+		const std::vector<int64>& basePackageIds,
 		const Path& packagePath)
 	{
 		auto contentObjectInsert = db.BeginTransaction ();
@@ -506,46 +1089,140 @@ private:
 			"(StorageMappingId, Hash) "
 			"VALUES (?, ?)"
 		);
+		auto storageBlockChecksumsInsertQuery = db.Prepare (
+			"INSERT INTO storage_block_checksums "
+			"(StorageMappingId, WeakChecksum, StrongChecksum) "
+			"VALUES (?, ?, ?)");
+		auto storageDeltasInsertQuery = db.Prepare (
+			"INSERT INTO storage_deltas "
+			"(ContentObjectId, BaseHash, SourcePackageId, PackageOffset, PackageSize, DeltaSize, Compression, StorageHash) "
+			"VALUES (?, ?, ?, ?, ?, ?, ?, ?)");
 
-		///@TODO(minor) Support splitting packages for media limits
-		auto package = CreateFile (packagePath / (sourcePackage.name + ".kypkg"));
-
-		PackageHeader packageHeader;
-		PackageHeader::Initialize (packageHeader);
-
-		package->Write (ArrayRef<PackageHeader> (packageHeader));
+		std::vector<const ContentObject*> newContentObjects;
 
-		packageInsertQuery.BindArguments (sourcePackage.name, (sourcePackage.name + ".kypkg"),
-			Uuid::CreateRandom ());
-		packageInsertQuery.Step ();
-		packageInsertQuery.Reset ();
-
-		const auto packageId = db.GetLastRowId ();
-
-		auto compressor = CreateBlockCompressor (sourcePackage.compressionAlgorithm);
-		auto compressorId = IdFromCompressionAlgorithm (sourcePackage.compressionAlgorithm);
-
-		std::vector<byte> compressionInputBuffer, compressionOutputBuffer;
-
-		// We can insert content objects directly - every unique file is one
 		for (const auto& kv : sourcePackage.contentObjects) {
 			const auto contentObjectId = uniqueContentObjects.find (kv.hash)->second;
 
 			for (const auto& reference : kv.duplicates) {
-				const auto fileSetId = fileToFileSetId.find (reference)->second;
-
 				filesInsertQuery.BindArguments (
-					reference.string ().c_str (),
+					sourcePackage.targets.GetString (reference.target).c_str (),
 					contentObjectId,
-					fileSetId);
+					fileSetIds [reference.fileSet]);
 				filesInsertQuery.Step ();
 				filesInsertQuery.Reset ();
 			}
 
+			const auto baseChunks = base.chunks.find (kv.hash);
+
+			if (baseChunks == base.chunks.end ()) {
+				newContentObjects.push_back (&kv);
+				continue;
+			}
+
+			// Reference the chunks in the base repository packages
+			for (const auto& chunk : baseChunks->second) {
+				storageMappingInsertQuery.BindArguments (contentObjectId,
+					basePackageIds [chunk.package],
+					chunk.packageOffset, chunk.packageSize,
+					chunk.sourceOffset, chunk.sourceSize,
+					chunk.compression.empty () ? nullptr : chunk.compression.c_str ());
+				storageMappingInsertQuery.Step ();
+				storageMappingInsertQuery.Reset ();
+
+				const auto storageMappingId = db.GetLastRowId ();
+
+				if (chunk.hasStorageHash) {
+					storageHashesInsertQuery.BindArguments (
+						storageMappingId, chunk.storageHash);
+					storageHashesInsertQuery.Step ();
+					storageHashesInsertQuery.Reset ();
+				}
+
+				if (chunk.hasBlockChecksums) {
+					storageBlockChecksumsInsertQuery.BindArguments (
+						storageMappingId,
+						static_cast<int64> (chunk.weakChecksum),
+						chunk.strongChecksum);
+					storageBlockChecksumsInsertQuery.Step ();
+					storageBlockChecksumsInsertQuery.Reset ();
+				}
+			}
+		}
+
+		if (newContentObjects.empty ()) {
+			contentObjectInsert.Commit ();
+			return;
+		}
+
+		const auto packageName = ReservePackageName (sourcePackage.name);
+
+		std::unique_ptr<kyla::File> package;
+		int64 packageId = -1;
+		int volumeCount = 0;
+
+		// Every volume is a source package of its own. The first one uses
+		// the package name, the following ones get the volume number
+		// appended
+		auto startVolume = [&]() -> void {
+			const auto volumeName = (volumeCount == 0)
+				? packageName
+				: ReservePackageName (packageName + "." + std::to_string (volumeCount));
+			++volumeCount;
+
+			package = CreateFile (packagePath / (volumeName + ".kypkg"));
+
+			PackageHeader packageHeader;
+			PackageHeader::Initialize (packageHeader);
+
+			package->Write (ArrayRef<PackageHeader> (packageHeader));
+
+			packageInsertQuery.BindArguments (volumeName, (volumeName + ".kypkg"),
+				Uuid::CreateRandom ());
+			packageInsertQuery.Step ();
+			packageInsertQuery.Reset ();
+
+			packageId = db.GetLastRowId ();
+		};
+
+		// Start a new volume if size bytes don't fit into the current one.
+		// Every volume gets at least one chunk, even if it's larger
+		auto reserveSpace = [&](const int64 size) -> void {
+			const auto offset = package->Tell ();
+
+			if (volumeSize_ > 0
+				&& offset > static_cast<int64> (sizeof (PackageHeader))
+				&& offset + size > volumeSize_) {
+				startVolume ();
+			}
+		};
+
+		startVolume ();
+
+		auto compressor = CreateBlockCompressor (sourcePackage.compressionAlgorithm);
+		auto compressorId = IdFromCompressionAlgorithm (sourcePackage.compressionAlgorithm);
+
+		std::vector<byte> compressionInputBuffer;
+		// Large enough for any chunk, so it is allocated once
+		std::vector<byte> compressionOutputBuffer (static_cast<std::size_t> (
+			compressor->GetCompressionBound (chunkSize_)));
+
+		for (const auto contentObject : newContentObjects) {
+			const auto& kv = *contentObject;
+			const auto contentObjectId = uniqueContentObjects.find (kv.hash)->second;
+
 			///@TODO(minor) Support per-file compression algorithms
 
 			auto inputFile = OpenFile (kv.sourceFile, FileOpenMode::Read);
 			const auto inputFileSize = inputFile->GetSize ();
+			int64 storedSize = 0;
+
+			// Objects which fit into a volume are not split, so they can
+			// be read from a single volume. The uncompressed size is used
+			// as the compressed size is not known yet
+			if (inputFileSize <= volumeSize_
+				- static_cast<int64> (sizeof (PackageHeader))) {
+				reserveSpace (inputFileSize);
+			}
 
 			if (inputFileSize == 0) {
 				// If it's a null-byte file, we still store a storage mapping
@@ -566,11 +1243,15 @@ private:
 				int64 bytesRead = -1;
 				int64 readOffset = 0;
 				while ((bytesRead = inputFile->Read (compressionInputBuffer)) > 0) {
-					compressionOutputBuffer.resize (
-						compressor->GetCompressionBound (bytesRead));
-					const auto compressedSize = compressor->Compress (
-						ArrayRef<byte> (compressionInputBuffer).Slice (0, bytesRead),
-						compressionOutputBuffer);
+					int64 compressedSize;
+					{
+						TraceSpan span ("encode", "Compress", bytesRead);
+						compressedSize = compressor->Compress (
+							ArrayRef<byte> (compressionInputBuffer).Slice (0, bytesRead),
+							compressionOutputBuffer);
+					}
+
+					reserveSpace (compressedSize);
 
 					const auto startOffset = package->Tell ();
 					package->Write (ArrayRef<byte> (compressionOutputBuffer).Slice (0, compressedSize));
@@ -596,29 +1277,600 @@ private:
 					storageHashesInsertQuery.Step ();
 					storageHashesInsertQuery.Reset ();
 
+					// Objects which are split into several chunks get block
+					// checksums, so targets can reuse the unchanged chunks
+					// of an outdated version
+					if (inputFileSize > chunkSize_) {
+						const auto chunk = ArrayRef<byte> (compressionInputBuffer)
+							.Slice (0, bytesRead);
+
+						storageBlockChecksumsInsertQuery.BindArguments (
+							storageMappingId,
+							static_cast<int64> (ComputeWeakChecksum (chunk)),
+							ComputeSHA256 (chunk));
+						storageBlockChecksumsInsertQuery.Step ();
+						storageBlockChecksumsInsertQuery.Reset ();
+					}
+
 					readOffset += bytesRead;
+					storedSize += compressedSize;
+				}
+			}
+
+			if (!computeDeltas_ || inputFileSize == 0 || inputFileSize > MaxDeltaSize) {
+				continue;
+			}
+
+			// Every previous version of a file using this content object can
+			// serve as a base. The delta is only kept if it's smaller than
+			// the chunks it replaces
+			std::unordered_set<SHA256Digest, HashDigestHash, HashDigestEqual> baseHashes;
+			for (const auto& reference : kv.duplicates) {
+				const auto baseFile = base.files.find (
+					sourcePackage.targets.GetString (reference.target));
+
+				if (baseFile != base.files.end ()) {
+					baseHashes.insert (baseFile->second);
 				}
 			}
+
+			std::vector<byte> contents;
+
+			for (const auto& baseHash : baseHashes) {
+				const auto baseChunks = base.chunks.find (baseHash);
+
+				if (baseChunks == base.chunks.end ()) {
+					continue;
+				}
+
+				const auto& lastChunk = baseChunks->second.back ();
+				if (lastChunk.sourceOffset + lastChunk.sourceSize > MaxDeltaSize) {
+					continue;
+				}
+
+				if (contents.empty ()) {
+					contents.resize (static_cast<std::size_t> (inputFileSize));
+					inputFile->Seek (0);
+					inputFile->Read (contents);
+				}
+
+				TraceSpan span ("encode", "Compute delta", inputFileSize);
+
+				const auto delta = ComputeDelta (
+					ReadBaseContentObject (base, baseChunks->second), contents);
+
+				// Only grow the buffer, it is still used for the chunks of
+				// the following content objects
+				const auto deltaBound = compressor->GetCompressionBound (delta.size ());
+				if (static_cast<int64> (compressionOutputBuffer.size ()) < deltaBound) {
+					compressionOutputBuffer.resize (static_cast<std::size_t> (deltaBound));
+				}
+
+				const auto compressedSize = compressor->Compress (
+					delta, compressionOutputBuffer);
+
+				if (compressedSize >= storedSize) {
+					continue;
+				}
+
+				const auto compressedDelta = ArrayRef<byte> (compressionOutputBuffer)
+					.Slice (0, compressedSize);
+
+				reserveSpace (compressedSize);
+
+				const auto startOffset = package->Tell ();
+				package->Write (compressedDelta);
+
+				storageDeltasInsertQuery.BindArguments (contentObjectId,
+					baseHash, packageId,
+					startOffset, compressedSize,
+					static_cast<int64> (delta.size ()),
+					compressorId,
+					ComputeSHA256 (compressedDelta));
+				storageDeltasInsertQuery.Step ();
+				storageDeltasInsertQuery.Reset ();
+			}
 		}
 
 		contentObjectInsert.Commit ();
 	}
 
+	// Deltas need the base and the new content object in memory, so larger
+	// objects are always stored in full
+	static const int64 MaxDeltaSize = 256 << 20;
+
+	bool computeDeltas_ = false;
+
 	int64 chunkSize_ = 4 << 20; // 4 MiB chunks is the default
+	// Maximum size of a package file, or 0 if packages are not split
+	int64 volumeSize_ = 0;
+	std::unordered_set<std::string> usedPackageNames_;
 };
+
+/**
+Compresses chunks and appends them to a package. Chunks are collected until
+the memory budget is used up, then they are compressed and hashed in parallel
+and written in the order they were added.
+*/
+class PackageWriter final
+{
+public:
+	PackageWriter (Sql::Database& db, kyla::File& package, const int64 packageId,
+		const CompressionAlgorithm compression, const ResourceLimits& limits)
+		: package_ (package)
+		, packageId_ (packageId)
+		, compression_ (compression)
+		, limits_ (limits)
+		, storageMappingInsertQuery_ (db.Prepare (
+			"INSERT INTO storage_mapping "
+			"(ContentObjectId, SourcePackageId, PackageOffset, PackageSize, SourceOffset, SourceSize, Compression) "
+			"VALUES (?, ?, ?, ?, ?, ?, ?)"))
+		, storageHashesInsertQuery_ (db.Prepare (
+			"INSERT INTO storage_hashes "
+			"(StorageMappingId, Hash) "
+			"VALUES (?, ?)"))
+		, storageBlockChecksumsInsertQuery_ (db.Prepare (
+			"INSERT INTO storage_block_checksums "
+			"(StorageMappingId, WeakChecksum, StrongChecksum) "
+			"VALUES (?, ?, ?)"))
+		, db_ (db)
+	{
+		for (int i = 0; i < std::max (limits.threadCount, 1); ++i) {
+			compressors_.push_back (CreateBlockCompressor (compression));
+		}
+	}
+
+	/**
+	If hasBlockChecksums is set, the checksums of the uncompressed data are
+	stored as well, see storage_block_checksums.
+	*/
+	void AddChunk (const int64 contentObjectId, const int64 sourceOffset,
+		std::vector<byte> data, const bool hasBlockChecksums)
+	{
+		pendingBytes_ += static_cast<int64> (data.size ());
+
+		Chunk chunk;
+		chunk.contentObjectId = contentObjectId;
+		chunk.sourceOffset = sourceOffset;
+		chunk.data = std::move (data);
+		chunk.hasBlockChecksums = hasBlockChecksums;
+		pending_.push_back (std::move (chunk));
+
+		if (pending_.size () >= compressors_.size () * 4
+			|| pendingBytes_ >= limits_.memoryBudget / 2) {
+			Flush ();
+		}
+	}
+
+	void Flush ()
+	{
+		// Chunks may be compressed on other threads
+		const auto tracer = Tracer::GetCurrent ();
+
+		// Every worker handles every n-th chunk with its own compressor
+		auto compress = [this, tracer] (const std::size_t worker) -> void {
+			TracerScope tracerScope (tracer);
+			auto& compressor = *compressors_ [worker];
+
+			for (auto i = worker; i < pending_.size (); i += compressors_.size ()) {
+				auto& chunk = pending_ [i];
+
+				if (chunk.data.empty ()) {
+					continue;
+				}
+
+				TraceSpan span ("encode", "Compress",
+					static_cast<int64> (chunk.data.size ()));
+
+				chunk.compressed.resize (static_cast<std::size_t> (
+					compressor.GetCompressionBound (chunk.data.size ())));
+				const auto compressedSize = compressor.Compress (
+					chunk.data, chunk.compressed);
+				chunk.compressed.resize (static_cast<std::size_t> (compressedSize));
+
+				chunk.hash = ComputeSHA256 (chunk.compressed);
+
+				if (chunk.hasBlockChecksums) {
+					chunk.weakChecksum = ComputeWeakChecksum (chunk.data);
+					chunk.strongChecksum = ComputeSHA256 (chunk.data);
+				}
+			}
+		};
+
+		const auto workerCount = std::min (compressors_.size (), pending_.size ());
+
+		// With a single chunk, compress on the calling thread
+		const auto launchPolicy = (workerCount > 1)
+			? std::launch::async : std::launch::deferred;
+
+		std::vector<std::future<void>> results;
+		for (std::size_t i = 0; i < workerCount; ++i) {
+			results.push_back (std::async (launchPolicy, compress, i));
+		}
+
+		for (auto& result : results) {
+			result.get ();
+		}
+
+		const auto compressorId = IdFromCompressionAlgorithm (compression_);
+
+		TraceSpan span ("write", "Write chunks");
+
+		for (const auto& chunk : pending_) {
+			const auto startOffset = package_.Tell ();
+
+			if (chunk.data.empty ()) {
+				// If it's a null-byte file, we still store a storage mapping
+				storageMappingInsertQuery_.BindArguments (chunk.contentObjectId,
+					packageId_,
+					startOffset, 0 /* = size */,
+					0 /* = output offset */,
+					0 /* = uncompressed size */,
+					IdFromCompressionAlgorithm (CompressionAlgorithm::Uncompressed));
+				storageMappingInsertQuery_.Step ();
+				storageMappingInsertQuery_.Reset ();
+
+				continue;
+			}
+
+			package_.Write (chunk.compressed);
+			span.AddBytes (static_cast<int64> (chunk.compressed.size ()));
+
+			storageMappingInsertQuery_.BindArguments (chunk.contentObjectId,
+				packageId_,
+				startOffset, static_cast<int64> (chunk.compressed.size ()),
+				chunk.sourceOffset,
+				static_cast<int64> (chunk.data.size ()),
+				compressorId);
+			storageMappingInsertQuery_.Step ();
+			storageMappingInsertQuery_.Reset ();
+
+			const auto storageMappingId = db_.GetLastRowId ();
+
+			storageHashesInsertQuery_.BindArguments (
+				storageMappingId, chunk.hash);
+			storageHashesInsertQuery_.Step ();
+			storageHashesInsertQuery_.Reset ();
+
+			if (chunk.hasBlockChecksums) {
+				storageBlockChecksumsInsertQuery_.BindArguments (
+					storageMappingId,
+					static_cast<int64> (chunk.weakChecksum),
+					chunk.strongChecksum);
+				storageBlockChecksumsInsertQuery_.Step ();
+				storageBlockChecksumsInsertQuery_.Reset ();
+			}
+		}
+
+		pending_.clear ();
+		pendingBytes_ = 0;
+	}
+
+private:
+	struct Chunk
+	{
+		int64 contentObjectId;
+		int64 sourceOffset;
+		std::vector<byte> data;
+		std::vector<byte> compressed;
+		SHA256Digest hash;
+		bool hasBlockChecksums;
+		uint32 weakChecksum;
+		SHA256Digest strongChecksum;
+	};
+
+	kyla::File& package_;
+	int64 packageId_;
+	CompressionAlgorithm compression_;
+	ResourceLimits limits_;
+
+	Sql::Statement storageMappingInsertQuery_;
+	Sql::Statement storageHashesInsertQuery_;
+	Sql::Statement storageBlockChecksumsInsertQuery_;
+	Sql::Database& db_;
+
+	std::vector<std::unique_ptr<BlockCompressor>> compressors_;
+	std::vector<Chunk> pending_;
+	int64 pendingBytes_ = 0;
+};
+
+/**
+Splits the contents of one content object into chunks. Chunks never span
+several content objects, so every chunk can be decoded on its own.
+*/
+class ObjectChunker final
+{
+public:
+	ObjectChunker (PackageWriter& writer, const int64 chunkSize)
+		: writer_ (writer)
+		, chunkSize_ (chunkSize)
+	{
+	}
+
+	void Begin (const int64 contentObjectId, const int64 size)
+	{
+		contentObjectId_ = contentObjectId;
+		hasBlockChecksums_ = size > chunkSize_;
+		offset_ = 0;
+		current_.clear ();
+	}
+
+	void Append (const ArrayRef<>& contents)
+	{
+		auto data = static_cast<const byte*> (contents.GetData ());
+		auto remaining = static_cast<int64> (contents.GetSize ());
+
+		while (remaining > 0) {
+			const auto count = std::min (remaining,
+				chunkSize_ - static_cast<int64> (current_.size ()));
+			current_.insert (current_.end (), data, data + count);
+			data += count;
+			remaining -= count;
+
+			if (static_cast<int64> (current_.size ()) == chunkSize_) {
+				Emit ();
+			}
+		}
+	}
+
+	void End ()
+	{
+		// Empty objects are stored as one empty chunk
+		if (!current_.empty () || offset_ == 0) {
+			Emit ();
+		}
+	}
+
+private:
+	void Emit ()
+	{
+		const auto size = static_cast<int64> (current_.size ());
+		writer_.AddChunk (contentObjectId_, offset_, std::move (current_),
+			hasBlockChecksums_);
+		current_ = std::vector<byte> ();
+		offset_ += size;
+	}
+
+	PackageWriter& writer_;
+	int64 chunkSize_;
+
+	int64 contentObjectId_ = -1;
+	bool hasBlockChecksums_ = false;
+	int64 offset_ = 0;
+	std::vector<byte> current_;
+};
+
+struct ObjectToRepack
+{
+	int64 id;
+	SHA256Digest hash;
+	int64 size;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+void RepackObjects (Repository& source, const std::vector<ObjectToRepack>& objects,
+	PackageWriter& writer, const RepackOptions& options)
+{
+	ObjectChunker chunker (writer, options.chunkSize);
+
+	std::size_t next = 0;
+	while (next < objects.size ()) {
+		// Fetch as many objects at once as fit into the memory budget. A
+		// batch always contains at least one object
+		auto batchEnd = next;
+		int64 batchSize = 0;
+		do {
+			batchSize += objects [batchEnd].size;
+			++batchEnd;
+		} while (batchEnd < objects.size ()
+			&& batchSize + objects [batchEnd].size <= options.limits.memoryBudget);
+
+		if (batchEnd - next == 1) {
+			// A single object is streamed, as it may exceed the budget
+			const auto& object = objects [next];
+
+			chunker.Begin (object.id, object.size);
+			source.GetContentObjects (ArrayRef<SHA256Digest> (&object.hash, 1),
+				[&chunker] (const SHA256Digest&, const ArrayRef<>& contents,
+					const int64, const int64) -> void {
+				chunker.Append (contents);
+			}, options.limits);
+			chunker.End ();
+		} else {
+			std::vector<SHA256Digest> hashes;
+			for (auto i = next; i < batchEnd; ++i) {
+				hashes.push_back (objects [i].hash);
+			}
+
+			std::unordered_map<SHA256Digest, std::vector<byte>,
+				HashDigestHash, HashDigestEqual> contents;
+
+			source.GetContentObjects (hashes,
+				[&contents] (const SHA256Digest& hash, const ArrayRef<>& data,
+					const int64 offset, const int64 totalSize) -> void {
+				auto& buffer = contents [hash];
+				buffer.resize (static_cast<std::size_t> (totalSize));
+				::memcpy (buffer.data () + offset, data.GetData (),
+					static_cast<std::size_t> (data.GetSize ()));
+			}, options.limits);
+
+			for (auto i = next; i < batchEnd; ++i) {
+				const auto& object = objects [i];
+
+				chunker.Begin (object.id, object.size);
+
+				if (object.size > 0) {
+					const auto it = contents.find (object.hash);
+
+					if (it == contents.end ()) {
+						throw RuntimeException ("RepositoryBuilder",
+							str (boost::format ("Content object '%1%' could not be read")
+								% ToString (object.hash)),
+							KYLA_FILE_LINE);
+					}
+
+					chunker.Append (it->second);
+					contents.erase (it);
+				}
+
+				chunker.End ();
+			}
+		}
+
+		next = batchEnd;
+	}
+
+	writer.Flush ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Write one package for every source package of the repository attached as
+repack_source, or a single main package if there are none.
+*/
+void RepackPackages (Sql::Database& db, Repository& source,
+	const Path& targetPath, const RepackOptions& options)
+{
+	struct Package
+	{
+		int64 id;
+		std::string name;
+		std::string filename;
+	};
+
+	std::vector<Package> packages;
+
+	auto sourcePackagesQuery = db.Prepare (
+		"SELECT Id, Name, Filename FROM repack_source.source_packages ORDER BY Id");
+	while (sourcePackagesQuery.Step ()) {
+		packages.push_back (Package{ sourcePackagesQuery.GetInt64 (0),
+			sourcePackagesQuery.GetText (1),
+			sourcePackagesQuery.GetText (2) });
+	}
+
+	const bool hasSourcePackages = !packages.empty ();
+
+	if (!hasSourcePackages) {
+		packages.push_back (Package{ 1, "main", "main.kypkg" });
+	}
+
+	// Without source packages, all content objects go into the main package,
+	// and the package order is the order in which they were added
+	const char* storedObjects = hasSourcePackages
+		? "(SELECT ContentObjectId, MIN(PackageOffset) AS FirstOffset "
+		"FROM repack_source.storage_mapping WHERE SourcePackageId = ? "
+		"GROUP BY ContentObjectId)"
+		: "(SELECT Id AS ContentObjectId, Id AS FirstOffset "
+		"FROM content_objects)";
+
+	const char* orderBy = "stored.FirstOffset";
+	switch (options.order) {
+	case RepackOptions::Order::Package:
+		break;
+
+	case RepackOptions::Order::Fileset:
+		orderBy = "usage.FileSetId, usage.Path, stored.FirstOffset";
+		break;
+
+	case RepackOptions::Order::Path:
+		orderBy = "usage.Path, stored.FirstOffset";
+		break;
+	}
+
+	const auto objectsSql = str (boost::format (
+		"SELECT content_objects.Id, content_objects.Hash, content_objects.Size "
+		"FROM %1% AS stored "
+		"    INNER JOIN content_objects ON content_objects.Id = stored.ContentObjectId "
+		"    LEFT JOIN (SELECT ContentObjectId, MIN(FileSetId) AS FileSetId, MIN(Path) AS Path "
+		"        FROM files GROUP BY ContentObjectId) AS usage "
+		"    ON usage.ContentObjectId = content_objects.Id "
+		"ORDER BY %2%") % storedObjects % orderBy);
+
+	auto packageInsertQuery = db.Prepare (
+		"INSERT INTO source_packages (Id, Name, Filename, Uuid) VALUES (?, ?, ?, ?)");
+	auto compressionQuery = db.Prepare (
+		"SELECT Compression FROM repack_source.storage_mapping "
+		"WHERE SourcePackageId = ? AND SourceSize > 0 "
+		"GROUP BY Compression ORDER BY COUNT(*) DESC LIMIT 1");
+
+	for (const auto& package : packages) {
+		auto compression = CompressionAlgorithm::Brotli;
+
+		if (options.overrideCompression) {
+			compression = options.compression;
+		} else if (hasSourcePackages) {
+			compressionQuery.BindArguments (package.id);
+			if (compressionQuery.Step ()) {
+				compression = CompressionAlgorithmFromId (
+					compressionQuery.GetText (0));
+			}
+			compressionQuery.Reset ();
+		}
+
+		std::vector<ObjectToRepack> objects;
+
+		auto objectsQuery = db.Prepare (objectsSql.c_str ());
+		if (hasSourcePackages) {
+			objectsQuery.BindArguments (package.id);
+		}
+
+		while (objectsQuery.Step ()) {
+			ObjectToRepack object;
+			object.id = objectsQuery.GetInt64 (0);
+			objectsQuery.GetBlob (1, object.hash);
+			object.size = objectsQuery.GetInt64 (2);
+
+			objects.push_back (object);
+		}
+
+		auto packageInsert = db.BeginTransaction ();
+
+		packageInsertQuery.BindArguments (package.id, package.name,
+			package.filename, Uuid::CreateRandom ());
+		packageInsertQuery.Step ();
+		packageInsertQuery.Reset ();
+
+		auto packageFile = CreateFile (targetPath / package.filename);
+
+		PackageHeader packageHeader;
+		PackageHeader::Initialize (packageHeader);
+
+		packageFile->Write (ArrayRef<PackageHeader> (packageHeader));
+
+		PackageWriter writer (db, *packageFile, package.id, compression,
+			options.limits);
+		RepackObjects (source, objects, writer, options);
+
+		packageInsert.Commit ();
+	}
+}
 }
 
 namespace kyla {
 ///////////////////////////////////////////////////////////////////////////////
 void BuildRepository (const char* descriptorFile,
-	const char* sourceDirectory, const char* targetDirectory)
+	const char* sourceDirectory, const char* targetDirectory,
+	const char* baseRepository, const bool computeDeltas,
+	const ResourceLimits& limits)
 {
 	const auto inputFile = descriptorFile;
 
+	TraceSpan span ("action", "Build");
+
 	BuildContext ctx;
 	ctx.sourceDirectory = sourceDirectory;
 	ctx.targetDirectory = targetDirectory;
 
+	if (baseRepository) {
+		ctx.baseRepository = baseRepository;
+	} else if (computeDeltas) {
+		throw RuntimeException ("Deltas can only be computed against a base repository",
+			KYLA_FILE_LINE);
+	}
+
+	ctx.computeDeltas = computeDeltas;
+	ctx.limits = limits;
+
 	boost::filesystem::create_directories (ctx.targetDirectory);
 
 	pugi::xml_document doc;
@@ -630,13 +1882,20 @@ void BuildRepository (const char* descriptorFile,
 	auto sourcePackages = GetSourcePackages (doc, ctx);
 	AssignFileSetsToPackages (doc, ctx, sourcePackages);
 
-	for (auto& sourcePackage : sourcePackages) {
-		HashFiles (sourcePackage.second.fileSets, ctx);
+	// The access trace is relative to the repository description
+	std::unordered_map<std::string, std::size_t> accessTrace;
+	if (const auto accessTraceNode = doc.select_node ("//Package/AccessTrace")) {
+		accessTrace = LoadAccessTrace (Path{ inputFile }.parent_path ()
+			/ accessTraceNode.node ().text ().as_string ());
 	}
 
 	for (auto& sourcePackage : sourcePackages) {
+		TraceSpan packageSpan ("build", "Find content objects");
+		packageSpan.SetDetail (sourcePackage.second.name);
+
 		sourcePackage.second.contentObjects = FindContentObjects (
-			sourcePackage.second.fileSets, ctx);
+			sourcePackage.second.fileSets, sourcePackage.second.targets, ctx);
+		OrderContentObjects (sourcePackage.second, accessTrace);
 	}
 
 	const auto packageTypeNode = doc.select_node ("//Package/Type");
@@ -646,6 +1905,11 @@ void BuildRepository (const char* descriptorFile,
 	if (packageTypeNode) {
 		const auto packageType = packageTypeNode.node ().text ().as_string ();
 		if (strcmp (packageType, "Loose") == 0) {
+			if (baseRepository) {
+				throw RuntimeException ("Only packed repositories can be built on a base repository",
+					KYLA_FILE_LINE);
+			}
+
 			builder.reset (new LooseRepositoryBuilder);
 		} else if (strcmp (packageType, "Packed") == 0) {
 			builder.reset (new PackedRepositoryBuilder);
@@ -661,3 +1925,60 @@ void BuildRepository (const char* descriptorFile,
 	builder->Build (ctx, sourcePackages);
 }
 }
+
+namespace kyla {
+///////////////////////////////////////////////////////////////////////////////
+void RepackRepository (const char* sourceRepository,
+	const char* targetDirectory, const RepackOptions& options)
+{
+	if (options.chunkSize < 1 || options.chunkSize > ((1ll << 31) - 1)) {
+		throw RuntimeException ("RepositoryBuilder",
+			"Chunk size must be between 1 byte and 2 GiB",
+			KYLA_FILE_LINE);
+	}
+
+	auto source = OpenRepository (sourceRepository, false);
+
+	const Path targetPath = targetDirectory;
+	boost::filesystem::create_directories (targetPath);
+
+	auto dbFile = targetPath / "repository.db";
+	boost::filesystem::remove (dbFile);
+
+	auto db = Sql::Database::Create (
+		dbFile.string ().c_str ());
+
+	db.Execute (install_db_structure);
+	db.Execute ("PRAGMA journal_mode=WAL;");
+	db.Execute ("PRAGMA synchronous=NORMAL;");
+
+	db.AttachTemporaryCopy ("repack_source", source->GetDatabase ());
+
+	// The ids are kept, so the storage mappings can be joined against the
+	// source database. Files are inserted last, as their triggers update the
+	// reference counts of the content objects
+	auto metadataInsert = db.BeginTransaction ();
+	db.Execute ("INSERT INTO file_sets (Id, Uuid, Name) "
+		"SELECT Id, Uuid, Name FROM repack_source.file_sets");
+	db.Execute ("INSERT INTO content_objects (Id, Hash, Size) "
+		"SELECT Id, Hash, Size FROM repack_source.content_objects");
+	db.Execute ("INSERT INTO files (Path, ContentObjectId, FileSetId) "
+		"SELECT Path, ContentObjectId, FileSetId FROM repack_source.files");
+	db.Execute ("INSERT INTO properties (Name, Value) "
+		"SELECT Name, Value FROM repack_source.properties");
+	metadataInsert.Commit ();
+
+	RepackPackages (db, *source, targetPath, options);
+
+	db.Detach ("repack_source");
+
+	PopulateFileSetStatistics (db);
+
+	db.Execute ("PRAGMA journal_mode=DELETE;");
+	// Necessary to get good index statistics
+	db.Execute ("ANALYZE");
+	db.Execute ("VACUUM");
+
+	db.Close ();
+}
+}
@@ -0,0 +1,381 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "RepositoryInspector.h"
+
+#include "sql/Database.h"
+#include "Json.h"
+#include "Repository.h"
+
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <ostream>
+
+namespace kyla {
+namespace {
+///////////////////////////////////////////////////////////////////////////////
+/**
+Get the lower-case extension of a repository path, including the dot.
+*/
+std::string GetExtension (const char* path)
+{
+	if (path == nullptr) {
+		return "(unreferenced)";
+	}
+
+	const std::string p = path;
+	const auto nameStart = p.find_last_of ('/');
+	const auto dot = p.find_last_of ('.');
+
+	// Dot files like .gitignore have no extension
+	if (dot == std::string::npos || dot == 0
+		|| (nameStart != std::string::npos && dot <= nameStart + 1)) {
+		return "(none)";
+	}
+
+	auto result = p.substr (dot);
+	std::transform (result.begin (), result.end (), result.begin (),
+		[](const char c) -> char {
+		return static_cast<char> (std::tolower (static_cast<unsigned char> (c)));
+	});
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void AddToGroup (std::map<std::string, RepositoryInspection::ChunkGroup>& groups,
+	const std::string& name, const int64 sourceSize, const int64 storedSize)
+{
+	auto& group = groups [name];
+	group.name = name;
+	group.chunkCount += 1;
+	group.sourceSize += sourceSize;
+	group.storedSize += storedSize;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<RepositoryInspection::ChunkGroup> GetGroups (
+	const std::map<std::string, RepositoryInspection::ChunkGroup>& groups)
+{
+	std::vector<RepositoryInspection::ChunkGroup> result;
+
+	for (const auto& group : groups) {
+		result.push_back (group.second);
+	}
+
+	// Largest first, so the groups which matter most are on top
+	std::stable_sort (result.begin (), result.end (),
+		[](const RepositoryInspection::ChunkGroup& a,
+			const RepositoryInspection::ChunkGroup& b) -> bool {
+		return a.sourceSize > b.sourceSize;
+	});
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+double GetRatio (const int64 a, const int64 b)
+{
+	if (b == 0) {
+		return 0;
+	}
+
+	return static_cast<double> (a) / static_cast<double> (b);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void WriteGroups (std::ostream& output,
+	const std::vector<RepositoryInspection::ChunkGroup>& groups)
+{
+	output << "[\n";
+	for (std::size_t i = 0; i < groups.size (); ++i) {
+		const auto& group = groups [i];
+
+		output << "\t\t\t\t{\"name\": ";
+		WriteJsonString (output, group.name);
+		output
+			<< ", \"chunkCount\": " << group.chunkCount
+			<< ", \"sourceSize\": " << group.sourceSize
+			<< ", \"storedSize\": " << group.storedSize
+			<< ", \"compressionRatio\": " << GetRatio (group.storedSize, group.sourceSize)
+			<< "}" << ((i + 1 < groups.size ()) ? "," : "") << "\n";
+	}
+	output << "\t\t\t]";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void InspectChunks (Sql::Database& db, const int64 packageId,
+	RepositoryInspection::SourcePackage& package)
+{
+	auto chunksQuery = db.Prepare (
+		"SELECT storage_mapping.SourceSize, storage_mapping.PackageSize, "
+		"    storage_mapping.Compression, inspect_object_paths.Path, "
+		"    storage_hashes.StorageMappingId "
+		"FROM storage_mapping "
+		"LEFT JOIN inspect_object_paths "
+		"    ON inspect_object_paths.ContentObjectId = storage_mapping.ContentObjectId "
+		"LEFT JOIN storage_hashes "
+		"    ON storage_hashes.StorageMappingId = storage_mapping.Id "
+		"WHERE storage_mapping.SourcePackageId = ?");
+	chunksQuery.BindArguments (packageId);
+
+	std::map<int64, RepositoryInspection::ChunkSizeBucket> chunkSizes;
+	std::map<std::string, RepositoryInspection::ChunkGroup> compression;
+	std::map<std::string, RepositoryInspection::ChunkGroup> extensions;
+
+	while (chunksQuery.Step ()) {
+		const auto sourceSize = chunksQuery.GetInt64 (0);
+		const auto storedSize = chunksQuery.GetInt64 (1);
+
+		package.chunkCount += 1;
+		package.sourceSize += sourceSize;
+		package.storedSize += storedSize;
+
+		if (chunksQuery.GetColumnType (4) != Sql::Type::Null) {
+			package.hashedChunkCount += 1;
+		}
+
+		int64 upperBound = 4 << 10;
+		while (upperBound < sourceSize) {
+			upperBound *= 2;
+		}
+
+		auto& bucket = chunkSizes [upperBound];
+		bucket.upperBound = upperBound;
+		bucket.chunkCount += 1;
+		bucket.sourceSize += sourceSize;
+
+		const auto codec = (chunksQuery.GetColumnType (2) == Sql::Type::Null)
+			? std::string ("Uncompressed")
+			: std::string (chunksQuery.GetText (2));
+		AddToGroup (compression, codec, sourceSize, storedSize);
+
+		AddToGroup (extensions, GetExtension (chunksQuery.GetText (3)),
+			sourceSize, storedSize);
+	}
+
+	for (const auto& bucket : chunkSizes) {
+		package.chunkSizes.push_back (bucket.second);
+	}
+
+	package.compression = GetGroups (compression);
+	package.extensions = GetGroups (extensions);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void InspectDuplicates (Sql::Database& db, const int64 packageId,
+	RepositoryInspection::SourcePackage& package)
+{
+	{
+		auto uniqueQuery = db.Prepare (
+			"SELECT COUNT(*), TOTAL(Size) FROM content_objects "
+			"WHERE Id IN (SELECT ContentObjectId FROM storage_mapping "
+			"    WHERE SourcePackageId = ?)");
+		uniqueQuery.BindArguments (packageId);
+		uniqueQuery.Step ();
+
+		package.contentObjectCount = uniqueQuery.GetInt64 (0);
+		package.uniqueSize = uniqueQuery.GetInt64 (1);
+	}
+
+	{
+		auto referencedQuery = db.Prepare (
+			"SELECT TOTAL(content_objects.Size) FROM files "
+			"INNER JOIN content_objects ON content_objects.Id = files.ContentObjectId "
+			"WHERE files.ContentObjectId IN (SELECT ContentObjectId FROM storage_mapping "
+			"    WHERE SourcePackageId = ?)");
+		referencedQuery.BindArguments (packageId);
+		referencedQuery.Step ();
+
+		package.referencedSize = referencedQuery.GetInt64 (0);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void InspectDeltas (Sql::Database& db, const int64 packageId,
+	RepositoryInspection::SourcePackage& package)
+{
+	// Repositories built before deltas were added don't have the table
+	{
+		auto hasDeltasQuery = db.Prepare (
+			"SELECT COUNT(*) FROM sqlite_master "
+			"WHERE type = 'table' AND name = 'storage_deltas'");
+		hasDeltasQuery.Step ();
+
+		if (hasDeltasQuery.GetInt64 (0) == 0) {
+			return;
+		}
+	}
+
+	auto deltasQuery = db.Prepare (
+		"SELECT COUNT(*), TOTAL(PackageSize) FROM storage_deltas "
+		"WHERE SourcePackageId = ?");
+	deltasQuery.BindArguments (packageId);
+	deltasQuery.Step ();
+
+	package.deltaCount = deltasQuery.GetInt64 (0);
+	package.deltaStoredSize = deltasQuery.GetInt64 (1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void InspectLayout (Sql::Database& db, const int64 packageId,
+	RepositoryInspection::SourcePackage& package)
+{
+	auto filesetsQuery = db.Prepare (
+		"SELECT Id, Uuid, Name FROM file_sets ORDER BY Id");
+
+	auto chunksQuery = db.Prepare (
+		"SELECT PackageOffset, PackageSize FROM storage_mapping "
+		"WHERE SourcePackageId = ? AND ContentObjectId IN "
+		"    (SELECT ContentObjectId FROM files WHERE FileSetId = ?) "
+		"ORDER BY PackageOffset");
+
+	while (filesetsQuery.Step ()) {
+		RepositoryInspection::FilesetLayout layout;
+		filesetsQuery.GetBlob (1, layout.id);
+
+		if (filesetsQuery.GetColumnType (2) != Sql::Type::Null) {
+			layout.name = filesetsQuery.GetText (2);
+		}
+
+		chunksQuery.BindArguments (packageId, filesetsQuery.GetInt64 (0));
+
+		int64 previousEnd = -1;
+		while (chunksQuery.Step ()) {
+			const auto offset = chunksQuery.GetInt64 (0);
+			const auto size = chunksQuery.GetInt64 (1);
+
+			if (previousEnd >= 0 && offset != previousEnd) {
+				layout.seekCount += 1;
+				layout.seekDistance += offset - previousEnd;
+			}
+
+			layout.chunkCount += 1;
+			layout.readSize += size;
+			previousEnd = offset + size;
+		}
+
+		chunksQuery.Reset ();
+
+		if (layout.chunkCount > 0) {
+			package.filesets.push_back (layout);
+		}
+	}
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+RepositoryInspection InspectRepository (Repository& repository)
+{
+	auto& db = repository.GetDatabase ();
+
+	// Content objects don't know their files, so we pick one path for each
+	// to assign chunks to an extension. files isn't indexed by content
+	// object, hence the temporary table instead of a correlated subquery
+	auto objectPathsTable = db.CreateTemporaryTable ("inspect_object_paths",
+		"ContentObjectId INTEGER PRIMARY KEY NOT NULL, Path TEXT NOT NULL");
+	db.Execute (
+		"INSERT INTO inspect_object_paths (ContentObjectId, Path) "
+		"SELECT ContentObjectId, MIN(Path) FROM files GROUP BY ContentObjectId");
+
+	RepositoryInspection result;
+
+	auto packagesQuery = db.Prepare (
+		"SELECT Id, Name, Filename FROM source_packages ORDER BY Id");
+
+	while (packagesQuery.Step ()) {
+		const auto packageId = packagesQuery.GetInt64 (0);
+
+		RepositoryInspection::SourcePackage package;
+		package.name = packagesQuery.GetText (1);
+		package.filename = packagesQuery.GetText (2);
+
+		InspectChunks (db, packageId, package);
+		InspectDuplicates (db, packageId, package);
+		InspectDeltas (db, packageId, package);
+		InspectLayout (db, packageId, package);
+
+		result.sourcePackages.push_back (package);
+	}
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Ratios are derived here instead of being stored, so the totals remain exact.
+The compression ratio is the stored size divided by the source size, the
+duplicate ratio the fraction of the referenced size saved by storing every
+content object once.
+*/
+void RepositoryInspection::WriteJson (std::ostream& output) const
+{
+	output << "{\n\t\"sourcePackages\": [\n";
+
+	for (std::size_t i = 0; i < sourcePackages.size (); ++i) {
+		const auto& package = sourcePackages [i];
+
+		output << "\t\t{\n\t\t\t\"name\": ";
+		WriteJsonString (output, package.name);
+		output << ",\n\t\t\t\"filename\": ";
+		WriteJsonString (output, package.filename);
+		output
+			<< ",\n\t\t\t\"chunkCount\": " << package.chunkCount
+			<< ",\n\t\t\t\"sourceSize\": " << package.sourceSize
+			<< ",\n\t\t\t\"storedSize\": " << package.storedSize
+			<< ",\n\t\t\t\"compressionRatio\": " << GetRatio (package.storedSize, package.sourceSize)
+			<< ",\n\t\t\t\"storageHashCoverage\": " << GetRatio (package.hashedChunkCount, package.chunkCount)
+			<< ",\n\t\t\t\"contentObjectCount\": " << package.contentObjectCount
+			<< ",\n\t\t\t\"uniqueSize\": " << package.uniqueSize
+			<< ",\n\t\t\t\"referencedSize\": " << package.referencedSize
+			<< ",\n\t\t\t\"duplicateRatio\": "
+			<< (package.referencedSize > 0 ? 1 - GetRatio (package.uniqueSize, package.referencedSize) : 0)
+			<< ",\n\t\t\t\"deltaCount\": " << package.deltaCount
+			<< ",\n\t\t\t\"deltaStoredSize\": " << package.deltaStoredSize;
+
+		output << ",\n\t\t\t\"chunkSizes\": [\n";
+		for (std::size_t j = 0; j < package.chunkSizes.size (); ++j) {
+			const auto& bucket = package.chunkSizes [j];
+
+			output
+				<< "\t\t\t\t{\"upperBound\": " << bucket.upperBound
+				<< ", \"chunkCount\": " << bucket.chunkCount
+				<< ", \"sourceSize\": " << bucket.sourceSize
+				<< "}" << ((j + 1 < package.chunkSizes.size ()) ? "," : "") << "\n";
+		}
+		output << "\t\t\t]";
+
+		output << ",\n\t\t\t\"compression\": ";
+		WriteGroups (output, package.compression);
+		output << ",\n\t\t\t\"extensions\": ";
+		WriteGroups (output, package.extensions);
+
+		output << ",\n\t\t\t\"filesets\": [\n";
+		for (std::size_t j = 0; j < package.filesets.size (); ++j) {
+			const auto& layout = package.filesets [j];
+
+			output << "\t\t\t\t{\"id\": ";
+			WriteJsonString (output, ToString (layout.id));
+			output << ", \"name\": ";
+			WriteJsonString (output, layout.name);
+			output
+				<< ", \"chunkCount\": " << layout.chunkCount
+				<< ", \"readSize\": " << layout.readSize
+				<< ", \"seekCount\": " << layout.seekCount
+				<< ", \"seekDistance\": " << layout.seekDistance
+				<< ", \"meanSeekDistance\": " << GetRatio (layout.seekDistance, layout.seekCount)
+				<< "}" << ((j + 1 < package.filesets.size ()) ? "," : "") << "\n";
+		}
+		output << "\t\t\t]\n\t\t}" << ((i + 1 < sourcePackages.size ()) ? "," : "") << "\n";
+	}
+
+	output << "\t]\n}\n";
+}
+}
@@ -0,0 +1,191 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "Trace.h"
+
+#include "Json.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+
+namespace kyla {
+namespace {
+thread_local Tracer* currentTracer = nullptr;
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Trace events use microseconds, write nanoseconds as fractional microseconds.
+*/
+void WriteMicroseconds (std::ostream& output, const int64 nanoseconds)
+{
+	output << (nanoseconds / 1000) << '.'
+		<< std::setw (3) << std::setfill ('0') << (nanoseconds % 1000)
+		<< std::setfill (' ');
+}
+}
+
+/**
+@class Tracer
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+Tracer::Tracer ()
+	: origin_ (Clock::now ())
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void Tracer::AddSpan (const char* category, const char* name,
+	const int64 start, const int64 duration,
+	const char* countName, const int64 count,
+	const StringRef& detail)
+{
+	Span span;
+	span.category = category;
+	span.name = name;
+	span.countName = countName;
+	span.start = start;
+	span.duration = std::max<int64> (duration, 0);
+	span.count = count;
+
+	std::lock_guard<std::mutex> lock (mutex_);
+
+	span.detail = detail.IsEmpty ()
+		? nullptr : &*details_.insert (detail.ToString ()).first;
+
+	const auto thread = threads_.emplace (std::this_thread::get_id (),
+		static_cast<int> (threads_.size ()) + 1);
+	span.thread = thread.first->second;
+
+	spans_.push_back (std::move (span));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int64 Tracer::GetTime () const
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds> (
+		Clock::now () - origin_).count ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void Tracer::Reset ()
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+
+	origin_ = Clock::now ();
+	spans_.clear ();
+	details_.clear ();
+	threads_.clear ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void Tracer::WriteJson (std::ostream& output) const
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+
+	// Spans are recorded when they end, so nested spans come first
+	std::vector<const Span*> spans;
+	for (const auto& span : spans_) {
+		spans.push_back (&span);
+	}
+
+	std::stable_sort (spans.begin (), spans.end (),
+		[](const Span* a, const Span* b) -> bool {
+		return a->start < b->start;
+	});
+
+	output << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+	for (std::size_t i = 0; i < spans.size (); ++i) {
+		const auto& span = *spans [i];
+
+		output << "\t{\"ph\": \"X\", \"pid\": 1, \"tid\": " << span.thread
+			<< ", \"cat\": ";
+		WriteJsonString (output, span.category);
+		output << ", \"name\": ";
+		WriteJsonString (output, span.name);
+		output << ", \"ts\": ";
+		WriteMicroseconds (output, span.start);
+		output << ", \"dur\": ";
+		WriteMicroseconds (output, span.duration);
+		output << ", \"args\": {";
+		WriteJsonString (output, span.countName);
+		output << ": " << span.count;
+
+		if (span.detail) {
+			output << ", \"detail\": ";
+			WriteJsonString (output, *span.detail);
+		}
+
+		output << "}}";
+
+		if (i + 1 < spans.size ()) {
+			output << ",";
+		}
+
+		output << "\n";
+	}
+
+	output << "]}\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+Tracer* Tracer::GetCurrent ()
+{
+	return currentTracer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TracerScope::TracerScope (Tracer* tracer)
+	: tracer_ (tracer)
+{
+	if (tracer_) {
+		previous_ = currentTracer;
+		currentTracer = tracer_;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TracerScope::~TracerScope ()
+{
+	if (tracer_) {
+		currentTracer = previous_;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TraceSpan::TraceSpan (const char* category, const char* name, const int64 bytes)
+	: tracer_ (currentTracer)
+	, category_ (category)
+	, name_ (name)
+	, bytes_ (bytes)
+{
+	if (tracer_) {
+		start_ = tracer_->GetTime ();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+TraceSpan::~TraceSpan ()
+{
+	if (tracer_) {
+		tracer_->AddSpan (category_, name_, start_,
+			tracer_->GetTime () - start_, "bytes", bytes_, detail_);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void TraceSpan::SetDetail (const StringRef& detail)
+{
+	if (tracer_) {
+		detail_ = detail.ToString ();
+	}
+}
+}
@@ -24,6 +24,17 @@ details.
 #undef min
 #undef max
 #undef CreateFile
+#elif KYLA_PLATFORM_LINUX
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #endif
 
 namespace kyla {
@@ -104,22 +115,307 @@ struct WebRepository::Impl
 
 	HINTERNET internet_;
 #elif KYLA_PLATFORM_LINUX
+	/**
+	A minimal HTTP/1.1 client. Every read is a range request on a persistent
+	connection, so seeking doesn't require any network traffic. Only plain
+	http URLs are supported.
+	*/
 	struct File
 	{
+	public:
+		File (const File&) = delete;
+		File& operator= (const File&) = delete;
+
+		explicit File (const std::string& url)
+			: url_ (url)
+		{
+			static const std::string scheme = "http://";
+
+			if (url.compare (0, scheme.size (), scheme) != 0) {
+				throw RuntimeException (str (boost::format (
+					"Only http URLs are supported (got: '%1%')") % url),
+					KYLA_FILE_LINE);
+			}
+
+			const auto pathStart = url.find ('/', scheme.size ());
+			host_ = url.substr (scheme.size (), pathStart - scheme.size ());
+			path_ = (pathStart == std::string::npos) ? "/" : url.substr (pathStart);
+
+			const auto portStart = host_.find (':');
+			if (portStart != std::string::npos) {
+				port_ = host_.substr (portStart + 1);
+				hostName_ = host_.substr (0, portStart);
+			} else {
+				port_ = "80";
+				hostName_ = host_;
+			}
+		}
+
+		~File ()
+		{
+			Disconnect ();
+		}
+
 		int64 Read (const MutableArrayRef<>& buffer)
 		{
-			throw RuntimeException ("NOT IMPLEMENTED", KYLA_FILE_LINE);
+			if (buffer.GetSize () == 0) {
+				return 0;
+			}
+
+			// The server may close a kept-alive connection at any time, so
+			// we retry once using a new connection. Errors reported by the
+			// server would only be reported again
+			for (int attempt = 0;; ++attempt) {
+				try {
+					const auto bytesRead = ReadRange (buffer);
+					offset_ += bytesRead;
+					return bytesRead;
+				} catch (const ConnectionException&) {
+					Disconnect ();
+
+					if (attempt > 0) {
+						throw;
+					}
+				} catch (const RuntimeException&) {
+					Disconnect ();
+					throw;
+				}
+			}
 		}
 
 		void Seek (int64 offset)
 		{
-			throw RuntimeException ("NOT IMPLEMENTED", KYLA_FILE_LINE);
+			offset_ = offset;
 		}
+
+	private:
+		/**
+		Thrown if the connection fails before the response was received
+		completely.
+		*/
+		class ConnectionException : public RuntimeException
+		{
+		public:
+			ConnectionException (const std::string& msg, const char* file, const int line)
+				: RuntimeException (msg, file, line)
+			{
+			}
+		};
+
+		void Connect ()
+		{
+			addrinfo hints;
+			std::memset (&hints, 0, sizeof (hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+
+			addrinfo* addresses = nullptr;
+			if (::getaddrinfo (hostName_.c_str (), port_.c_str (), &hints, &addresses) != 0) {
+				throw ConnectionException (str (boost::format (
+					"Could not resolve '%1%'") % hostName_), KYLA_FILE_LINE);
+			}
+
+			for (auto address = addresses; address; address = address->ai_next) {
+				socket_ = ::socket (address->ai_family,
+					address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+
+				if (socket_ < 0) {
+					continue;
+				}
+
+				if (::connect (socket_, address->ai_addr, address->ai_addrlen) == 0) {
+					break;
+				}
+
+				::close (socket_);
+				socket_ = -1;
+			}
+
+			::freeaddrinfo (addresses);
+
+			if (socket_ < 0) {
+				throw ConnectionException (str (boost::format (
+					"Could not connect to '%1%'") % host_), KYLA_FILE_LINE);
+			}
+
+			const int noDelay = 1;
+			::setsockopt (socket_, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof (noDelay));
+		}
+
+		void Disconnect ()
+		{
+			if (socket_ >= 0) {
+				::close (socket_);
+				socket_ = -1;
+			}
+
+			received_.clear ();
+		}
+
+		void Send (const std::string& data)
+		{
+			std::size_t sent = 0;
+
+			while (sent < data.size ()) {
+				const auto result = ::send (socket_, data.data () + sent,
+					data.size () - sent, MSG_NOSIGNAL);
+
+				if (result < 0 && errno == EINTR) {
+					continue;
+				} else if (result <= 0) {
+					throw ConnectionException ("Could not send request", KYLA_FILE_LINE);
+				}
+
+				sent += result;
+			}
+		}
+
+		/**
+		Receive more data into received_.
+		*/
+		void Receive ()
+		{
+			char data [64 << 10];
+
+			for (;;) {
+				const auto result = ::recv (socket_, data, sizeof (data), 0);
+
+				if (result < 0 && errno == EINTR) {
+					continue;
+				} else if (result <= 0) {
+					throw ConnectionException ("Connection closed by server", KYLA_FILE_LINE);
+				}
+
+				received_.append (data, result);
+				return;
+			}
+		}
+
+		/**
+		Receive size bytes of the response body. If output is null, the data
+		is dropped.
+		*/
+		void ReceiveBody (byte* output, int64 size)
+		{
+			while (size > 0) {
+				if (received_.empty ()) {
+					Receive ();
+				}
+
+				const auto count = std::min<int64> (size, received_.size ());
+
+				if (output) {
+					std::memcpy (output, received_.data (), count);
+					output += count;
+				}
+
+				received_.erase (0, count);
+				size -= count;
+			}
+		}
+
+		int64 ReadRange (const MutableArrayRef<>& buffer)
+		{
+			if (socket_ < 0) {
+				Connect ();
+			}
+
+			Send (str (boost::format (
+				"GET %1% HTTP/1.1\r\n"
+				"Host: %2%\r\n"
+				"Range: bytes=%3%-%4%\r\n"
+				"User-Agent: kyla\r\n"
+				"\r\n") % path_ % host_ % offset_ % (offset_ + buffer.GetSize () - 1)));
+
+			std::size_t headerEnd;
+			while ((headerEnd = received_.find ("\r\n\r\n")) == std::string::npos) {
+				Receive ();
+			}
+
+			const auto header = received_.substr (0, headerEnd);
+			received_.erase (0, headerEnd + 4);
+
+			// "HTTP/1.1 206 ..."
+			const auto statusStart = header.find (' ');
+			if (statusStart == std::string::npos) {
+				throw RuntimeException ("Invalid HTTP response", KYLA_FILE_LINE);
+			}
+
+			const auto status = std::atoi (header.c_str () + statusStart + 1);
+
+			int64 contentLength = -1;
+			bool closeConnection = false;
+
+			auto lineEnd = header.find ("\r\n");
+			while (lineEnd != std::string::npos) {
+				const auto lineStart = lineEnd + 2;
+				lineEnd = header.find ("\r\n", lineStart);
+
+				auto line = header.substr (lineStart,
+					lineEnd == std::string::npos ? std::string::npos : lineEnd - lineStart);
+				std::transform (line.begin (), line.end (), line.begin (), ::tolower);
+
+				if (line.compare (0, 15, "content-length:") == 0) {
+					contentLength = std::atoll (line.c_str () + 15);
+				} else if (line.compare (0, 11, "connection:") == 0) {
+					closeConnection = line.find ("close") != std::string::npos;
+				} else if (line.compare (0, 18, "transfer-encoding:") == 0
+					&& line.find ("chunked") != std::string::npos) {
+					throw RuntimeException ("Chunked HTTP responses are not supported",
+						KYLA_FILE_LINE);
+				}
+			}
+
+			if (contentLength < 0) {
+				throw RuntimeException ("HTTP response without content length",
+					KYLA_FILE_LINE);
+			}
+
+			int64 bytesRead = 0;
+
+			if (status == 206) {
+				bytesRead = std::min<int64> (contentLength, buffer.GetSize ());
+				ReceiveBody (static_cast<byte*> (buffer.GetData ()), bytesRead);
+				ReceiveBody (nullptr, contentLength - bytesRead);
+			} else if (status == 200) {
+				// The server ignored the range and sent the whole file
+				const auto skip = std::min (offset_, contentLength);
+				bytesRead = std::min<int64> (contentLength - skip, buffer.GetSize ());
+				ReceiveBody (nullptr, skip);
+				ReceiveBody (static_cast<byte*> (buffer.GetData ()), bytesRead);
+				ReceiveBody (nullptr, contentLength - skip - bytesRead);
+			} else if (status == 416) {
+				// Reading past the end of the file
+				ReceiveBody (nullptr, contentLength);
+			} else {
+				ReceiveBody (nullptr, contentLength);
+
+				throw RuntimeException (str (boost::format (
+					"Request for '%1%' failed with HTTP status %2%") % url_ % status),
+					KYLA_FILE_LINE);
+			}
+
+			if (closeConnection) {
+				Disconnect ();
+			}
+
+			return bytesRead;
+		}
+
+		std::string url_;
+		std::string host_;
+		std::string hostName_;
+		std::string port_;
+		std::string path_;
+
+		int socket_ = -1;
+		int64 offset_ = 0;
+		std::string received_;
 	};
 
-	std::unique_ptr<File> Open (const std::string& file)
+	std::unique_ptr<File> Open (const std::string& url)
 	{
-		throw RuntimeException ("NOT IMPLEMENTED", KYLA_FILE_LINE);
+		return std::unique_ptr<File> (new File (url));
 	}
 #else
 #endif
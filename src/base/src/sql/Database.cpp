@@ -8,11 +8,16 @@ details.
 */
 
 #include "sql/Database.h"
+#include "sql/Profiler.h"
 
 #include <sqlite3.h>
 
 #include <boost/format.hpp>
 #include "Exception.h"
+#include "Trace.h"
+
+#include <list>
+#include <unordered_map>
 
 namespace {
 class SQLException : public kyla::RuntimeException
@@ -54,6 +59,8 @@ public:
 	{
 		db_ = other.db_;
 		other.db_ = nullptr;
+
+		return *this;
 	}
 
 	void Open (const char *name, const OpenMode mode)
@@ -70,22 +77,26 @@ public:
 		}
 
 		SAFE_SQLITE (sqlite3_open_v2(name, &db_, sqliteOpenMode, nullptr));
+		RegisterModules ();
 	}
 
 	void Create (const char* name)
 	{
 		SAFE_SQLITE(sqlite3_open_v2 (name, &db_,
 			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr));
+		RegisterModules ();
 	}
 
 	void Create ()
 	{
 		SAFE_SQLITE(sqlite3_open (":memory:", &db_));
+		RegisterModules ();
 	}
 
 	void Close ()
 	{
 		if (db_) {
+			ClearStatementCache ();
 			SAFE_SQLITE(sqlite3_close (db_));
 			db_ = nullptr;
 		}
@@ -94,6 +105,7 @@ public:
 	~Impl ()
 	{
 		if (db_) {
+			ClearStatementCache ();
 			sqlite3_close (db_);
 		}
 	}
@@ -131,6 +143,72 @@ public:
 		sqlite3_stmt* stmt;
 		SAFE_SQLITE(sqlite3_prepare_v2 (db_, sql, -1, &stmt, nullptr));
 		*result = static_cast<void*> (stmt);
+
+		if (profiler_) {
+			profiler_->OnPrepare (sql);
+		}
+	}
+
+	/**
+	Get a statement from the statement cache, or prepare and cache a new one.
+
+	Returns true if the statement is owned by the cache, in which case it must
+	be handed back using StatementRelease instead of being finalized. If the
+	cached statement for this SQL is currently in use, a new, uncached
+	statement is prepared instead.
+	*/
+	bool StatementAcquire (const char* sql, void** result)
+	{
+		auto it = statementCacheIndex_.find (sql);
+
+		if (it != statementCacheIndex_.end ()) {
+			if (it->second->inUse) {
+				StatementPrepare (sql, result);
+				return false;
+			}
+
+			// Move to the front, that's the most recently used entry
+			statementCache_.splice (statementCache_.begin (), statementCache_,
+				it->second);
+			it->second->inUse = true;
+			*result = it->second->statement;
+			return true;
+		}
+
+		StatementPrepare (sql, result);
+
+		statementCache_.push_front (CachedStatement{ sql, *result, true });
+		statementCacheIndex_ [statementCache_.front ().sql] = statementCache_.begin ();
+		statementCacheHandles_ [*result] = statementCache_.begin ();
+
+		EvictStatements ();
+
+		return true;
+	}
+
+	/**
+	Hand a cached statement back. It gets reset and all bindings are cleared,
+	so the next user gets a fresh statement.
+	*/
+	void StatementRelease (void* statement)
+	{
+		auto stmt = static_cast<sqlite3_stmt*> (statement);
+
+		EndTracedExecution (statement);
+
+		// The result of reset is the error of the last step, which has been
+		// reported already
+		sqlite3_reset (stmt);
+		sqlite3_clear_bindings (stmt);
+
+		auto it = statementCacheHandles_.find (statement);
+		if (it != statementCacheHandles_.end ()) {
+			it->second->inUse = false;
+		} else {
+			sqlite3_finalize (stmt);
+		}
+
+		EvictStatements ();
 	}
 
 	void StatementBind (void* statement, const int index,
@@ -162,13 +240,52 @@ public:
 			data, static_cast<int> (size), SQLiteValueBinding (binding)));
 	}
 
+	/**
+	Register an array for use with the kyla_array table-valued function and
+	bind its handle to the statement. If handle is non-zero, the existing
+	registration is updated instead.
+	*/
+	std::int64_t StatementBindArray (void* statement, const int index,
+		const ArrayBinding& binding, std::int64_t handle)
+	{
+		if (handle == 0) {
+			handle = nextArrayHandle_++;
+		}
+
+		arrayBindings_ [handle] = binding;
+
+		SAFE_SQLITE (sqlite3_bind_int64 (static_cast<sqlite3_stmt*>(statement),
+			index, handle));
+
+		return handle;
+	}
+
+	void ReleaseArray (const std::int64_t handle)
+	{
+		arrayBindings_.erase (handle);
+	}
+
 	bool StatementStep (void* statement)
 	{
+		if (profiler_) {
+			profiler_->OnStep (sqlite3_sql (static_cast<sqlite3_stmt*> (statement)));
+		}
+
+		const auto tracedExecution = BeginTracedExecution (statement);
+
 		auto r = sqlite3_step (static_cast<sqlite3_stmt*> (statement));
 
 		if (r == SQLITE_ROW) {
+			if (tracedExecution) {
+				++tracedExecution->rows;
+			}
+
 			return true;
-		} else if (r == SQLITE_DONE) {
+		}
+
+		EndTracedExecution (statement);
+
+		if (r == SQLITE_DONE) {
 			return false;
 		}
 
@@ -177,11 +294,14 @@ public:
 
 	void StatementReset (void* statement)
 	{
+		EndTracedExecution (statement);
 		SAFE_SQLITE (sqlite3_reset (static_cast<sqlite3_stmt*> (statement)));
 	}
 
 	void StatementFinalize (void* statement)
 	{
+		EndTracedExecution (statement);
+
 		///@TODO This should not throw because it's called from destructur
 		SAFE_SQLITE (sqlite3_finalize (static_cast<sqlite3_stmt*> (statement)));
 	}
@@ -270,6 +390,30 @@ public:
 		sqlite3_backup_finish (backup);
 	}
 
+	void Attach (Impl* other, const char* name)
+	{
+		const auto filename = sqlite3_db_filename (other->db_, "main");
+
+		if (filename == nullptr || *filename == '\0') {
+			AttachTemporaryCopy (other, name);
+			return;
+		}
+
+		std::string sql = "ATTACH DATABASE ? AS ";
+		sql += name;
+
+		sqlite3_stmt* statement = nullptr;
+		SAFE_SQLITE (sqlite3_prepare_v2 (db_, sql.c_str (), -1, &statement, nullptr));
+
+		sqlite3_bind_text (statement, 1, filename, -1, SQLITE_TRANSIENT);
+		const auto result = sqlite3_step (statement);
+		sqlite3_finalize (statement);
+
+		if (result != SQLITE_DONE) {
+			throw SQLException (db_, result, KYLA_FILE_LINE);
+		}
+	}
+
 	void Detach (const char* name)
 	{
 		std::string sql = "DETACH DATABASE ";
@@ -285,7 +429,302 @@ public:
 		return TemporaryTable (this, name);
 	}
 
+	void SetProfiler (Profiler* profiler)
+	{
+		profiler_ = profiler;
+
+		if (profiler_) {
+			sqlite3_trace_v2 (db_, SQLITE_TRACE_PROFILE, &Impl::TraceCallback, this);
+		} else {
+			sqlite3_trace_v2 (db_, 0, nullptr, nullptr);
+		}
+	}
+
+	Profiler* GetProfiler () const
+	{
+		return profiler_;
+	}
+
 private:
+	/**
+	The kyla_array module exposes an array registered with StatementBindArray
+	as a table-valued function. It is used as following:
+
+	SELECT Value FROM kyla_array(?)
+
+	where the parameter is bound using Statement::BindArray. The virtual table
+	reads directly from the caller's memory, so the array must stay alive
+	until the statement has finished.
+	*/
+	struct ArrayTable
+	{
+		sqlite3_vtab base;
+		Impl* impl;
+	};
+
+	struct ArrayCursor
+	{
+		sqlite3_vtab_cursor base;
+		ArrayBinding binding;
+		std::int64_t handle;
+		std::int64_t row;
+	};
+
+	enum ArrayColumn
+	{
+		ArrayColumn_Value,
+		ArrayColumn_Handle
+	};
+
+	static int ArrayConnect (sqlite3* db, void* aux, int, const char* const*,
+		sqlite3_vtab** result, char**)
+	{
+		const auto r = sqlite3_declare_vtab (db,
+			"CREATE TABLE x(Value, Handle HIDDEN)");
+
+		if (r != SQLITE_OK) {
+			return r;
+		}
+
+		auto table = new ArrayTable;
+		memset (&table->base, 0, sizeof (table->base));
+		table->impl = static_cast<Impl*> (aux);
+
+		*result = &table->base;
+		return SQLITE_OK;
+	}
+
+	static int ArrayDisconnect (sqlite3_vtab* table)
+	{
+		delete reinterpret_cast<ArrayTable*> (table);
+		return SQLITE_OK;
+	}
+
+	static int ArrayBestIndex (sqlite3_vtab*, sqlite3_index_info* info)
+	{
+		for (int i = 0; i < info->nConstraint; ++i) {
+			const auto& constraint = info->aConstraint [i];
+
+			if (constraint.usable
+				&& constraint.iColumn == ArrayColumn_Handle
+				&& constraint.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+				info->aConstraintUsage [i].argvIndex = 1;
+				info->aConstraintUsage [i].omit = 1;
+				info->idxNum = 1;
+				info->estimatedCost = 1;
+				return SQLITE_OK;
+			}
+		}
+
+		// Without a handle the table is empty, make sure the planner avoids
+		// this
+		info->idxNum = 0;
+		info->estimatedCost = 2147483647;
+		return SQLITE_OK;
+	}
+
+	static int ArrayOpen (sqlite3_vtab*, sqlite3_vtab_cursor** result)
+	{
+		auto cursor = new ArrayCursor;
+		memset (&cursor->base, 0, sizeof (cursor->base));
+		cursor->binding = ArrayBinding{};
+		cursor->handle = 0;
+		cursor->row = 0;
+
+		*result = &cursor->base;
+		return SQLITE_OK;
+	}
+
+	static int ArrayClose (sqlite3_vtab_cursor* cursor)
+	{
+		delete reinterpret_cast<ArrayCursor*> (cursor);
+		return SQLITE_OK;
+	}
+
+	static int ArrayFilter (sqlite3_vtab_cursor* pCursor, int idxNum, const char*,
+		int argc, sqlite3_value** argv)
+	{
+		auto cursor = reinterpret_cast<ArrayCursor*> (pCursor);
+		auto impl = reinterpret_cast<ArrayTable*> (pCursor->pVtab)->impl;
+
+		cursor->binding = ArrayBinding{};
+		cursor->handle = 0;
+		cursor->row = 0;
+
+		if (idxNum == 1 && argc == 1) {
+			cursor->handle = sqlite3_value_int64 (argv [0]);
+
+			auto it = impl->arrayBindings_.find (cursor->handle);
+			if (it != impl->arrayBindings_.end ()) {
+				cursor->binding = it->second;
+			}
+		}
+
+		return SQLITE_OK;
+	}
+
+	static int ArrayNext (sqlite3_vtab_cursor* cursor)
+	{
+		++reinterpret_cast<ArrayCursor*> (cursor)->row;
+		return SQLITE_OK;
+	}
+
+	static int ArrayEof (sqlite3_vtab_cursor* pCursor)
+	{
+		auto cursor = reinterpret_cast<ArrayCursor*> (pCursor);
+		return cursor->row >= cursor->binding.count;
+	}
+
+	static int ArrayColumn (sqlite3_vtab_cursor* pCursor, sqlite3_context* ctx,
+		int column)
+	{
+		auto cursor = reinterpret_cast<ArrayCursor*> (pCursor);
+		const auto& binding = cursor->binding;
+
+		switch (column) {
+		case ArrayColumn_Value:
+			if (binding.type == ArrayBinding::Type::Int64) {
+				sqlite3_result_int64 (ctx,
+					static_cast<const std::int64_t*> (binding.data) [cursor->row]);
+			} else {
+				sqlite3_result_blob (ctx,
+					static_cast<const char*> (binding.data) + cursor->row * binding.elementSize,
+					static_cast<int> (binding.elementSize), SQLITE_STATIC);
+			}
+			break;
+
+		case ArrayColumn_Handle:
+			sqlite3_result_int64 (ctx, cursor->handle);
+			break;
+		}
+
+		return SQLITE_OK;
+	}
+
+	static int ArrayRowid (sqlite3_vtab_cursor* cursor, sqlite3_int64* rowid)
+	{
+		*rowid = reinterpret_cast<ArrayCursor*> (cursor)->row;
+		return SQLITE_OK;
+	}
+
+	void RegisterModules ()
+	{
+		// No xCreate makes this an eponymous-only virtual table, which can be
+		// used as a table-valued function without a CREATE VIRTUAL TABLE
+		// All other callbacks are optional, and newer SQLite versions keep
+		// adding fields, so only the used ones are set
+		static sqlite3_module arrayModule = []() -> sqlite3_module {
+			sqlite3_module module = {};
+			module.xConnect = ArrayConnect;
+			module.xBestIndex = ArrayBestIndex;
+			module.xDisconnect = ArrayDisconnect;
+			module.xOpen = ArrayOpen;
+			module.xClose = ArrayClose;
+			module.xFilter = ArrayFilter;
+			module.xNext = ArrayNext;
+			module.xEof = ArrayEof;
+			module.xColumn = ArrayColumn;
+			module.xRowid = ArrayRowid;
+			return module;
+		} ();
+
+		SAFE_SQLITE (sqlite3_create_module (db_, "kyla_array", &arrayModule, this));
+	}
+
+	struct CachedStatement
+	{
+		std::string sql;
+		void* statement;
+		bool inUse;
+	};
+
+	struct TracedExecution
+	{
+		Tracer* tracer;
+		int64 start;
+		int64 rows;
+	};
+
+	/**
+	Executions of a statement are traced as one span, from the first step
+	until the statement is done or reset, with the number of rows. Timing is
+	done here instead of using sqlite3_trace_v2, which reports durations with
+	millisecond resolution only.
+
+	Returns null if no tracer is current.
+	*/
+	TracedExecution* BeginTracedExecution (void* statement)
+	{
+		if (!tracedExecutions_.empty ()) {
+			const auto it = tracedExecutions_.find (statement);
+
+			if (it != tracedExecutions_.end ()) {
+				return &it->second;
+			}
+		}
+
+		const auto tracer = Tracer::GetCurrent ();
+
+		if (!tracer) {
+			return nullptr;
+		}
+
+		return &tracedExecutions_.emplace (statement,
+			TracedExecution{ tracer, tracer->GetTime (), 0 }).first->second;
+	}
+
+	void EndTracedExecution (void* statement)
+	{
+		if (tracedExecutions_.empty ()) {
+			return;
+		}
+
+		const auto it = tracedExecutions_.find (statement);
+
+		if (it == tracedExecutions_.end ()) {
+			return;
+		}
+
+		const auto& execution = it->second;
+		execution.tracer->AddSpan ("sql", "Execute", execution.start,
+			execution.tracer->GetTime () - execution.start,
+			"rows", execution.rows,
+			sqlite3_sql (static_cast<sqlite3_stmt*> (statement)));
+
+		tracedExecutions_.erase (it);
+	}
+
+	void EvictStatements ()
+	{
+		// Walk from the least recently used end and drop everything which is
+		// not handed out while we're above the limit
+		auto it = statementCache_.end ();
+		while (statementCache_.size () > StatementCacheSize
+			&& it != statementCache_.begin ()) {
+			--it;
+
+			if (it->inUse) {
+				continue;
+			}
+
+			sqlite3_finalize (static_cast<sqlite3_stmt*> (it->statement));
+			statementCacheIndex_.erase (it->sql);
+			statementCacheHandles_.erase (it->statement);
+			it = statementCache_.erase (it);
+		}
+	}
+
+	void ClearStatementCache ()
+	{
+		for (auto& entry : statementCache_) {
+			sqlite3_finalize (static_cast<sqlite3_stmt*> (entry.statement));
+		}
+
+		statementCacheIndex_.clear ();
+		statementCacheHandles_.clear ();
+		statementCache_.clear ();
+	}
+
 	// Returns a function pointer to a void (void*) function
 	static void(*SQLiteValueBinding(const ValueBinding binding))(void*)
 	{
@@ -299,7 +738,48 @@ private:
 		return nullptr;
 	}
 
+	/**
+	Called by SQLite whenever a statement finishes, that is, it has been
+	stepped to completion or reset. The statement counters are reset so the
+	next execution starts from zero again.
+	*/
+	static int TraceCallback (unsigned int type, void* context, void* p, void* x)
+	{
+		if (type != SQLITE_TRACE_PROFILE) {
+			return 0;
+		}
+
+		auto impl = static_cast<Impl*> (context);
+		auto statement = static_cast<sqlite3_stmt*> (p);
+
+		if (impl->profiler_) {
+			const auto sql = sqlite3_sql (statement);
+
+			impl->profiler_->OnExecuted (sql ? sql : "",
+				*static_cast<sqlite3_int64*> (x),
+				sqlite3_stmt_status (statement, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1),
+				sqlite3_stmt_status (statement, SQLITE_STMTSTATUS_AUTOINDEX, 1),
+				sqlite3_stmt_status (statement, SQLITE_STMTSTATUS_VM_STEP, 1));
+		}
+
+		return 0;
+	}
+
 	sqlite3* db_ = nullptr;
+	Profiler* profiler_ = nullptr;
+
+	static const std::size_t StatementCacheSize = 64;
+
+	std::unordered_map<std::int64_t, ArrayBinding> arrayBindings_;
+	std::int64_t nextArrayHandle_ = 1;
+
+	// Most recently used statements are at the front
+	std::list<CachedStatement> statementCache_;
+	std::unordered_map<std::string, std::list<CachedStatement>::iterator> statementCacheIndex_;
+	std::unordered_map<void*, std::list<CachedStatement>::iterator> statementCacheHandles_;
+
+	// Statements which are being executed while a tracer is current
+	std::unordered_map<void*, TracedExecution> tracedExecutions_;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -439,21 +919,21 @@ void Transaction::Rollback ()
 Statement::Statement (Database::Impl* impl, const char* statement)
 : impl_ (impl)
 {
-	impl_->StatementPrepare (statement, &p_);
+	cached_ = impl_->StatementAcquire (statement, &p_);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 Statement::~Statement ()
 {
-	if (p_) {
-		impl_->StatementFinalize (p_);
-	}
+	Release ();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 Statement::Statement (Statement&& other)
 	: impl_ (other.impl_)
 	, p_ (other.p_)
+	, cached_ (other.cached_)
+	, arrayHandles_ (std::move (other.arrayHandles_))
 {
 	other.p_ = nullptr;
 }
@@ -461,14 +941,37 @@ Statement::Statement (Statement&& other)
 ////////////////////////////////////////////////////////////////////////////////
 Statement& Statement::operator=(Statement&& other)
 {
+	Release ();
+
 	impl_ = other.impl_;
 	p_ = other.p_;
+	cached_ = other.cached_;
+	arrayHandles_ = std::move (other.arrayHandles_);
 
 	other.p_ = nullptr;
 
 	return *this;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void Statement::Release ()
+{
+	for (const auto& indexHandle : arrayHandles_) {
+		impl_->ReleaseArray (indexHandle.second);
+	}
+	arrayHandles_.clear ();
+
+	if (p_) {
+		if (cached_) {
+			impl_->StatementRelease (p_);
+		} else {
+			impl_->StatementFinalize (p_);
+		}
+
+		p_ = nullptr;
+	}
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 bool Statement::Step ()
 {
@@ -514,6 +1017,47 @@ void Statement::Bind (const int index,
 		data.GetSize (), data.GetData (), binding);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void Statement::BindArray (const int index, const ArrayRef<std::int64_t>& values)
+{
+	ArrayBinding binding;
+	binding.data = values.GetData ();
+	binding.count = values.GetCount ();
+	binding.elementSize = sizeof (std::int64_t);
+	binding.type = ArrayBinding::Type::Int64;
+
+	BindArray (index, binding);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void Statement::BindArray (const int index, const void* data,
+	const std::int64_t count, const std::int64_t elementSize)
+{
+	ArrayBinding binding;
+	binding.data = data;
+	binding.count = count;
+	binding.elementSize = elementSize;
+	binding.type = ArrayBinding::Type::Blob;
+
+	BindArray (index, binding);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void Statement::BindArray (const int index, const ArrayBinding& binding)
+{
+	// Rebinding the same index reuses the handle, so binding in a loop
+	// doesn't accumulate registrations
+	for (auto& indexHandle : arrayHandles_) {
+		if (indexHandle.first == index) {
+			impl_->StatementBindArray (p_, index, binding, indexHandle.second);
+			return;
+		}
+	}
+
+	const auto handle = impl_->StatementBindArray (p_, index, binding, 0);
+	arrayHandles_.push_back (std::make_pair (index, handle));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 std::int64_t Statement::GetInt64 (const int index) const
 {
@@ -614,6 +1158,24 @@ TemporaryTable Database::CreateTemporaryTable (const char* name,
 	return impl_->CreateTemporaryTable (name, columnDefinition);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+void Database::SetProfiler (Profiler* profiler)
+{
+	impl_->SetProfiler (profiler);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+Profiler* Database::GetProfiler () const
+{
+	return impl_->GetProfiler ();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void Database::Attach (const char* name, Database& other)
+{
+	impl_->Attach (other.impl_.get (), name);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 void Database::Detach (const char * name)
 {
@@ -0,0 +1,160 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "sql/Profiler.h"
+
+#include "sql/Database.h"
+#include "Json.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <ostream>
+
+namespace kyla {
+namespace Sql {
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::OnPrepare (const char* sql)
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+	++statements_ [sql].prepareCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::OnStep (const char* sql)
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+	++statements_ [sql].stepCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::OnExecuted (const char* sql, const std::int64_t time,
+	const std::int64_t fullScanSteps, const std::int64_t autoIndexSteps,
+	const std::int64_t virtualMachineSteps)
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+	auto& statement = statements_ [sql];
+
+	++statement.executionCount;
+	statement.totalTime += time;
+	statement.fullScanSteps += fullScanSteps;
+	statement.autoIndexSteps += autoIndexSteps;
+	statement.virtualMachineSteps += virtualMachineSteps;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::vector<StatementProfile> Profiler::GetProfile () const
+{
+	std::vector<StatementProfile> result;
+
+	{
+		std::lock_guard<std::mutex> lock (mutex_);
+		result.reserve (statements_.size ());
+
+		for (const auto& kv : statements_) {
+			result.push_back (kv.second);
+			result.back ().sql = kv.first;
+		}
+	}
+
+	std::sort (result.begin (), result.end (),
+		[](const StatementProfile& a, const StatementProfile& b) -> bool {
+		return a.totalTime > b.totalTime;
+	});
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::Reset ()
+{
+	std::lock_guard<std::mutex> lock (mutex_);
+	statements_.clear ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::Report (Log& log, const std::size_t maxStatements) const
+{
+	const auto profile = GetProfile ();
+
+	std::int64_t totalTime = 0;
+	for (const auto& statement : profile) {
+		totalTime += statement.totalTime;
+	}
+
+	log.Info ("SQL profile", boost::format ("%1% statements, %2$.3f ms total")
+		% profile.size () % (totalTime / 1000000.0));
+
+	const auto count = std::min (maxStatements, profile.size ());
+	for (std::size_t i = 0; i < count; ++i) {
+		const auto& statement = profile [i];
+
+		log.Info ("SQL profile", boost::format (
+			"%1$.3f ms, %2% executions, %3% steps, %4% prepares, "
+			"%5% full scan steps%6%: %7%")
+			% (statement.totalTime / 1000000.0)
+			% statement.executionCount
+			% statement.stepCount
+			% statement.prepareCount
+			% statement.fullScanSteps
+			% (statement.autoIndexSteps > 0 ? ", automatic index" : "")
+			% statement.sql);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void Profiler::WriteJson (std::ostream& output) const
+{
+	const auto profile = GetProfile ();
+
+	output << "[\n";
+	for (std::size_t i = 0; i < profile.size (); ++i) {
+		const auto& statement = profile [i];
+
+		output << "\t{\"sql\": ";
+		WriteJsonString (output, statement.sql);
+		output
+			<< ", \"prepareCount\": " << statement.prepareCount
+			<< ", \"executionCount\": " << statement.executionCount
+			<< ", \"stepCount\": " << statement.stepCount
+			<< ", \"totalTimeNs\": " << statement.totalTime
+			<< ", \"fullScanSteps\": " << statement.fullScanSteps
+			<< ", \"autoIndexSteps\": " << statement.autoIndexSteps
+			<< ", \"autoIndex\": " << (statement.autoIndexSteps > 0 ? "true" : "false")
+			<< ", \"virtualMachineSteps\": " << statement.virtualMachineSteps
+			<< "}";
+
+		if (i + 1 < profile.size ()) {
+			output << ",";
+		}
+
+		output << "\n";
+	}
+	output << "]\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+ProfilerScope::ProfilerScope (Profiler* profiler, Database& database)
+	: profiler_ (profiler)
+	, database_ (database)
+{
+	if (profiler_) {
+		previous_ = database_.GetProfiler ();
+		database_.SetProfiler (profiler_);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+ProfilerScope::~ProfilerScope ()
+{
+	if (profiler_) {
+		database_.SetProfiler (previous_);
+	}
+}
+}
+}
@@ -0,0 +1,937 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include "HttpServer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if KYLA_PLATFORM_LINUX
+	#include <arpa/inet.h>
+	#include <cerrno>
+	#include <fcntl.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <poll.h>
+	#include <sys/sendfile.h>
+	#include <sys/socket.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#if KYLA_PLATFORM_LINUX
+namespace {
+// Requests with larger headers are rejected
+const std::size_t MaximumHeaderSize = 16 << 10;
+// Requests with more ranges are answered with the whole file
+const std::size_t MaximumRangeCount = 64;
+// How often blocked threads check whether the server is stopping
+const int PollIntervalMs = 200;
+// Idle connections are closed after this time
+const int KeepAliveTimeoutMs = 15000;
+
+const char* MultipartBoundary = "KYLA_BYTERANGES";
+
+std::mutex logMutex;
+
+struct ByteRange
+{
+	// Both inclusive
+	std::int64_t first;
+	std::int64_t last;
+
+	std::int64_t GetSize () const
+	{
+		return last - first + 1;
+	}
+};
+
+struct Request
+{
+	std::string method;
+	std::string target;
+	int minorVersion = 0;
+
+	std::string connection;
+	std::string range;
+	bool hasRange = false;
+	bool hasBody = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+std::string ToLower (std::string s)
+{
+	std::transform (s.begin (), s.end (), s.begin (), [](const char c) -> char {
+		return static_cast<char> (std::tolower (static_cast<unsigned char> (c)));
+	});
+
+	return s;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string Trim (const std::string& s)
+{
+	const auto first = s.find_first_not_of (" \t");
+
+	if (first == std::string::npos) {
+		return std::string ();
+	}
+
+	return s.substr (first, s.find_last_not_of (" \t") - first + 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const char* GetReasonPhrase (const int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 206: return "Partial Content";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 416: return "Range Not Satisfiable";
+	case 431: return "Request Header Fields Too Large";
+	default:
+		return "Internal Server Error";
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool ParseNumber (const std::string& s, std::int64_t& value)
+{
+	// 18 digits always fit into an int64
+	if (s.empty () || s.size () > 18) {
+		return false;
+	}
+
+	value = 0;
+	for (const auto c : s) {
+		if (c < '0' || c > '9') {
+			return false;
+		}
+
+		value = value * 10 + (c - '0');
+	}
+
+	return true;
+}
+
+enum class RangeParseResult
+{
+	// The header can't be parsed, and must be ignored
+	Invalid,
+	Satisfiable,
+	Unsatisfiable
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Parse a Range header as described in RFC 7233. Ranges which start past the
+end of the file are dropped, ranges which end past it are clipped.
+*/
+RangeParseResult ParseRanges (const std::string& header,
+	const std::int64_t size, std::vector<ByteRange>& ranges)
+{
+	const std::string unit = "bytes=";
+
+	if (ToLower (header.substr (0, unit.size ())) != unit) {
+		return RangeParseResult::Invalid;
+	}
+
+	std::size_t specCount = 0;
+	std::size_t start = unit.size ();
+
+	while (start <= header.size ()) {
+		auto end = header.find (',', start);
+		if (end == std::string::npos) {
+			end = header.size ();
+		}
+
+		const auto spec = Trim (header.substr (start, end - start));
+		start = end + 1;
+
+		// Empty list elements are allowed
+		if (spec.empty ()) {
+			continue;
+		}
+
+		if (++specCount > MaximumRangeCount) {
+			return RangeParseResult::Invalid;
+		}
+
+		const auto dash = spec.find ('-');
+		if (dash == std::string::npos) {
+			return RangeParseResult::Invalid;
+		}
+
+		const auto firstPart = spec.substr (0, dash);
+		const auto lastPart = spec.substr (dash + 1);
+
+		ByteRange range;
+
+		if (firstPart.empty ()) {
+			// Suffix range, the last n bytes
+			std::int64_t suffixLength = 0;
+			if (!ParseNumber (lastPart, suffixLength)) {
+				return RangeParseResult::Invalid;
+			}
+
+			if (suffixLength == 0 || size == 0) {
+				continue;
+			}
+
+			range.first = std::max<std::int64_t> (0, size - suffixLength);
+			range.last = size - 1;
+		} else {
+			if (!ParseNumber (firstPart, range.first)) {
+				return RangeParseResult::Invalid;
+			}
+
+			if (lastPart.empty ()) {
+				range.last = size - 1;
+			} else if (!ParseNumber (lastPart, range.last)
+				|| range.last < range.first) {
+				return RangeParseResult::Invalid;
+			}
+
+			if (range.first >= size) {
+				continue;
+			}
+
+			range.last = std::min (range.last, size - 1);
+		}
+
+		ranges.push_back (range);
+	}
+
+	if (specCount == 0) {
+		return RangeParseResult::Invalid;
+	}
+
+	return ranges.empty ()
+		? RangeParseResult::Unsatisfiable
+		: RangeParseResult::Satisfiable;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Map a request target to a path below root. Returns false if the target is
+malformed or tries to leave the root.
+*/
+bool GetLocalPath (const std::string& root, const std::string& target,
+	std::string& path)
+{
+	if (target.empty () || target [0] != '/') {
+		return false;
+	}
+
+	const auto query = target.find_first_of ("?#");
+	const auto encodedPath = target.substr (0, query);
+
+	std::string decodedPath;
+	for (std::size_t i = 0; i < encodedPath.size (); ++i) {
+		if (encodedPath [i] == '%') {
+			if (i + 2 >= encodedPath.size ()
+				|| !std::isxdigit (static_cast<unsigned char> (encodedPath [i + 1]))
+				|| !std::isxdigit (static_cast<unsigned char> (encodedPath [i + 2]))) {
+				return false;
+			}
+
+			decodedPath += static_cast<char> (
+				std::stoi (encodedPath.substr (i + 1, 2), nullptr, 16));
+			i += 2;
+		} else {
+			decodedPath += encodedPath [i];
+		}
+	}
+
+	path = root;
+
+	std::size_t start = 1;
+	while (start <= decodedPath.size ()) {
+		auto end = decodedPath.find ('/', start);
+		if (end == std::string::npos) {
+			end = decodedPath.size ();
+		}
+
+		const auto segment = decodedPath.substr (start, end - start);
+		start = end + 1;
+
+		if (segment.empty () || segment == ".") {
+			continue;
+		}
+
+		if (segment == ".."
+			|| segment.find ('\0') != std::string::npos
+			|| segment.find ('\\') != std::string::npos) {
+			return false;
+		}
+
+		path += "/" + segment;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Limits the bandwidth of a response. Every send is split into slices, and
+after each slice, we sleep until the average rate since the start of the
+response is back at the limit.
+*/
+class Throttle
+{
+public:
+	explicit Throttle (const std::int64_t bytesPerSecond)
+		: bytesPerSecond_ (bytesPerSecond)
+	{
+	}
+
+	void Start ()
+	{
+		start_ = Clock::now ();
+		bytesSent_ = 0;
+	}
+
+	void Consume (const std::int64_t bytes)
+	{
+		if (bytesPerSecond_ <= 0) {
+			return;
+		}
+
+		bytesSent_ += bytes;
+
+		std::this_thread::sleep_until (start_ + std::chrono::duration_cast<Clock::duration> (
+			std::chrono::duration<double> (
+				static_cast<double> (bytesSent_) / bytesPerSecond_)));
+	}
+
+	/**
+	The largest amount of data to send at once. Without a limit, there's no
+	reason to split.
+	*/
+	std::int64_t GetSliceSize () const
+	{
+		if (bytesPerSecond_ <= 0) {
+			return std::int64_t (1) << 30;
+		}
+
+		// Roughly 20 slices per second, so the rate is smooth
+		return std::max<std::int64_t> (1 << 10,
+			std::min<std::int64_t> (1 << 20, bytesPerSecond_ / 20));
+	}
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	std::int64_t bytesPerSecond_;
+	std::int64_t bytesSent_ = 0;
+	Clock::time_point start_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+A file descriptor which is closed when it goes out of scope.
+*/
+class FileDescriptor
+{
+public:
+	explicit FileDescriptor (const int fd)
+		: fd_ (fd)
+	{
+	}
+
+	~FileDescriptor ()
+	{
+		if (fd_ >= 0) {
+			::close (fd_);
+		}
+	}
+
+	FileDescriptor (const FileDescriptor&) = delete;
+	FileDescriptor& operator= (const FileDescriptor&) = delete;
+
+	int Get () const
+	{
+		return fd_;
+	}
+
+private:
+	int fd_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+class Connection
+{
+public:
+	Connection (const int socket, const HttpServerOptions& options,
+		const std::atomic<bool>& stopping)
+		: socket_ (socket)
+		, options_ (options)
+		, stopping_ (stopping)
+		, throttle_ (options.bandwidth)
+	{
+	}
+
+	void Run ()
+	{
+		const int noDelay = 1;
+		::setsockopt (socket_, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof (noDelay));
+
+		// Clients which stop reading must not block a worker forever
+		timeval timeout;
+		timeout.tv_sec = KeepAliveTimeoutMs / 1000;
+		timeout.tv_usec = 0;
+		::setsockopt (socket_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+		for (;;) {
+			Request request;
+			if (!ReadRequest (request)) {
+				return;
+			}
+
+			if (!HandleRequest (request)) {
+				return;
+			}
+		}
+	}
+
+private:
+	/**
+	Wait until the socket is readable. Returns false if the connection has
+	been idle for too long, or if the server is stopping.
+	*/
+	bool WaitReadable ()
+	{
+		for (int waited = 0; waited < KeepAliveTimeoutMs; waited += PollIntervalMs) {
+			if (stopping_) {
+				return false;
+			}
+
+			pollfd pfd;
+			pfd.fd = socket_;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+
+			const auto result = ::poll (&pfd, 1, PollIntervalMs);
+
+			if (result > 0) {
+				return true;
+			} else if (result < 0 && errno != EINTR) {
+				return false;
+			}
+		}
+
+		return false;
+	}
+
+	bool ReadRequest (Request& request)
+	{
+		std::size_t headerEnd;
+
+		while ((headerEnd = buffer_.find ("\r\n\r\n")) == std::string::npos) {
+			if (buffer_.size () > MaximumHeaderSize) {
+				SendResponse (431, false, std::string ());
+				return false;
+			}
+
+			if (!WaitReadable ()) {
+				return false;
+			}
+
+			char data [4096];
+			const auto received = ::recv (socket_, data, sizeof (data), 0);
+
+			if (received <= 0) {
+				if (received < 0 && errno == EINTR) {
+					continue;
+				}
+
+				return false;
+			}
+
+			buffer_.append (data, received);
+		}
+
+		const auto header = buffer_.substr (0, headerEnd);
+		// Pipelined requests stay in the buffer
+		buffer_.erase (0, headerEnd + 4);
+
+		auto lineEnd = header.find ("\r\n");
+		const auto requestLine = header.substr (0, lineEnd);
+
+		const auto methodEnd = requestLine.find (' ');
+		const auto targetEnd = requestLine.rfind (' ');
+
+		if (methodEnd == std::string::npos || targetEnd == methodEnd
+			|| requestLine.compare (targetEnd + 1, 7, "HTTP/1.") != 0
+			|| requestLine.size () != targetEnd + 9) {
+			SendResponse (400, false, std::string ());
+			return false;
+		}
+
+		request.method = requestLine.substr (0, methodEnd);
+		request.target = requestLine.substr (methodEnd + 1, targetEnd - methodEnd - 1);
+		request.minorVersion = requestLine [targetEnd + 8] - '0';
+
+		while (lineEnd != std::string::npos) {
+			const auto lineStart = lineEnd + 2;
+			lineEnd = header.find ("\r\n", lineStart);
+
+			const auto line = header.substr (lineStart,
+				lineEnd == std::string::npos ? std::string::npos : lineEnd - lineStart);
+			const auto colon = line.find (':');
+
+			if (colon == std::string::npos) {
+				continue;
+			}
+
+			const auto name = ToLower (Trim (line.substr (0, colon)));
+			const auto value = Trim (line.substr (colon + 1));
+
+			if (name == "connection") {
+				request.connection = ToLower (value);
+			} else if (name == "range") {
+				request.range = value;
+				request.hasRange = true;
+			} else if (name == "transfer-encoding") {
+				request.hasBody = true;
+			} else if (name == "content-length") {
+				request.hasBody = request.hasBody || (value != "0");
+			}
+		}
+
+		return true;
+	}
+
+	bool SendAll (const char* data, std::size_t size)
+	{
+		while (size > 0) {
+			const auto slice = static_cast<std::size_t> (std::min<std::int64_t> (
+				size, throttle_.GetSliceSize ()));
+			const auto sent = ::send (socket_, data, slice, MSG_NOSIGNAL);
+
+			if (sent < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				return false;
+			}
+
+			data += sent;
+			size -= sent;
+			throttle_.Consume (sent);
+		}
+
+		return true;
+	}
+
+	bool SendAll (const std::string& s)
+	{
+		return SendAll (s.data (), s.size ());
+	}
+
+	/**
+	Send part of a file using sendfile, so the data is never copied into
+	user space.
+	*/
+	bool SendFileRange (const int fd, std::int64_t offset, std::int64_t size)
+	{
+		while (size > 0) {
+			const auto slice = std::min (size, throttle_.GetSliceSize ());
+			off_t fileOffset = offset;
+			const auto sent = ::sendfile (socket_, fd, &fileOffset, slice);
+
+			if (sent < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				return false;
+			} else if (sent == 0) {
+				// The file was truncated while we were sending it
+				return false;
+			}
+
+			offset += sent;
+			size -= sent;
+			throttle_.Consume (sent);
+		}
+
+		return true;
+	}
+
+	bool SendResponse (const int status, const bool keepAlive,
+		const std::string& headers, const std::int64_t contentLength = 0)
+	{
+		if (options_.latency > 0) {
+			std::this_thread::sleep_for (std::chrono::milliseconds (options_.latency));
+		}
+
+		throttle_.Start ();
+
+		std::string response = "HTTP/1.1 " + std::to_string (status) + " "
+			+ GetReasonPhrase (status) + "\r\n"
+			+ "Server: kyla\r\n"
+			+ "Content-Length: " + std::to_string (contentLength) + "\r\n"
+			+ (keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n")
+			+ headers + "\r\n";
+
+		return SendAll (response);
+	}
+
+	/**
+	Returns false if the connection must be closed.
+	*/
+	bool HandleRequest (const Request& request)
+	{
+		const bool keepAlive = !stopping_ && ((request.minorVersion >= 1)
+			? request.connection.find ("close") == std::string::npos
+			: request.connection.find ("keep-alive") != std::string::npos);
+
+		int status = 0;
+		std::int64_t bytesSent = 0;
+
+		const auto result = HandleRequest (request, keepAlive, status, bytesSent);
+
+		if (options_.verbose) {
+			std::lock_guard<std::mutex> lock (logMutex);
+			std::cout << request.method << " " << request.target << " "
+				<< status << " " << bytesSent << std::endl;
+		}
+
+		return result && keepAlive;
+	}
+
+	bool HandleRequest (const Request& request, const bool keepAlive,
+		int& status, std::int64_t& bytesSent)
+	{
+		const bool isHead = request.method == "HEAD";
+
+		if (request.method != "GET" && !isHead) {
+			status = 405;
+			// The request may have a body we can't skip
+			SendResponse (status, false, "Allow: GET, HEAD\r\n");
+			return false;
+		}
+
+		if (request.hasBody) {
+			status = 400;
+			SendResponse (status, false, std::string ());
+			return false;
+		}
+
+		std::string path;
+		if (!GetLocalPath (options_.root, request.target, path)) {
+			status = 400;
+			return SendResponse (status, keepAlive, std::string ());
+		}
+
+		FileDescriptor file (::open (path.c_str (), O_RDONLY | O_CLOEXEC));
+		struct stat fileStat;
+
+		if (file.Get () < 0 || ::fstat (file.Get (), &fileStat) != 0
+			|| !S_ISREG (fileStat.st_mode)) {
+			status = 404;
+			return SendResponse (status, keepAlive, std::string ());
+		}
+
+		const std::int64_t fileSize = fileStat.st_size;
+
+		std::vector<ByteRange> ranges;
+		const auto rangeResult = request.hasRange
+			? ParseRanges (request.range, fileSize, ranges)
+			: RangeParseResult::Invalid;
+
+		if (rangeResult == RangeParseResult::Unsatisfiable) {
+			status = 416;
+			return SendResponse (status, keepAlive,
+				"Content-Range: bytes */" + std::to_string (fileSize) + "\r\n");
+		}
+
+		if (rangeResult == RangeParseResult::Invalid) {
+			status = 200;
+			if (!SendResponse (status, keepAlive,
+				"Accept-Ranges: bytes\r\n"
+				"Content-Type: application/octet-stream\r\n", fileSize)) {
+				return false;
+			}
+
+			if (isHead) {
+				return true;
+			}
+
+			bytesSent = fileSize;
+			return SendFileRange (file.Get (), 0, fileSize);
+		}
+
+		status = 206;
+
+		if (ranges.size () == 1) {
+			const auto& range = ranges.front ();
+
+			if (!SendResponse (status, keepAlive,
+				"Accept-Ranges: bytes\r\n"
+				"Content-Type: application/octet-stream\r\n"
+				"Content-Range: bytes " + std::to_string (range.first) + "-"
+				+ std::to_string (range.last) + "/" + std::to_string (fileSize) + "\r\n",
+				range.GetSize ())) {
+				return false;
+			}
+
+			if (isHead) {
+				return true;
+			}
+
+			bytesSent = range.GetSize ();
+			return SendFileRange (file.Get (), range.first, range.GetSize ());
+		}
+
+		// Multiple ranges are sent as multipart/byteranges. The part headers
+		// are built first, as they count towards the content length
+		std::vector<std::string> partHeaders;
+		std::int64_t contentLength = 0;
+
+		for (const auto& range : ranges) {
+			partHeaders.push_back (std::string ("\r\n--") + MultipartBoundary + "\r\n"
+				+ "Content-Type: application/octet-stream\r\n"
+				+ "Content-Range: bytes " + std::to_string (range.first) + "-"
+				+ std::to_string (range.last) + "/" + std::to_string (fileSize)
+				+ "\r\n\r\n");
+
+			contentLength += partHeaders.back ().size () + range.GetSize ();
+		}
+
+		const auto trailer = std::string ("\r\n--") + MultipartBoundary + "--\r\n";
+		contentLength += trailer.size ();
+
+		if (!SendResponse (status, keepAlive,
+			std::string ("Accept-Ranges: bytes\r\n")
+			+ "Content-Type: multipart/byteranges; boundary=" + MultipartBoundary + "\r\n",
+			contentLength)) {
+			return false;
+		}
+
+		if (isHead) {
+			return true;
+		}
+
+		for (std::size_t i = 0; i < ranges.size (); ++i) {
+			if (!SendAll (partHeaders [i])
+				|| !SendFileRange (file.Get (), ranges [i].first, ranges [i].GetSize ())) {
+				return false;
+			}
+		}
+
+		bytesSent = contentLength;
+		return SendAll (trailer);
+	}
+
+	int socket_;
+	const HttpServerOptions& options_;
+	const std::atomic<bool>& stopping_;
+	Throttle throttle_;
+
+	std::string buffer_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+[[noreturn]] void ThrowSystemError (const std::string& what)
+{
+	throw std::runtime_error (what + ": " + std::strerror (errno));
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+struct HttpServer::Impl
+{
+	explicit Impl (const HttpServerOptions& options)
+		: options_ (options)
+	{
+		listenSocket_ = ::socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+		if (listenSocket_ < 0) {
+			ThrowSystemError ("Could not create socket");
+		}
+
+		const int reuseAddress = 1;
+		::setsockopt (listenSocket_, SOL_SOCKET, SO_REUSEADDR,
+			&reuseAddress, sizeof (reuseAddress));
+
+		sockaddr_in address;
+		std::memset (&address, 0, sizeof (address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons (static_cast<uint16_t> (options.port));
+
+		if (::inet_pton (AF_INET, options.address.c_str (), &address.sin_addr) != 1) {
+			::close (listenSocket_);
+			throw std::runtime_error ("Invalid address '" + options.address
+				+ "', only IPv4 addresses are supported");
+		}
+
+		if (::bind (listenSocket_, reinterpret_cast<sockaddr*> (&address), sizeof (address)) != 0
+			|| ::listen (listenSocket_, 128) != 0) {
+			const auto error = errno;
+			::close (listenSocket_);
+			errno = error;
+			ThrowSystemError ("Could not listen on " + options.address
+				+ ":" + std::to_string (options.port));
+		}
+
+		socklen_t addressLength = sizeof (address);
+		::getsockname (listenSocket_, reinterpret_cast<sockaddr*> (&address), &addressLength);
+		port_ = ntohs (address.sin_port);
+	}
+
+	~Impl ()
+	{
+		::close (listenSocket_);
+	}
+
+	void Run (const std::function<bool ()>& stopRequested)
+	{
+		stopping_ = false;
+
+		std::vector<std::thread> workers;
+		for (int i = 0; i < std::max (1, options_.threadCount); ++i) {
+			workers.emplace_back ([this]() -> void { Work (); });
+		}
+
+		while (!stopRequested ()) {
+			pollfd pfd;
+			pfd.fd = listenSocket_;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+
+			if (::poll (&pfd, 1, PollIntervalMs) <= 0) {
+				continue;
+			}
+
+			const auto socket = ::accept4 (listenSocket_, nullptr, nullptr, SOCK_CLOEXEC);
+
+			if (socket < 0) {
+				continue;
+			}
+
+			std::lock_guard<std::mutex> lock (mutex_);
+			pendingConnections_.push_back (socket);
+			connectionAvailable_.notify_one ();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock (mutex_);
+			stopping_ = true;
+			connectionAvailable_.notify_all ();
+		}
+
+		for (auto& worker : workers) {
+			worker.join ();
+		}
+
+		for (const auto socket : pendingConnections_) {
+			::close (socket);
+		}
+
+		pendingConnections_.clear ();
+	}
+
+	void Work ()
+	{
+		for (;;) {
+			int socket = -1;
+
+			{
+				std::unique_lock<std::mutex> lock (mutex_);
+				connectionAvailable_.wait (lock, [this]() -> bool {
+					return stopping_ || !pendingConnections_.empty ();
+				});
+
+				if (stopping_) {
+					return;
+				}
+
+				socket = pendingConnections_.front ();
+				pendingConnections_.pop_front ();
+			}
+
+			Connection connection (socket, options_, stopping_);
+			connection.Run ();
+
+			::close (socket);
+		}
+	}
+
+	int GetPort () const
+	{
+		return port_;
+	}
+
+private:
+	HttpServerOptions options_;
+	int listenSocket_ = -1;
+	int port_ = 0;
+
+	std::mutex mutex_;
+	std::condition_variable connectionAvailable_;
+	std::deque<int> pendingConnections_;
+	std::atomic<bool> stopping_ { false };
+};
+#else
+///////////////////////////////////////////////////////////////////////////////
+struct HttpServer::Impl
+{
+	explicit Impl (const HttpServerOptions&)
+	{
+		throw std::runtime_error ("Serving repositories is not supported on this platform");
+	}
+
+	void Run (const std::function<bool ()>&)
+	{
+	}
+
+	int GetPort () const
+	{
+		return 0;
+	}
+};
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+HttpServer::HttpServer (const HttpServerOptions& options)
+	: impl_ (new Impl (options))
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+HttpServer::~HttpServer ()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int HttpServer::GetPort () const
+{
+	return impl_->GetPort ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void HttpServer::Run (const std::function<bool ()>& stopRequested)
+{
+	impl_->Run (stopRequested);
+}
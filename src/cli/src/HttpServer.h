@@ -0,0 +1,71 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#ifndef KYLA_CLI_HTTP_SERVER_H
+#define KYLA_CLI_HTTP_SERVER_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+struct HttpServerOptions
+{
+	// Directory to serve, requests can't access anything outside of it
+	std::string root;
+	std::string address = "127.0.0.1";
+	// If 0, a free port is picked, use HttpServer::GetPort to query it
+	int port = 8080;
+	int threadCount = 8;
+
+	// Maximum number of bytes per second sent on each connection, or 0 for
+	// no limit
+	std::int64_t bandwidth = 0;
+	// Delay before each response, in milliseconds
+	int latency = 0;
+
+	// Write one line per request to stdout
+	bool verbose = false;
+};
+
+/**
+A small HTTP/1.1 server for static files, as needed to serve a packed
+repository to a web repository. Only GET and HEAD are supported. Connections
+are kept alive, and single and multiple byte ranges can be requested.
+
+Each connection is handled by one of threadCount worker threads, so at most
+threadCount clients are served at once, and further connections wait until
+a worker is available.
+*/
+class HttpServer final
+{
+public:
+	/**
+	Bind to the address and port and start listening. Throws if this fails.
+	*/
+	explicit HttpServer (const HttpServerOptions& options);
+	~HttpServer ();
+
+	HttpServer (const HttpServer&) = delete;
+	HttpServer& operator= (const HttpServer&) = delete;
+
+	int GetPort () const;
+
+	/**
+	Serve requests until stopRequested returns true. It is polled several
+	times per second.
+	*/
+	void Run (const std::function<bool ()>& stopRequested);
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> impl_;
+};
+
+#endif
@@ -7,14 +7,37 @@ details.
 [LICENSE END]
 */
 
+#include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
+#include <pugixml.hpp>
 
 #include "Kyla.h"
-
+#include "HttpServer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <iomanip>
+#include <random>
+#include <sstream>
+#include <thread>
 #include "Uuid.h"
 
+#if KYLA_PLATFORM_WINDOWS
+	#define WIN32_LEAN_AND_MEAN
+	#include <Windows.h>
+	#include <Psapi.h>
+	#undef min
+	#undef max
+#else
+	#include <sys/resource.h>
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 const char* kylaGetErrorString (const int r)
 {
@@ -23,6 +46,7 @@ const char* kylaGetErrorString (const int r)
 	case kylaResult_Error: return "Error";
 	case kylaResult_ErrorInvalidArgument: return "Invalid argument";
 	case kylaResult_ErrorUnsupportedApiVersion: return "Unsupported Api version";
+	case kylaResult_ErrorCancelled: return "Cancelled";
 	default:
 		return "Unknown error";
 	}
@@ -33,7 +57,15 @@ const char* kylaGetErrorString (const int r)
 namespace po = boost::program_options;
 
 extern int kylaBuildRepository (const char* repositoryDescription,
-	const char* sourceDirectory, const char* targetDirectory);
+	const char* sourceDirectory, const char* targetDirectory,
+	const char* baseRepository, int computeDeltas,
+	const int64_t memoryBudget, const char* traceFile);
+extern int kylaInspectRepository (const char* repositoryPath,
+	const char* outputFile);
+extern int kylaRepackRepository (const char* sourceRepository,
+	const char* targetDirectory, const char* compression,
+	const int64_t chunkSize, const char* order,
+	const int threadCount, const int64_t memoryBudget);
 
 ///////////////////////////////////////////////////////////////////////////////
 void StdoutLog (const char* source, const kylaLogSeverity severity,
@@ -49,6 +81,60 @@ void StdoutLog (const char* source, const kylaLogSeverity severity,
 	std::cout << source << ":" << message << "\n";
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void SetInstallerOptions (KylaInstaller* installer,
+	po::variables_map& vm)
+{
+	if (vm ["profile-sql"].as<bool> ()) {
+		const int enable = 1;
+		KYLA_CHECKED_CALL (installer->SetOption (installer,
+			kylaInstallerOption_ProfileDatabase, sizeof (enable), &enable));
+	}
+
+	if (vm.count ("profile-sql-json")) {
+		const auto& filename = vm ["profile-sql-json"].as<std::string> ();
+		KYLA_CHECKED_CALL (installer->SetOption (installer,
+			kylaInstallerOption_DatabaseProfileFile, filename.size () + 1,
+			filename.c_str ()));
+	}
+
+	if (vm.count ("trace")) {
+		const auto& filename = vm ["trace"].as<std::string> ();
+		KYLA_CHECKED_CALL (installer->SetOption (installer,
+			kylaInstallerOption_TraceFile, filename.size () + 1,
+			filename.c_str ()));
+	}
+
+	if (vm.count ("threads")) {
+		const int threadCount = vm ["threads"].as<int> ();
+		KYLA_CHECKED_CALL (installer->SetOption (installer,
+			kylaInstallerOption_ThreadCount, sizeof (threadCount), &threadCount));
+	}
+
+	if (vm.count ("io-concurrency")) {
+		const int ioConcurrency = vm ["io-concurrency"].as<int> ();
+		KYLA_CHECKED_CALL (installer->SetOption (installer,
+			kylaInstallerOption_IoConcurrency, sizeof (ioConcurrency),
+			&ioConcurrency));
+	}
+
+	if (vm.count ("memory-budget")) {
+		const int64_t memoryBudget =
+			static_cast<int64_t> (vm ["memory-budget"].as<int> ()) << 20;
+		KYLA_CHECKED_CALL (installer->SetOption (installer,
+			kylaInstallerOption_MemoryBudget, sizeof (memoryBudget),
+			&memoryBudget));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static volatile std::sig_atomic_t interruptRequested = 0;
+
+void InterruptHandler (int)
+{
+	interruptRequested = 1;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void StdoutProgress (const KylaProgress* progress, void* context)
 {
@@ -56,9 +142,25 @@ void StdoutProgress (const KylaProgress* progress, void* context)
 		"                                        ";
 	//   0123456789012345678901234567890123456879
 
-	std::cout << std::fixed << std::setprecision (2) << progress->totalProgress * 100
-		<< " % : " << progress->action 
-		<< (padding + std::min (::strlen (padding), ::strlen (progress->action))) << "\r";
+	std::stringstream status;
+	status << std::fixed << std::setprecision (2) << progress->totalProgress * 100
+		<< " % : " << progress->action;
+
+	if (progress->bytesTotal > 0) {
+		status << " (" << std::setprecision (1)
+			<< progress->bytesPerSecond / (1 << 20) << " MiB/s";
+
+		if (progress->secondsRemaining >= 0) {
+			status << ", " << static_cast<int64_t> (progress->secondsRemaining)
+				<< " s remaining";
+		}
+
+		status << ")";
+	}
+
+	const auto line = status.str ();
+	std::cout << line
+		<< (padding + std::min (::strlen (padding), line.size ())) << "\r";
 
 	if (progress->totalProgress == 1.0) {
 		std::cout << "\n";
@@ -73,6 +175,10 @@ int Build (const std::vector<std::string>& options,
 	build_desc.add_options ()
 		("source-directory", po::value<std::string> ()->default_value ("."),
 			"Source directory")
+		("base", po::value<std::string> (),
+			"Packed repository whose packages are reused, only new content is written")
+		("deltas", po::bool_switch ()->default_value (false),
+			"Store deltas from the files in the base repository to new content")
 			("input", po::value<std::string> ())
 		("output-directory", po::value<std::string> ());
 
@@ -89,14 +195,173 @@ int Build (const std::vector<std::string>& options,
 		return 1;
 	}
 
+	const auto memoryBudget = vm.count ("memory-budget")
+		? static_cast<int64_t> (vm ["memory-budget"].as<int> ()) << 20 : 0;
+
 	const auto result = kylaBuildRepository (
 		vm ["input"].as<std::string> ().c_str (),
 		vm ["source-directory"].as<std::string> ().c_str (),
-		vm ["output-directory"].as<std::string> ().c_str ());
+		vm ["output-directory"].as<std::string> ().c_str (),
+		vm.count ("base") ? vm ["base"].as<std::string> ().c_str () : nullptr,
+		vm ["deltas"].as<bool> () ? 1 : 0,
+		memoryBudget,
+		vm.count ("trace") ? vm ["trace"].as<std::string> ().c_str () : nullptr);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int Inspect (const std::vector<std::string>& options,
+	po::variables_map& vm)
+{
+	po::options_description inspect_desc ("inspect options");
+	inspect_desc.add_options ()
+		("output,o", po::value<std::string> (),
+			"Write the statistics to this file instead of stdout")
+		("input", po::value<std::string> ());
+
+	po::positional_options_description posInspect;
+	posInspect
+		.add ("input", 1);
+
+	try {
+		po::store (po::command_line_parser (options).options (inspect_desc)
+			.positional (posInspect).run (), vm);
+	} catch (const std::exception& e) {
+		std::cerr << e.what () << std::endl;
+		return 1;
+	}
+
+	if (!vm.count ("input")) {
+		std::cerr << "No repository was specified" << std::endl;
+		return 1;
+	}
+
+	const auto result = kylaInspectRepository (
+		vm ["input"].as<std::string> ().c_str (),
+		vm.count ("output") ? vm ["output"].as<std::string> ().c_str () : nullptr);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int Repack (const std::vector<std::string>& options,
+	po::variables_map& vm)
+{
+	po::options_description repack_desc ("repack options");
+	repack_desc.add_options ()
+		("compression", po::value<std::string> (),
+			"Brotli, ZIP or Uncompressed, by default every package keeps its compression")
+		("chunk-size", po::value<int64_t> ()->default_value (0),
+			"Chunk size in bytes, 0 uses the default of 4 MiB")
+		("order", po::value<std::string> ()->default_value ("package"),
+			"Order of the content objects: package, fileset or path")
+		("input", po::value<std::string> ())
+		("output-directory", po::value<std::string> ());
+
+	po::positional_options_description posRepack;
+	posRepack
+		.add ("input", 1)
+		.add ("output-directory", 1);
+
+	try {
+		po::store (po::command_line_parser (options).options (repack_desc)
+			.positional (posRepack).run (), vm);
+	} catch (const std::exception& e) {
+		std::cerr << e.what () << std::endl;
+		return 1;
+	}
+
+	if (!vm.count ("input") || !vm.count ("output-directory")) {
+		std::cerr << "Source repository and output directory must be specified" << std::endl;
+		return 1;
+	}
+
+	const auto threadCount = vm.count ("threads") ? vm ["threads"].as<int> () : 0;
+	const auto memoryBudget = vm.count ("memory-budget")
+		? static_cast<int64_t> (vm ["memory-budget"].as<int> ()) << 20 : 0;
+
+	const auto result = kylaRepackRepository (
+		vm ["input"].as<std::string> ().c_str (),
+		vm ["output-directory"].as<std::string> ().c_str (),
+		vm.count ("compression") ? vm ["compression"].as<std::string> ().c_str () : nullptr,
+		vm ["chunk-size"].as<int64_t> (),
+		vm ["order"].as<std::string> ().c_str (),
+		threadCount, memoryBudget);
+
+	if (result != kylaResult_Ok) {
+		std::cerr << kylaGetErrorString (result) << std::endl;
+	}
 
 	return result;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+int Serve (const std::vector<std::string>& options,
+	po::variables_map& vm)
+{
+	po::options_description serve_desc ("serve options");
+	serve_desc.add_options ()
+		("bind", po::value<std::string> ()->default_value ("127.0.0.1"),
+			"IPv4 address to listen on")
+		("port", po::value<int> ()->default_value (8080),
+			"Port to listen on, 0 picks a free port")
+		("connections", po::value<int> ()->default_value (8),
+			"Number of connections which are served at once")
+		("bandwidth", po::value<int64_t> ()->default_value (0),
+			"Bandwidth limit per connection in KiB/s, 0 for no limit")
+		("latency", po::value<int> ()->default_value (0),
+			"Delay before each response, in milliseconds")
+		("verbose,v", po::bool_switch ()->default_value (false),
+			"Print every request")
+		("directory", po::value<std::string> ());
+
+	po::positional_options_description posServe;
+	posServe
+		.add ("directory", 1);
+
+	try {
+		po::store (po::command_line_parser (options).options (serve_desc)
+			.positional (posServe).run (), vm);
+	} catch (const std::exception& e) {
+		std::cerr << e.what () << std::endl;
+		return 1;
+	}
+
+	if (!vm.count ("directory")) {
+		std::cerr << "No directory was specified" << std::endl;
+		return 1;
+	}
+
+	HttpServerOptions serverOptions;
+	serverOptions.root = vm ["directory"].as<std::string> ();
+	serverOptions.address = vm ["bind"].as<std::string> ();
+	serverOptions.port = vm ["port"].as<int> ();
+	serverOptions.threadCount = vm ["connections"].as<int> ();
+	serverOptions.bandwidth = vm ["bandwidth"].as<int64_t> () << 10;
+	serverOptions.latency = vm ["latency"].as<int> ();
+	serverOptions.verbose = vm ["verbose"].as<bool> ();
+
+	HttpServer server (serverOptions);
+
+	// The URL is printed once we're listening, so scripts can wait for it
+	std::cout << "Serving " << serverOptions.root << " at http://"
+		<< serverOptions.address << ":" << server.GetPort () << "/" << std::endl;
+
+	interruptRequested = false;
+	auto previousInterruptHandler = std::signal (SIGINT, InterruptHandler);
+	auto previousTerminateHandler = std::signal (SIGTERM, InterruptHandler);
+
+	server.Run ([]() -> bool {
+		return interruptRequested != 0;
+	});
+
+	std::signal (SIGINT, previousInterruptHandler);
+	std::signal (SIGTERM, previousTerminateHandler);
+
+	return 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 int Validate (const std::vector<std::string>& options,
 	po::variables_map& vm)
@@ -170,6 +435,8 @@ int Validate (const std::vector<std::string>& options,
 		installer->SetLogCallback (installer, StdoutLog, nullptr);
 	}
 
+	SetInstallerOptions (installer, vm);
+
 	KylaTargetRepository repository;
 	KYLA_CHECKED_CALL (installer->OpenTargetRepository (installer, 
 		vm ["input"].as<std::string> ().c_str (), 0, &repository));
@@ -218,6 +485,8 @@ int Repair (const std::vector<std::string>& options,
 		installer->SetLogCallback (installer, StdoutLog, nullptr);
 	}
 
+	SetInstallerOptions (installer, vm);
+
 	KylaTargetRepository source;
 	KYLA_CHECKED_CALL (installer->OpenSourceRepository (installer, 
 		vm ["source"].as<std::string> ().c_str (), 0, &source));
@@ -244,7 +513,9 @@ int QueryFilesets (const std::vector<std::string>& options,
 	build_desc.add_options ()
 		("source", po::value<std::string> ())
 		("name,n", po::bool_switch ()->default_value (false),
-			"query the fileset name as well");
+			"query the fileset name as well")
+		("download-size,d", po::bool_switch ()->default_value (false),
+			"query the download size as well");
 
 	po::positional_options_description posBuild;
 	posBuild
@@ -314,7 +585,18 @@ int QueryFilesets (const std::vector<std::string>& options,
 			filesetId, kylaFilesetProperty_FileCount,
 			&int64Size, &fileCount));
 
-		std::cout << " " << fileCount << " " << size << std::endl;
+		std::cout << " " << fileCount << " " << size;
+
+		if (vm ["download-size"].as<bool> ()) {
+			std::int64_t downloadSize;
+			KYLA_CHECKED_CALL (installer->QueryFileset (installer, source,
+				filesetId, kylaFilesetProperty_DownloadSize,
+				&int64Size, &downloadSize));
+
+			std::cout << " " << downloadSize;
+		}
+
+		std::cout << std::endl;
 	}
 
 	installer->CloseRepository (installer, source);
@@ -332,6 +614,8 @@ int ConfigureOrInstall (const std::string& cmd,
 	build_desc.add_options ()
 		("source", po::value<std::string> ())
 		("target", po::value<std::string> ())
+		("also-target", po::value<std::vector<std::string>> ()->composing (),
+			"Additional target, all targets are processed in one pass")
 		("file-sets", po::value<std::vector<std::string>> ()->composing ());
 
 	po::positional_options_description posBuild;
@@ -360,14 +644,27 @@ int ConfigureOrInstall (const std::string& cmd,
 		installer->SetProgressCallback (installer, StdoutProgress, nullptr);
 	}
 
+	SetInstallerOptions (installer, vm);
+
 	KylaSourceRepository source;
 	KYLA_CHECKED_CALL (installer->OpenSourceRepository (installer, 
 		vm ["source"].as<std::string> ().c_str (), 0, &source));
 
-	KylaTargetRepository target;
-	KYLA_CHECKED_CALL (installer->OpenTargetRepository (installer, 
-		vm ["target"].as<std::string> ().c_str (), 
-		cmd == "install" ? kylaRepositoryOption_Create : 0, &target));
+	std::vector<std::string> targetPaths{ vm ["target"].as<std::string> () };
+	if (vm.count ("also-target")) {
+		const auto& additionalTargets = vm ["also-target"].as<std::vector<std::string>> ();
+		targetPaths.insert (targetPaths.end (),
+			additionalTargets.begin (), additionalTargets.end ());
+	}
+
+	std::vector<KylaTargetRepository> targets;
+	for (const auto& targetPath : targetPaths) {
+		KylaTargetRepository target;
+		KYLA_CHECKED_CALL (installer->OpenTargetRepository (installer,
+			targetPath.c_str (),
+			cmd == "install" ? kylaRepositoryOption_Create : 0, &target));
+		targets.push_back (target);
+	}
 
 	const auto filesets = vm ["file-sets"].as<std::vector<std::string>> ();
 
@@ -385,23 +682,627 @@ int ConfigureOrInstall (const std::string& cmd,
 	desiredState.filesetCount = static_cast<int> (filesetIds.size ());
 	desiredState.filesetIds = filesetPointers.data ();
 
-	int result = -1;
+	const auto action = cmd == "install" ? kylaAction_Install : kylaAction_Configure;
+	int result = kylaResult_Ok;
 
-	if (cmd == "install") {
-		result = installer->Execute (installer, kylaAction_Install,
-			target, source, &desiredState);
+	if (targets.size () > 1) {
+		result = installer->ExecuteMany (installer, action,
+			static_cast<int> (targets.size ()), targets.data (), source,
+			&desiredState);
 	} else {
-		result = installer->Execute (installer, kylaAction_Configure,
-			target, source, &desiredState);
+		// Run in the background so Ctrl+C can cancel the operation cleanly
+		KylaOperation operation = nullptr;
+		result = installer->ExecuteAsync (installer, action,
+			targets.front (), source, &desiredState, &operation);
+
+		if (result == kylaResult_Ok) {
+			interruptRequested = false;
+			auto previousHandler = std::signal (SIGINT, InterruptHandler);
+
+			int finished = 0;
+			bool cancelled = false;
+			while (installer->Poll (installer, operation, &finished) == kylaResult_Ok
+				&& !finished) {
+				if (interruptRequested && !cancelled) {
+					installer->Cancel (installer, operation);
+					cancelled = true;
+				}
+
+				std::this_thread::sleep_for (std::chrono::milliseconds (50));
+			}
+
+			result = installer->Wait (installer, operation);
+			std::signal (SIGINT, previousHandler);
+		}
 	}
 
 	installer->CloseRepository (installer, source);
-	installer->CloseRepository (installer, target);
+	for (auto target : targets) {
+		installer->CloseRepository (installer, target);
+	}
+	KYLA_CHECKED_CALL (kylaDestroyInstaller (installer));
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int Plan (const std::vector<std::string>& options,
+	po::variables_map& vm)
+{
+	po::options_description build_desc ("plan options");
+	build_desc.add_options ()
+		("source", po::value<std::string> ())
+		("target", po::value<std::string> ())
+		("file-sets", po::value<std::vector<std::string>> ()->composing ());
+
+	po::positional_options_description posBuild;
+	posBuild
+		.add ("source", 1)
+		.add ("target", 1)
+		.add ("file-sets", -1);
+
+	try {
+		po::store (po::command_line_parser (options).options (build_desc).positional (posBuild).run (), vm);
+	} catch (const std::exception& e) {
+		std::cerr << e.what () << std::endl;
+		return 1;
+	}
+
+	KylaInstaller* installer = nullptr;
+	KYLA_CHECKED_CALL (kylaCreateInstaller (KYLA_API_VERSION_1_0, &installer));
+
+	assert (installer);
+
+	if (vm ["log"].as<bool> ()) {
+		installer->SetLogCallback (installer, StdoutLog, nullptr);
+	}
+
+	SetInstallerOptions (installer, vm);
+
+	KylaSourceRepository source;
+	KYLA_CHECKED_CALL (installer->OpenSourceRepository (installer,
+		vm ["source"].as<std::string> ().c_str (), 0, &source));
+
+	// If the target can't be opened, plan a new installation
+	KylaTargetRepository target = nullptr;
+	if (installer->OpenTargetRepository (installer,
+		vm ["target"].as<std::string> ().c_str (), kylaRepositoryOption_ReadOnly,
+		&target) != kylaResult_Ok) {
+		target = nullptr;
+	}
+
+	std::vector<std::string> filesets;
+	if (vm.count ("file-sets")) {
+		filesets = vm ["file-sets"].as<std::vector<std::string>> ();
+	}
+
+	std::vector<const uint8_t*> filesetPointers;
+	std::vector<kyla::Uuid> filesetIds;
+	for (const auto& fileset : filesets) {
+		filesetIds.push_back (kyla::Uuid::Parse (fileset));
+	}
+
+	for (const auto& filesetId : filesetIds) {
+		filesetPointers.push_back (filesetId.GetData ());
+	}
+
+	KylaDesiredState desiredState = {};
+	desiredState.filesetCount = static_cast<int> (filesetIds.size ());
+	desiredState.filesetIds = filesetPointers.data ();
+
+	KylaPlan plan = {};
+	const auto result = installer->Plan (installer, target, source,
+		&desiredState, &plan);
+
+	if (result == kylaResult_Ok) {
+		std::cout << "download " << plan.downloadSize << " " << plan.chunkCount << "\n";
+		std::cout << "reusable " << plan.reusableSize << "\n";
+
+		for (int i = 0; i < plan.sourcePackageCount; ++i) {
+			std::cout << "package " << plan.sourcePackages [i].name << " "
+				<< plan.sourcePackages [i].downloadSize << " "
+				<< plan.sourcePackages [i].chunkCount << "\n";
+		}
+
+		std::cout << "write " << plan.writeFileCount << " " << plan.writeSize << "\n";
+		std::cout << "delete " << plan.deleteFileCount << " " << plan.deleteSize << "\n";
+		std::cout << "disk-change " << (plan.writeSize - plan.deleteSize) << std::endl;
+	}
+
+	installer->CloseRepository (installer, source);
+	if (target) {
+		installer->CloseRepository (installer, target);
+	}
+	KYLA_CHECKED_CALL (kylaDestroyInstaller (installer));
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int ReadFile (const std::vector<std::string>& options,
+	po::variables_map& vm)
+{
+	po::options_description build_desc ("read-file options");
+	build_desc.add_options ()
+		("source", po::value<std::string> ())
+		("path", po::value<std::string> ())
+		("offset", po::value<int64_t> ()->default_value (0),
+			"first byte to read")
+		("size", po::value<int64_t> ()->default_value (-1),
+			"number of bytes to read, by default, until the end of the file");
+
+	po::positional_options_description posBuild;
+	posBuild
+		.add ("source", 1)
+		.add ("path", 1);
+
+	try {
+		po::store (po::command_line_parser (options).options (build_desc).positional (posBuild).run (), vm);
+	} catch (const std::exception& e) {
+		std::cerr << e.what () << std::endl;
+		return 1;
+	}
+
+	if (vm ["source"].empty () || vm ["path"].empty ()) {
+		std::cerr << "No repository or path specified" << std::endl;
+		return 1;
+	}
+
+	KylaInstaller* installer = nullptr;
+	KYLA_CHECKED_CALL (kylaCreateInstaller (KYLA_API_VERSION_1_0, &installer));
+
+	assert (installer);
+
+	if (vm ["log"].as<bool> ()) {
+		installer->SetLogCallback (installer, StdoutLog, nullptr);
+	}
+
+	KylaSourceRepository source;
+	KYLA_CHECKED_CALL (installer->OpenSourceRepository (installer,
+		vm ["source"].as<std::string> ().c_str (), 0, &source));
+
+	const auto path = vm ["path"].as<std::string> ();
+
+	int64_t offset = vm ["offset"].as<int64_t> ();
+	int64_t remaining = vm ["size"].as<int64_t> ();
+
+	if (remaining < 0) {
+		int64_t fileSize = 0;
+		KYLA_CHECKED_CALL (installer->GetFileSize (installer, source,
+			path.c_str (), &fileSize));
+		remaining = std::max<int64_t> (fileSize - offset, 0);
+	}
+
+	// Read in blocks, so large files never have to be kept in memory
+	std::vector<char> buffer (256 << 10);
+	int result = kylaResult_Ok;
+
+	while (remaining > 0) {
+		size_t bytesRead = 0;
+		result = installer->ReadFile (installer, source, path.c_str (), offset,
+			buffer.data (),
+			static_cast<size_t> (std::min<int64_t> (remaining, buffer.size ())),
+			&bytesRead);
+
+		if (result != kylaResult_Ok || bytesRead == 0) {
+			break;
+		}
+
+		std::cout.write (buffer.data (), bytesRead);
+		offset += bytesRead;
+		remaining -= bytesRead;
+	}
+
+	std::cout.flush ();
+
+	installer->CloseRepository (installer, source);
 	KYLA_CHECKED_CALL (kylaDestroyInstaller (installer));
 
 	return result;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/**
+Peak resident set size of this process so far, in KiB.
+*/
+int64_t GetPeakResidentSetSize ()
+{
+#if KYLA_PLATFORM_WINDOWS
+	PROCESS_MEMORY_COUNTERS counters;
+	if (::GetProcessMemoryInfo (::GetCurrentProcess (), &counters, sizeof (counters))) {
+		return static_cast<int64_t> (counters.PeakWorkingSetSize / 1024);
+	}
+
+	return 0;
+#else
+	struct rusage usage;
+	::getrusage (RUSAGE_SELF, &usage);
+
+	// ru_maxrss is in KiB on Linux
+	return usage.ru_maxrss;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Write size bytes of synthetic data. Data is generated in blocks, each of which
+is either a short repeating pattern (with probability compressibility) or
+random. The same seed always produces the same contents.
+*/
+void WriteBenchFile (const boost::filesystem::path& path,
+	const uint64_t seed, const int64_t size, const double compressibility)
+{
+	static const int BlockSize = 4096;
+
+	std::mt19937_64 rng (seed);
+	std::bernoulli_distribution isCompressible (compressibility);
+
+	std::vector<char> block (BlockSize);
+	std::ofstream output (path.string (), std::ios::binary);
+
+	for (int64_t written = 0; written < size; written += BlockSize) {
+		if (isCompressible (rng)) {
+			for (int i = 0; i < BlockSize; ++i) {
+				block [i] = static_cast<char> ('a' + i % 16);
+			}
+		} else {
+			for (int i = 0; i < BlockSize; i += sizeof (uint64_t)) {
+				const uint64_t value = rng ();
+				::memcpy (block.data () + i, &value, sizeof (value));
+			}
+		}
+
+		output.write (block.data (),
+			std::min<int64_t> (BlockSize, size - written));
+	}
+
+	if (!output) {
+		throw std::runtime_error ("Could not write '" + path.string () + "'");
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int Bench (const std::vector<std::string>& options,
+	po::variables_map& vm)
+{
+	po::options_description bench_desc ("bench options");
+	bench_desc.add_options ()
+		("work-directory", po::value<std::string> (),
+			"Directory for the generated data, a temporary directory if not set")
+		("file-count", po::value<int> ()->default_value (1000),
+			"Number of files to generate")
+		("min-size", po::value<int64_t> ()->default_value (1024),
+			"Minimum file size in bytes")
+		("max-size", po::value<int64_t> ()->default_value (1 << 20),
+			"Maximum file size in bytes")
+		("size-distribution", po::value<std::string> ()->default_value ("log-uniform"),
+			"File size distribution, either uniform or log-uniform")
+		("duplicates", po::value<double> ()->default_value (0.1),
+			"Fraction of files which duplicate the contents of another file")
+		("compressibility", po::value<double> ()->default_value (0.5),
+			"Fraction of the data which is trivially compressible")
+		("compression", po::value<std::string> ()->default_value ("Brotli"),
+			"Package compression, either Brotli, ZIP or None")
+		("chunk-size", po::value<int64_t> (),
+			"Chunk size of the generated repository")
+		("seed", po::value<unsigned int> ()->default_value (1),
+			"Seed for the generator")
+		("output,o", po::value<std::string> (),
+			"Write the results to this file instead of stdout")
+		("keep", po::bool_switch ()->default_value (false),
+			"Keep the generated data");
+
+	try {
+		po::store (po::command_line_parser (options).options (bench_desc).run (), vm);
+	} catch (const std::exception& e) {
+		std::cerr << e.what () << std::endl;
+		return 1;
+	}
+
+	const auto fileCount = vm ["file-count"].as<int> ();
+	const auto minSize = vm ["min-size"].as<int64_t> ();
+	const auto maxSize = vm ["max-size"].as<int64_t> ();
+	const auto sizeDistribution = vm ["size-distribution"].as<std::string> ();
+	const auto duplicates = vm ["duplicates"].as<double> ();
+	const auto compressibility = vm ["compressibility"].as<double> ();
+	const auto compression = vm ["compression"].as<std::string> ();
+	const auto seed = vm ["seed"].as<unsigned int> ();
+
+	if (fileCount < 2 || minSize < 0 || maxSize < minSize
+		|| duplicates < 0 || duplicates > 1
+		|| compressibility < 0 || compressibility > 1
+		|| (sizeDistribution != "uniform" && sizeDistribution != "log-uniform")) {
+		std::cerr << "Invalid bench parameters" << std::endl;
+		return 1;
+	}
+
+	namespace fs = boost::filesystem;
+
+	const bool isTemporaryDirectory = vm.count ("work-directory") == 0;
+	const fs::path workDirectory = isTemporaryDirectory
+		? fs::temp_directory_path () / fs::unique_path ("kyla-bench-%%%%-%%%%")
+		: fs::path (vm ["work-directory"].as<std::string> ());
+
+	const auto sourceDirectory = workDirectory / "source";
+	const auto repositoryDirectory = workDirectory / "repository";
+	const auto deployDirectory = workDirectory / "deploy";
+	const auto descriptionFile = workDirectory / "bench.xml";
+
+	for (const auto& directory : { sourceDirectory, repositoryDirectory, deployDirectory }) {
+		fs::remove_all (directory);
+	}
+
+	fs::create_directories (sourceDirectory);
+
+	struct Phase
+	{
+		std::string name;
+		double seconds;
+		int64_t files;
+		int64_t bytes;
+	};
+
+	std::vector<Phase> phases;
+
+	const auto measure = [&phases](const char* name, const int64_t files,
+		const int64_t bytes, const std::function<void ()>& function) -> void {
+		const auto start = std::chrono::steady_clock::now ();
+		function ();
+		const auto end = std::chrono::steady_clock::now ();
+
+		phases.push_back (Phase{ name,
+			std::chrono::duration<double> (end - start).count (),
+			files, bytes });
+	};
+
+	// Files are split evenly into two file sets, so configure has something
+	// to fetch
+	static const char* filesetIds [] = {
+		"6b2f1a6e-3c52-4a51-9d1e-0d35e4cb5a10",
+		"a3c4d6f2-8e7b-4c1d-b5a9-2f60e18d7c41"
+	};
+
+	struct BenchFile
+	{
+		std::string path;
+		uint64_t seed;
+		int64_t size;
+	};
+
+	std::vector<BenchFile> files;
+	int64_t filesetFiles [2] = {};
+	int64_t filesetBytes [2] = {};
+
+	{
+		std::mt19937_64 rng (seed);
+		std::uniform_int_distribution<int64_t> uniformSize (minSize, maxSize);
+		std::uniform_real_distribution<double> logSize (
+			std::log (static_cast<double> (std::max<int64_t> (minSize, 1))),
+			std::log (static_cast<double> (std::max<int64_t> (maxSize, 1))));
+		std::bernoulli_distribution isDuplicate (duplicates);
+
+		for (int i = 0; i < fileCount; ++i) {
+			BenchFile file;
+
+			std::ostringstream path;
+			path << "d" << std::setw (3) << std::setfill ('0') << (i / 100)
+				<< "/f" << std::setw (6) << std::setfill ('0') << i << ".bin";
+			file.path = path.str ();
+
+			if (!files.empty () && isDuplicate (rng)) {
+				const auto& original = files [std::uniform_int_distribution<std::size_t> (
+					0, files.size () - 1) (rng)];
+				file.seed = original.seed;
+				file.size = original.size;
+			} else {
+				file.seed = rng ();
+				file.size = (sizeDistribution == "uniform")
+					? uniformSize (rng)
+					: std::min (maxSize, std::max (minSize,
+						static_cast<int64_t> (std::exp (logSize (rng)))));
+			}
+
+			files.push_back (file);
+
+			const auto fileset = (i < fileCount / 2) ? 0 : 1;
+			++filesetFiles [fileset];
+			filesetBytes [fileset] += file.size;
+		}
+	}
+
+	const auto totalFiles = filesetFiles [0] + filesetFiles [1];
+	const auto totalBytes = filesetBytes [0] + filesetBytes [1];
+
+	measure ("generate", totalFiles, totalBytes, [&]() -> void {
+		for (const auto& file : files) {
+			const auto path = sourceDirectory / file.path;
+			fs::create_directories (path.parent_path ());
+			WriteBenchFile (path, file.seed, file.size, compressibility);
+		}
+	});
+
+	{
+		pugi::xml_document description;
+		auto repositoryNode = description.append_child ("Repository");
+
+		auto packageNode = repositoryNode.append_child ("Package");
+		packageNode.append_child ("Type").text ().set ("Packed");
+
+		if (vm.count ("chunk-size")) {
+			packageNode.append_child ("ChunkSize").text ().set (
+				std::to_string (vm ["chunk-size"].as<int64_t> ()).c_str ());
+		}
+
+		auto sourcePackageNode = repositoryNode.append_child ("SourcePackages")
+			.append_child ("SourcePackage");
+		sourcePackageNode.append_attribute ("Id").set_value ("main");
+		sourcePackageNode.append_attribute ("Name").set_value ("main");
+		sourcePackageNode.append_attribute ("Compression").set_value (compression.c_str ());
+
+		auto filesetsNode = repositoryNode.append_child ("FileSets");
+		pugi::xml_node filesetNodes [2];
+		for (int i = 0; i < 2; ++i) {
+			filesetNodes [i] = filesetsNode.append_child ("FileSet");
+			filesetNodes [i].append_attribute ("Id").set_value (filesetIds [i]);
+			filesetNodes [i].append_attribute ("Name").set_value (
+				i == 0 ? "first" : "second");
+		}
+
+		for (int i = 0; i < fileCount; ++i) {
+			filesetNodes [(i < fileCount / 2) ? 0 : 1].append_child ("File")
+				.append_attribute ("Source").set_value (files [i].path.c_str ());
+		}
+
+		description.save_file (descriptionFile.string ().c_str ());
+	}
+
+	measure ("build", totalFiles, totalBytes, [&]() -> void {
+		KYLA_CHECKED_CALL (kylaBuildRepository (
+			descriptionFile.string ().c_str (),
+			sourceDirectory.string ().c_str (),
+			repositoryDirectory.string ().c_str (), nullptr, 0,
+			vm.count ("memory-budget")
+				? static_cast<int64_t> (vm ["memory-budget"].as<int> ()) << 20 : 0,
+			nullptr));
+	});
+
+	KylaInstaller* installer = nullptr;
+	KYLA_CHECKED_CALL (kylaCreateInstaller (KYLA_API_VERSION_1_0, &installer));
+
+	if (vm ["log"].as<bool> ()) {
+		installer->SetLogCallback (installer, StdoutLog, nullptr);
+	}
+
+	SetInstallerOptions (installer, vm);
+
+	KylaSourceRepository source;
+	KYLA_CHECKED_CALL (installer->OpenSourceRepository (installer,
+		repositoryDirectory.string ().c_str (), 0, &source));
+
+	std::vector<kyla::Uuid> filesetUuids;
+	for (const auto filesetId : filesetIds) {
+		filesetUuids.push_back (kyla::Uuid::Parse (filesetId));
+	}
+
+	const uint8_t* filesetPointers [] = {
+		filesetUuids [0].GetData (), filesetUuids [1].GetData ()
+	};
+
+	// Every phase opens the target again, as a separate kcl call would
+	const auto execute = [&](const kylaAction action, const int filesetCount) -> void {
+		KylaTargetRepository target;
+		KYLA_CHECKED_CALL (installer->OpenTargetRepository (installer,
+			deployDirectory.string ().c_str (),
+			action == kylaAction_Install ? kylaRepositoryOption_Create : 0,
+			&target));
+
+		KylaDesiredState desiredState = {};
+		desiredState.filesetCount = filesetCount;
+		desiredState.filesetIds = filesetPointers;
+
+		const auto result = installer->Execute (installer, action, target,
+			source, filesetCount > 0 ? &desiredState : nullptr);
+		installer->CloseRepository (installer, target);
+
+		KYLA_CHECKED_CALL (result);
+	};
+
+	int validationErrors = 0;
+	installer->SetValidationCallback (installer, [](kylaValidationResult validationResult,
+		const kylaValidationItemInfo*, void* context) -> void {
+		if (validationResult != kylaValidationResult_Ok) {
+			++*static_cast<int*> (context);
+		}
+	}, &validationErrors);
+
+	measure ("install", filesetFiles [0], filesetBytes [0], [&]() -> void {
+		execute (kylaAction_Install, 1);
+	});
+
+	measure ("configure", filesetFiles [1], filesetBytes [1], [&]() -> void {
+		execute (kylaAction_Configure, 2);
+	});
+
+	measure ("verify", totalFiles, totalBytes, [&]() -> void {
+		execute (kylaAction_Verify, 0);
+	});
+
+	const auto verifyErrors = validationErrors;
+
+	// Remove every tenth file, and let repair restore them
+	int64_t removedFiles = 0;
+	int64_t removedBytes = 0;
+	for (int i = 0; i < fileCount; i += 10) {
+		fs::remove (deployDirectory / files [i].path);
+		++removedFiles;
+		removedBytes += files [i].size;
+	}
+
+	measure ("repair", removedFiles, removedBytes, [&]() -> void {
+		execute (kylaAction_Repair, 0);
+	});
+
+	validationErrors = 0;
+	execute (kylaAction_Verify, 0);
+	const auto repairErrors = validationErrors;
+
+	installer->CloseRepository (installer, source);
+	KYLA_CHECKED_CALL (kylaDestroyInstaller (installer));
+
+	if (!vm ["keep"].as<bool> ()) {
+		if (isTemporaryDirectory) {
+			fs::remove_all (workDirectory);
+		} else {
+			for (const auto& directory : { sourceDirectory, repositoryDirectory, deployDirectory }) {
+				fs::remove_all (directory);
+			}
+			fs::remove (descriptionFile);
+		}
+	}
+
+	std::ofstream outputFile;
+	if (vm.count ("output")) {
+		outputFile.open (vm ["output"].as<std::string> ());
+	}
+	std::ostream& output = vm.count ("output") ? outputFile : std::cout;
+
+	output << "{\n"
+		<< "  \"parameters\": {\n"
+		<< "    \"fileCount\": " << fileCount << ",\n"
+		<< "    \"minSize\": " << minSize << ",\n"
+		<< "    \"maxSize\": " << maxSize << ",\n"
+		<< "    \"sizeDistribution\": \"" << sizeDistribution << "\",\n"
+		<< "    \"duplicates\": " << duplicates << ",\n"
+		<< "    \"compressibility\": " << compressibility << ",\n"
+		<< "    \"compression\": \"" << compression << "\",\n"
+		<< "    \"seed\": " << seed << "\n"
+		<< "  },\n"
+		<< "  \"phases\": [\n";
+
+	for (std::size_t i = 0; i < phases.size (); ++i) {
+		const auto& phase = phases [i];
+		const auto seconds = std::max (phase.seconds, 1e-9);
+
+		output << "    {\"name\": \"" << phase.name << "\""
+			<< ", \"seconds\": " << phase.seconds
+			<< ", \"files\": " << phase.files
+			<< ", \"bytes\": " << phase.bytes
+			<< ", \"filesPerSecond\": " << phase.files / seconds
+			<< ", \"megabytesPerSecond\": " << phase.bytes / seconds / 1e6
+			<< "}" << (i + 1 < phases.size () ? "," : "") << "\n";
+	}
+
+	// All phases run in this process, so only the peak of the whole run is
+	// known
+	output << "  ],\n"
+		<< "  \"peakRssKiB\": " << GetPeakResidentSetSize () << ",\n"
+		<< "  \"verifyErrors\": " << verifyErrors << ",\n"
+		<< "  \"errorsAfterRepair\": " << repairErrors << "\n"
+		<< "}\n";
+
+	return (verifyErrors == 0 && repairErrors == 0) ? 0 : 1;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 int main (int argc, char* argv [])
 {
@@ -409,6 +1310,18 @@ int main (int argc, char* argv [])
 	global.add_options ()
 		("log,l", po::bool_switch ()->default_value (false), "Show log output")
 		("progress,p", po::bool_switch ()->default_value (false), "Show progress")
+		("profile-sql", po::bool_switch ()->default_value (false),
+			"Log the slowest SQL statements after the command has finished")
+		("profile-sql-json", po::value<std::string> (),
+			"Write an SQL profile as JSON to this file")
+		("trace", po::value<std::string> (),
+			"Write a timeline of the command to this file, in the Chrome trace event format")
+		("threads", po::value<int> (),
+			"Number of worker threads used for hashing and decompression")
+		("io-concurrency", po::value<int> (),
+			"Number of package reads in flight at once")
+		("memory-budget", po::value<int> (),
+			"Upper bound for buffers, in MiB")
 		("command", po::value<std::string> (), "command to execute")
 		("subargs", po::value<std::vector<std::string> > (), "Arguments for command");
 
@@ -453,6 +1366,18 @@ int main (int argc, char* argv [])
 			return QueryFilesets (options, vm);
 		} else if (cmd == "install" || cmd == "configure") {
 			return ConfigureOrInstall (cmd, options, vm);
+		} else if (cmd == "plan") {
+			return Plan (options, vm);
+		} else if (cmd == "read-file") {
+			return ReadFile (options, vm);
+		} else if (cmd == "serve") {
+			return Serve (options, vm);
+		} else if (cmd == "inspect") {
+			return Inspect (options, vm);
+		} else if (cmd == "repack") {
+			return Repack (options, vm);
+		} else if (cmd == "bench") {
+			return Bench (options, vm);
 		} else {
 			std::cerr << "No command was specified" << std::endl;
 			return 1;
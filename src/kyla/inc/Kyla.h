@@ -33,7 +33,8 @@ enum kylaResult
 	kylaResult_Ok = 0,
 	kylaResult_Error = 1,
 	kylaResult_ErrorInvalidArgument = 2,
-	kylaResult_ErrorUnsupportedApiVersion = 3
+	kylaResult_ErrorUnsupportedApiVersion = 3,
+	kylaResult_ErrorCancelled = 4
 };
 
 struct KylaProgress
@@ -42,6 +43,25 @@ struct KylaProgress
 
 	const char* action;
 	const char* detailMessage;
+
+	/**
+	Bytes processed and to be processed in the current action. Both are 0 if
+	the current action does not process file contents.
+	*/
+	int64_t bytesDone;
+	int64_t bytesTotal;
+
+	/**
+	Throughput of the current action in bytes per second, averaged over the
+	last few seconds.
+	*/
+	double bytesPerSecond;
+
+	/**
+	Estimated number of seconds until the current action is finished, or a
+	negative value if it cannot be estimated yet.
+	*/
+	double secondsRemaining;
 };
 
 typedef void (*KylaProgressCallback)(const struct KylaProgress* progress,
@@ -77,6 +97,8 @@ typedef struct KylaRepositoryImpl* KylaSourceRepository;
 typedef struct KylaRepositoryImpl* KylaTargetRepository;
 typedef struct KylaRepositoryImpl* KylaRepository;
 
+typedef struct KylaOperationImpl* KylaOperation;
+
 enum kylaRepositoryOption
 {
 	/**
@@ -147,7 +169,121 @@ enum kylaFilesetProperty
 	/**
 	The number of files when deployed, stored in an int64_t.
 	*/
-	kylaFilesetProperty_FileCount
+	kylaFilesetProperty_FileCount,
+
+	/**
+	The number of bytes which have to be fetched from the source repository
+	to deploy the file set, stored in an int64_t.
+	*/
+	kylaFilesetProperty_DownloadSize
+};
+
+enum kylaInstallerOption
+{
+	/**
+	Profile all database statements executed by an action, passed as an int.
+	If non-zero, a report of the slowest statements is written to the log
+	after each call to Execute.
+	*/
+	kylaInstallerOption_ProfileDatabase,
+
+	/**
+	Write the database profile as JSON to this file after each call to
+	Execute, passed as a null-terminated, UTF8 encoded string. Setting a file
+	enables database profiling, passing null disables the output again.
+	*/
+	kylaInstallerOption_DatabaseProfileFile,
+
+	/**
+	The minimum time in milliseconds between two calls to the progress
+	callback, passed as an int. The default is 100. Progress is always
+	reported when an action starts or finishes.
+	*/
+	kylaInstallerOption_ProgressInterval,
+
+	/**
+	Upper bound in bytes for the buffers an action holds at once, passed as
+	an int64_t. The default is 64 MiB. A single chunk is always buffered,
+	even if it exceeds the budget.
+	*/
+	kylaInstallerOption_MemoryBudget,
+
+	/**
+	The number of worker threads used for hashing and decompression, passed
+	as an int. The default is the number of hardware threads. Use 1 to do
+	all work on the calling thread.
+	*/
+	kylaInstallerOption_ThreadCount,
+
+	/**
+	The number of reads from source packages which may be in flight at once,
+	passed as an int. The default is 4.
+	*/
+	kylaInstallerOption_IoConcurrency,
+
+	/**
+	Record a timeline of each call to Execute, and write it to this file in
+	the Chrome trace event format, passed as a null-terminated, UTF8 encoded
+	string. The file can be opened in chrome://tracing or Perfetto. Passing
+	null disables tracing again.
+	*/
+	kylaInstallerOption_TraceFile
+};
+
+struct KylaSourcePackagePlan
+{
+	/**
+	The name of the source package, as a null-terminated, UTF8 encoded
+	string.
+	*/
+	const char* name;
+
+	/**
+	The number of bytes read from this source package, as stored in the
+	package.
+	*/
+	int64_t downloadSize;
+	int64_t chunkCount;
+};
+
+struct KylaPlan
+{
+	/**
+	The number of bytes which have to be fetched from the source repository,
+	in total and split into chunks. Deltas against files in the target are
+	used if possible, assuming these files have not been modified.
+	*/
+	int64_t downloadSize;
+	int64_t chunkCount;
+
+	/**
+	The part of downloadSize which is first searched for in the previous
+	versions of changed files. Chunks found there are not downloaded, so
+	between downloadSize - reusableSize and downloadSize bytes are fetched.
+	*/
+	int64_t reusableSize;
+
+	/**
+	The number of distinct content objects which have to be fetched.
+	*/
+	int64_t contentObjectCount;
+
+	/**
+	The files written to and removed from the target. Files which change are
+	counted in both. The change in disk usage is writeSize - deleteSize.
+	*/
+	int64_t writeFileCount;
+	int64_t writeSize;
+	int64_t deleteFileCount;
+	int64_t deleteSize;
+
+	/**
+	The source packages which have to be read. Content objects which are not
+	stored in a package, for instance in a loose repository, are only
+	included in the totals.
+	*/
+	int sourcePackageCount;
+	const struct KylaSourcePackagePlan* sourcePackages;
 };
 
 struct KylaInstaller
@@ -247,6 +383,103 @@ struct KylaInstaller
 	int (*Execute)(KylaInstaller* installer, kylaAction action,
 		KylaTargetRepository target, KylaSourceRepository source,
 		const KylaDesiredState* desiredState);
+
+	/**
+	Set an installer option.
+
+	The optionId must be one of the enumeration values from
+	kylaInstallerOption. valueSize must be set to the size of the buffer value
+	points to.
+	*/
+	int (*SetOption)(KylaInstaller* installer, int optionId,
+		size_t valueSize, const void* value);
+
+	/**
+	Execute an action on the target repository in the background.
+
+	The arguments are the same as for Execute and are checked immediately.
+	On success, operation is set to a handle for the running action, which
+	must be released using Wait. Only one operation can be running per
+	installer at a time, and the repositories must not be used until it has
+	finished.
+
+	The log, progress and validation callbacks are invoked from a background
+	thread while the operation is running.
+	*/
+	int (*ExecuteAsync)(KylaInstaller* installer, kylaAction action,
+		KylaTargetRepository target, KylaSourceRepository source,
+		const KylaDesiredState* desiredState, KylaOperation* operation);
+
+	/**
+	Block until the operation has finished and release it. The return value
+	is the result of the action, kylaResult_ErrorCancelled if it has been
+	cancelled.
+	*/
+	int (*Wait)(KylaInstaller* installer, KylaOperation operation);
+
+	/**
+	Check whether the operation has finished, without blocking. finished is
+	set to 1 if it has, 0 otherwise. The operation still has to be released
+	using Wait.
+	*/
+	int (*Poll)(KylaInstaller* installer, KylaOperation operation,
+		int* finished);
+
+	/**
+	Request cancellation of a running operation. This returns immediately,
+	the operation stops at the next point where the target repository is
+	consistent, for instance, in between two chunks while fetching content.
+	A cancelled configure or install can be completed by running it again.
+	Use Wait to wait for the operation to stop.
+	*/
+	int (*Cancel)(KylaInstaller* installer, KylaOperation operation);
+
+	/**
+	Compute what configuring the target to the desired state would do,
+	without modifying it.
+
+	The target may be null, or opened using kylaRepositoryOption_Create, in
+	which case an installation into an empty directory is planned. The
+	source packages in the plan are owned by the installer and remain valid
+	until the next call to Plan.
+	*/
+	int (*Plan)(KylaInstaller* installer, KylaTargetRepository target,
+		KylaSourceRepository source, const KylaDesiredState* desiredState,
+		struct KylaPlan* plan);
+
+	/**
+	Get the size of a file stored in a repository, in bytes.
+
+	The path is relative to the repository root and uses forward slashes, as
+	in the repository description.
+	*/
+	int (*GetFileSize)(KylaInstaller* installer, KylaRepository repository,
+		const char* path, int64_t* size);
+
+	/**
+	Read a file directly from a repository, without deploying it.
+
+	Up to bufferSize bytes are read starting at offset into buffer. The number
+	of bytes read is written to bytesRead, which is less than bufferSize only
+	if the end of the file has been reached. For packed repositories, only
+	the chunks overlapping the requested range are read, and recently used
+	chunks are cached, so reading a file in small blocks is efficient.
+	*/
+	int (*ReadFile)(KylaInstaller* installer, KylaRepository repository,
+		const char* path, int64_t offset, void* buffer, size_t bufferSize,
+		size_t* bytesRead);
+
+	/**
+	Run kylaAction_Install or kylaAction_Configure on several target
+	repositories at once. Each content object is read from the source and
+	decoded once, and written to every target which needs it, so the
+	decoding cost doesn't depend on the number of targets.
+
+	Every target must be valid for the action on its own, as for Execute.
+	*/
+	int (*ExecuteMany)(KylaInstaller* installer, kylaAction action,
+		int targetCount, const KylaTargetRepository* targetRepositories,
+		KylaSourceRepository source, const KylaDesiredState* desiredState);
 };
 
 #define KYLA_MAKE_API_VERSION(major,minor,patch) (major << 22 | minor << 12 | patch);
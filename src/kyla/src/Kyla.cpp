@@ -13,11 +13,29 @@ details.
 
 #include "Repository.h"
 #include "RepositoryBuilder.h"
+#include "RepositoryInspector.h"
 
 #include "Log.h"
 
+#include "sql/Profiler.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+
 #define KYLA_C_API_BEGIN() try {
-#define KYLA_C_API_END() } catch (const kyla::RuntimeException& e) {    	  \
+#define KYLA_C_API_END() } catch (const kyla::OperationCancelledException& e) { \
+		if (installer) {													  \
+			static_cast<KylaInstallerInternal*> (installer)					  \
+				->log->Info (e.GetSource (), e.what ());					  \
+		}																	  \
+		return kylaResult_ErrorCancelled;									  \
+	} catch (const kyla::RuntimeException& e) {								  \
 		if (installer) {													  \
 			static_cast<KylaInstallerInternal*> (installer)					  \
 				->log->Error (e.GetSource (), e.what ());					  \
@@ -47,6 +65,13 @@ struct KylaRepositoryImpl
 	int options = 0;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+struct KylaOperationImpl
+{
+	std::future<int> result;
+	std::atomic<bool> cancellationRequested { false };
+};
+
 namespace {
 ///////////////////////////////////////////////////////////////////////////////
 struct KylaInstallerInternal : public KylaInstaller
@@ -55,12 +80,21 @@ struct KylaInstallerInternal : public KylaInstaller
 	void* validationCallbackContext = nullptr;
 	std::unique_ptr<kyla::Log> log;
 	std::unique_ptr<kyla::Progress> progress;
+	std::unique_ptr<kyla::Sql::Profiler> profiler;
+	std::string profileFile;
+	std::unique_ptr<kyla::Tracer> tracer;
+	std::string traceFile;
+	kyla::ResourceLimits limits;
+	bool operationRunning = false;
+
+	// Storage for the result of the last call to Plan
+	kyla::ConfigurationPlan plan;
+	std::vector<KylaSourcePackagePlan> planSourcePackages;
 
 	KylaInstallerInternal ()
 		: log (new kyla::Log ([](kyla::LogLevel, const char*, const char*) -> void {
 	}))
-		, progress (new kyla::Progress ([](const float totalProgress, 
-			const char* stageName, const char* action) -> void {
+		, progress (new kyla::Progress ([](const kyla::ProgressInfo&) -> void {
 	}))
 	{
 	}
@@ -165,11 +199,8 @@ int kylaCloseRepository (KylaInstaller* installer,
 		return kylaResult_ErrorInvalidArgument;
 	}
 
-	if (!repository->p) {
-		internal->log->Error ("kylaCloseRepository", "repository is already closed");
-		return kylaResult_ErrorInvalidArgument;
-	}
-
+	// Target repositories opened for creation have no repository until an
+	// install succeeded, but the handle must be released all the same
 	repository->p.reset ();
 
 	delete repository;
@@ -180,21 +211,23 @@ int kylaCloseRepository (KylaInstaller* installer,
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-int kylaExecute (
-	KylaInstaller* installer,
+/**
+Check the arguments of Execute and ExecuteAsync, and convert the desired state
+into file set ids.
+*/
+int kylaCheckExecuteArguments (
+	KylaInstallerInternal* internal,
 	kylaAction action,
 	KylaTargetRepository targetRepository,
 	KylaSourceRepository sourceRepository,
-	const KylaDesiredState* desiredState)
+	const KylaDesiredState* desiredState,
+	std::vector<kyla::Uuid>& filesetIds)
 {
-	KYLA_C_API_BEGIN ()
-
-	if (installer == nullptr) {
+	if (internal->operationRunning) {
+		internal->log->Error ("kylaExecute", "another operation is still running");
 		return kylaResult_ErrorInvalidArgument;
 	}
 
-	auto internal = static_cast<KylaInstallerInternal*> (installer);
-
 	if (targetRepository == nullptr) {
 		internal->log->Error ("kylaExecute", "target repository was null");
 		return kylaResult_ErrorInvalidArgument;
@@ -218,8 +251,6 @@ int kylaExecute (
 		}
 	}
 
-	std::vector<kyla::Uuid> filesetIds;
-
 	if (desiredState == nullptr) {
 		switch (action) {
 		case kylaAction_Configure:
@@ -255,14 +286,9 @@ int kylaExecute (
 		}
 	}
 
-	kyla::Repository::ExecutionContext executionContext {
-		*internal->log, *internal->progress };
-
 	switch (action) {
 	case kylaAction_Install:
-		targetRepository->p = kyla::DeployRepository (*sourceRepository->p,
-			targetRepository->path.string ().c_str (), filesetIds, 
-			executionContext);
+	case kylaAction_Verify:
 		break;
 
 	case kylaAction_Configure:
@@ -271,9 +297,6 @@ int kylaExecute (
 				"target repository cannot be opened in read-only mode for kylaAction_Configure");
 			return kylaResult_Error;
 		}
-		targetRepository->p->Configure (
-			*sourceRepository->p, filesetIds, executionContext);
-
 		break;
 
 	case kylaAction_Repair:
@@ -282,7 +305,78 @@ int kylaExecute (
 				"target repository cannot be opened in read-only mode for kylaAction_Repair");
 			return kylaResult_Error;
 		}
+		break;
+
+	default:
+		internal->log->Error ("kylaExecute",
+			"invalid action");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	return kylaResult_Ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void kylaReportProfile (KylaInstallerInternal* internal)
+{
+	if (internal->profiler) {
+		internal->profiler->Report (*internal->log);
+
+		if (!internal->profileFile.empty ()) {
+			std::ofstream output (internal->profileFile);
+			internal->profiler->WriteJson (output);
+		}
+	}
+
+	if (internal->tracer) {
+		std::ofstream output (internal->traceFile);
+		internal->tracer->WriteJson (output);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Run an action once the arguments have been checked. This is called on a
+background thread for ExecuteAsync.
+*/
+int kylaExecuteChecked (
+	KylaInstaller* installer,
+	kylaAction action,
+	KylaTargetRepository targetRepository,
+	KylaSourceRepository sourceRepository,
+	const std::vector<kyla::Uuid>& filesetIds,
+	const std::atomic<bool>* cancellationFlag)
+{
+	KYLA_C_API_BEGIN ()
+
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
+
+	if (internal->profiler) {
+		internal->profiler->Reset ();
+	}
+
+	if (internal->tracer) {
+		internal->tracer->Reset ();
+	}
+
+	kyla::Repository::ExecutionContext executionContext {
+		*internal->log, *internal->progress, internal->profiler.get (),
+		internal->tracer.get (), cancellationFlag, internal->limits };
+
+	switch (action) {
+	case kylaAction_Install:
+		targetRepository->p = kyla::DeployRepository (*sourceRepository->p,
+			targetRepository->path.string ().c_str (), filesetIds, 
+			executionContext);
+		break;
+
+	case kylaAction_Configure:
+		targetRepository->p->Configure (
+			*sourceRepository->p, filesetIds, executionContext);
+
+		break;
 
+	case kylaAction_Repair:
 		///@TODO(minor) Pass through the fileset ids
 		targetRepository->p->Repair (*sourceRepository->p, executionContext);
 
@@ -316,17 +410,20 @@ int kylaExecute (
 		return kylaResult_ErrorInvalidArgument;
 	}
 
+	kylaReportProfile (internal);
+
 	return kylaResult_Ok;
 
 	KYLA_C_API_END ()
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-int kylaQueryRepository (KylaInstaller* installer,
-	KylaSourceRepository repository,
-	int propertyId,
-	size_t* pResultSize,
-	void* pResult)
+int kylaExecute (
+	KylaInstaller* installer,
+	kylaAction action,
+	KylaTargetRepository targetRepository,
+	KylaSourceRepository sourceRepository,
+	const KylaDesiredState* desiredState)
 {
 	KYLA_C_API_BEGIN ()
 
@@ -334,48 +431,62 @@ int kylaQueryRepository (KylaInstaller* installer,
 		return kylaResult_ErrorInvalidArgument;
 	}
 
-	auto i = static_cast<KylaInstallerInternal*> (installer);
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
 
-	if (repository == nullptr) {
-		i->log->Error ("kylaQueryRepository", "repository was null");
+	std::vector<kyla::Uuid> filesetIds;
+	const auto checkResult = kylaCheckExecuteArguments (internal, action,
+		targetRepository, sourceRepository, desiredState, filesetIds);
 
-		return kylaResult_ErrorInvalidArgument;
+	if (checkResult != kylaResult_Ok) {
+		return checkResult;
 	}
 
-	if (repository->repositoryType != KylaRepositoryImpl::RepositoryType::Source) {
-		i->log->Error ("kylaQueryRepository", "repository must be a source repository");
+	return kylaExecuteChecked (installer, action, targetRepository,
+		sourceRepository, filesetIds, nullptr);
+
+	KYLA_C_API_END ()
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int kylaExecuteAsync (
+	KylaInstaller* installer,
+	kylaAction action,
+	KylaTargetRepository targetRepository,
+	KylaSourceRepository sourceRepository,
+	const KylaDesiredState* desiredState,
+	KylaOperation* operation)
+{
+	KYLA_C_API_BEGIN ()
+
+	if (installer == nullptr) {
 		return kylaResult_ErrorInvalidArgument;
 	}
 
-	switch (propertyId) {
-	case kylaRepositoryProperty_AvailableFilesets:
-	{
-		const auto result = repository->p->GetFilesets ();
-		const auto resultSize = static_cast<int> (result.size ()) * sizeof (KylaUuid);
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
 
-		if (pResultSize && !pResult) {
-			*pResultSize = resultSize;
-		} else if (pResultSize && pResult) {
-			if (*pResultSize < resultSize) {
-				i->log->Error ("kylaQueryRepository", "result size is too small");
-				return kylaResult_ErrorInvalidArgument;
-			} else {
-				*pResultSize = resultSize;
-			}
+	if (operation == nullptr) {
+		internal->log->Error ("kylaExecuteAsync", "operation was null");
+		return kylaResult_ErrorInvalidArgument;
+	}
 
-			::memcpy (pResult, result.data (), resultSize);
-		} else {
-			i->log->Error ("kylaQueryRepository", "at least one of {result size, result pointer} must be set");
-			return kylaResult_ErrorInvalidArgument;
-		}
+	std::vector<kyla::Uuid> filesetIds;
+	const auto checkResult = kylaCheckExecuteArguments (internal, action,
+		targetRepository, sourceRepository, desiredState, filesetIds);
 
-		break;
+	if (checkResult != kylaResult_Ok) {
+		return checkResult;
 	}
 
-	default:
-		i->log->Error ("kylaQueryRepository", "invalid property id");
-		return kylaResult_ErrorInvalidArgument;
-	}
+	std::unique_ptr<KylaOperationImpl> result (new KylaOperationImpl);
+	const auto cancellationFlag = &result->cancellationRequested;
+
+	result->result = std::async (std::launch::async, [=] () -> int {
+		return kylaExecuteChecked (installer, action, targetRepository,
+			sourceRepository, filesetIds, cancellationFlag);
+	});
+
+	internal->operationRunning = true;
+	*operation = result.release ();
 
 	return kylaResult_Ok;
 
@@ -383,12 +494,7 @@ int kylaQueryRepository (KylaInstaller* installer,
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-int kylaQueryFileset (KylaInstaller* installer,
-	KylaSourceRepository repository,
-	struct KylaUuid id,
-	int propertyId,
-	size_t* pResultSize,
-	void* pResult)
+int kylaWait (KylaInstaller* installer, KylaOperation operation)
 {
 	KYLA_C_API_BEGIN ()
 
@@ -396,125 +502,854 @@ int kylaQueryFileset (KylaInstaller* installer,
 		return kylaResult_ErrorInvalidArgument;
 	}
 
-	auto i = static_cast<KylaInstallerInternal*> (installer);
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
 
-	if (repository == nullptr) {
-		i->log->Error ("kylaQueryFileset", "repository was null");
+	if (operation == nullptr) {
+		internal->log->Error ("kylaWait", "operation was null");
 		return kylaResult_ErrorInvalidArgument;
 	}
 
-	if (repository->repositoryType != KylaRepositoryImpl::RepositoryType::Source) {
-		i->log->Error ("kylaQueryFileset", "repository must be a source repository");
-		return kylaResult_ErrorInvalidArgument;
-	}
+	const auto result = operation->result.get ();
 
-	const kyla::Uuid uuid{ id.bytes };
-	
-	switch (propertyId) {
-	case kylaFilesetProperty_FileCount:
-	{
-		const auto resultSize = sizeof (std::int64_t);
-		if (pResultSize && !pResult) {
-			*pResultSize = resultSize;
-		} else if (pResultSize && pResult) {
-			if (*pResultSize < resultSize) {
-				i->log->Error ("kylaQueryFileset", "result size is too small");
-				return kylaResult_ErrorInvalidArgument;
-			} else {
-				*pResultSize = resultSize;
-			}
+	delete operation;
+	internal->operationRunning = false;
 
-			*static_cast<std::int64_t*> (pResult) =
-				repository->p->GetFilesetFileCount (uuid);
-		} else {
-			i->log->Error ("kylaQueryFileset", "at least one of {result size, result pointer} must be set");
-			return kylaResult_ErrorInvalidArgument;
-		}
+	return result;
 
-		break;
-	}
-	case kylaFilesetProperty_Size:
-	{
-		const auto resultSize = sizeof (std::int64_t);
-		if (pResultSize && !pResult) {
-			*pResultSize = resultSize;
-		} else if (pResultSize && pResult) {
-			if (*pResultSize < resultSize) {
-				i->log->Error ("kylaQueryFileset", "result size is too small");
-				return kylaResult_ErrorInvalidArgument;
-			} else {
-				*pResultSize = resultSize;
-			}
+	KYLA_C_API_END ()
+}
 
-			*static_cast<std::int64_t*> (pResult) =
-				repository->p->GetFilesetSize (uuid);
-		} else {
-			i->log->Error ("kylaQueryFileset", "at least one of {result size, result pointer} must be set");
-			return kylaResult_ErrorInvalidArgument;
-		}
+///////////////////////////////////////////////////////////////////////////////
+int kylaPoll (KylaInstaller* installer, KylaOperation operation,
+	int* finished)
+{
+	KYLA_C_API_BEGIN ()
 
-		break;
+	if (installer == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
 	}
-	case kylaFilesetProperty_Name:
-	{
-		const auto name = repository->p->GetFilesetName (uuid);
-		const auto resultSize = name.size () + 1;
 
-		if (pResultSize && !pResult) {
-			*pResultSize = resultSize;
-		} else if (pResultSize && pResult) {
-			if (*pResultSize < resultSize) {
-				i->log->Error ("kylaQueryFileset", "result size is too small");
-				return kylaResult_ErrorInvalidArgument;
-			} else {
-				*pResultSize = resultSize;
-			}
-			
-			::memset (pResult, 0, name.size () + 1);
-			::memcpy (pResult, name.data (), name.size ());
-		} else {
-			i->log->Error ("kylaQueryFileset", "at least one of {result size, result pointer} must be set");
-			return kylaResult_ErrorInvalidArgument;
-		}
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
 
-		break;
+	if (operation == nullptr) {
+		internal->log->Error ("kylaPoll", "operation was null");
+		return kylaResult_ErrorInvalidArgument;
 	}
 
-	default:
-		i->log->Error ("kylaQueryFileset", "invalid property id");
+	if (finished == nullptr) {
+		internal->log->Error ("kylaPoll", "finished was null");
 		return kylaResult_ErrorInvalidArgument;
 	}
 
+	*finished = (operation->result.wait_for (std::chrono::seconds (0))
+		== std::future_status::ready) ? 1 : 0;
+
 	return kylaResult_Ok;
 
 	KYLA_C_API_END ()
 }
-}
 
 ///////////////////////////////////////////////////////////////////////////////
-KYLA_EXPORT int kylaBuildRepository (const char* descriptorFile,
-	const char* sourceDirectory, const char* targetDirectory)
+int kylaCancel (KylaInstaller* installer, KylaOperation operation)
 {
-	// Only needed for the C_API macros which assume we're int the normal
-	// installer
-	void* installer = nullptr;
-
 	KYLA_C_API_BEGIN ()
 
-	if (descriptorFile == nullptr) {
+	if (installer == nullptr) {
 		return kylaResult_ErrorInvalidArgument;
 	}
 
-	if (sourceDirectory == nullptr) {
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
+
+	if (operation == nullptr) {
+		internal->log->Error ("kylaCancel", "operation was null");
 		return kylaResult_ErrorInvalidArgument;
 	}
 
-	if (targetDirectory == nullptr) {
-		return kylaResult_ErrorInvalidArgument;
+	operation->cancellationRequested = true;
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END ()
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int kylaPlan (KylaInstaller* installer,
+	KylaTargetRepository targetRepository,
+	KylaSourceRepository sourceRepository,
+	const KylaDesiredState* desiredState,
+	KylaPlan* plan)
+{
+	KYLA_C_API_BEGIN ()
+
+	if (installer == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
+
+	if (internal->operationRunning) {
+		internal->log->Error ("kylaPlan", "another operation is still running");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (sourceRepository == nullptr
+		|| sourceRepository->repositoryType != KylaRepositoryImpl::RepositoryType::Source) {
+		internal->log->Error ("kylaPlan", "source repository is not a valid source. "
+			"A source repository must be opened using OpenSourceRepository.");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (targetRepository != nullptr
+		&& targetRepository->repositoryType != KylaRepositoryImpl::RepositoryType::Target) {
+		internal->log->Error ("kylaPlan", "target repository is not a valid target. "
+			"A target repository must be opened using OpenTargetRepository.");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (desiredState == nullptr || desiredState->filesetCount < 0
+		|| (desiredState->filesetCount > 0 && desiredState->filesetIds == nullptr)) {
+		internal->log->Error ("kylaPlan", "desired state is invalid");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (plan == nullptr) {
+		internal->log->Error ("kylaPlan", "plan was null");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	std::vector<kyla::Uuid> filesetIds;
+	for (int i = 0; i < desiredState->filesetCount; ++i) {
+		if (desiredState->filesetIds [i] == nullptr) {
+			internal->log->Error ("kylaPlan", "desired state file set id was null");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		filesetIds.push_back (kyla::Uuid{ desiredState->filesetIds [i] });
+	}
+
+	kyla::Repository::ExecutionContext executionContext {
+		*internal->log, *internal->progress, internal->profiler.get (),
+		internal->tracer.get (), nullptr, internal->limits };
+
+	// A target which has been opened for creation is planned as a new
+	// installation
+	internal->plan = kyla::PlanConfiguration (*sourceRepository->p,
+		targetRepository ? targetRepository->p.get () : nullptr,
+		filesetIds, executionContext);
+
+	internal->planSourcePackages.clear ();
+	for (const auto& package : internal->plan.sourcePackages) {
+		KylaSourcePackagePlan packagePlan;
+		packagePlan.name = package.name.c_str ();
+		packagePlan.downloadSize = package.downloadSize;
+		packagePlan.chunkCount = package.chunkCount;
+
+		internal->planSourcePackages.push_back (packagePlan);
+	}
+
+	plan->downloadSize = internal->plan.downloadSize;
+	plan->chunkCount = internal->plan.chunkCount;
+	plan->reusableSize = internal->plan.reusableSize;
+	plan->contentObjectCount = internal->plan.contentObjectCount;
+	plan->writeFileCount = internal->plan.writeFileCount;
+	plan->writeSize = internal->plan.writeSize;
+	plan->deleteFileCount = internal->plan.deleteFileCount;
+	plan->deleteSize = internal->plan.deleteSize;
+	plan->sourcePackageCount = static_cast<int> (internal->planSourcePackages.size ());
+	plan->sourcePackages = internal->planSourcePackages.data ();
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END ()
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int kylaGetFileSize (KylaInstaller* installer,
+	KylaRepository repository,
+	const char* path,
+	int64_t* size)
+{
+	KYLA_C_API_BEGIN ()
+
+	if (installer == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
+
+	if (internal->operationRunning) {
+		internal->log->Error ("kylaGetFileSize", "another operation is still running");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (repository == nullptr || !repository->p) {
+		internal->log->Error ("kylaGetFileSize", "repository is not open");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (path == nullptr) {
+		internal->log->Error ("kylaGetFileSize", "path was null");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (size == nullptr) {
+		internal->log->Error ("kylaGetFileSize", "size was null");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	*size = repository->p->GetFileSize (path);
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END ()
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int kylaReadFile (KylaInstaller* installer,
+	KylaRepository repository,
+	const char* path,
+	int64_t offset,
+	void* buffer,
+	size_t bufferSize,
+	size_t* bytesRead)
+{
+	KYLA_C_API_BEGIN ()
+
+	if (installer == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
+
+	if (internal->operationRunning) {
+		internal->log->Error ("kylaReadFile", "another operation is still running");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (repository == nullptr || !repository->p) {
+		internal->log->Error ("kylaReadFile", "repository is not open");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (path == nullptr) {
+		internal->log->Error ("kylaReadFile", "path was null");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (offset < 0) {
+		internal->log->Error ("kylaReadFile", "offset must not be negative");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (buffer == nullptr && bufferSize > 0) {
+		internal->log->Error ("kylaReadFile", "buffer was null");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	const auto result = repository->p->ReadFile (path, offset,
+		kyla::MutableArrayRef<> (buffer, bufferSize), internal->limits);
+
+	if (bytesRead) {
+		*bytesRead = static_cast<size_t> (result);
+	}
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END ()
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int kylaExecuteMany (
+	KylaInstaller* installer,
+	kylaAction action,
+	int targetCount,
+	const KylaTargetRepository* targetRepositories,
+	KylaSourceRepository sourceRepository,
+	const KylaDesiredState* desiredState)
+{
+	KYLA_C_API_BEGIN ()
+
+	if (installer == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
+
+	if (action != kylaAction_Install && action != kylaAction_Configure) {
+		internal->log->Error ("kylaExecuteMany",
+			"action must be kylaAction_Install or kylaAction_Configure");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (targetCount <= 0 || targetRepositories == nullptr) {
+		internal->log->Error ("kylaExecuteMany",
+			"at least one target repository must be passed");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	std::vector<kyla::Uuid> filesetIds;
+	for (int i = 0; i < targetCount; ++i) {
+		filesetIds.clear ();
+
+		const auto checkResult = kylaCheckExecuteArguments (internal, action,
+			targetRepositories [i], sourceRepository, desiredState, filesetIds);
+
+		if (checkResult != kylaResult_Ok) {
+			return checkResult;
+		}
+
+		if (std::find (targetRepositories, targetRepositories + i,
+			targetRepositories [i]) != targetRepositories + i) {
+			internal->log->Error ("kylaExecuteMany",
+				"a target repository must not be passed more than once");
+			return kylaResult_ErrorInvalidArgument;
+		}
+	}
+
+	if (internal->profiler) {
+		internal->profiler->Reset ();
+	}
+
+	if (internal->tracer) {
+		internal->tracer->Reset ();
+	}
+
+	kyla::Repository::ExecutionContext executionContext {
+		*internal->log, *internal->progress, internal->profiler.get (),
+		internal->tracer.get (), nullptr, internal->limits };
+
+	if (action == kylaAction_Install) {
+		std::vector<std::string> paths;
+		for (int i = 0; i < targetCount; ++i) {
+			paths.push_back (targetRepositories [i]->path.string ());
+		}
+
+		std::vector<const char*> pathPointers;
+		for (const auto& path : paths) {
+			pathPointers.push_back (path.c_str ());
+		}
+
+		auto repositories = kyla::DeployRepositories (*sourceRepository->p,
+			pathPointers, filesetIds, executionContext);
+
+		for (int i = 0; i < targetCount; ++i) {
+			targetRepositories [i]->p = std::move (repositories [i]);
+		}
+	} else {
+		std::vector<kyla::Repository*> targets;
+		for (int i = 0; i < targetCount; ++i) {
+			targets.push_back (targetRepositories [i]->p.get ());
+		}
+
+		kyla::ConfigureRepositories (*sourceRepository->p, targets,
+			filesetIds, executionContext);
+	}
+
+	kylaReportProfile (internal);
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END ()
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int kylaSetOption (KylaInstaller* installer,
+	int optionId,
+	size_t valueSize,
+	const void* value)
+{
+	KYLA_C_API_BEGIN ()
+
+	if (installer == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	auto internal = static_cast<KylaInstallerInternal*> (installer);
+
+	switch (optionId) {
+	case kylaInstallerOption_ProfileDatabase:
+	{
+		if (value == nullptr || valueSize < sizeof (int)) {
+			internal->log->Error ("kylaSetOption", "value must point to an int");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		if (*static_cast<const int*> (value)) {
+			if (!internal->profiler) {
+				internal->profiler.reset (new kyla::Sql::Profiler);
+			}
+		} else {
+			internal->profiler.reset ();
+			internal->profileFile.clear ();
+		}
+
+		break;
+	}
+	case kylaInstallerOption_DatabaseProfileFile:
+	{
+		if (value == nullptr) {
+			internal->profileFile.clear ();
+			break;
+		}
+
+		const auto filename = static_cast<const char*> (value);
+		internal->profileFile.assign (filename, ::strnlen (filename, valueSize));
+
+		if (!internal->profiler) {
+			internal->profiler.reset (new kyla::Sql::Profiler);
+		}
+
+		break;
+	}
+	case kylaInstallerOption_TraceFile:
+	{
+		if (value == nullptr) {
+			internal->tracer.reset ();
+			internal->traceFile.clear ();
+			break;
+		}
+
+		const auto filename = static_cast<const char*> (value);
+		internal->traceFile.assign (filename, ::strnlen (filename, valueSize));
+
+		if (!internal->tracer) {
+			internal->tracer.reset (new kyla::Tracer);
+		}
+
+		break;
+	}
+	case kylaInstallerOption_ProgressInterval:
+	{
+		if (value == nullptr || valueSize < sizeof (int)) {
+			internal->log->Error ("kylaSetOption", "value must point to an int");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		const auto interval = *static_cast<const int*> (value);
+
+		if (interval < 0) {
+			internal->log->Error ("kylaSetOption", "progress interval must not be negative");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		internal->progress->SetInterval (std::chrono::milliseconds (interval));
+
+		break;
+	}
+	case kylaInstallerOption_MemoryBudget:
+	{
+		if (value == nullptr || valueSize < sizeof (int64_t)) {
+			internal->log->Error ("kylaSetOption", "value must point to an int64_t");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		const auto memoryBudget = *static_cast<const int64_t*> (value);
+
+		if (memoryBudget <= 0) {
+			internal->log->Error ("kylaSetOption", "memory budget must be positive");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		internal->limits.memoryBudget = memoryBudget;
+
+		break;
+	}
+	case kylaInstallerOption_ThreadCount:
+	case kylaInstallerOption_IoConcurrency:
+	{
+		if (value == nullptr || valueSize < sizeof (int)) {
+			internal->log->Error ("kylaSetOption", "value must point to an int");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		const auto count = *static_cast<const int*> (value);
+
+		if (count <= 0) {
+			internal->log->Error ("kylaSetOption", "count must be positive");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		if (optionId == kylaInstallerOption_ThreadCount) {
+			internal->limits.threadCount = count;
+		} else {
+			internal->limits.ioConcurrency = count;
+		}
+
+		break;
+	}
+
+	default:
+		internal->log->Error ("kylaSetOption", "invalid option id");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END ()
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int kylaQueryRepository (KylaInstaller* installer,
+	KylaSourceRepository repository,
+	int propertyId,
+	size_t* pResultSize,
+	void* pResult)
+{
+	KYLA_C_API_BEGIN ()
+
+	if (installer == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	auto i = static_cast<KylaInstallerInternal*> (installer);
+
+	if (repository == nullptr) {
+		i->log->Error ("kylaQueryRepository", "repository was null");
+
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (repository->repositoryType != KylaRepositoryImpl::RepositoryType::Source) {
+		i->log->Error ("kylaQueryRepository", "repository must be a source repository");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	switch (propertyId) {
+	case kylaRepositoryProperty_AvailableFilesets:
+	{
+		const auto result = repository->p->GetFilesets ();
+		const auto resultSize = static_cast<int> (result.size ()) * sizeof (KylaUuid);
+
+		if (pResultSize && !pResult) {
+			*pResultSize = resultSize;
+		} else if (pResultSize && pResult) {
+			if (*pResultSize < resultSize) {
+				i->log->Error ("kylaQueryRepository", "result size is too small");
+				return kylaResult_ErrorInvalidArgument;
+			} else {
+				*pResultSize = resultSize;
+			}
+
+			::memcpy (pResult, result.data (), resultSize);
+		} else {
+			i->log->Error ("kylaQueryRepository", "at least one of {result size, result pointer} must be set");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		break;
+	}
+
+	default:
+		i->log->Error ("kylaQueryRepository", "invalid property id");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END ()
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int kylaQueryFileset (KylaInstaller* installer,
+	KylaSourceRepository repository,
+	struct KylaUuid id,
+	int propertyId,
+	size_t* pResultSize,
+	void* pResult)
+{
+	KYLA_C_API_BEGIN ()
+
+	if (installer == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	auto i = static_cast<KylaInstallerInternal*> (installer);
+
+	if (repository == nullptr) {
+		i->log->Error ("kylaQueryFileset", "repository was null");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (repository->repositoryType != KylaRepositoryImpl::RepositoryType::Source) {
+		i->log->Error ("kylaQueryFileset", "repository must be a source repository");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	const kyla::Uuid uuid{ id.bytes };
+	
+	switch (propertyId) {
+	case kylaFilesetProperty_FileCount:
+	{
+		const auto resultSize = sizeof (std::int64_t);
+		if (pResultSize && !pResult) {
+			*pResultSize = resultSize;
+		} else if (pResultSize && pResult) {
+			if (*pResultSize < resultSize) {
+				i->log->Error ("kylaQueryFileset", "result size is too small");
+				return kylaResult_ErrorInvalidArgument;
+			} else {
+				*pResultSize = resultSize;
+			}
+
+			*static_cast<std::int64_t*> (pResult) =
+				repository->p->GetFilesetFileCount (uuid);
+		} else {
+			i->log->Error ("kylaQueryFileset", "at least one of {result size, result pointer} must be set");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		break;
+	}
+	case kylaFilesetProperty_Size:
+	{
+		const auto resultSize = sizeof (std::int64_t);
+		if (pResultSize && !pResult) {
+			*pResultSize = resultSize;
+		} else if (pResultSize && pResult) {
+			if (*pResultSize < resultSize) {
+				i->log->Error ("kylaQueryFileset", "result size is too small");
+				return kylaResult_ErrorInvalidArgument;
+			} else {
+				*pResultSize = resultSize;
+			}
+
+			*static_cast<std::int64_t*> (pResult) =
+				repository->p->GetFilesetSize (uuid);
+		} else {
+			i->log->Error ("kylaQueryFileset", "at least one of {result size, result pointer} must be set");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		break;
+	}
+	case kylaFilesetProperty_DownloadSize:
+	{
+		const auto resultSize = sizeof (std::int64_t);
+		if (pResultSize && !pResult) {
+			*pResultSize = resultSize;
+		} else if (pResultSize && pResult) {
+			if (*pResultSize < resultSize) {
+				i->log->Error ("kylaQueryFileset", "result size is too small");
+				return kylaResult_ErrorInvalidArgument;
+			} else {
+				*pResultSize = resultSize;
+			}
+
+			*static_cast<std::int64_t*> (pResult) =
+				repository->p->GetFilesetDownloadSize (uuid);
+		} else {
+			i->log->Error ("kylaQueryFileset", "at least one of {result size, result pointer} must be set");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		break;
+	}
+	case kylaFilesetProperty_Name:
+	{
+		const auto name = repository->p->GetFilesetName (uuid);
+		const auto resultSize = name.size () + 1;
+
+		if (pResultSize && !pResult) {
+			*pResultSize = resultSize;
+		} else if (pResultSize && pResult) {
+			if (*pResultSize < resultSize) {
+				i->log->Error ("kylaQueryFileset", "result size is too small");
+				return kylaResult_ErrorInvalidArgument;
+			} else {
+				*pResultSize = resultSize;
+			}
+			
+			::memset (pResult, 0, name.size () + 1);
+			::memcpy (pResult, name.data (), name.size ());
+		} else {
+			i->log->Error ("kylaQueryFileset", "at least one of {result size, result pointer} must be set");
+			return kylaResult_ErrorInvalidArgument;
+		}
+
+		break;
+	}
+
+	default:
+		i->log->Error ("kylaQueryFileset", "invalid property id");
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END ()
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Build a repository. If baseRepository is not null, content objects stored in
+that packed repository are referenced instead of being written again. If
+computeDeltas is non-zero, deltas against the files in baseRepository are
+stored as well. If memoryBudget is 0, the default is used. If traceFile is
+not null, a timeline of the build is written to it in the Chrome trace event
+format.
+*/
+KYLA_EXPORT int kylaBuildRepository (const char* descriptorFile,
+	const char* sourceDirectory, const char* targetDirectory,
+	const char* baseRepository, int computeDeltas,
+	const int64_t memoryBudget, const char* traceFile)
+{
+	// Only needed for the C_API macros which assume we're int the normal
+	// installer
+	void* installer = nullptr;
+
+	KYLA_C_API_BEGIN ()
+
+	if (descriptorFile == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (sourceDirectory == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (targetDirectory == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (memoryBudget < 0) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	kyla::ResourceLimits limits;
+
+	if (memoryBudget > 0) {
+		limits.memoryBudget = memoryBudget;
+	}
+
+	std::unique_ptr<kyla::Tracer> tracer;
+	if (traceFile) {
+		tracer.reset (new kyla::Tracer);
+	}
+
+	{
+		kyla::TracerScope tracerScope (tracer.get ());
+
+		kyla::BuildRepository (descriptorFile,
+			sourceDirectory, targetDirectory, baseRepository,
+			computeDeltas != 0, limits);
+	}
+
+	if (tracer) {
+		std::ofstream output (traceFile);
+		tracer->WriteJson (output);
+	}
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END()
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Write storage statistics for the repository at repositoryPath as JSON into
+outputFile, or to stdout if outputFile is null.
+*/
+KYLA_EXPORT int kylaInspectRepository (const char* repositoryPath,
+	const char* outputFile)
+{
+	// Only needed for the C_API macros which assume we're int the normal
+	// installer
+	void* installer = nullptr;
+
+	KYLA_C_API_BEGIN ()
+
+	if (repositoryPath == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	auto repository = kyla::OpenRepository (repositoryPath, false);
+	const auto inspection = kyla::InspectRepository (*repository);
+
+	if (outputFile) {
+		std::ofstream output (outputFile);
+		inspection.WriteJson (output);
+	} else {
+		inspection.WriteJson (std::cout);
+	}
+
+	return kylaResult_Ok;
+
+	KYLA_C_API_END()
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Write a recompressed and reordered copy of sourceRepository to
+targetDirectory. compression is one of Brotli, ZIP or Uncompressed, if null,
+every package keeps its current compression. order is one of package,
+fileset or path, if null, the package order is kept. If chunkSize,
+threadCount or memoryBudget are 0, the defaults are used.
+*/
+KYLA_EXPORT int kylaRepackRepository (const char* sourceRepository,
+	const char* targetDirectory, const char* compression,
+	const int64_t chunkSize, const char* order,
+	const int threadCount, const int64_t memoryBudget)
+{
+	// Only needed for the C_API macros which assume we're int the normal
+	// installer
+	void* installer = nullptr;
+
+	KYLA_C_API_BEGIN ()
+
+	if (sourceRepository == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (targetDirectory == nullptr) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	if (chunkSize < 0 || threadCount < 0 || memoryBudget < 0) {
+		return kylaResult_ErrorInvalidArgument;
+	}
+
+	kyla::RepackOptions options;
+
+	if (compression) {
+		options.overrideCompression = true;
+
+		if (strcmp (compression, "Brotli") == 0) {
+			options.compression = kyla::CompressionAlgorithm::Brotli;
+		} else if (strcmp (compression, "ZIP") == 0) {
+			options.compression = kyla::CompressionAlgorithm::Zip;
+		} else if (strcmp (compression, "Uncompressed") == 0) {
+			options.compression = kyla::CompressionAlgorithm::Uncompressed;
+		} else {
+			return kylaResult_ErrorInvalidArgument;
+		}
+	}
+
+	if (order) {
+		if (strcmp (order, "package") == 0) {
+			options.order = kyla::RepackOptions::Order::Package;
+		} else if (strcmp (order, "fileset") == 0) {
+			options.order = kyla::RepackOptions::Order::Fileset;
+		} else if (strcmp (order, "path") == 0) {
+			options.order = kyla::RepackOptions::Order::Path;
+		} else {
+			return kylaResult_ErrorInvalidArgument;
+		}
+	}
+
+	if (chunkSize > 0) {
+		options.chunkSize = chunkSize;
+	}
+
+	if (threadCount > 0) {
+		options.limits.threadCount = threadCount;
+	}
+
+	if (memoryBudget > 0) {
+		options.limits.memoryBudget = memoryBudget;
 	}
 
-	kyla::BuildRepository (descriptorFile,
-		sourceDirectory, targetDirectory);
+	kyla::RepackRepository (sourceRepository, targetDirectory, options);
 
 	return kylaResult_Ok;
 
@@ -545,6 +1380,15 @@ int kylaCreateInstaller (int kylaApiVersion, KylaInstaller** pInstaller)
 	internal->OpenTargetRepository = kylaOpenTargetRepository;
 	internal->QueryRepository = kylaQueryRepository;
 	internal->QueryFileset = kylaQueryFileset;
+	internal->SetOption = kylaSetOption;
+	internal->ExecuteAsync = kylaExecuteAsync;
+	internal->Wait = kylaWait;
+	internal->Poll = kylaPoll;
+	internal->Cancel = kylaCancel;
+	internal->Plan = kylaPlan;
+	internal->GetFileSize = kylaGetFileSize;
+	internal->ReadFile = kylaReadFile;
+	internal->ExecuteMany = kylaExecuteMany;
 	internal->SetLogCallback =
 	[](KylaInstaller* installer, KylaLogCallback logCallback, void* callbackContext) -> int {
 		KYLA_C_API_BEGIN ()
@@ -593,14 +1437,18 @@ int kylaCreateInstaller (int kylaApiVersion, KylaInstaller** pInstaller)
 		auto internal = static_cast<KylaInstallerInternal*> (installer);
 		
 		internal->progress.reset (new kyla::Progress ([=](
-			const float f, const char* s, const char* a) -> void {
+			const kyla::ProgressInfo& info) -> void {
 			KylaProgress progress;
-			progress.detailMessage = a;
-			progress.action = s;
-			progress.totalProgress = f;
+			progress.detailMessage = info.action;
+			progress.action = info.stageName;
+			progress.totalProgress = info.totalProgress;
+			progress.bytesDone = info.bytesDone;
+			progress.bytesTotal = info.bytesTotal;
+			progress.bytesPerSecond = info.bytesPerSecond;
+			progress.secondsRemaining = info.secondsRemaining;
 
 			progressCallback (&progress, callbackContext);
-		}));
+		}, internal->progress->GetInterval ()));
 
 		return kylaResult_Ok;
 
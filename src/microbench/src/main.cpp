@@ -0,0 +1,566 @@
+/**
+[LICENSE BEGIN]
+kyla Copyright (C) 2016 Matthäus G. Chajdas
+
+This file is distributed under the BSD 2-clause license. See LICENSE for
+details.
+[LICENSE END]
+*/
+
+#include <boost/program_options.hpp>
+
+#include "Compression.h"
+#include "Hash.h"
+#include "Uuid.h"
+#include "sql/Database.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace po = boost::program_options;
+
+using namespace kyla;
+
+namespace {
+/**
+Passed to every benchmark. The benchmark performs its setup, and then runs
+the code to measure inside a while (state.KeepRunning ()) loop. Only the
+loop itself is timed.
+*/
+class State
+{
+public:
+	explicit State (const int64 iterations)
+		: iterations_ (iterations)
+	{
+	}
+
+	bool KeepRunning ()
+	{
+		if (!started_) {
+			started_ = true;
+			realStart_ = Clock::now ();
+			cpuStart_ = std::clock ();
+		}
+
+		if (done_ < iterations_) {
+			++done_;
+			return true;
+		}
+
+		realTime_ = std::chrono::duration<double> (Clock::now () - realStart_).count ();
+		cpuTime_ = static_cast<double> (std::clock () - cpuStart_) / CLOCKS_PER_SEC;
+
+		return false;
+	}
+
+	/**
+	Bytes processed by a single iteration.
+	*/
+	void SetBytesPerIteration (const int64 bytes)
+	{
+		bytesPerIteration_ = bytes;
+	}
+
+	int64 GetIterations () const
+	{
+		return iterations_;
+	}
+
+	int64 GetBytesPerIteration () const
+	{
+		return bytesPerIteration_;
+	}
+
+	double GetRealTime () const
+	{
+		return realTime_;
+	}
+
+	double GetCpuTime () const
+	{
+		return cpuTime_;
+	}
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	int64 iterations_;
+	int64 done_ = 0;
+	int64 bytesPerIteration_ = 0;
+	bool started_ = false;
+
+	Clock::time_point realStart_;
+	std::clock_t cpuStart_ = 0;
+
+	double realTime_ = 0;
+	double cpuTime_ = 0;
+};
+
+struct Benchmark
+{
+	std::string name;
+	std::function<void (State&)> function;
+};
+
+struct Result
+{
+	std::string name;
+	int64 iterations;
+	// Per iteration, in nanoseconds
+	double realTime;
+	double cpuTime;
+	double bytesPerSecond;
+};
+
+// Results are written here, so the compiler can't remove the code under test
+volatile int64 sink;
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Create deterministic input data. Half of the 4 KiB blocks are random, the
+other half repeat a short pattern, so compressors have some, but not too
+much, work to do.
+*/
+std::vector<byte> CreateInput (const int64 size)
+{
+	std::vector<byte> result (size);
+
+	std::mt19937 generator (size);
+	std::uniform_int_distribution<int> byteDistribution (0, 255);
+
+	static const char pattern [] = "kyla content object ";
+
+	for (int64 i = 0; i < size; i += 4096) {
+		const auto blockEnd = std::min<int64> (i + 4096, size);
+		const bool isRandom = ((i / 4096) % 2) == 1;
+
+		for (int64 j = i; j < blockEnd; ++j) {
+			result [j] = isRandom
+				? static_cast<byte> (byteDistribution (generator))
+				: static_cast<byte> (pattern [j % (sizeof (pattern) - 1)]);
+		}
+	}
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+std::string SizeToString (const int64 size)
+{
+	if (size >= (1 << 20) && (size % (1 << 20)) == 0) {
+		return std::to_string (size >> 20) + "M";
+	} else if (size >= (1 << 10) && (size % (1 << 10)) == 0) {
+		return std::to_string (size >> 10) + "K";
+	} else {
+		return std::to_string (size);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const char* CompressionAlgorithmName (const CompressionAlgorithm algorithm)
+{
+	switch (algorithm) {
+	case CompressionAlgorithm::Uncompressed: return "Uncompressed";
+	case CompressionAlgorithm::Zip: return "ZIP";
+	case CompressionAlgorithm::Brotli: return "Brotli";
+	default:
+		return "Unknown";
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void AddCompressionBenchmarks (std::vector<Benchmark>& benchmarks)
+{
+	static const CompressionAlgorithm algorithms [] = {
+		CompressionAlgorithm::Uncompressed,
+		CompressionAlgorithm::Zip,
+		CompressionAlgorithm::Brotli
+	};
+
+	// 4 MiB is the default chunk size used by the repository builder
+	static const int64 sizes [] = { 64 << 10, 1 << 20, 4 << 20 };
+
+	for (const auto algorithm : algorithms) {
+		for (const auto size : sizes) {
+			const auto suffix = std::string ("/") + CompressionAlgorithmName (algorithm)
+				+ "/" + SizeToString (size);
+
+			benchmarks.push_back ({ "Compress" + suffix, [=](State& state) -> void {
+				const auto input = CreateInput (size);
+				auto compressor = CreateBlockCompressor (algorithm);
+				std::vector<byte> output (compressor->GetCompressionBound (size));
+
+				state.SetBytesPerIteration (size);
+				while (state.KeepRunning ()) {
+					sink = compressor->Compress (input, output);
+				}
+			} });
+
+			benchmarks.push_back ({ "Decompress" + suffix, [=](State& state) -> void {
+				const auto input = CreateInput (size);
+				auto compressor = CreateBlockCompressor (algorithm);
+				std::vector<byte> compressed (compressor->GetCompressionBound (size));
+				compressed.resize (compressor->Compress (input, compressed));
+				std::vector<byte> output (size);
+
+				state.SetBytesPerIteration (size);
+				while (state.KeepRunning ()) {
+					compressor->Decompress (compressed, output);
+					sink = output [0];
+				}
+			} });
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void AddHashBenchmarks (std::vector<Benchmark>& benchmarks)
+{
+	static const int64 sizes [] = { 4 << 10, 1 << 20 };
+
+	for (const auto size : sizes) {
+		benchmarks.push_back ({ "ComputeSHA256/" + SizeToString (size),
+			[=](State& state) -> void {
+			const auto input = CreateInput (size);
+
+			state.SetBytesPerIteration (size);
+			while (state.KeepRunning ()) {
+				sink = ComputeSHA256 (input).bytes [0];
+			}
+		} });
+	}
+
+	// Matches how files are hashed while validating - a stream of 64 KiB
+	// reads
+	benchmarks.push_back ({ "SHA256StreamHasher/4M/64K", [](State& state) -> void {
+		const int64 size = 4 << 20;
+		const int64 blockSize = 64 << 10;
+		const auto input = CreateInput (size);
+		SHA256StreamHasher hasher;
+
+		state.SetBytesPerIteration (size);
+		while (state.KeepRunning ()) {
+			hasher.Initialize ();
+			for (int64 i = 0; i < size; i += blockSize) {
+				hasher.Update (ArrayRef<byte> (input.data () + i, blockSize));
+			}
+			sink = hasher.Finalize ().bytes [0];
+		}
+	} });
+
+	benchmarks.push_back ({ "ToString/SHA256Digest", [](State& state) -> void {
+		const auto digest = ComputeSHA256 (CreateInput (64));
+
+		while (state.KeepRunning ()) {
+			sink = ToString (digest).size ();
+		}
+	} });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void AddUuidBenchmarks (std::vector<Benchmark>& benchmarks)
+{
+	benchmarks.push_back ({ "Uuid::Parse", [](State& state) -> void {
+		const std::string uuid = "b7705480-903e-455a-9512-483c50c4af36";
+
+		while (state.KeepRunning ()) {
+			sink = Uuid::Parse (uuid.c_str ()).GetData () [0];
+		}
+	} });
+
+	benchmarks.push_back ({ "Uuid::ToString", [](State& state) -> void {
+		const auto uuid = Uuid::Parse ("b7705480-903e-455a-9512-483c50c4af36");
+
+		while (state.KeepRunning ()) {
+			sink = uuid.ToString ().size ();
+		}
+	} });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+The SQL benchmarks use an in-memory database with a table shaped like the
+content_objects table, so they measure the statement overhead and not the
+disk.
+*/
+Sql::Database CreateBenchmarkDatabase ()
+{
+	auto db = Sql::Database::Create ();
+	db.Execute ("CREATE TABLE objects (Id INTEGER PRIMARY KEY NOT NULL, "
+		"Hash BLOB NOT NULL UNIQUE, Size INTEGER NOT NULL);");
+
+	auto transaction = db.BeginTransaction ();
+	auto insertQuery = db.Prepare ("INSERT INTO objects (Id, Hash, Size) VALUES (?, ?, ?)");
+
+	for (int64 i = 0; i < 1024; ++i) {
+		const auto hash = ComputeSHA256 (ArrayRef<int64> (i));
+		insertQuery.BindArguments (i, hash, i * 4096);
+		insertQuery.Step ();
+		insertQuery.Reset ();
+	}
+
+	transaction.Commit ();
+
+	return db;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void AddSqlBenchmarks (std::vector<Benchmark>& benchmarks)
+{
+	benchmarks.push_back ({ "Sql/Prepare", [](State& state) -> void {
+		auto db = CreateBenchmarkDatabase ();
+
+		while (state.KeepRunning ()) {
+			auto query = db.Prepare ("SELECT Size FROM objects WHERE Hash = ?");
+		}
+	} });
+
+	benchmarks.push_back ({ "Sql/SelectBindStep", [](State& state) -> void {
+		auto db = CreateBenchmarkDatabase ();
+		auto query = db.Prepare ("SELECT Size FROM objects WHERE Hash = ?");
+
+		std::vector<SHA256Digest> hashes;
+		for (int64 i = 0; i < 1024; ++i) {
+			hashes.push_back (ComputeSHA256 (ArrayRef<int64> (i)));
+		}
+
+		int64 i = 0;
+		while (state.KeepRunning ()) {
+			query.BindArguments (hashes [i++ % 1024]);
+			query.Step ();
+			sink = query.GetInt64 (0);
+			query.Reset ();
+		}
+	} });
+
+	benchmarks.push_back ({ "Sql/InsertBindStep", [](State& state) -> void {
+		auto db = CreateBenchmarkDatabase ();
+		auto transaction = db.BeginTransaction ();
+		// Replace existing rows, so the table size stays constant no matter
+		// how many iterations are run
+		auto query = db.Prepare ("INSERT OR REPLACE INTO objects (Id, Hash, Size) "
+			"VALUES (?, ?, ?)");
+
+		std::vector<SHA256Digest> hashes;
+		for (int64 i = 0; i < 1024; ++i) {
+			hashes.push_back (ComputeSHA256 (ArrayRef<int64> (i)));
+		}
+
+		int64 i = 0;
+		while (state.KeepRunning ()) {
+			const auto index = i++ % 1024;
+			query.BindArguments (index, hashes [index], i);
+			query.Step ();
+			query.Reset ();
+		}
+
+		transaction.Commit ();
+	} });
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Increase the iteration count until a run takes at least minimumTime, then
+run the benchmark repetitions times with that count and return the median.
+The median is stable enough to compare results across commits.
+*/
+Result RunBenchmark (const Benchmark& benchmark,
+	const double minimumTime, const int repetitions)
+{
+	int64 iterations = 1;
+
+	for (;;) {
+		State state (iterations);
+		benchmark.function (state);
+
+		if (state.GetRealTime () >= minimumTime || iterations >= 1000000000) {
+			break;
+		}
+
+		// Aim a bit beyond the minimum time, but grow by at most 10x per
+		// step as the first runs are dominated by noise
+		const auto perIteration = std::max (state.GetRealTime (), 1e-9) / iterations;
+		const auto target = static_cast<int64> (minimumTime * 1.4 / perIteration);
+		iterations = std::max (iterations + 1, std::min (iterations * 10, target));
+	}
+
+	std::vector<State> runs;
+	for (int i = 0; i < repetitions; ++i) {
+		State state (iterations);
+		benchmark.function (state);
+		runs.push_back (state);
+	}
+
+	std::sort (runs.begin (), runs.end (), [](const State& a, const State& b) -> bool {
+		return a.GetRealTime () < b.GetRealTime ();
+	});
+
+	const auto& median = runs [runs.size () / 2];
+
+	Result result;
+	result.name = benchmark.name;
+	result.iterations = iterations;
+	result.realTime = median.GetRealTime () * 1e9 / iterations;
+	result.cpuTime = median.GetCpuTime () * 1e9 / iterations;
+	result.bytesPerSecond = (median.GetBytesPerIteration () > 0 && median.GetRealTime () > 0)
+		? median.GetBytesPerIteration () * iterations / median.GetRealTime ()
+		: 0;
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/**
+Write the results in the JSON format used by Google Benchmark, so its
+comparison tools can be used to compare two runs.
+*/
+void WriteJson (std::ostream& output, const std::vector<Result>& results,
+	const int repetitions)
+{
+	const auto now = std::time (nullptr);
+	char date [64] = { 0 };
+	std::strftime (date, sizeof (date), "%Y-%m-%d %H:%M:%S", std::localtime (&now));
+
+	output << std::setprecision (12);
+	output << "{\n"
+		<< "  \"context\": {\n"
+		<< "    \"date\": \"" << date << "\",\n"
+		<< "    \"num_cpus\": " << std::thread::hardware_concurrency () << ",\n"
+		<< "    \"repetitions\": " << repetitions << ",\n"
+#ifdef NDEBUG
+		<< "    \"library_build_type\": \"release\"\n"
+#else
+		<< "    \"library_build_type\": \"debug\"\n"
+#endif
+		<< "  },\n"
+		<< "  \"benchmarks\": [\n";
+
+	for (std::size_t i = 0; i < results.size (); ++i) {
+		const auto& result = results [i];
+
+		output << "    {\n"
+			<< "      \"name\": \"" << result.name << "\",\n"
+			<< "      \"iterations\": " << result.iterations << ",\n"
+			<< "      \"real_time\": " << result.realTime << ",\n"
+			<< "      \"cpu_time\": " << result.cpuTime << ",\n";
+
+		if (result.bytesPerSecond > 0) {
+			output << "      \"bytes_per_second\": " << result.bytesPerSecond << ",\n";
+		}
+
+		output << "      \"time_unit\": \"ns\"\n"
+			<< "    }" << ((i + 1 < results.size ()) ? "," : "") << "\n";
+	}
+
+	output << "  ]\n"
+		<< "}\n";
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main (int argc, char* argv [])
+{
+	po::options_description generic ("Generic options");
+	generic.add_options ()
+		("help,h", "Show this help")
+		("list", po::bool_switch ()->default_value (false),
+			"List the benchmarks and exit")
+		("filter", po::value<std::string> ()->default_value (".*"),
+			"Only run benchmarks whose name matches this regular expression")
+		("min-time", po::value<double> ()->default_value (0.5),
+			"Minimum time per run, in seconds")
+		("repetitions", po::value<int> ()->default_value (3),
+			"Number of runs per benchmark, the median is reported")
+		("output,o", po::value<std::string> (),
+			"Write the results as JSON to this file");
+
+	po::variables_map vm;
+
+	try {
+		po::store (po::parse_command_line (argc, argv, generic), vm);
+		po::notify (vm);
+	} catch (const std::exception& e) {
+		std::cerr << e.what () << std::endl;
+		return 1;
+	}
+
+	if (vm.count ("help")) {
+		std::cout << generic << std::endl;
+		return 0;
+	}
+
+	std::vector<Benchmark> benchmarks;
+	AddCompressionBenchmarks (benchmarks);
+	AddHashBenchmarks (benchmarks);
+	AddUuidBenchmarks (benchmarks);
+	AddSqlBenchmarks (benchmarks);
+
+	std::regex filter;
+	try {
+		filter = std::regex (vm ["filter"].as<std::string> ());
+	} catch (const std::exception& e) {
+		std::cerr << "Invalid filter: " << e.what () << std::endl;
+		return 1;
+	}
+
+	if (vm ["list"].as<bool> ()) {
+		for (const auto& benchmark : benchmarks) {
+			if (std::regex_search (benchmark.name, filter)) {
+				std::cout << benchmark.name << "\n";
+			}
+		}
+
+		return 0;
+	}
+
+	const auto minimumTime = vm ["min-time"].as<double> ();
+	const auto repetitions = std::max (1, vm ["repetitions"].as<int> ());
+
+	std::cout << std::left << std::setw (32) << "Benchmark"
+		<< std::right << std::setw (14) << "Time (ns)"
+		<< std::setw (14) << "CPU (ns)"
+		<< std::setw (14) << "Iterations"
+		<< std::setw (12) << "MB/s" << "\n";
+
+	std::vector<Result> results;
+	for (const auto& benchmark : benchmarks) {
+		if (!std::regex_search (benchmark.name, filter)) {
+			continue;
+		}
+
+		const auto result = RunBenchmark (benchmark, minimumTime, repetitions);
+
+		std::cout << std::left << std::setw (32) << result.name
+			<< std::right << std::fixed << std::setprecision (1)
+			<< std::setw (14) << result.realTime
+			<< std::setw (14) << result.cpuTime
+			<< std::setw (14) << result.iterations;
+
+		if (result.bytesPerSecond > 0) {
+			std::cout << std::setw (12) << result.bytesPerSecond / (1 << 20);
+		}
+
+		std::cout << std::endl;
+
+		results.push_back (result);
+	}
+
+	if (vm.count ("output")) {
+		std::ofstream output (vm ["output"].as<std::string> ());
+		WriteJson (output, results, repetitions);
+	}
+
+	return 0;
+}
@@ -4,7 +4,10 @@ PRAGMA foreign_keys = ON;
 CREATE TABLE content_objects (
 	Id INTEGER PRIMARY KEY NOT NULL,
 	Hash BLOB NOT NULL UNIQUE,
-	Size INTEGER NOT NULL);
+	Size INTEGER NOT NULL,
+	-- Number of files referencing this content object, maintained by the
+	-- files_*_reference_count triggers below
+	ReferenceCount INTEGER NOT NULL DEFAULT 0);
 
 -- All file sets stored in this repository
 CREATE TABLE file_sets (
@@ -49,6 +52,62 @@ CREATE TABLE storage_hashes (
 	Hash BLOB NOT NULL
 );
 
+-- Checksums of the uncompressed chunks of content objects which are split
+-- into several chunks. Targets search outdated local files for these blocks,
+-- and only fetch the chunks they can't find
+CREATE TABLE storage_block_checksums (
+	StorageMappingId INTEGER PRIMARY KEY NOT NULL,
+	-- Rolling checksum, see RollingChecksum
+	WeakChecksum INTEGER NOT NULL,
+	-- SHA256 of the uncompressed chunk
+	StrongChecksum BLOB NOT NULL
+);
+
+-- Binary deltas which reconstruct a content object from a previous version of
+-- it. They are stored in addition to the storage mapping, and only used if
+-- the target has the base content object already
+CREATE TABLE storage_deltas (
+	Id INTEGER PRIMARY KEY NOT NULL,
+	ContentObjectId INTEGER NOT NULL,
+	-- Hash of the content object the delta is applied to. This is not a
+	-- reference, as the base is usually not part of this repository
+	BaseHash BLOB NOT NULL,
+	SourcePackageId INTEGER NOT NULL,
+	PackageOffset INTEGER NOT NULL,
+	PackageSize INTEGER NOT NULL,
+	-- Size of the delta before compression
+	DeltaSize INTEGER NOT NULL,
+	-- None if uncompressed
+	Compression VARCHAR,
+	-- Hash of the data stored in the package
+	StorageHash BLOB NOT NULL,
+	FOREIGN KEY(ContentObjectId) REFERENCES content_objects(Id),
+	FOREIGN KEY(SourcePackageId) REFERENCES source_packages(Id));
+
+-- Precomputed per file set statistics, written by the repository builder so
+-- querying file sets does not require joining files and content objects.
+-- Repositories without a row here fall back to computing them on the fly
+CREATE TABLE file_set_statistics (
+	FileSetId INTEGER PRIMARY KEY NOT NULL,
+	-- Number of files when deployed
+	FileCount INTEGER NOT NULL,
+	-- Size of all files when deployed
+	Size INTEGER NOT NULL,
+	-- Size of all unique content objects
+	UniqueSize INTEGER NOT NULL,
+	-- Bytes that have to be fetched from the source packages
+	DownloadSize INTEGER NOT NULL,
+	FOREIGN KEY(FileSetId) REFERENCES file_sets(Id) ON DELETE CASCADE);
+
+-- Download size of a file set, split by the source packages it is stored in
+CREATE TABLE file_set_source_package_statistics (
+	FileSetId INTEGER NOT NULL,
+	SourcePackageId INTEGER NOT NULL,
+	DownloadSize INTEGER NOT NULL,
+	PRIMARY KEY(FileSetId, SourcePackageId),
+	FOREIGN KEY(FileSetId) REFERENCES file_sets(Id) ON DELETE CASCADE,
+	FOREIGN KEY(SourcePackageId) REFERENCES source_packages(Id));
+
 -- Take advantage of SQLite's dynamic types here so we don't have to store
 -- whether it is an int, a blob or a string
 CREATE TABLE properties (
@@ -58,9 +117,36 @@ CREATE TABLE properties (
 
 CREATE INDEX files_file_set_id_idx ON files (FileSetId ASC);
 CREATE INDEX storage_mapping_content_object_id_idx ON storage_mapping (ContentObjectId ASC);
+CREATE INDEX storage_deltas_content_object_id_idx ON storage_deltas (ContentObjectId ASC);
 CREATE INDEX content_object_hash_idx ON content_objects (Hash ASC);
 CREATE INDEX files_path_idx ON files (Path ASC);
 
+-- Only unreferenced content objects are indexed, so finding orphans is an
+-- index lookup
+CREATE INDEX content_objects_unreferenced_idx ON content_objects (Id)
+	WHERE ReferenceCount = 0;
+
+CREATE TRIGGER files_insert_reference_count AFTER INSERT ON files
+BEGIN
+	UPDATE content_objects SET ReferenceCount = ReferenceCount + 1
+		WHERE Id = NEW.ContentObjectId;
+END;
+
+CREATE TRIGGER files_delete_reference_count AFTER DELETE ON files
+BEGIN
+	UPDATE content_objects SET ReferenceCount = ReferenceCount - 1
+		WHERE Id = OLD.ContentObjectId;
+END;
+
+CREATE TRIGGER files_update_reference_count AFTER UPDATE OF ContentObjectId ON files
+BEGIN
+	UPDATE content_objects SET ReferenceCount = ReferenceCount - 1
+		WHERE Id = OLD.ContentObjectId;
+	UPDATE content_objects SET ReferenceCount = ReferenceCount + 1
+		WHERE Id = NEW.ContentObjectId;
+END;
+
+-- Kept for compatibility, the reference count is stored directly now
 CREATE VIEW content_objects_with_reference_count
-	AS SELECT Id, Hash, Size, (SELECT COUNT(*) FROM files WHERE ContentObjectId=Id) AS ReferenceCount
+	AS SELECT Id, Hash, Size, ReferenceCount
 	FROM content_objects;
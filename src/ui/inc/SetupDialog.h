@@ -13,6 +13,8 @@ details.
 #include <QDialog>
 #include <QThread>
 
+#include <atomic>
+
 #include "SetupContext.h"
 
 namespace Ui {
@@ -23,7 +25,7 @@ class SetupDialog;
 
 /**
 The install thread executes the actual installation. It's on a separate thread
-to not block the UI.
+to not block the UI, and can be cancelled using Cancel ().
 */
 class InstallThread : public QThread
 {
@@ -33,6 +35,8 @@ public:
 
 	void run ();
 
+	void Cancel ();
+
 signals:
 	void ProgressChanged (const int progress, const char* action,
 		const char* detail);
@@ -40,6 +44,7 @@ signals:
 
 private:
 	const SetupDialog* parent_;
+	std::atomic<bool> cancelRequested_ { false };
 };
 
 class SetupDialog : public QDialog
@@ -60,6 +65,8 @@ public slots:
 	void InstallationFinished (const bool success);
 
 private:
+	void UpdatePlan ();
+
 	Ui::SetupDialog *ui;
 	SetupContext* context_;
 	InstallThread* installThread_ = nullptr;
@@ -128,9 +128,25 @@ void InstallThread::run ()
 	desiredState.filesetCount = itemCount;
 	desiredState.filesetIds = idPointers.data ();
 
-	auto executeResult = installer->Execute (installer, action,
+	KylaOperation operation = nullptr;
+	auto executeResult = installer->ExecuteAsync (installer, action,
 		targetRepository, 
-		parent_->GetSetupContext ()->sourceRepository, &desiredState);
+		parent_->GetSetupContext ()->sourceRepository, &desiredState,
+		&operation);
+
+	if (executeResult == kylaResult_Ok) {
+		int finished = 0;
+		while (installer->Poll (installer, operation, &finished) == kylaResult_Ok
+			&& !finished) {
+			if (cancelRequested_) {
+				installer->Cancel (installer, operation);
+			}
+
+			msleep (50);
+		}
+
+		executeResult = installer->Wait (installer, operation);
+	}
 
 	installer->CloseRepository (installer, targetRepository);
 
@@ -159,6 +175,7 @@ SetupDialog::SetupDialog(SetupContext* context, QWidget *parent)
 			[=] () -> void {
 			ui->startInstallationButton->setEnabled(
 				! ui->targetDirectoryEdit->text ().isEmpty());
+			UpdatePlan ();
 	});
 
 	auto installer = context_->installer;
@@ -166,22 +183,7 @@ SetupDialog::SetupDialog(SetupContext* context, QWidget *parent)
 
 	connect (ui->featureSelection, &QListWidget::itemChanged,
 		[=]() -> void {
-		std::int64_t totalSize = 0;
-
-		for (int i = 0; i < ui->featureSelection->count (); ++i) {
-			auto item = static_cast<FilesetListItem*> (ui->featureSelection->item (i));
-
-			if (item->checkState () == Qt::Checked) {
-				totalSize += item->GetSize ();
-			}
-		}
-
-		if (totalSize > 0) {
-			ui->requiredDiskSpaceValue->setText (tr("Required disk space: %1")
-				.arg (FormatMemorySize (totalSize, 3, 0.1f)));
-		} else {
-			ui->requiredDiskSpaceValue->setText (tr ("No features selected"));
-		}
+		UpdatePlan ();
 	});
 
 	std::size_t resultSize = 0;
@@ -239,6 +241,83 @@ void SetupDialog::UpdateProgress (const int progress, const char* message,
 	ui->progressBar->setValue (progress);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/**
+Show how much has to be downloaded and how the disk usage changes for the
+current selection. Planning only reads the repositories, so this runs on
+every change.
+*/
+void SetupDialog::UpdatePlan ()
+{
+	// The installer must not be used while the installation is running
+	if (installThread_) {
+		return;
+	}
+
+	const auto selectedFilesets = GetSelectedFilesets ();
+
+	if (selectedFilesets.empty ()) {
+		ui->requiredDiskSpaceValue->setText (tr ("No features selected"));
+		return;
+	}
+
+	std::vector<const uint8_t*> idPointers;
+	for (const auto& id : selectedFilesets) {
+		idPointers.push_back (id.bytes);
+	}
+
+	KylaDesiredState desiredState;
+	desiredState.filesetCount = static_cast<int> (idPointers.size ());
+	desiredState.filesetIds = idPointers.data ();
+
+	auto installer = context_->installer;
+
+	// If there is no installation in the target directory yet, we plan
+	// a new installation
+	KylaTargetRepository targetRepository = nullptr;
+	const auto targetDirectory = GetTargetDirectory ();
+
+	if (!targetDirectory.isEmpty ()) {
+		if (installer->OpenTargetRepository (installer,
+			targetDirectory.toUtf8 ().data (),
+			kylaRepositoryOption_ReadOnly, &targetRepository) != kylaResult_Ok) {
+			targetRepository = nullptr;
+		}
+	}
+
+	KylaPlan plan;
+	const auto planResult = installer->Plan (installer, targetRepository,
+		context_->sourceRepository, &desiredState, &plan);
+
+	if (targetRepository) {
+		installer->CloseRepository (installer, targetRepository);
+	}
+
+	if (planResult != kylaResult_Ok) {
+		ui->requiredDiskSpaceValue->setText (tr ("Could not determine the required disk space"));
+		return;
+	}
+
+	const auto diskChange = plan.writeSize - plan.deleteSize;
+
+	// Parts of changed files may be found locally, which is only known once
+	// the installation runs
+	auto downloadSize = FormatMemorySize (plan.downloadSize, 3, 0.1f);
+	if (plan.reusableSize > 0) {
+		downloadSize = tr ("up to %1").arg (downloadSize);
+	}
+
+	if (diskChange >= 0) {
+		ui->requiredDiskSpaceValue->setText (tr ("Download: %1, required disk space: %2")
+			.arg (downloadSize)
+			.arg (FormatMemorySize (diskChange, 3, 0.1f)));
+	} else {
+		ui->requiredDiskSpaceValue->setText (tr ("Download: %1, freed disk space: %2")
+			.arg (downloadSize)
+			.arg (FormatMemorySize (-diskChange, 3, 0.1f)));
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void SetupDialog::InstallationFinished (const bool success)
 {
@@ -259,6 +338,7 @@ void SetupDialog::InstallationFinished (const bool success)
 SetupDialog::~SetupDialog()
 {
 	if (installThread_) {
+		installThread_->Cancel ();
 		installThread_->wait ();
 	}
 	delete ui;
@@ -297,3 +377,9 @@ InstallThread::InstallThread (const SetupDialog * dialog)
 	: parent_ (dialog)
 {
 }
+
+///////////////////////////////////////////////////////////////////////////////
+void InstallThread::Cancel ()
+{
+	cancelRequested_ = true;
+}
@@ -6,6 +6,7 @@
 # [LICENSE END]
 
 import argparse
+import signal
 import subprocess
 import os
 import hashlib
@@ -23,13 +24,21 @@ class KylaRunner:
         self._kcl = kclBinaryPath
         self._verbose = verbose
 
-    def BuildRepository(self, desc, targetDirectory, sourceDirectory=None):
+    def BuildRepository(self, desc, targetDirectory, sourceDirectory=None,
+        baseRepository=None, deltas=False):
         args = [self._kcl, 'build']
 
         if sourceDirectory:
             args.append ('--source-directory')
             args.append (sourceDirectory)
 
+        if baseRepository:
+            args.append ('--base')
+            args.append (baseRepository)
+
+        if deltas:
+            args.append ('--deltas')
+
         args.append (desc)
         args.append (targetDirectory)
 
@@ -41,16 +50,100 @@ class KylaRunner:
             print ('Result:', result.returncode)
         return result.returncode == 0
 
-    def Install(self, source, target, filesets=[]):
-        return self._ExecuteAction ('install', source, target, filesets)
+    def Install(self, source, target, filesets=[], alsoTargets=[], trace=None,
+        cancelAfter=None):
+        return self._ExecuteAction ('install', source, target,
+            filesets + self._AlsoTargetArgs (alsoTargets), trace, cancelAfter)
+
+    def Configure(self, source, target, filesets=[], alsoTargets=[], trace=None):
+        return self._ExecuteAction ('configure', source, target,
+            filesets + self._AlsoTargetArgs (alsoTargets), trace)
 
-    def Configure(self, source, target, filesets=[]):
-        return self._ExecuteAction ('configure', source, target, filesets)
+    def _AlsoTargetArgs(self, alsoTargets):
+        args = []
+        for t in alsoTargets:
+            args += ['--also-target', t]
+        return args
 
     def Validate(self, source, target, filesets=[]):
         return self._ExecuteAction ('validate', source, target, filesets)
 
-    def _ExecuteAction(self, action, source, target, filesets):
+    def Serve(self, directory, latency=0):
+        args = [self._kcl, 'serve', directory, '--port', '0',
+            '--latency', str (latency)]
+
+        if self._verbose:
+            print ('Executing: "{}"'.format (' '.join (args)))
+
+        # The server prints its URL once it is listening
+        server = subprocess.Popen (args, stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE, universal_newlines=True)
+        line = server.stdout.readline ().strip ()
+        if not line.endswith ('/'):
+            server.kill ()
+            server.wait ()
+            return None, None
+        return server, line.split (' ') [-1]
+
+    def Inspect(self, source, output):
+        args = [self._kcl, 'inspect', source, '--output', output]
+
+        if self._verbose:
+            print ('Executing: "{}"'.format (' '.join (args)))
+
+        result = subprocess.run (args,stdout=subprocess.PIPE,stderr=subprocess.PIPE)
+        if self._verbose:
+            print ('Result:', result.returncode)
+        return result.returncode == 0
+
+    def Plan(self, source, target, filesets=[]):
+        args = [self._kcl, 'plan', source, target] + filesets
+
+        if self._verbose:
+            print ('Executing: "{}"'.format (' '.join (args)))
+
+        result = subprocess.run (args,stdout=subprocess.PIPE,stderr=subprocess.PIPE,
+            universal_newlines=True)
+        if self._verbose:
+            print ('Result:', result.returncode)
+        return result.stdout if result.returncode == 0 else None
+
+    def QueryFilesets(self, source):
+        args = [self._kcl, 'query-filesets', source, '--name', '--download-size']
+
+        if self._verbose:
+            print ('Executing: "{}"'.format (' '.join (args)))
+
+        result = subprocess.run (args,stdout=subprocess.PIPE,stderr=subprocess.PIPE,
+            universal_newlines=True)
+        if self._verbose:
+            print ('Result:', result.returncode)
+        return result.stdout if result.returncode == 0 else None
+
+    def ReadFile(self, source, path, options):
+        args = [self._kcl, 'read-file', source, path] + options
+
+        if self._verbose:
+            print ('Executing: "{}"'.format (' '.join (args)))
+
+        result = subprocess.run (args,stdout=subprocess.PIPE,stderr=subprocess.PIPE)
+        if self._verbose:
+            print ('Result:', result.returncode)
+        return result.stdout if result.returncode == 0 else None
+
+    def Repack(self, source, target, options):
+        args = [self._kcl, 'repack', source, target] + options
+
+        if self._verbose:
+            print ('Executing: "{}"'.format (' '.join (args)))
+
+        result = subprocess.run (args,stdout=subprocess.PIPE,stderr=subprocess.PIPE)
+        if self._verbose:
+            print ('Result:', result.returncode)
+        return result.returncode == 0
+
+    def _ExecuteAction(self, action, source, target, filesets, trace=None,
+        cancelAfter=None):
         args = [self._kcl, action, source, target] + filesets
 
         # validate doesn't handle source and filesets yet, so we need to strip
@@ -58,9 +151,25 @@ class KylaRunner:
         if action == 'validate':
             args = args[0:2] + ['--summary=false', args[3]]
 
+        # Global options go before the command
+        if trace:
+            args = args[0:1] + ['--trace', trace] + args[1:]
+
         if self._verbose:
             print ('Executing: "{}"'.format (' '.join (args)))
 
+        # Interrupt the action like Ctrl+C does, it must report that it was
+        # cancelled
+        if cancelAfter is not None:
+            process = subprocess.Popen (args,stdout=subprocess.PIPE,stderr=subprocess.PIPE)
+            time.sleep (cancelAfter)
+            process.send_signal (signal.SIGINT)
+            process.communicate ()
+            if self._verbose:
+                print ('Result:', process.returncode)
+            # kylaResult_ErrorCancelled
+            return process.returncode == 4
+
         try:
             result = subprocess.run (args,stdout=subprocess.PIPE,stderr=subprocess.PIPE)
             if self._verbose:
@@ -76,6 +185,20 @@ class TestEnvironment:
         self.testDirectory = testDirectory
         self.kyla = kyla
         self.workingDirectory = os.path.abspath ('.')
+        self.servers = []
+        self.serverUrl = None
+
+    def GetSourcePath(self, source):
+        # Sources can refer to the URL of the server started using serve
+        if '${server}' in source:
+            return source.replace ('${server}', self.serverUrl)
+        return os.path.join (self.testDirectory, source)
+
+    def StopServers(self):
+        for server in self.servers:
+            server.terminate ()
+            server.wait ()
+        self.servers = []
 
 class SetupGenerateRepository:
     def Execute(self, env : TestEnvironment, args):
@@ -86,24 +209,71 @@ class SetupGenerateRepository:
         if sourceDirectory:
             sourceDirectory = os.path.join (env.workingDirectory, 'tests', sourceDirectory)
 
+        baseRepository = args.get ('base', None)
+
+        if baseRepository:
+            baseRepository = os.path.join (env.testDirectory, baseRepository)
+
         return env.kyla.BuildRepository (source,
-            target, sourceDirectory = sourceDirectory)
+            target, sourceDirectory = sourceDirectory,
+            baseRepository = baseRepository,
+            deltas = args.get ('deltas', False))
+
+class SetupServe:
+    def Execute(self, env : TestEnvironment, args):
+        directory = os.path.join (env.testDirectory, args ['directory'])
+
+        server, url = env.kyla.Serve (directory, args.get ('latency', 0))
+        if server is None:
+            return False
+
+        env.servers.append (server)
+        env.serverUrl = url
+        return True
 
 class ExecuteInstall:
     def Execute(self, env : TestEnvironment, args):
-        source = os.path.join (env.testDirectory, args ['source'])
+        source = env.GetSourcePath (args ['source'])
         target = os.path.join (env.testDirectory, args ['target'])
         filesets = args ['filesets']
+        alsoTargets = [os.path.join (env.testDirectory, t)
+            for t in args.get ('also-targets', [])]
+
+        trace = args.get ('trace', None)
 
-        return env.kyla.Install (source, target, filesets)
+        if trace:
+            trace = os.path.join (env.testDirectory, trace)
+
+        return env.kyla.Install (source, target, filesets, alsoTargets, trace,
+            args.get ('cancel-after', None))
 
 class ExecuteConfigure:
     def Execute(self, env : TestEnvironment, args):
-        source = os.path.join (env.testDirectory, args ['source'])
+        source = env.GetSourcePath (args ['source'])
         target = os.path.join (env.testDirectory, args ['target'])
         filesets = args ['filesets']
+        alsoTargets = [os.path.join (env.testDirectory, t)
+            for t in args.get ('also-targets', [])]
+        trace = args.get ('trace', None)
 
-        return env.kyla.Configure (source, target, filesets)
+        if trace:
+            trace = os.path.join (env.testDirectory, trace)
+
+        return env.kyla.Configure (source, target, filesets, alsoTargets, trace)
+
+class ExecutePlan:
+    def Execute(self, env : TestEnvironment, args):
+        source = env.GetSourcePath (args ['source'])
+        target = os.path.join (env.testDirectory, args ['target'])
+        filesets = args ['filesets']
+
+        plan = env.kyla.Plan (source, target, filesets)
+        if plan is None:
+            return False
+
+        with open (os.path.join (env.testDirectory, args ['output']), 'w') as outputFile:
+            outputFile.write (plan)
+        return True
 
 class ExecuteValidate:
     def Execute(self, env : TestEnvironment, args):
@@ -117,6 +287,54 @@ class ExecuteValidate:
         else:
             return not result
 
+class ExecuteInspect:
+    def Execute(self, env : TestEnvironment, args):
+        source = os.path.join (env.testDirectory, args ['source'])
+        output = os.path.join (env.testDirectory, args ['output'])
+
+        return env.kyla.Inspect (source, output)
+
+class ExecuteQueryFilesets:
+    def Execute(self, env : TestEnvironment, args):
+        source = env.GetSourcePath (args ['source'])
+
+        filesets = env.kyla.QueryFilesets (source)
+        if filesets is None:
+            return False
+
+        with open (os.path.join (env.testDirectory, args ['output']), 'w') as outputFile:
+            outputFile.write (filesets)
+        return True
+
+class ExecuteReadFile:
+    def Execute(self, env : TestEnvironment, args):
+        source = env.GetSourcePath (args ['source'])
+
+        options = []
+        for option in ['offset', 'size']:
+            if option in args:
+                options += ['--' + option, str (args [option])]
+
+        contents = env.kyla.ReadFile (source, args ['path'], options)
+        if contents is None:
+            return False
+
+        with open (os.path.join (env.testDirectory, args ['output']), 'wb') as outputFile:
+            outputFile.write (contents)
+        return True
+
+class ExecuteRepack:
+    def Execute(self, env : TestEnvironment, args):
+        source = os.path.join (env.testDirectory, args ['source'])
+        target = os.path.join (env.testDirectory, args ['target'])
+
+        options = []
+        for option in ['compression', 'chunk-size', 'order']:
+            if option in args:
+                options += ['--' + option, str (args [option])]
+
+        return env.kyla.Repack (source, target, options)
+
 class ZeroFile:
     def Execute (self, env : TestEnvironment, args):
         blockSize = 1 << 20 # 1 MiB sized blocks
@@ -152,6 +370,86 @@ class CheckHash:
                 return False
         return True
 
+class CheckJson:
+    def Execute (self, env : TestEnvironment, args):
+        try:
+            document = json.load (open (os.path.join (env.testDirectory, args ['file']), 'r'))
+        except:
+            print ('Could not parse', args ['file'])
+            return False
+
+        # Keys are paths like "sourcePackages.0.name"
+        for k,v in args ['values'].items ():
+            value = document
+            try:
+                for part in k.split ('.'):
+                    value = value [int (part)] if isinstance (value, list) else value [part]
+            except:
+                print ('Missing', k)
+                return False
+
+            if value != v:
+                print ('Wrong value', k, 'expected', v, 'actual', value)
+                return False
+        return True
+
+class CheckPlan:
+    def Execute (self, env : TestEnvironment, args):
+        # Every line of kcl plan is a name followed by numbers
+        plan = {}
+        try:
+            for line in open (os.path.join (env.testDirectory, args ['plan']), 'r'):
+                parts = line.split ()
+                if parts [0] == 'package':
+                    plan ['package ' + parts [1]] = [int (p) for p in parts [2:]]
+                else:
+                    plan [parts [0]] = [int (p) for p in parts [1:]]
+        except:
+            print ('Could not parse', args ['plan'])
+            return False
+
+        for k,v in args.get ('values', {}).items ():
+            if plan.get (k, None) != v:
+                print ('Wrong value', k, 'expected', v, 'actual', plan.get (k, None))
+                return False
+
+        # The bytes read from packages while configuring, as recorded in
+        # the trace, must lie within the planned bounds
+        if 'trace' in args:
+            try:
+                document = json.load (open (os.path.join (env.testDirectory, args ['trace']), 'r'))
+            except:
+                print ('Could not parse', args ['trace'])
+                return False
+
+            readBytes = sum ([event ['args'] ['bytes'] for event in document ['traceEvents']
+                if event ['cat'] == 'io' and event ['name'] == 'Read'])
+            downloadSize = plan ['download'] [0]
+            minimumSize = downloadSize - plan.get ('reusable', [0]) [0]
+
+            if readBytes < minimumSize or readBytes > downloadSize:
+                print ('Read', readBytes, 'bytes, planned', minimumSize, 'to', downloadSize)
+                return False
+
+            # Less than the full download is read if local chunks were used
+            if args.get ('reused', False) and readBytes == downloadSize:
+                print ('Read', readBytes, 'bytes, nothing was reused')
+                return False
+        return True
+
+class CheckOutput:
+    def Execute (self, env : TestEnvironment, args):
+        try:
+            lines = open (os.path.join (env.testDirectory, args ['file']), 'r').read ().splitlines ()
+        except:
+            print ('Could not read', args ['file'])
+            return False
+
+        if lines != args ['lines']:
+            print ('Wrong output', args ['file'], 'expected', args ['lines'], 'actual', lines)
+            return False
+        return True
+
 class CheckNotExistant:
     def Execute (self, env : TestEnvironment, args):
         for arg in args:
@@ -168,12 +466,21 @@ class CheckExistant:
 
 hooks = {
     'generate-repository' : SetupGenerateRepository,
+    'serve' : SetupServe,
     'install' : ExecuteInstall,
     'configure' : ExecuteConfigure,
+    'plan' : ExecutePlan,
     'validate' : ExecuteValidate,
+    'inspect' : ExecuteInspect,
+    'repack' : ExecuteRepack,
+    'read-file' : ExecuteReadFile,
+    'query-filesets' : ExecuteQueryFilesets,
     'check-hash' : CheckHash,
     'check-not-existant' : CheckNotExistant,
     'check-existant' : CheckExistant,
+    'check-json' : CheckJson,
+    'check-plan' : CheckPlan,
+    'check-output' : CheckOutput,
     'zero-file' : ZeroFile
 }
 
@@ -187,16 +494,19 @@ class Test:
         with tempfile.TemporaryDirectory () as tempDir:
             env = TestEnvironment (self.__kyla, tempDir)
 
-            for phase in ['setup', 'execute', 'test']:
-                for step in self.__test [phase]:
-                    k = list (step.keys ()) [0]
-                    v = step [k]
-                    hook = hooks [k] ()
-                    r = hook.Execute (env, v)
-
-                    if r == False:
-                        print (hook, 'failed')
-                        return False
+            try:
+                for phase in ['setup', 'execute', 'test']:
+                    for step in self.__test [phase]:
+                        k = list (step.keys ()) [0]
+                        v = step [k]
+                        hook = hooks [k] ()
+                        r = hook.Execute (env, v)
+
+                        if r == False:
+                            print (hook, 'failed')
+                            return False
+            finally:
+                env.StopServers ()
         return True
 
 def check_negative(invalue):